@@ -0,0 +1,41 @@
+#!/bin/sh
+# Compares two runs of bench/micro and lists the benchmarks that got slower
+# by more than the threshold (in percent, 10 by default). Exits with 1 if
+# there are any, so it can gate a release.
+#
+#   usage: bench/compare.sh <baseline.json> <current.json> [threshold]
+
+BASELINE=$1
+CURRENT=$2
+THRESHOLD=${3:-10}
+if [ -z "$BASELINE" ] || [ -z "$CURRENT" ]; then
+    echo "usage: bench/compare.sh <baseline.json> <current.json> [threshold]"
+    exit 2
+fi
+
+fields() {
+    sed -n 's/.*"name":"\([^"]*\)".*"ns_per_op":\([0-9.]*\).*/\1 \2/p' "$1"
+}
+
+fields "$BASELINE" > "$BASELINE.fields"
+fields "$CURRENT" | awk -v threshold="$THRESHOLD" -v baseline="$BASELINE.fields" '
+    BEGIN {
+        while ((getline line < baseline) > 0) {
+            split(line, f, " ")
+            base[f[1]] = f[2]
+        }
+    }
+    $1 in base {
+        change = ($2 - base[$1]) * 100 / base[$1]
+        printf "%-24s %12.1f %12.1f %+7.1f%%\n", $1, base[$1], $2, change
+        if (change > threshold) slower += 1
+    }
+    END {
+        if (slower) {
+            printf "%d benchmark(s) slower by more than %s%%\n", slower, threshold
+            exit 1
+        }
+    }'
+status=$?
+rm -f "$BASELINE.fields"
+exit $status
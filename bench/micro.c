@@ -0,0 +1,437 @@
+/* Microbenchmarks for the hot paths of the read-eval loop: vector growth,
+ * the scanner, the parser and the lookups done for every command. The
+ * shell is compiled in, so the numbers are for the real code paths.
+ *
+ * Each benchmark runs at a few input sizes, doubling its iteration count
+ * until a run takes long enough to time, and prints one JSON object per
+ * line (see bench/compare.sh for checking two runs against each other).
+ *
+ *   usage: bench/micro [filter]
+ */
+
+#define main myshell_main
+#include "../myshell.c"
+#undef main
+
+typedef struct bench_state_t {
+    size_t arg;
+    size_t iterations;
+    /* items processed per iteration, for items_per_second */
+    size_t items;
+    double start;
+    double elapsed;
+} bench_state_t;
+
+typedef struct bench_t {
+    const char * name;
+    void (* fn)(bench_state_t *);
+    size_t args[4];
+} bench_t;
+
+static const double BENCH_MIN_SECS = 0.1;
+
+double bench_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void bench_resume(bench_state_t * p_state) {
+    p_state->start = bench_now();
+}
+
+void bench_pause(bench_state_t * p_state) {
+    p_state->elapsed += bench_now() - p_state->start;
+}
+
+/* keeps the compiler from optimizing away work whose result is unused */
+volatile size_t bench_sink;
+
+void bench_vec_push(bench_state_t * p_state) {
+    token_t token = {"word", 4, TOK_WORD};
+    bench_resume(p_state);
+    for (size_t i = 0; i < p_state->iterations; i += 1) {
+        vec_t vec;
+        vec_init(&vec, sizeof(token_t));
+        for (size_t j = 0; j < p_state->arg; j += 1) vec_push(&vec, &token);
+        bench_sink = vec.npos;
+        vec_free(&vec, NULL);
+    }
+    bench_pause(p_state);
+    p_state->items = p_state->arg;
+}
+
+void bench_vec_push_arena(bench_state_t * p_state) {
+    token_t token = {"word", 4, TOK_WORD};
+    arena_t arena;
+    memset(&arena, 0, sizeof(arena_t));
+    bench_resume(p_state);
+    for (size_t i = 0; i < p_state->iterations; i += 1) {
+        vec_t vec;
+        arena_reset(&arena);
+        vec_init_arena(&vec, &arena, sizeof(token_t));
+        for (size_t j = 0; j < p_state->arg; j += 1) vec_push(&vec, &token);
+        bench_sink = vec.npos;
+    }
+    bench_pause(p_state);
+    arena_free(&arena);
+    p_state->items = p_state->arg;
+}
+
+char * bench_line(const char * unit, const size_t unit_tokens, const size_t tokens, size_t * p_len) {
+    /* "word" followed by unit until the line has about that many tokens,
+       with the newline and the two NULs the scanner wants */
+    const size_t unit_len = strlen(unit);
+    const size_t units = tokens > unit_tokens ? (tokens - 1) / unit_tokens : 0;
+    const size_t len = strlen("word") + units * unit_len + 1;
+    char * line = malloc(len + 2);
+    if (!line) {
+        puts("ERROR: malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    char * p_end = line + sprintf(line, "word");
+    for (size_t i = 0; i < units; i += 1) p_end += sprintf(p_end, "%s", unit);
+    p_end[0] = '\n';
+    p_end[1] = p_end[2] = '\0';
+    *p_len = len + 2;
+    return line;
+}
+
+void bench_lex(bench_state_t * p_state, const char * unit, const size_t unit_tokens) {
+    size_t len;
+    char * line = bench_line(unit, unit_tokens, p_state->arg, &len);
+    char * buffer = malloc(len);
+    shell_ctx_t ctx;
+    if (!buffer || !shell_ctx_init(&ctx)) {
+        puts(CTX_INIT_ERROR_MSG);
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < p_state->iterations; i += 1) {
+        /* words are terminated in place, so every run needs a fresh copy */
+        memcpy(buffer, line, len);
+        shell_ctx_reset(&ctx);
+        bench_resume(p_state);
+        lexer_parse_buffer(&ctx, buffer, len);
+        bench_pause(p_state);
+    }
+    p_state->items = ctx.tokens.npos;
+    shell_ctx_free(&ctx);
+    free(buffer);
+    free(line);
+}
+
+void bench_parse(bench_state_t * p_state, const char * unit, const size_t unit_tokens) {
+    size_t len;
+    char * line = bench_line(unit, unit_tokens, p_state->arg, &len);
+    shell_ctx_t ctx;
+    if (!shell_ctx_init(&ctx)) {
+        puts(CTX_INIT_ERROR_MSG);
+        exit(EXIT_FAILURE);
+    }
+    lexer_parse_buffer(&ctx, line, len);
+    bench_resume(p_state);
+    for (size_t i = 0; i < p_state->iterations; i += 1) {
+        command_t * commands;
+        arena_reset(&ctx.arena);
+        if (parse_commands(&ctx, &commands) == PARSE_ERROR) {
+            puts(PARSE_ERROR_MSG);
+            exit(EXIT_FAILURE);
+        }
+        bench_sink = (size_t)commands;
+    }
+    bench_pause(p_state);
+    p_state->items = ctx.tokens.npos;
+    shell_ctx_free(&ctx);
+    free(line);
+}
+
+void bench_lex_args(bench_state_t * p_state) {
+    bench_lex(p_state, " word", 1);
+}
+
+void bench_lex_pipes(bench_state_t * p_state) {
+    bench_lex(p_state, " | word", 2);
+}
+
+void bench_lex_quotes(bench_state_t * p_state) {
+    /* quotes and escapes are squeezed out of the line in place */
+    bench_lex(p_state, " 'two words' \"in quotes\" es\\ caped", 3);
+}
+
+void bench_lex_vars(bench_state_t * p_state) {
+    /* expansions, which build their words in the arena */
+    bench_lex(p_state, " $BENCH_VAR \"${BENCH_VAR}\"x", 2);
+}
+
+void bench_parse_args(bench_state_t * p_state) {
+    bench_parse(p_state, " word", 1);
+}
+
+void bench_parse_pipes(bench_state_t * p_state) {
+    bench_parse(p_state, " | word", 2);
+}
+
+void bench_parse_redirs(bench_state_t * p_state) {
+    bench_parse(p_state, " | word < in > out", 6);
+}
+
+void bench_builtin_find(bench_state_t * p_state) {
+    static const char * NAMES[] = {"echo", "test", "ls", "grep", "cd", "wc", "printf", "cat"};
+    bench_resume(p_state);
+    for (size_t i = 0; i < p_state->iterations; i += 1) {
+        bench_sink = (size_t)builtin_find(&global_builtins, NAMES[i & 7]);
+    }
+    bench_pause(p_state);
+    p_state->items = 1;
+}
+
+void bench_plan_lookup(bench_state_t * p_state) {
+    /* a cache that is full, with every lookup a hit on some arg-sized line */
+    size_t len;
+    char * line = bench_line(" word", 1, p_state->arg, &len);
+    shell_ctx_t ctx;
+    if (!shell_ctx_init(&ctx)) {
+        puts(CTX_INIT_ERROR_MSG);
+        exit(EXIT_FAILURE);
+    }
+    plan_cache_init(&global_plans);
+    char * buffer = malloc(len);
+    for (int i = 0; i < PLAN_CACHE_CAPACITY; i += 1) {
+        memcpy(buffer, line, len);
+        buffer[0] = 'a' + i % 26;
+        buffer[1] = 'a' + i / 26;
+        shell_ctx_reset(&ctx);
+        plan_cache_lookup(&global_plans, &ctx, buffer, len - 3);
+        lexer_parse_buffer(&ctx, buffer, len);
+        command_t * commands;
+        parse_commands(&ctx, &commands);
+        plan_cache_store(&global_plans, &ctx, commands, ctx.num_commands);
+    }
+    bench_resume(p_state);
+    for (size_t i = 0; i < p_state->iterations; i += 1) {
+        line[0] = 'a' + (i % PLAN_CACHE_CAPACITY) % 26;
+        line[1] = 'a' + (i % PLAN_CACHE_CAPACITY) / 26;
+        shell_ctx_reset(&ctx);
+        bench_sink = plan_cache_lookup(&global_plans, &ctx, line, len - 3);
+    }
+    bench_pause(p_state);
+    p_state->items = ctx.tokens.npos;
+    shell_ctx_free(&ctx);
+    free(buffer);
+    free(line);
+}
+
+/* the directory bench_glob lists, kept from one run to the next since
+   filling it takes far longer than the benchmark */
+char bench_glob_dir[32];
+size_t bench_glob_files;
+
+void bench_glob_remove() {
+    char path[64];
+    for (size_t i = 0; i < bench_glob_files; i += 1) {
+        snprintf(path, sizeof(path), "%s/file%zu", bench_glob_dir, i);
+        unlink(path);
+    }
+    if (bench_glob_files) rmdir(bench_glob_dir);
+    bench_glob_files = 0;
+}
+
+void bench_glob_fill(const size_t files) {
+    if (bench_glob_files == files) return;
+    bench_glob_remove();
+    strcpy(bench_glob_dir, "/tmp/myshell_bench_XXXXXX");
+    if (!mkdtemp(bench_glob_dir)) {
+        perror("ERROR: mkdtemp");
+        exit(EXIT_FAILURE);
+    }
+    bench_glob_files = files;
+    char path[64];
+    for (size_t i = 0; i < files; i += 1) {
+        snprintf(path, sizeof(path), "%s/file%zu", bench_glob_dir, i);
+        close(open(path, O_WRONLY | O_CREAT, 0644));
+    }
+    /* back dated, a directory changed within the second is always read */
+    struct timespec times[2] = {{0, UTIME_OMIT}, {time(NULL) - 10, 0}};
+    utimensat(AT_FDCWD, bench_glob_dir, times, 0);
+}
+
+void bench_glob(bench_state_t * p_state, const bool cached) {
+    /* one pattern matching a tenth of a directory of arg files, with the
+       listing reused from the last run or read again every time */
+    bench_glob_fill(p_state->arg);
+    shell_ctx_t ctx;
+    if (!shell_ctx_init(&ctx)) {
+        puts(CTX_INIT_ERROR_MSG);
+        exit(EXIT_FAILURE);
+    }
+    char pattern[64];
+    snprintf(pattern, sizeof(pattern), "%s/*7", bench_glob_dir);
+    char path[MAXPATHLEN];
+    vec_t matches;
+    for (size_t i = 0; i < p_state->iterations; i += 1) {
+        arena_reset(&ctx.arena);
+        vec_init_arena(&matches, &ctx.arena, sizeof(char *));
+        for (int j = 0; j < DIR_CACHE_CAPACITY && !cached; j += 1) {
+            global_dir_cache.listings[j].valid = false;
+        }
+        bench_resume(p_state);
+        glob_walk(&ctx, &matches, path, 0, pattern);
+        bench_pause(p_state);
+        bench_sink = matches.npos;
+    }
+    p_state->items = p_state->arg;
+    shell_ctx_free(&ctx);
+}
+
+void bench_glob_cached(bench_state_t * p_state) {
+    bench_glob(p_state, true);
+}
+
+void bench_glob_read(bench_state_t * p_state) {
+    bench_glob(p_state, false);
+}
+
+/* a history file of bench_history_entries lines, kept between runs like
+   bench_glob_dir */
+char bench_history_path[] = "/tmp/myshell_bench_history";
+size_t bench_history_entries;
+
+void bench_history_remove() {
+    if (bench_history_entries) unlink(bench_history_path);
+    bench_history_entries = 0;
+}
+
+void bench_history_fill(const size_t entries) {
+    /* one entry holds the needle, a tenth of the way in */
+    if (bench_history_entries == entries) return;
+    bench_history_remove();
+    FILE * p_file = fopen(bench_history_path, "w");
+    if (!p_file) {
+        perror("ERROR: history");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < entries; i += 1) {
+        if (i == entries / 10) fputs("grep needle /var/log/syslog\n", p_file);
+        else fprintf(p_file, "ls -l /srv/data/%zu | sort -k5 | head -n %zu\n", i, i % 50);
+    }
+    fclose(p_file);
+    bench_history_entries = entries;
+    if (global_history.open) {
+        close(global_history.fd);
+        history_reset(&global_history);
+        global_history.open = false;
+    }
+    var_set(&global_vars, "HISTFILE", 8, bench_history_path, false);
+    if (!history_open(&global_history) || !history_sync(&global_history)) {
+        perror("ERROR: history");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void bench_history_find(bench_state_t * p_state) {
+    /* a reverse search through the whole history, once it is indexed */
+    bench_history_fill(p_state->arg);
+    history_index(&global_history);
+    bench_resume(p_state);
+    for (size_t i = 0; i < p_state->iterations; i += 1) {
+        bench_sink = history_find(&global_history, "needle", 6, global_history.num_entries);
+    }
+    bench_pause(p_state);
+    p_state->items = p_state->arg;
+}
+
+void bench_history_index(bench_state_t * p_state) {
+    /* what the first search after startup pays */
+    bench_history_fill(p_state->arg);
+    for (size_t i = 0; i < p_state->iterations; i += 1) {
+        history_reset(&global_history);
+        history_sync(&global_history);
+        bench_resume(p_state);
+        history_index(&global_history);
+        bench_pause(p_state);
+    }
+    p_state->items = p_state->arg;
+}
+
+void bench_script_loop(bench_state_t * p_state) {
+    /* a for loop over arg words around a builtin, compiled once, so what
+       is timed is the dispatch and the per-pipeline evaluation */
+    static script_t * p_script;
+    static size_t script_arg;
+    if (!p_script || script_arg != p_state->arg) {
+        if (p_script) script_release(p_script);
+        size_t len;
+        char * words = bench_line(" w", 1, p_state->arg, &len);
+        const size_t size = len + 32;
+        char * text = malloc(size);
+        const int text_len = snprintf(text, size, "for i in %.*s; do true; done", (int)(len - 3), words);
+        script_failure_t failure;
+        p_script = script_compile(text, text_len, &failure);
+        p_script->refs = 1;
+        script_arg = p_state->arg;
+        free(text);
+        free(words);
+    }
+    shell_ctx_t ctx;
+    if (!shell_ctx_init(&ctx)) {
+        puts(CTX_INIT_ERROR_MSG);
+        exit(EXIT_FAILURE);
+    }
+    bench_resume(p_state);
+    for (size_t i = 0; i < p_state->iterations; i += 1) {
+        bench_sink = script_run(&ctx, p_script, 0);
+    }
+    bench_pause(p_state);
+    p_state->items = p_state->arg;
+    shell_ctx_free(&ctx);
+}
+
+static const bench_t BENCHMARKS[] = {
+    {"vec_push", bench_vec_push, {16, 256, 4096, 65536}},
+    {"vec_push_arena", bench_vec_push_arena, {16, 256, 4096, 65536}},
+    {"lex_args", bench_lex_args, {10, 100, 1000, 10000}},
+    {"lex_pipes", bench_lex_pipes, {10, 100, 1000, 10000}},
+    {"lex_quotes", bench_lex_quotes, {10, 100, 1000, 10000}},
+    {"lex_vars", bench_lex_vars, {10, 100, 1000, 10000}},
+    {"parse_args", bench_parse_args, {10, 100, 1000, 10000}},
+    {"parse_pipes", bench_parse_pipes, {10, 100, 1000, 10000}},
+    {"parse_redirs", bench_parse_redirs, {10, 100, 1000, 10000}},
+    {"builtin_find", bench_builtin_find, {1}},
+    {"plan_lookup", bench_plan_lookup, {10, 100, 1000}},
+    {"glob_cached", bench_glob_cached, {100, 10000, 200000}},
+    {"glob_read", bench_glob_read, {100, 10000, 200000}},
+    {"history_find", bench_history_find, {10000, 1000000}},
+    {"history_index", bench_history_index, {10000, 1000000}},
+    {"script_loop", bench_script_loop, {10, 1000}}
+};
+
+int main(int argc, char ** argv) {
+    const char * filter = argc > 1 ? argv[1] : "";
+    setenv("BENCH_VAR", "value", 1);
+    atexit(bench_glob_remove);
+    atexit(bench_history_remove);
+    if (!var_table_init(&global_vars, environ) || !builtin_table_init(&global_builtins)) {
+        puts(CTX_INIT_ERROR_MSG);
+        return EXIT_FAILURE;
+    }
+    for (size_t b = 0; b < sizeof(BENCHMARKS) / sizeof(bench_t); b += 1) {
+        const bench_t * p_bench = &BENCHMARKS[b];
+        if (!strstr(p_bench->name, filter)) continue;
+        for (size_t a = 0; a < 4 && p_bench->args[a]; a += 1) {
+            bench_state_t state;
+            memset(&state, 0, sizeof(bench_state_t));
+            state.arg = p_bench->args[a];
+            for (state.iterations = 1; ; state.iterations *= 2) {
+                state.elapsed = 0;
+                p_bench->fn(&state);
+                if (state.elapsed >= BENCH_MIN_SECS) break;
+            }
+            const double ns_per_op = state.elapsed * 1e9 / state.iterations;
+            printf("{\"name\":\"%s/%zu\",\"iterations\":%zu,\"ns_per_op\":%.1f,"
+                   "\"items_per_second\":%.0f}\n", p_bench->name, state.arg,
+                   state.iterations, ns_per_op, state.items * 1e9 / ns_per_op);
+            fflush(stdout);
+        }
+    }
+    return EXIT_SUCCESS;
+}
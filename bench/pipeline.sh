@@ -0,0 +1,33 @@
+#!/bin/sh
+# Reports how long the shell needs to launch and reap a pipeline of N
+# /bin/true stages, for growing N, per job and per stage. Launch cost that
+# grows faster than the stage count shows up as a rising per-stage figure.
+#
+#   usage: bench/pipeline.sh [path/to/myshell] [jobs] [stages...]
+
+SHELL_BIN=${1:-./myshell}
+JOBS=${2:-200}
+shift 2 2> /dev/null
+STAGES=${*:-1 2 4 8 16 32 64}
+INPUT=$(mktemp)
+trap 'rm -f "$INPUT"' EXIT
+
+for n in $STAGES; do
+    line=/bin/true
+    i=1
+    while [ "$i" -lt "$n" ]; do
+        line="$line | /bin/true"
+        i=$((i + 1))
+    done
+    : > "$INPUT"
+    i=0
+    while [ "$i" -lt "$JOBS" ]; do
+        echo "$line" >> "$INPUT"
+        i=$((i + 1))
+    done
+    start=$(date +%s%N)
+    "$SHELL_BIN" -n < "$INPUT" > /dev/null
+    end=$(date +%s%N)
+    us=$(( (end - start) / JOBS / 1000 ))
+    printf 'stages %3d  us_per_job %6d  us_per_stage %4d\n' "$n" "$us" $(( us / n ))
+done
@@ -0,0 +1,27 @@
+#!/bin/sh
+# Reports the average time the shell needs to launch and reap one job, for
+# both the posix_spawn path and the fork fallback (-F). The job is
+# /bin/true by path, since a bare true runs as a builtin.
+#
+#   usage: bench/spawn.sh [path/to/myshell] [jobs]
+
+SHELL_BIN=${1:-./myshell}
+JOBS=${2:-2000}
+INPUT=$(mktemp)
+trap 'rm -f "$INPUT"' EXIT
+
+i=0
+while [ "$i" -lt "$JOBS" ]; do
+    echo "/bin/true" >> "$INPUT"
+    i=$((i + 1))
+done
+
+run() {
+    start=$(date +%s%N)
+    "$SHELL_BIN" -n "$@" < "$INPUT" > /dev/null
+    end=$(date +%s%N)
+    echo $(( (end - start) / JOBS / 1000 ))
+}
+
+printf 'spawn_us_per_job %s\n' "$(run)"
+printf 'fork_us_per_job %s\n' "$(run -F)"
@@ -0,0 +1,41 @@
+#!/bin/sh
+# Reports how long `myshell -c true` takes from exec to exit, once cold and
+# then warm, next to /bin/true as a floor for what fork and exec cost.
+# Cold means a fresh copy of the binary; with BENCH_DROP_CACHES=1 (root
+# only) the page cache is dropped as well.
+#
+#   usage: bench/startup.sh [path/to/myshell] [runs]
+
+SHELL_BIN=${1:-./myshell}
+RUNS=${2:-1000}
+COLD_BIN=$(mktemp)
+trap 'rm -f "$COLD_BIN"' EXIT
+cp "$SHELL_BIN" "$COLD_BIN"
+chmod +x "$COLD_BIN"
+
+now() {
+    date +%s%N
+}
+
+if [ "$BENCH_DROP_CACHES" = 1 ]; then
+    sync
+    echo 3 > /proc/sys/vm/drop_caches
+fi
+start=$(now)
+"$COLD_BIN" -c true
+end=$(now)
+printf 'cold_us %s\n' $(( (end - start) / 1000 ))
+
+average() {
+    start=$(now)
+    i=0
+    while [ "$i" -lt "$RUNS" ]; do
+        "$@"
+        i=$((i + 1))
+    done
+    end=$(now)
+    echo $(( (end - start) / RUNS / 1000 ))
+}
+
+printf 'warm_us %s\n' "$(average "$SHELL_BIN" -c true)"
+printf 'true_us %s\n' "$(average /bin/true)"
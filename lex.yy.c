@@ -0,0 +1,4399 @@
+#line 3 "lex.yy.c"
+
+#define  YY_INT_ALIGNED short int
+
+/* A lexical scanner generated by flex */
+
+#define FLEX_SCANNER
+#define YY_FLEX_MAJOR_VERSION 2
+#define YY_FLEX_MINOR_VERSION 5
+#define YY_FLEX_SUBMINOR_VERSION 35
+#if YY_FLEX_SUBMINOR_VERSION > 0
+#define FLEX_BETA
+#endif
+
+/* First, we deal with  platform-specific or compiler-specific issues. */
+
+/* begin standard C headers. */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+
+/* end standard C headers. */
+
+/* flex integer type definitions */
+
+#ifndef FLEXINT_H
+#define FLEXINT_H
+
+/* C99 systems have <inttypes.h>. Non-C99 systems may or may not. */
+
+#if defined (__STDC_VERSION__) && __STDC_VERSION__ >= 199901L
+
+/* C99 says to define __STDC_LIMIT_MACROS before including stdint.h,
+ * if you want the limit (max/min) macros for int types. 
+ */
+#ifndef __STDC_LIMIT_MACROS
+#define __STDC_LIMIT_MACROS 1
+#endif
+
+#include <inttypes.h>
+typedef int8_t flex_int8_t;
+typedef uint8_t flex_uint8_t;
+typedef int16_t flex_int16_t;
+typedef uint16_t flex_uint16_t;
+typedef int32_t flex_int32_t;
+typedef uint32_t flex_uint32_t;
+typedef uint64_t flex_uint64_t;
+#else
+typedef signed char flex_int8_t;
+typedef short int flex_int16_t;
+typedef int flex_int32_t;
+typedef unsigned char flex_uint8_t; 
+typedef unsigned short int flex_uint16_t;
+typedef unsigned int flex_uint32_t;
+#endif /* ! C99 */
+
+/* Limits of integral types. */
+#ifndef INT8_MIN
+#define INT8_MIN               (-128)
+#endif
+#ifndef INT16_MIN
+#define INT16_MIN              (-32767-1)
+#endif
+#ifndef INT32_MIN
+#define INT32_MIN              (-2147483647-1)
+#endif
+#ifndef INT8_MAX
+#define INT8_MAX               (127)
+#endif
+#ifndef INT16_MAX
+#define INT16_MAX              (32767)
+#endif
+#ifndef INT32_MAX
+#define INT32_MAX              (2147483647)
+#endif
+#ifndef UINT8_MAX
+#define UINT8_MAX              (255U)
+#endif
+#ifndef UINT16_MAX
+#define UINT16_MAX             (65535U)
+#endif
+#ifndef UINT32_MAX
+#define UINT32_MAX             (4294967295U)
+#endif
+
+#endif /* ! FLEXINT_H */
+
+#ifdef __cplusplus
+
+/* The "const" storage-class-modifier is valid. */
+#define YY_USE_CONST
+
+#else   /* ! __cplusplus */
+
+/* C99 requires __STDC__ to be defined as 1. */
+#if defined (__STDC__)
+
+#define YY_USE_CONST
+
+#endif  /* defined (__STDC__) */
+#endif  /* ! __cplusplus */
+
+#ifdef YY_USE_CONST
+#define yyconst const
+#else
+#define yyconst
+#endif
+
+/* Returned upon end-of-file. */
+#define YY_NULL 0
+
+/* Promotes a possibly negative, possibly signed char to an unsigned
+ * integer for use as an array index.  If the signed char is negative,
+ * we want to instead treat it as an 8-bit unsigned char, hence the
+ * double cast.
+ */
+#define YY_SC_TO_UI(c) ((unsigned int) (unsigned char) c)
+
+/* An opaque pointer. */
+#ifndef YY_TYPEDEF_YY_SCANNER_T
+#define YY_TYPEDEF_YY_SCANNER_T
+typedef void* yyscan_t;
+#endif
+
+/* For convenience, these vars (plus the bison vars far below)
+   are macros in the reentrant scanner. */
+#define yyin yyg->yyin_r
+#define yyout yyg->yyout_r
+#define yyextra yyg->yyextra_r
+#define yyleng yyg->yyleng_r
+#define yytext yyg->yytext_r
+#define yylineno (YY_CURRENT_BUFFER_LVALUE->yy_bs_lineno)
+#define yycolumn (YY_CURRENT_BUFFER_LVALUE->yy_bs_column)
+#define yy_flex_debug yyg->yy_flex_debug_r
+
+/* Enter a start condition.  This macro really ought to take a parameter,
+ * but we do it the disgusting crufty way forced on us by the ()-less
+ * definition of BEGIN.
+ */
+#define BEGIN yyg->yy_start = 1 + 2 *
+
+/* Translate the current start state into a value that can be later handed
+ * to BEGIN to return to the state.  The YYSTATE alias is for lex
+ * compatibility.
+ */
+#define YY_START ((yyg->yy_start - 1) / 2)
+#define YYSTATE YY_START
+
+/* Action number for EOF rule of a given start state. */
+#define YY_STATE_EOF(state) (YY_END_OF_BUFFER + state + 1)
+
+/* Special action meaning "start processing a new file". */
+#define YY_NEW_FILE yyrestart(yyin ,yyscanner )
+
+#define YY_END_OF_BUFFER_CHAR 0
+
+/* Size of default input buffer. */
+#ifndef YY_BUF_SIZE
+#define YY_BUF_SIZE 16384
+#endif
+
+/* The state buf must be large enough to hold one state per character in the main buffer.
+ */
+#define YY_STATE_BUF_SIZE   ((YY_BUF_SIZE + 2) * sizeof(yy_state_type))
+
+#ifndef YY_TYPEDEF_YY_BUFFER_STATE
+#define YY_TYPEDEF_YY_BUFFER_STATE
+typedef struct yy_buffer_state *YY_BUFFER_STATE;
+#endif
+
+#ifndef YY_TYPEDEF_YY_SIZE_T
+#define YY_TYPEDEF_YY_SIZE_T
+typedef size_t yy_size_t;
+#endif
+
+#define EOB_ACT_CONTINUE_SCAN 0
+#define EOB_ACT_END_OF_FILE 1
+#define EOB_ACT_LAST_MATCH 2
+
+    #define YY_LESS_LINENO(n)
+    
+/* Return all but the first "n" matched characters back to the input stream. */
+#define yyless(n) \
+    do \
+        { \
+        /* Undo effects of setting up yytext. */ \
+        int yyless_macro_arg = (n); \
+        YY_LESS_LINENO(yyless_macro_arg);\
+        *yy_cp = yyg->yy_hold_char; \
+        YY_RESTORE_YY_MORE_OFFSET \
+        yyg->yy_c_buf_p = yy_cp = yy_bp + yyless_macro_arg - YY_MORE_ADJ; \
+        YY_DO_BEFORE_ACTION; /* set up yytext again */ \
+        } \
+    while ( 0 )
+
+#define unput(c) yyunput( c, yyg->yytext_ptr , yyscanner )
+
+#ifndef YY_STRUCT_YY_BUFFER_STATE
+#define YY_STRUCT_YY_BUFFER_STATE
+struct yy_buffer_state
+    {
+    FILE *yy_input_file;
+
+    char *yy_ch_buf;        /* input buffer */
+    char *yy_buf_pos;       /* current position in input buffer */
+
+    /* Size of input buffer in bytes, not including room for EOB
+     * characters.
+     */
+    yy_size_t yy_buf_size;
+
+    /* Number of characters read into yy_ch_buf, not including EOB
+     * characters.
+     */
+    yy_size_t yy_n_chars;
+
+    /* Whether we "own" the buffer - i.e., we know we created it,
+     * and can realloc() it to grow it, and should free() it to
+     * delete it.
+     */
+    int yy_is_our_buffer;
+
+    /* Whether this is an "interactive" input source; if so, and
+     * if we're using stdio for input, then we want to use getc()
+     * instead of fread(), to make sure we stop fetching input after
+     * each newline.
+     */
+    int yy_is_interactive;
+
+    /* Whether we're considered to be at the beginning of a line.
+     * If so, '^' rules will be active on the next match, otherwise
+     * not.
+     */
+    int yy_at_bol;
+
+    int yy_bs_lineno; /**< The line count. */
+    int yy_bs_column; /**< The column count. */
+    
+    /* Whether to try to fill the input buffer when we reach the
+     * end of it.
+     */
+    int yy_fill_buffer;
+
+    int yy_buffer_status;
+
+#define YY_BUFFER_NEW 0
+#define YY_BUFFER_NORMAL 1
+    /* When an EOF's been seen but there's still some text to process
+     * then we mark the buffer as YY_EOF_PENDING, to indicate that we
+     * shouldn't try reading from the input source any more.  We might
+     * still have a bunch of tokens to match, though, because of
+     * possible backing-up.
+     *
+     * When we actually see the EOF, we change the status to "new"
+     * (via yyrestart()), so that the user can continue scanning by
+     * just pointing yyin at a new input file.
+     */
+#define YY_BUFFER_EOF_PENDING 2
+
+    };
+#endif /* !YY_STRUCT_YY_BUFFER_STATE */
+
+/* We provide macros for accessing buffer states in case in the
+ * future we want to put the buffer states in a more general
+ * "scanner state".
+ *
+ * Returns the top of the stack, or NULL.
+ */
+#define YY_CURRENT_BUFFER ( yyg->yy_buffer_stack \
+                          ? yyg->yy_buffer_stack[yyg->yy_buffer_stack_top] \
+                          : NULL)
+
+/* Same as previous macro, but useful when we know that the buffer stack is not
+ * NULL or when we need an lvalue. For internal use only.
+ */
+#define YY_CURRENT_BUFFER_LVALUE yyg->yy_buffer_stack[yyg->yy_buffer_stack_top]
+
+void yyrestart (FILE *input_file ,yyscan_t yyscanner );
+void yy_switch_to_buffer (YY_BUFFER_STATE new_buffer ,yyscan_t yyscanner );
+YY_BUFFER_STATE yy_create_buffer (FILE *file,int size ,yyscan_t yyscanner );
+void yy_delete_buffer (YY_BUFFER_STATE b ,yyscan_t yyscanner );
+void yy_flush_buffer (YY_BUFFER_STATE b ,yyscan_t yyscanner );
+void yypush_buffer_state (YY_BUFFER_STATE new_buffer ,yyscan_t yyscanner );
+void yypop_buffer_state (yyscan_t yyscanner );
+
+static void yyensure_buffer_stack (yyscan_t yyscanner );
+static void yy_load_buffer_state (yyscan_t yyscanner );
+static void yy_init_buffer (YY_BUFFER_STATE b,FILE *file ,yyscan_t yyscanner );
+
+#define YY_FLUSH_BUFFER yy_flush_buffer(YY_CURRENT_BUFFER ,yyscanner)
+
+YY_BUFFER_STATE yy_scan_buffer (char *base,yy_size_t size ,yyscan_t yyscanner );
+YY_BUFFER_STATE yy_scan_string (yyconst char *yy_str ,yyscan_t yyscanner );
+YY_BUFFER_STATE yy_scan_bytes (yyconst char *bytes,yy_size_t len ,yyscan_t yyscanner );
+
+void *yyalloc (yy_size_t ,yyscan_t yyscanner );
+void *yyrealloc (void *,yy_size_t ,yyscan_t yyscanner );
+void yyfree (void * ,yyscan_t yyscanner );
+
+#define yy_new_buffer yy_create_buffer
+
+#define yy_set_interactive(is_interactive) \
+    { \
+    if ( ! YY_CURRENT_BUFFER ){ \
+        yyensure_buffer_stack (yyscanner); \
+        YY_CURRENT_BUFFER_LVALUE =    \
+            yy_create_buffer(yyin,YY_BUF_SIZE ,yyscanner); \
+    } \
+    YY_CURRENT_BUFFER_LVALUE->yy_is_interactive = is_interactive; \
+    }
+
+#define yy_set_bol(at_bol) \
+    { \
+    if ( ! YY_CURRENT_BUFFER ){\
+        yyensure_buffer_stack (yyscanner); \
+        YY_CURRENT_BUFFER_LVALUE =    \
+            yy_create_buffer(yyin,YY_BUF_SIZE ,yyscanner); \
+    } \
+    YY_CURRENT_BUFFER_LVALUE->yy_at_bol = at_bol; \
+    }
+
+#define YY_AT_BOL() (YY_CURRENT_BUFFER_LVALUE->yy_at_bol)
+
+/* Begin user sect3 */
+
+#define yywrap(yyscanner) 1
+#define YY_SKIP_YYWRAP
+
+typedef unsigned char YY_CHAR;
+
+typedef int yy_state_type;
+
+#define yytext_ptr yytext_r
+
+static yy_state_type yy_get_previous_state (yyscan_t yyscanner );
+static yy_state_type yy_try_NUL_trans (yy_state_type current_state  ,yyscan_t yyscanner);
+static int yy_get_next_buffer (yyscan_t yyscanner );
+static void yy_fatal_error (yyconst char msg[] ,yyscan_t yyscanner );
+
+/* Done after the current pattern has been matched and before the
+ * corresponding action - sets up yytext.
+ */
+#define YY_DO_BEFORE_ACTION \
+    yyg->yytext_ptr = yy_bp; \
+    yyleng = (yy_size_t) (yy_cp - yy_bp); \
+    yyg->yy_hold_char = *yy_cp; \
+    *yy_cp = '\0'; \
+    yyg->yy_c_buf_p = yy_cp;
+
+#define YY_NUM_RULES 37
+#define YY_END_OF_BUFFER 38
+/* This struct is not used in this scanner,
+   but its presence is necessary. */
+struct yy_trans_info
+    {
+    flex_int32_t yy_verify;
+    flex_int32_t yy_nxt;
+    };
+static yyconst flex_int16_t yy_nxt[][256] =
+    {
+    {
+        0,     0,     0,     0,     0,     0,     0,     0,     0,     0,
+        0,     0,     0,     0,     0,     0,     0,     0,     0,     0,
+        0,     0,     0,     0,     0,     0,     0,     0,     0,     0,
+        0,     0,     0,     0,     0,     0,     0,     0,     0,     0,
+        0,     0,     0,     0,     0,     0,     0,     0,     0,     0,
+        0,     0,     0,     0,     0,     0,     0,     0,     0,     0,
+        0,     0,     0,     0,     0,     0,     0,     0,     0,     0,
+        0,     0,     0,     0,     0,     0,     0,     0,     0,     0,
+        0,     0,     0,     0,     0,     0,     0,     0,     0,     0,
+        0,     0,     0,     0,     0,     0,     0,     0,     0,     0,
+        0,     0,     0,     0,     0,     0,     0,     0,     0,     0,
+        0,     0,     0,     0,     0,     0,     0,     0,     0,     0,
+        0,     0,     0,     0,     0,     0,     0,     0,     0,     0,
+        0,     0,     0,     0,     0,     0,     0,     0,     0,     0,
+        0,     0,     0,     0,     0,     0,     0,     0,     0,     0,
+        0,     0,     0,     0,     0,     0,     0,     0,     0,     0,
+        0,     0,     0,     0,     0,     0,     0,     0,     0,     0,
+        0,     0,     0,     0,     0,     0,     0,     0,     0,     0,
+        0,     0,     0,     0,     0,     0,     0,     0,     0,     0,
+        0,     0,     0,     0,     0,     0,     0,     0,     0,     0,
+        0,     0,     0,     0,     0,     0,     0,     0,     0,     0,
+        0,     0,     0,     0,     0,     0,     0,     0,     0,     0,
+        0,     0,     0,     0,     0,     0,     0,     0,     0,     0,
+        0,     0,     0,     0,     0,     0,     0,     0,     0,     0,
+        0,     0,     0,     0,     0,     0,     0,     0,     0,     0,
+        0,     0,     0,     0,     0,     0
+    },
+
+    {
+        5,     6,     6,     6,     6,     6,     6,     6,     6,     7,
+        8,     6,     6,     6,     6,     6,     6,     6,     6,     6,
+        6,     6,     6,     6,     6,     6,     6,     6,     6,     6,
+        6,     6,     7,     9,    10,    11,    12,     9,    13,    14,
+       15,     6,    16,     9,     9,     9,     9,     9,    17,    17,
+       17,    17,    17,    17,    17,    17,    17,    17,     9,    18,
+       19,     9,    20,    16,     9,     9,     9,     9,     9,     9,
+        9,     9,     9,     9,     9,     9,     9,     9,     9,     9,
+        9,     9,     9,     9,     9,     9,     9,     9,     9,     9,
+        9,    16,    21,     9,     6,     9,     6,     9,     9,     9,
+        9,     9,     9,     9,     9,     9,     9,     9,     9,     9,
+        9,     9,     9,     9,     9,     9,     9,     9,     9,     9,
+        9,     9,     9,     9,    22,     9,     9,     6,     6,     6,
+        6,     6,     6,     6,     6,     6,     6,     6,     6,     6,
+        6,     6,     6,     6,     6,     6,     6,     6,     6,     6,
+        6,     6,     6,     6,     6,     6,     6,     6,     6,     6,
+        6,     6,     6,     6,     6,     6,     6,     6,     6,     6,
+        6,     6,     6,     6,     6,     6,     6,     6,     6,     6,
+        6,     6,     6,     6,     6,     6,     6,     6,     6,     6,
+        6,     6,     6,     6,     6,     6,     6,     6,     6,     6,
+        6,     6,     6,     6,     6,     6,     6,     6,     6,     6,
+        6,     6,     6,     6,     6,     6,     6,     6,     6,     6,
+        6,     6,     6,     6,     6,     6,     6,     6,     6,     6,
+        6,     6,     6,     6,     6,     6,     6,     6,     6,     6,
+        6,     6,     6,     6,     6,     6,     6,     6,     6,     6,
+        6,     6,     6,     6,     6,     6
+    },
+
+    {
+        5,     6,     6,     6,     6,     6,     6,     6,     6,     7,
+        8,     6,     6,     6,     6,     6,     6,     6,     6,     6,
+        6,     6,     6,     6,     6,     6,     6,     6,     6,     6,
+        6,     6,     7,     9,    10,    11,    12,     9,    13,    14,
+       15,     6,    16,     9,     9,     9,     9,     9,    17,    17,
+       17,    17,    17,    17,    17,    17,    17,    17,     9,    18,
+       19,     9,    20,    16,     9,     9,     9,     9,     9,     9,
+        9,     9,     9,     9,     9,     9,     9,     9,     9,     9,
+        9,     9,     9,     9,     9,     9,     9,     9,     9,     9,
+        9,    16,    21,     9,     6,     9,     6,     9,     9,     9,
+        9,     9,     9,     9,     9,     9,     9,     9,     9,     9,
+        9,     9,     9,     9,     9,     9,     9,     9,     9,     9,
+        9,     9,     9,     9,    22,     9,     9,     6,     6,     6,
+        6,     6,     6,     6,     6,     6,     6,     6,     6,     6,
+        6,     6,     6,     6,     6,     6,     6,     6,     6,     6,
+        6,     6,     6,     6,     6,     6,     6,     6,     6,     6,
+        6,     6,     6,     6,     6,     6,     6,     6,     6,     6,
+        6,     6,     6,     6,     6,     6,     6,     6,     6,     6,
+        6,     6,     6,     6,     6,     6,     6,     6,     6,     6,
+        6,     6,     6,     6,     6,     6,     6,     6,     6,     6,
+        6,     6,     6,     6,     6,     6,     6,     6,     6,     6,
+        6,     6,     6,     6,     6,     6,     6,     6,     6,     6,
+        6,     6,     6,     6,     6,     6,     6,     6,     6,     6,
+        6,     6,     6,     6,     6,     6,     6,     6,     6,     6,
+        6,     6,     6,     6,     6,     6,     6,     6,     6,     6,
+        6,     6,     6,     6,     6,     6
+    },
+
+    {
+        5,    23,    23,    23,    23,    23,    23,    23,    23,    23,
+       23,    23,    23,    23,    23,    23,    23,    23,    23,    23,
+       23,    23,    23,    23,    23,    23,    23,    23,    23,    23,
+       23,    23,    23,    23,    24,    23,    25,    23,    23,    23,
+       23,    23,    26,    23,    23,    23,    23,    23,    23,    23,
+       23,    23,    23,    23,    23,    23,    23,    23,    23,    23,
+       23,    23,    23,    26,    23,    23,    23,    23,    23,    23,
+       23,    23,    23,    23,    23,    23,    23,    23,    23,    23,
+       23,    23,    23,    23,    23,    23,    23,    23,    23,    23,
+       23,    26,    27,    23,    23,    23,    23,    23,    23,    23,
+       23,    23,    23,    23,    23,    23,    23,    23,    23,    23,
+       23,    23,    23,    23,    23,    23,    23,    23,    23,    23,
+       23,    23,    23,    23,    23,    23,    23,    23,    23,    23,
+       23,    23,    23,    23,    23,    23,    23,    23,    23,    23,
+       23,    23,    23,    23,    23,    23,    23,    23,    23,    23,
+       23,    23,    23,    23,    23,    23,    23,    23,    23,    23,
+       23,    23,    23,    23,    23,    23,    23,    23,    23,    23,
+       23,    23,    23,    23,    23,    23,    23,    23,    23,    23,
+       23,    23,    23,    23,    23,    23,    23,    23,    23,    23,
+       23,    23,    23,    23,    23,    23,    23,    23,    23,    23,
+       23,    23,    23,    23,    23,    23,    23,    23,    23,    23,
+       23,    23,    23,    23,    23,    23,    23,    23,    23,    23,
+       23,    23,    23,    23,    23,    23,    23,    23,    23,    23,
+       23,    23,    23,    23,    23,    23,    23,    23,    23,    23,
+       23,    23,    23,    23,    23,    23,    23,    23,    23,    23,
+       23,    23,    23,    23,    23,    23
+    },
+
+    {
+        5,    23,    23,    23,    23,    23,    23,    23,    23,    23,
+       23,    23,    23,    23,    23,    23,    23,    23,    23,    23,
+       23,    23,    23,    23,    23,    23,    23,    23,    23,    23,
+       23,    23,    23,    23,    24,    23,    25,    23,    23,    23,
+       23,    23,    26,    23,    23,    23,    23,    23,    23,    23,
+       23,    23,    23,    23,    23,    23,    23,    23,    23,    23,
+       23,    23,    23,    26,    23,    23,    23,    23,    23,    23,
+       23,    23,    23,    23,    23,    23,    23,    23,    23,    23,
+       23,    23,    23,    23,    23,    23,    23,    23,    23,    23,
+       23,    26,    27,    23,    23,    23,    23,    23,    23,    23,
+       23,    23,    23,    23,    23,    23,    23,    23,    23,    23,
+       23,    23,    23,    23,    23,    23,    23,    23,    23,    23,
+       23,    23,    23,    23,    23,    23,    23,    23,    23,    23,
+       23,    23,    23,    23,    23,    23,    23,    23,    23,    23,
+       23,    23,    23,    23,    23,    23,    23,    23,    23,    23,
+       23,    23,    23,    23,    23,    23,    23,    23,    23,    23,
+       23,    23,    23,    23,    23,    23,    23,    23,    23,    23,
+       23,    23,    23,    23,    23,    23,    23,    23,    23,    23,
+       23,    23,    23,    23,    23,    23,    23,    23,    23,    23,
+       23,    23,    23,    23,    23,    23,    23,    23,    23,    23,
+       23,    23,    23,    23,    23,    23,    23,    23,    23,    23,
+       23,    23,    23,    23,    23,    23,    23,    23,    23,    23,
+       23,    23,    23,    23,    23,    23,    23,    23,    23,    23,
+       23,    23,    23,    23,    23,    23,    23,    23,    23,    23,
+       23,    23,    23,    23,    23,    23,    23,    23,    23,    23,
+       23,    23,    23,    23,    23,    23
+    },
+
+    {
+       -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,
+       -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,
+       -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,
+       -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,
+       -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,
+       -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,
+       -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,
+       -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,
+       -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,
+       -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,
+       -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,
+       -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,
+       -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,
+       -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,
+       -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,
+       -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,
+       -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,
+       -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,
+       -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,
+       -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,
+       -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,
+       -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,
+       -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,
+       -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,
+       -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,    -5,
+       -5,    -5,    -5,    -5,    -5,    -5
+    },
+
+    {
+        5,    -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,
+       -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,
+       -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,
+       -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,
+       -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,
+       -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,
+       -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,
+       -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,
+       -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,
+       -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,
+       -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,
+       -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,
+       -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,
+       -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,
+       -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,
+       -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,
+       -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,
+       -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,
+       -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,
+       -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,
+       -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,
+       -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,
+       -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,
+       -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,
+       -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,    -6,
+       -6,    -6,    -6,    -6,    -6,    -6
+    },
+
+    {
+        5,    -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,    28,
+       -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,
+       -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,
+       -7,    -7,    28,    -7,    -7,    -7,    -7,    -7,    -7,    -7,
+       -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,
+       -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,
+       -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,
+       -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,
+       -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,
+       -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,
+       -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,
+       -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,
+       -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,
+       -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,
+       -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,
+       -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,
+       -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,
+       -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,
+       -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,
+       -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,
+       -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,
+       -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,
+       -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,
+       -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,
+       -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,    -7,
+       -7,    -7,    -7,    -7,    -7,    -7
+    },
+
+    {
+        5,    -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,
+       -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,
+       -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,
+       -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,
+       -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,
+       -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,
+       -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,
+       -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,
+       -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,
+       -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,
+       -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,
+       -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,
+       -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,
+       -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,
+       -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,
+       -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,
+       -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,
+       -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,
+       -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,
+       -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,
+       -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,
+       -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,
+       -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,
+       -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,
+       -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,    -8,
+       -8,    -8,    -8,    -8,    -8,    -8
+    },
+
+    {
+        5,    -9,    -9,    -9,    -9,    -9,    -9,    -9,    -9,    -9,
+       -9,    -9,    -9,    -9,    -9,    -9,    -9,    -9,    -9,    -9,
+       -9,    -9,    -9,    -9,    -9,    -9,    -9,    -9,    -9,    -9,
+       -9,    -9,    -9,    29,    -9,    29,    -9,    29,    -9,    -9,
+       -9,    -9,    -9,    29,    29,    29,    29,    29,    29,    29,
+       29,    29,    29,    29,    29,    29,    29,    29,    29,    -9,
+       -9,    29,    -9,    -9,    29,    29,    29,    29,    29,    29,
+       29,    29,    29,    29,    29,    29,    29,    29,    29,    29,
+       29,    29,    29,    29,    29,    29,    29,    29,    29,    29,
+       29,    -9,    -9,    29,    -9,    29,    -9,    29,    29,    29,
+       29,    29,    29,    29,    29,    29,    29,    29,    29,    29,
+       29,    29,    29,    29,    29,    29,    29,    29,    29,    29,
+       29,    29,    29,    29,    -9,    29,    29,    -9,    -9,    -9,
+       -9,    -9,    -9,    -9,    -9,    -9,    -9,    -9,    -9,    -9,
+       -9,    -9,    -9,    -9,    -9,    -9,    -9,    -9,    -9,    -9,
+       -9,    -9,    -9,    -9,    -9,    -9,    -9,    -9,    -9,    -9,
+       -9,    -9,    -9,    -9,    -9,    -9,    -9,    -9,    -9,    -9,
+       -9,    -9,    -9,    -9,    -9,    -9,    -9,    -9,    -9,    -9,
+       -9,    -9,    -9,    -9,    -9,    -9,    -9,    -9,    -9,    -9,
+       -9,    -9,    -9,    -9,    -9,    -9,    -9,    -9,    -9,    -9,
+       -9,    -9,    -9,    -9,    -9,    -9,    -9,    -9,    -9,    -9,
+       -9,    -9,    -9,    -9,    -9,    -9,    -9,    -9,    -9,    -9,
+       -9,    -9,    -9,    -9,    -9,    -9,    -9,    -9,    -9,    -9,
+       -9,    -9,    -9,    -9,    -9,    -9,    -9,    -9,    -9,    -9,
+       -9,    -9,    -9,    -9,    -9,    -9,    -9,    -9,    -9,    -9,
+       -9,    -9,    -9,    -9,    -9,    -9
+    },
+
+    {
+        5,   -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,
+      -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,
+      -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,
+      -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,
+      -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,
+      -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,
+      -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,
+      -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,
+      -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,
+      -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,
+      -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,
+      -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,
+      -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,
+      -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,
+      -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,
+      -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,
+      -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,
+      -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,
+      -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,
+      -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,
+      -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,
+      -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,
+      -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,
+      -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,
+      -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,   -10,
+      -10,   -10,   -10,   -10,   -10,   -10
+    },
+
+    {
+        5,    30,    30,    30,    30,    30,    30,    30,    30,    30,
+      -11,    30,    30,    30,    30,    30,    30,    30,    30,    30,
+       30,    30,    30,    30,    30,    30,    30,    30,    30,    30,
+       30,    30,    30,    31,    30,    31,    30,    31,    30,    30,
+       30,    30,    30,    31,    31,    31,    31,    31,    31,    31,
+       31,    31,    31,    31,    31,    31,    31,    31,    31,    30,
+       30,    31,    30,    30,    31,    31,    31,    31,    31,    31,
+       31,    31,    31,    31,    31,    31,    31,    31,    31,    31,
+       31,    31,    31,    31,    31,    31,    31,    31,    31,    31,
+       31,    30,    30,    31,    30,    31,    30,    31,    31,    31,
+       31,    31,    31,    31,    31,    31,    31,    31,    31,    31,
+       31,    31,    31,    31,    31,    31,    31,    31,    31,    31,
+       31,    31,    31,    31,    30,    31,    31,    30,    30,    30,
+       30,    30,    30,    30,    30,    30,    30,    30,    30,    30,
+       30,    30,    30,    30,    30,    30,    30,    30,    30,    30,
+       30,    30,    30,    30,    30,    30,    30,    30,    30,    30,
+       30,    30,    30,    30,    30,    30,    30,    30,    30,    30,
+       30,    30,    30,    30,    30,    30,    30,    30,    30,    30,
+       30,    30,    30,    30,    30,    30,    30,    30,    30,    30,
+       30,    30,    30,    30,    30,    30,    30,    30,    30,    30,
+       30,    30,    30,    30,    30,    30,    30,    30,    30,    30,
+       30,    30,    30,    30,    30,    30,    30,    30,    30,    30,
+       30,    30,    30,    30,    30,    30,    30,    30,    30,    30,
+       30,    30,    30,    30,    30,    30,    30,    30,    30,    30,
+       30,    30,    30,    30,    30,    30,    30,    30,    30,    30,
+       30,    30,    30,    30,    30,    30
+    },
+
+    {
+        5,   -12,   -12,   -12,   -12,   -12,   -12,   -12,   -12,   -12,
+      -12,   -12,   -12,   -12,   -12,   -12,   -12,   -12,   -12,   -12,
+      -12,   -12,   -12,   -12,   -12,   -12,   -12,   -12,   -12,   -12,
+      -12,   -12,   -12,   -12,   -12,    32,   -12,   -12,   -12,   -12,
+      -12,   -12,    32,   -12,   -12,   -12,   -12,   -12,    32,    32,
+       32,    32,    32,    32,    32,    32,    32,    32,   -12,   -12,
+      -12,   -12,   -12,    32,    32,    33,    33,    33,    33,    33,
+       33,    33,    33,    33,    33,    33,    33,    33,    33,    33,
+       33,    33,    33,    33,    33,    33,    33,    33,    33,    33,
+       33,   -12,   -12,   -12,   -12,    33,   -12,    33,    33,    33,
+       33,    33,    33,    33,    33,    33,    33,    33,    33,    33,
+       33,    33,    33,    33,    33,    33,    33,    33,    33,    33,
+       33,    33,    33,    34,   -12,   -12,   -12,   -12,   -12,   -12,
+      -12,   -12,   -12,   -12,   -12,   -12,   -12,   -12,   -12,   -12,
+      -12,   -12,   -12,   -12,   -12,   -12,   -12,   -12,   -12,   -12,
+      -12,   -12,   -12,   -12,   -12,   -12,   -12,   -12,   -12,   -12,
+      -12,   -12,   -12,   -12,   -12,   -12,   -12,   -12,   -12,   -12,
+      -12,   -12,   -12,   -12,   -12,   -12,   -12,   -12,   -12,   -12,
+      -12,   -12,   -12,   -12,   -12,   -12,   -12,   -12,   -12,   -12,
+      -12,   -12,   -12,   -12,   -12,   -12,   -12,   -12,   -12,   -12,
+      -12,   -12,   -12,   -12,   -12,   -12,   -12,   -12,   -12,   -12,
+      -12,   -12,   -12,   -12,   -12,   -12,   -12,   -12,   -12,   -12,
+      -12,   -12,   -12,   -12,   -12,   -12,   -12,   -12,   -12,   -12,
+      -12,   -12,   -12,   -12,   -12,   -12,   -12,   -12,   -12,   -12,
+      -12,   -12,   -12,   -12,   -12,   -12,   -12,   -12,   -12,   -12,
+      -12,   -12,   -12,   -12,   -12,   -12
+    },
+
+    {
+        5,   -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,
+      -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,
+      -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,
+      -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,    35,   -13,
+      -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,
+      -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,
+      -13,   -13,    36,   -13,   -13,   -13,   -13,   -13,   -13,   -13,
+      -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,
+      -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,
+      -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,
+      -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,
+      -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,
+      -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,
+      -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,
+      -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,
+      -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,
+      -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,
+      -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,
+      -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,
+      -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,
+      -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,
+      -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,
+      -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,
+      -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,
+      -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,   -13,
+      -13,   -13,   -13,   -13,   -13,   -13
+    },
+
+    {
+        5,    37,    37,    37,    37,    37,    37,    37,    37,    37,
+       37,    37,    37,    37,    37,    37,    37,    37,    37,    37,
+       37,    37,    37,    37,    37,    37,    37,    37,    37,    37,
+       37,    37,    37,    37,    37,    37,    37,    37,    37,    38,
+       37,    37,    39,    37,    37,    37,    37,    37,    37,    37,
+       37,    37,    37,    37,    37,    37,    37,    37,    37,    37,
+       37,    37,    37,    39,    37,    37,    37,    37,    37,    37,
+       37,    37,    37,    37,    37,    37,    37,    37,    37,    37,
+       37,    37,    37,    37,    37,    37,    37,    37,    37,    37,
+       37,    39,    37,    37,    37,    37,    37,    37,    37,    37,
+       37,    37,    37,    37,    37,    37,    37,    37,    37,    37,
+       37,    37,    37,    37,    37,    37,    37,    37,    37,    37,
+       37,    37,    37,    37,    37,    37,    37,    37,    37,    37,
+       37,    37,    37,    37,    37,    37,    37,    37,    37,    37,
+       37,    37,    37,    37,    37,    37,    37,    37,    37,    37,
+       37,    37,    37,    37,    37,    37,    37,    37,    37,    37,
+       37,    37,    37,    37,    37,    37,    37,    37,    37,    37,
+       37,    37,    37,    37,    37,    37,    37,    37,    37,    37,
+       37,    37,    37,    37,    37,    37,    37,    37,    37,    37,
+       37,    37,    37,    37,    37,    37,    37,    37,    37,    37,
+       37,    37,    37,    37,    37,    37,    37,    37,    37,    37,
+       37,    37,    37,    37,    37,    37,    37,    37,    37,    37,
+       37,    37,    37,    37,    37,    37,    37,    37,    37,    37,
+       37,    37,    37,    37,    37,    37,    37,    37,    37,    37,
+       37,    37,    37,    37,    37,    37,    37,    37,    37,    37,
+       37,    37,    37,    37,    37,    37
+    },
+
+    {
+        5,   -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,    40,
+      -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,
+      -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,
+      -15,   -15,    40,   -15,   -15,   -15,   -15,   -15,   -15,   -15,
+      -15,    41,   -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,
+      -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,
+      -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,
+      -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,
+      -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,
+      -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,
+      -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,
+      -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,
+      -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,
+      -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,
+      -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,
+      -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,
+      -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,
+      -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,
+      -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,
+      -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,
+      -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,
+      -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,
+      -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,
+      -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,
+      -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,   -15,
+      -15,   -15,   -15,   -15,   -15,   -15
+    },
+
+    {
+        5,   -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,
+      -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,
+      -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,
+      -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,
+      -16,   -16,    42,   -16,   -16,   -16,   -16,   -16,   -16,   -16,
+      -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,
+      -16,   -16,   -16,    42,   -16,   -16,   -16,   -16,   -16,   -16,
+      -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,
+      -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,
+      -16,    42,   -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,
+      -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,
+      -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,
+      -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,
+      -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,
+      -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,
+      -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,
+      -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,
+      -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,
+      -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,
+      -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,
+      -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,
+      -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,
+      -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,
+      -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,
+      -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,   -16,
+      -16,   -16,   -16,   -16,   -16,   -16
+    },
+
+    {
+        5,   -17,   -17,   -17,   -17,   -17,   -17,   -17,   -17,   -17,
+      -17,   -17,   -17,   -17,   -17,   -17,   -17,   -17,   -17,   -17,
+      -17,   -17,   -17,   -17,   -17,   -17,   -17,   -17,   -17,   -17,
+      -17,   -17,   -17,    29,   -17,    29,   -17,    29,   -17,   -17,
+      -17,   -17,   -17,    29,    29,    29,    29,    29,    29,    29,
+       29,    29,    29,    29,    29,    29,    29,    29,    29,   -17,
+       43,    29,    44,   -17,    29,    29,    29,    29,    29,    29,
+       29,    29,    29,    29,    29,    29,    29,    29,    29,    29,
+       29,    29,    29,    29,    29,    29,    29,    29,    29,    29,
+       29,   -17,   -17,    29,   -17,    29,   -17,    29,    29,    29,
+       29,    29,    29,    29,    29,    29,    29,    29,    29,    29,
+       29,    29,    29,    29,    29,    29,    29,    29,    29,    29,
+       29,    29,    29,    29,   -17,    29,    29,   -17,   -17,   -17,
+      -17,   -17,   -17,   -17,   -17,   -17,   -17,   -17,   -17,   -17,
+      -17,   -17,   -17,   -17,   -17,   -17,   -17,   -17,   -17,   -17,
+      -17,   -17,   -17,   -17,   -17,   -17,   -17,   -17,   -17,   -17,
+      -17,   -17,   -17,   -17,   -17,   -17,   -17,   -17,   -17,   -17,
+      -17,   -17,   -17,   -17,   -17,   -17,   -17,   -17,   -17,   -17,
+      -17,   -17,   -17,   -17,   -17,   -17,   -17,   -17,   -17,   -17,
+      -17,   -17,   -17,   -17,   -17,   -17,   -17,   -17,   -17,   -17,
+      -17,   -17,   -17,   -17,   -17,   -17,   -17,   -17,   -17,   -17,
+      -17,   -17,   -17,   -17,   -17,   -17,   -17,   -17,   -17,   -17,
+      -17,   -17,   -17,   -17,   -17,   -17,   -17,   -17,   -17,   -17,
+      -17,   -17,   -17,   -17,   -17,   -17,   -17,   -17,   -17,   -17,
+      -17,   -17,   -17,   -17,   -17,   -17,   -17,   -17,   -17,   -17,
+      -17,   -17,   -17,   -17,   -17,   -17
+    },
+
+    {
+        5,   -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,
+      -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,
+      -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,
+      -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,
+      -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,
+      -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,
+      -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,
+      -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,
+      -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,
+      -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,
+      -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,
+      -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,
+      -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,
+      -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,
+      -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,
+      -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,
+      -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,
+      -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,
+      -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,
+      -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,
+      -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,
+      -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,
+      -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,
+      -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,
+      -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,   -18,
+      -18,   -18,   -18,   -18,   -18,   -18
+    },
+
+    {
+        5,   -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,
+      -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,
+      -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,
+      -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,    45,   -19,
+      -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,
+      -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,
+       46,   -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,
+      -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,
+      -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,
+      -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,
+      -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,
+      -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,
+      -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,
+      -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,
+      -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,
+      -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,
+      -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,
+      -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,
+      -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,
+      -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,
+      -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,
+      -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,
+      -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,
+      -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,
+      -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,   -19,
+      -19,   -19,   -19,   -19,   -19,   -19
+    },
+
+    {
+        5,   -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,
+      -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,
+      -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,
+      -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,    45,   -20,
+      -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,
+      -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,
+      -20,   -20,    47,   -20,   -20,   -20,   -20,   -20,   -20,   -20,
+      -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,
+      -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,
+      -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,
+      -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,
+      -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,
+      -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,
+      -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,
+      -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,
+      -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,
+      -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,
+      -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,
+      -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,
+      -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,
+      -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,
+      -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,
+      -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,
+      -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,
+      -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,   -20,
+      -20,   -20,   -20,   -20,   -20,   -20
+    },
+
+    {
+        5,    48,    48,    48,    48,    48,    48,    48,    48,    48,
+       49,    48,    48,    48,    48,    48,    48,    48,    48,    48,
+       48,    48,    48,    48,    48,    48,    48,    48,    48,    48,
+       48,    48,    48,    48,    48,    48,    48,    48,    48,    48,
+       48,    48,    50,    48,    48,    48,    48,    48,    48,    48,
+       48,    48,    48,    48,    48,    48,    48,    48,    48,    48,
+       48,    48,    48,    50,    48,    48,    48,    48,    48,    48,
+       48,    48,    48,    48,    48,    48,    48,    48,    48,    48,
+       48,    48,    48,    48,    48,    48,    48,    48,    48,    48,
+       48,    50,    48,    48,    48,    48,    48,    48,    48,    48,
+       48,    48,    48,    48,    48,    48,    48,    48,    48,    48,
+       48,    48,    48,    48,    48,    48,    48,    48,    48,    48,
+       48,    48,    48,    48,    48,    48,    48,    48,    48,    48,
+       48,    48,    48,    48,    48,    48,    48,    48,    48,    48,
+       48,    48,    48,    48,    48,    48,    48,    48,    48,    48,
+       48,    48,    48,    48,    48,    48,    48,    48,    48,    48,
+       48,    48,    48,    48,    48,    48,    48,    48,    48,    48,
+       48,    48,    48,    48,    48,    48,    48,    48,    48,    48,
+       48,    48,    48,    48,    48,    48,    48,    48,    48,    48,
+       48,    48,    48,    48,    48,    48,    48,    48,    48,    48,
+       48,    48,    48,    48,    48,    48,    48,    48,    48,    48,
+       48,    48,    48,    48,    48,    48,    48,    48,    48,    48,
+       48,    48,    48,    48,    48,    48,    48,    48,    48,    48,
+       48,    48,    48,    48,    48,    48,    48,    48,    48,    48,
+       48,    48,    48,    48,    48,    48,    48,    48,    48,    48,
+       48,    48,    48,    48,    48,    48
+    },
+
+    {
+        5,   -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,
+      -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,
+      -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,
+      -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,
+      -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,
+      -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,
+      -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,
+      -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,
+      -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,
+      -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,
+      -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,
+      -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,
+      -22,   -22,   -22,   -22,    51,   -22,   -22,   -22,   -22,   -22,
+      -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,
+      -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,
+      -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,
+      -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,
+      -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,
+      -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,
+      -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,
+      -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,
+      -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,
+      -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,
+      -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,
+      -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,   -22,
+      -22,   -22,   -22,   -22,   -22,   -22
+    },
+
+    {
+        5,    52,    52,    52,    52,    52,    52,    52,    52,    52,
+       52,    52,    52,    52,    52,    52,    52,    52,    52,    52,
+       52,    52,    52,    52,    52,    52,    52,    52,    52,    52,
+       52,    52,    52,    52,   -23,    52,   -23,    52,    52,    52,
+       52,    52,   -23,    52,    52,    52,    52,    52,    52,    52,
+       52,    52,    52,    52,    52,    52,    52,    52,    52,    52,
+       52,    52,    52,   -23,    52,    52,    52,    52,    52,    52,
+       52,    52,    52,    52,    52,    52,    52,    52,    52,    52,
+       52,    52,    52,    52,    52,    52,    52,    52,    52,    52,
+       52,   -23,   -23,    52,    52,    52,    52,    52,    52,    52,
+       52,    52,    52,    52,    52,    52,    52,    52,    52,    52,
+       52,    52,    52,    52,    52,    52,    52,    52,    52,    52,
+       52,    52,    52,    52,    52,    52,    52,    52,    52,    52,
+       52,    52,    52,    52,    52,    52,    52,    52,    52,    52,
+       52,    52,    52,    52,    52,    52,    52,    52,    52,    52,
+       52,    52,    52,    52,    52,    52,    52,    52,    52,    52,
+       52,    52,    52,    52,    52,    52,    52,    52,    52,    52,
+       52,    52,    52,    52,    52,    52,    52,    52,    52,    52,
+       52,    52,    52,    52,    52,    52,    52,    52,    52,    52,
+       52,    52,    52,    52,    52,    52,    52,    52,    52,    52,
+       52,    52,    52,    52,    52,    52,    52,    52,    52,    52,
+       52,    52,    52,    52,    52,    52,    52,    52,    52,    52,
+       52,    52,    52,    52,    52,    52,    52,    52,    52,    52,
+       52,    52,    52,    52,    52,    52,    52,    52,    52,    52,
+       52,    52,    52,    52,    52,    52,    52,    52,    52,    52,
+       52,    52,    52,    52,    52,    52
+    },
+
+    {
+        5,   -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,
+      -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,
+      -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,
+      -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,
+      -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,
+      -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,
+      -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,
+      -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,
+      -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,
+      -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,
+      -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,
+      -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,
+      -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,
+      -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,
+      -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,
+      -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,
+      -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,
+      -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,
+      -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,
+      -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,
+      -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,
+      -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,
+      -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,
+      -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,
+      -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,   -24,
+      -24,   -24,   -24,   -24,   -24,   -24
+    },
+
+    {
+        5,   -25,   -25,   -25,   -25,   -25,   -25,   -25,   -25,   -25,
+      -25,   -25,   -25,   -25,   -25,   -25,   -25,   -25,   -25,   -25,
+      -25,   -25,   -25,   -25,   -25,   -25,   -25,   -25,   -25,   -25,
+      -25,   -25,   -25,   -25,   -25,    53,   -25,   -25,   -25,   -25,
+      -25,   -25,    53,   -25,   -25,   -25,   -25,   -25,    53,    53,
+       53,    53,    53,    53,    53,    53,    53,    53,   -25,   -25,
+      -25,   -25,   -25,    53,    53,    54,    54,    54,    54,    54,
+       54,    54,    54,    54,    54,    54,    54,    54,    54,    54,
+       54,    54,    54,    54,    54,    54,    54,    54,    54,    54,
+       54,   -25,   -25,   -25,   -25,    54,   -25,    54,    54,    54,
+       54,    54,    54,    54,    54,    54,    54,    54,    54,    54,
+       54,    54,    54,    54,    54,    54,    54,    54,    54,    54,
+       54,    54,    54,    55,   -25,   -25,   -25,   -25,   -25,   -25,
+      -25,   -25,   -25,   -25,   -25,   -25,   -25,   -25,   -25,   -25,
+      -25,   -25,   -25,   -25,   -25,   -25,   -25,   -25,   -25,   -25,
+      -25,   -25,   -25,   -25,   -25,   -25,   -25,   -25,   -25,   -25,
+      -25,   -25,   -25,   -25,   -25,   -25,   -25,   -25,   -25,   -25,
+      -25,   -25,   -25,   -25,   -25,   -25,   -25,   -25,   -25,   -25,
+      -25,   -25,   -25,   -25,   -25,   -25,   -25,   -25,   -25,   -25,
+      -25,   -25,   -25,   -25,   -25,   -25,   -25,   -25,   -25,   -25,
+      -25,   -25,   -25,   -25,   -25,   -25,   -25,   -25,   -25,   -25,
+      -25,   -25,   -25,   -25,   -25,   -25,   -25,   -25,   -25,   -25,
+      -25,   -25,   -25,   -25,   -25,   -25,   -25,   -25,   -25,   -25,
+      -25,   -25,   -25,   -25,   -25,   -25,   -25,   -25,   -25,   -25,
+      -25,   -25,   -25,   -25,   -25,   -25,   -25,   -25,   -25,   -25,
+      -25,   -25,   -25,   -25,   -25,   -25
+    },
+
+    {
+        5,   -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,
+      -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,
+      -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,
+      -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,
+      -26,   -26,    56,   -26,   -26,   -26,   -26,   -26,   -26,   -26,
+      -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,
+      -26,   -26,   -26,    56,   -26,   -26,   -26,   -26,   -26,   -26,
+      -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,
+      -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,
+      -26,    56,   -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,
+      -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,
+      -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,
+      -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,
+      -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,
+      -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,
+      -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,
+      -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,
+      -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,
+      -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,
+      -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,
+      -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,
+      -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,
+      -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,
+      -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,
+      -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,   -26,
+      -26,   -26,   -26,   -26,   -26,   -26
+    },
+
+    {
+        5,   -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,
+       57,   -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,
+      -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,
+      -27,   -27,   -27,   -27,    58,   -27,    58,   -27,   -27,   -27,
+      -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,
+      -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,
+      -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,
+      -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,
+      -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,
+      -27,   -27,    58,   -27,   -27,   -27,    58,   -27,   -27,   -27,
+      -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,
+      -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,
+      -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,
+      -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,
+      -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,
+      -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,
+      -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,
+      -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,
+      -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,
+      -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,
+      -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,
+      -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,
+      -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,
+      -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,
+      -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,   -27,
+      -27,   -27,   -27,   -27,   -27,   -27
+    },
+
+    {
+        5,   -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,    28,
+      -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,
+      -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,
+      -28,   -28,    28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,
+      -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,
+      -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,
+      -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,
+      -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,
+      -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,
+      -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,
+      -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,
+      -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,
+      -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,
+      -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,
+      -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,
+      -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,
+      -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,
+      -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,
+      -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,
+      -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,
+      -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,
+      -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,
+      -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,
+      -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,
+      -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,   -28,
+      -28,   -28,   -28,   -28,   -28,   -28
+    },
+
+    {
+        5,   -29,   -29,   -29,   -29,   -29,   -29,   -29,   -29,   -29,
+      -29,   -29,   -29,   -29,   -29,   -29,   -29,   -29,   -29,   -29,
+      -29,   -29,   -29,   -29,   -29,   -29,   -29,   -29,   -29,   -29,
+      -29,   -29,   -29,    29,   -29,    29,   -29,    29,   -29,   -29,
+      -29,   -29,   -29,    29,    29,    29,    29,    29,    29,    29,
+       29,    29,    29,    29,    29,    29,    29,    29,    29,   -29,
+      -29,    29,   -29,   -29,    29,    29,    29,    29,    29,    29,
+       29,    29,    29,    29,    29,    29,    29,    29,    29,    29,
+       29,    29,    29,    29,    29,    29,    29,    29,    29,    29,
+       29,   -29,   -29,    29,   -29,    29,   -29,    29,    29,    29,
+       29,    29,    29,    29,    29,    29,    29,    29,    29,    29,
+       29,    29,    29,    29,    29,    29,    29,    29,    29,    29,
+       29,    29,    29,    29,   -29,    29,    29,   -29,   -29,   -29,
+      -29,   -29,   -29,   -29,   -29,   -29,   -29,   -29,   -29,   -29,
+      -29,   -29,   -29,   -29,   -29,   -29,   -29,   -29,   -29,   -29,
+      -29,   -29,   -29,   -29,   -29,   -29,   -29,   -29,   -29,   -29,
+      -29,   -29,   -29,   -29,   -29,   -29,   -29,   -29,   -29,   -29,
+      -29,   -29,   -29,   -29,   -29,   -29,   -29,   -29,   -29,   -29,
+      -29,   -29,   -29,   -29,   -29,   -29,   -29,   -29,   -29,   -29,
+      -29,   -29,   -29,   -29,   -29,   -29,   -29,   -29,   -29,   -29,
+      -29,   -29,   -29,   -29,   -29,   -29,   -29,   -29,   -29,   -29,
+      -29,   -29,   -29,   -29,   -29,   -29,   -29,   -29,   -29,   -29,
+      -29,   -29,   -29,   -29,   -29,   -29,   -29,   -29,   -29,   -29,
+      -29,   -29,   -29,   -29,   -29,   -29,   -29,   -29,   -29,   -29,
+      -29,   -29,   -29,   -29,   -29,   -29,   -29,   -29,   -29,   -29,
+      -29,   -29,   -29,   -29,   -29,   -29
+    },
+
+    {
+        5,    30,    30,    30,    30,    30,    30,    30,    30,    30,
+      -30,    30,    30,    30,    30,    30,    30,    30,    30,    30,
+       30,    30,    30,    30,    30,    30,    30,    30,    30,    30,
+       30,    30,    30,    30,    30,    30,    30,    30,    30,    30,
+       30,    30,    30,    30,    30,    30,    30,    30,    30,    30,
+       30,    30,    30,    30,    30,    30,    30,    30,    30,    30,
+       30,    30,    30,    30,    30,    30,    30,    30,    30,    30,
+       30,    30,    30,    30,    30,    30,    30,    30,    30,    30,
+       30,    30,    30,    30,    30,    30,    30,    30,    30,    30,
+       30,    30,    30,    30,    30,    30,    30,    30,    30,    30,
+       30,    30,    30,    30,    30,    30,    30,    30,    30,    30,
+       30,    30,    30,    30,    30,    30,    30,    30,    30,    30,
+       30,    30,    30,    30,    30,    30,    30,    30,    30,    30,
+       30,    30,    30,    30,    30,    30,    30,    30,    30,    30,
+       30,    30,    30,    30,    30,    30,    30,    30,    30,    30,
+       30,    30,    30,    30,    30,    30,    30,    30,    30,    30,
+       30,    30,    30,    30,    30,    30,    30,    30,    30,    30,
+       30,    30,    30,    30,    30,    30,    30,    30,    30,    30,
+       30,    30,    30,    30,    30,    30,    30,    30,    30,    30,
+       30,    30,    30,    30,    30,    30,    30,    30,    30,    30,
+       30,    30,    30,    30,    30,    30,    30,    30,    30,    30,
+       30,    30,    30,    30,    30,    30,    30,    30,    30,    30,
+       30,    30,    30,    30,    30,    30,    30,    30,    30,    30,
+       30,    30,    30,    30,    30,    30,    30,    30,    30,    30,
+       30,    30,    30,    30,    30,    30,    30,    30,    30,    30,
+       30,    30,    30,    30,    30,    30
+    },
+
+    {
+        5,    30,    30,    30,    30,    30,    30,    30,    30,    30,
+      -31,    30,    30,    30,    30,    30,    30,    30,    30,    30,
+       30,    30,    30,    30,    30,    30,    30,    30,    30,    30,
+       30,    30,    30,    31,    30,    31,    30,    31,    30,    30,
+       30,    30,    30,    31,    31,    31,    31,    31,    31,    31,
+       31,    31,    31,    31,    31,    31,    31,    31,    31,    30,
+       30,    31,    30,    30,    31,    31,    31,    31,    31,    31,
+       31,    31,    31,    31,    31,    31,    31,    31,    31,    31,
+       31,    31,    31,    31,    31,    31,    31,    31,    31,    31,
+       31,    30,    30,    31,    30,    31,    30,    31,    31,    31,
+       31,    31,    31,    31,    31,    31,    31,    31,    31,    31,
+       31,    31,    31,    31,    31,    31,    31,    31,    31,    31,
+       31,    31,    31,    31,    30,    31,    31,    30,    30,    30,
+       30,    30,    30,    30,    30,    30,    30,    30,    30,    30,
+       30,    30,    30,    30,    30,    30,    30,    30,    30,    30,
+       30,    30,    30,    30,    30,    30,    30,    30,    30,    30,
+       30,    30,    30,    30,    30,    30,    30,    30,    30,    30,
+       30,    30,    30,    30,    30,    30,    30,    30,    30,    30,
+       30,    30,    30,    30,    30,    30,    30,    30,    30,    30,
+       30,    30,    30,    30,    30,    30,    30,    30,    30,    30,
+       30,    30,    30,    30,    30,    30,    30,    30,    30,    30,
+       30,    30,    30,    30,    30,    30,    30,    30,    30,    30,
+       30,    30,    30,    30,    30,    30,    30,    30,    30,    30,
+       30,    30,    30,    30,    30,    30,    30,    30,    30,    30,
+       30,    30,    30,    30,    30,    30,    30,    30,    30,    30,
+       30,    30,    30,    30,    30,    30
+    },
+
+    {
+        5,   -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,
+      -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,
+      -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,
+      -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,
+      -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,
+      -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,
+      -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,
+      -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,
+      -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,
+      -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,
+      -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,
+      -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,
+      -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,
+      -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,
+      -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,
+      -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,
+      -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,
+      -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,
+      -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,
+      -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,
+      -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,
+      -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,
+      -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,
+      -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,
+      -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,   -32,
+      -32,   -32,   -32,   -32,   -32,   -32
+    },
+
+    {
+        5,   -33,   -33,   -33,   -33,   -33,   -33,   -33,   -33,   -33,
+      -33,   -33,   -33,   -33,   -33,   -33,   -33,   -33,   -33,   -33,
+      -33,   -33,   -33,   -33,   -33,   -33,   -33,   -33,   -33,   -33,
+      -33,   -33,   -33,   -33,   -33,   -33,   -33,   -33,   -33,   -33,
+      -33,   -33,   -33,   -33,   -33,   -33,   -33,   -33,    59,    59,
+       59,    59,    59,    59,    59,    59,    59,    59,   -33,   -33,
+      -33,   -33,   -33,   -33,   -33,    59,    59,    59,    59,    59,
+       59,    59,    59,    59,    59,    59,    59,    59,    59,    59,
+       59,    59,    59,    59,    59,    59,    59,    59,    59,    59,
+       59,   -33,   -33,   -33,   -33,    59,   -33,    59,    59,    59,
+       59,    59,    59,    59,    59,    59,    59,    59,    59,    59,
+       59,    59,    59,    59,    59,    59,    59,    59,    59,    59,
+       59,    59,    59,   -33,   -33,   -33,   -33,   -33,   -33,   -33,
+      -33,   -33,   -33,   -33,   -33,   -33,   -33,   -33,   -33,   -33,
+      -33,   -33,   -33,   -33,   -33,   -33,   -33,   -33,   -33,   -33,
+      -33,   -33,   -33,   -33,   -33,   -33,   -33,   -33,   -33,   -33,
+      -33,   -33,   -33,   -33,   -33,   -33,   -33,   -33,   -33,   -33,
+      -33,   -33,   -33,   -33,   -33,   -33,   -33,   -33,   -33,   -33,
+      -33,   -33,   -33,   -33,   -33,   -33,   -33,   -33,   -33,   -33,
+      -33,   -33,   -33,   -33,   -33,   -33,   -33,   -33,   -33,   -33,
+      -33,   -33,   -33,   -33,   -33,   -33,   -33,   -33,   -33,   -33,
+      -33,   -33,   -33,   -33,   -33,   -33,   -33,   -33,   -33,   -33,
+      -33,   -33,   -33,   -33,   -33,   -33,   -33,   -33,   -33,   -33,
+      -33,   -33,   -33,   -33,   -33,   -33,   -33,   -33,   -33,   -33,
+      -33,   -33,   -33,   -33,   -33,   -33,   -33,   -33,   -33,   -33,
+      -33,   -33,   -33,   -33,   -33,   -33
+    },
+
+    {
+        5,   -34,   -34,   -34,   -34,   -34,   -34,   -34,   -34,   -34,
+      -34,   -34,   -34,   -34,   -34,   -34,   -34,   -34,   -34,   -34,
+      -34,   -34,   -34,   -34,   -34,   -34,   -34,   -34,   -34,   -34,
+      -34,   -34,   -34,   -34,   -34,    60,   -34,   -34,   -34,   -34,
+      -34,   -34,    60,   -34,   -34,   -34,   -34,   -34,    60,    60,
+       60,    60,    60,    60,    60,    60,    60,    60,   -34,   -34,
+      -34,   -34,   -34,    60,    60,    61,    61,    61,    61,    61,
+       61,    61,    61,    61,    61,    61,    61,    61,    61,    61,
+       61,    61,    61,    61,    61,    61,    61,    61,    61,    61,
+       61,   -34,   -34,   -34,   -34,    61,   -34,    61,    61,    61,
+       61,    61,    61,    61,    61,    61,    61,    61,    61,    61,
+       61,    61,    61,    61,    61,    61,    61,    61,    61,    61,
+       61,    61,    61,   -34,   -34,   -34,   -34,   -34,   -34,   -34,
+      -34,   -34,   -34,   -34,   -34,   -34,   -34,   -34,   -34,   -34,
+      -34,   -34,   -34,   -34,   -34,   -34,   -34,   -34,   -34,   -34,
+      -34,   -34,   -34,   -34,   -34,   -34,   -34,   -34,   -34,   -34,
+      -34,   -34,   -34,   -34,   -34,   -34,   -34,   -34,   -34,   -34,
+      -34,   -34,   -34,   -34,   -34,   -34,   -34,   -34,   -34,   -34,
+      -34,   -34,   -34,   -34,   -34,   -34,   -34,   -34,   -34,   -34,
+      -34,   -34,   -34,   -34,   -34,   -34,   -34,   -34,   -34,   -34,
+      -34,   -34,   -34,   -34,   -34,   -34,   -34,   -34,   -34,   -34,
+      -34,   -34,   -34,   -34,   -34,   -34,   -34,   -34,   -34,   -34,
+      -34,   -34,   -34,   -34,   -34,   -34,   -34,   -34,   -34,   -34,
+      -34,   -34,   -34,   -34,   -34,   -34,   -34,   -34,   -34,   -34,
+      -34,   -34,   -34,   -34,   -34,   -34,   -34,   -34,   -34,   -34,
+      -34,   -34,   -34,   -34,   -34,   -34
+    },
+
+    {
+        5,   -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,
+      -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,
+      -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,
+      -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,
+      -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,
+      -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,
+      -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,
+      -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,
+      -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,
+      -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,
+      -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,
+      -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,
+      -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,
+      -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,
+      -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,
+      -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,
+      -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,
+      -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,
+      -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,
+      -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,
+      -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,
+      -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,
+      -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,
+      -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,
+      -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,   -35,
+      -35,   -35,   -35,   -35,   -35,   -35
+    },
+
+    {
+        5,   -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,
+      -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,
+      -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,
+      -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,
+      -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,
+      -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,
+      -36,   -36,    62,   -36,   -36,   -36,   -36,   -36,   -36,   -36,
+      -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,
+      -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,
+      -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,
+      -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,
+      -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,
+      -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,
+      -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,
+      -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,
+      -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,
+      -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,
+      -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,
+      -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,
+      -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,
+      -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,
+      -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,
+      -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,
+      -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,
+      -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,   -36,
+      -36,   -36,   -36,   -36,   -36,   -36
+    },
+
+    {
+        5,    37,    37,    37,    37,    37,    37,    37,    37,    37,
+       37,    37,    37,    37,    37,    37,    37,    37,    37,    37,
+       37,    37,    37,    37,    37,    37,    37,    37,    37,    37,
+       37,    37,    37,    37,    37,    37,    37,    37,    37,    38,
+       37,    37,    39,    37,    37,    37,    37,    37,    37,    37,
+       37,    37,    37,    37,    37,    37,    37,    37,    37,    37,
+       37,    37,    37,    39,    37,    37,    37,    37,    37,    37,
+       37,    37,    37,    37,    37,    37,    37,    37,    37,    37,
+       37,    37,    37,    37,    37,    37,    37,    37,    37,    37,
+       37,    39,    37,    37,    37,    37,    37,    37,    37,    37,
+       37,    37,    37,    37,    37,    37,    37,    37,    37,    37,
+       37,    37,    37,    37,    37,    37,    37,    37,    37,    37,
+       37,    37,    37,    37,    37,    37,    37,    37,    37,    37,
+       37,    37,    37,    37,    37,    37,    37,    37,    37,    37,
+       37,    37,    37,    37,    37,    37,    37,    37,    37,    37,
+       37,    37,    37,    37,    37,    37,    37,    37,    37,    37,
+       37,    37,    37,    37,    37,    37,    37,    37,    37,    37,
+       37,    37,    37,    37,    37,    37,    37,    37,    37,    37,
+       37,    37,    37,    37,    37,    37,    37,    37,    37,    37,
+       37,    37,    37,    37,    37,    37,    37,    37,    37,    37,
+       37,    37,    37,    37,    37,    37,    37,    37,    37,    37,
+       37,    37,    37,    37,    37,    37,    37,    37,    37,    37,
+       37,    37,    37,    37,    37,    37,    37,    37,    37,    37,
+       37,    37,    37,    37,    37,    37,    37,    37,    37,    37,
+       37,    37,    37,    37,    37,    37,    37,    37,    37,    37,
+       37,    37,    37,    37,    37,    37
+    },
+
+    {
+        5,   -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,
+      -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,
+      -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,
+      -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,
+      -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,
+      -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,
+      -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,
+      -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,
+      -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,
+      -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,
+      -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,
+      -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,
+      -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,
+      -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,
+      -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,
+      -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,
+      -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,
+      -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,
+      -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,
+      -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,
+      -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,
+      -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,
+      -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,
+      -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,
+      -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,   -38,
+      -38,   -38,   -38,   -38,   -38,   -38
+    },
+
+    {
+        5,    39,    39,    39,    39,    39,    39,    39,    39,    39,
+       39,    39,    39,    39,    39,    39,    39,    39,    39,    39,
+       39,    39,    39,    39,    39,    39,    39,    39,    39,    39,
+       39,    39,    39,    39,    39,    39,    39,    39,    39,    63,
+       39,    39,    39,    39,    39,    39,    39,    39,    39,    39,
+       39,    39,    39,    39,    39,    39,    39,    39,    39,    39,
+       39,    39,    39,    39,    39,    39,    39,    39,    39,    39,
+       39,    39,    39,    39,    39,    39,    39,    39,    39,    39,
+       39,    39,    39,    39,    39,    39,    39,    39,    39,    39,
+       39,    39,    39,    39,    39,    39,    39,    39,    39,    39,
+       39,    39,    39,    39,    39,    39,    39,    39,    39,    39,
+       39,    39,    39,    39,    39,    39,    39,    39,    39,    39,
+       39,    39,    39,    39,    39,    39,    39,    39,    39,    39,
+       39,    39,    39,    39,    39,    39,    39,    39,    39,    39,
+       39,    39,    39,    39,    39,    39,    39,    39,    39,    39,
+       39,    39,    39,    39,    39,    39,    39,    39,    39,    39,
+       39,    39,    39,    39,    39,    39,    39,    39,    39,    39,
+       39,    39,    39,    39,    39,    39,    39,    39,    39,    39,
+       39,    39,    39,    39,    39,    39,    39,    39,    39,    39,
+       39,    39,    39,    39,    39,    39,    39,    39,    39,    39,
+       39,    39,    39,    39,    39,    39,    39,    39,    39,    39,
+       39,    39,    39,    39,    39,    39,    39,    39,    39,    39,
+       39,    39,    39,    39,    39,    39,    39,    39,    39,    39,
+       39,    39,    39,    39,    39,    39,    39,    39,    39,    39,
+       39,    39,    39,    39,    39,    39,    39,    39,    39,    39,
+       39,    39,    39,    39,    39,    39
+    },
+
+    {
+        5,   -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,    40,
+      -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,
+      -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,
+      -40,   -40,    40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,
+      -40,    41,   -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,
+      -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,
+      -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,
+      -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,
+      -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,
+      -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,
+      -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,
+      -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,
+      -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,
+      -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,
+      -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,
+      -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,
+      -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,
+      -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,
+      -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,
+      -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,
+      -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,
+      -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,
+      -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,
+      -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,
+      -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,   -40,
+      -40,   -40,   -40,   -40,   -40,   -40
+    },
+
+    {
+        5,   -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,
+      -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,
+      -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,
+      -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,
+      -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,
+      -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,
+      -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,
+      -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,
+      -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,
+      -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,
+      -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,
+      -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,
+      -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,
+      -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,
+      -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,
+      -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,
+      -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,
+      -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,
+      -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,
+      -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,
+      -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,
+      -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,
+      -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,
+      -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,
+      -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,   -41,
+      -41,   -41,   -41,   -41,   -41,   -41
+    },
+
+    {
+        5,   -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,
+      -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,
+      -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,
+      -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,
+      -42,   -42,    42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,
+      -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,
+      -42,   -42,   -42,    42,   -42,   -42,   -42,   -42,   -42,   -42,
+      -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,
+      -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,
+      -42,    42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,
+      -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,
+      -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,
+      -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,
+      -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,
+      -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,
+      -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,
+      -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,
+      -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,
+      -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,
+      -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,
+      -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,
+      -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,
+      -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,
+      -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,
+      -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,   -42,
+      -42,   -42,   -42,   -42,   -42,   -42
+    },
+
+    {
+        5,   -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,
+      -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,
+      -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,
+      -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,    45,   -43,
+      -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,
+      -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,
+      -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,
+      -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,
+      -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,
+      -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,
+      -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,
+      -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,
+      -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,
+      -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,
+      -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,
+      -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,
+      -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,
+      -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,
+      -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,
+      -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,
+      -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,
+      -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,
+      -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,
+      -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,
+      -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,   -43,
+      -43,   -43,   -43,   -43,   -43,   -43
+    },
+
+    {
+        5,   -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,
+      -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,
+      -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,
+      -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,    45,   -44,
+      -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,
+      -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,
+      -44,   -44,    47,   -44,   -44,   -44,   -44,   -44,   -44,   -44,
+      -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,
+      -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,
+      -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,
+      -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,
+      -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,
+      -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,
+      -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,
+      -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,
+      -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,
+      -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,
+      -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,
+      -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,
+      -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,
+      -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,
+      -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,
+      -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,
+      -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,
+      -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,   -44,
+      -44,   -44,   -44,   -44,   -44,   -44
+    },
+
+    {
+        5,   -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,
+      -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,
+      -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,
+      -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,
+      -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,    64,    64,
+       64,    64,    64,    64,    64,    64,    64,    64,   -45,   -45,
+      -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,
+      -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,
+      -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,
+      -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,
+      -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,
+      -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,
+      -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,
+      -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,
+      -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,
+      -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,
+      -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,
+      -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,
+      -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,
+      -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,
+      -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,
+      -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,
+      -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,
+      -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,
+      -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,   -45,
+      -45,   -45,   -45,   -45,   -45,   -45
+    },
+
+    {
+        5,   -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,
+      -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,
+      -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,
+      -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,
+      -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,
+      -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,
+       65,   -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,
+      -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,
+      -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,
+      -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,
+      -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,
+      -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,
+      -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,
+      -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,
+      -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,
+      -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,
+      -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,
+      -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,
+      -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,
+      -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,
+      -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,
+      -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,
+      -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,
+      -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,
+      -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,   -46,
+      -46,   -46,   -46,   -46,   -46,   -46
+    },
+
+    {
+        5,   -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,
+      -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,
+      -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,
+      -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,
+      -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,
+      -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,
+      -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,
+      -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,
+      -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,
+      -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,
+      -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,
+      -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,
+      -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,
+      -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,
+      -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,
+      -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,
+      -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,
+      -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,
+      -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,
+      -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,
+      -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,
+      -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,
+      -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,
+      -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,
+      -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,   -47,
+      -47,   -47,   -47,   -47,   -47,   -47
+    },
+
+    {
+        5,   -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,
+      -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,
+      -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,
+      -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,
+      -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,
+      -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,
+      -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,
+      -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,
+      -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,
+      -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,
+      -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,
+      -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,
+      -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,
+      -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,
+      -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,
+      -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,
+      -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,
+      -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,
+      -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,
+      -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,
+      -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,
+      -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,
+      -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,
+      -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,
+      -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,   -48,
+      -48,   -48,   -48,   -48,   -48,   -48
+    },
+
+    {
+        5,   -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,
+      -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,
+      -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,
+      -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,
+      -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,
+      -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,
+      -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,
+      -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,
+      -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,
+      -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,
+      -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,
+      -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,
+      -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,
+      -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,
+      -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,
+      -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,
+      -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,
+      -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,
+      -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,
+      -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,
+      -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,
+      -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,
+      -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,
+      -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,
+      -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,   -49,
+      -49,   -49,   -49,   -49,   -49,   -49
+    },
+
+    {
+        5,   -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,
+      -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,
+      -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,
+      -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,
+      -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,
+      -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,
+      -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,
+      -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,
+      -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,
+      -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,
+      -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,
+      -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,
+      -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,
+      -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,
+      -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,
+      -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,
+      -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,
+      -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,
+      -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,
+      -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,
+      -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,
+      -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,
+      -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,
+      -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,
+      -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,   -50,
+      -50,   -50,   -50,   -50,   -50,   -50
+    },
+
+    {
+        5,   -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,
+      -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,
+      -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,
+      -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,
+      -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,
+      -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,
+      -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,
+      -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,
+      -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,
+      -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,
+      -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,
+      -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,
+      -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,
+      -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,
+      -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,
+      -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,
+      -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,
+      -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,
+      -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,
+      -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,
+      -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,
+      -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,
+      -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,
+      -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,
+      -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,   -51,
+      -51,   -51,   -51,   -51,   -51,   -51
+    },
+
+    {
+        5,    52,    52,    52,    52,    52,    52,    52,    52,    52,
+       52,    52,    52,    52,    52,    52,    52,    52,    52,    52,
+       52,    52,    52,    52,    52,    52,    52,    52,    52,    52,
+       52,    52,    52,    52,   -52,    52,   -52,    52,    52,    52,
+       52,    52,   -52,    52,    52,    52,    52,    52,    52,    52,
+       52,    52,    52,    52,    52,    52,    52,    52,    52,    52,
+       52,    52,    52,   -52,    52,    52,    52,    52,    52,    52,
+       52,    52,    52,    52,    52,    52,    52,    52,    52,    52,
+       52,    52,    52,    52,    52,    52,    52,    52,    52,    52,
+       52,   -52,   -52,    52,    52,    52,    52,    52,    52,    52,
+       52,    52,    52,    52,    52,    52,    52,    52,    52,    52,
+       52,    52,    52,    52,    52,    52,    52,    52,    52,    52,
+       52,    52,    52,    52,    52,    52,    52,    52,    52,    52,
+       52,    52,    52,    52,    52,    52,    52,    52,    52,    52,
+       52,    52,    52,    52,    52,    52,    52,    52,    52,    52,
+       52,    52,    52,    52,    52,    52,    52,    52,    52,    52,
+       52,    52,    52,    52,    52,    52,    52,    52,    52,    52,
+       52,    52,    52,    52,    52,    52,    52,    52,    52,    52,
+       52,    52,    52,    52,    52,    52,    52,    52,    52,    52,
+       52,    52,    52,    52,    52,    52,    52,    52,    52,    52,
+       52,    52,    52,    52,    52,    52,    52,    52,    52,    52,
+       52,    52,    52,    52,    52,    52,    52,    52,    52,    52,
+       52,    52,    52,    52,    52,    52,    52,    52,    52,    52,
+       52,    52,    52,    52,    52,    52,    52,    52,    52,    52,
+       52,    52,    52,    52,    52,    52,    52,    52,    52,    52,
+       52,    52,    52,    52,    52,    52
+    },
+
+    {
+        5,   -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,
+      -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,
+      -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,
+      -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,
+      -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,
+      -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,
+      -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,
+      -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,
+      -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,
+      -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,
+      -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,
+      -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,
+      -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,
+      -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,
+      -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,
+      -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,
+      -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,
+      -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,
+      -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,
+      -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,
+      -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,
+      -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,
+      -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,
+      -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,
+      -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,   -53,
+      -53,   -53,   -53,   -53,   -53,   -53
+    },
+
+    {
+        5,   -54,   -54,   -54,   -54,   -54,   -54,   -54,   -54,   -54,
+      -54,   -54,   -54,   -54,   -54,   -54,   -54,   -54,   -54,   -54,
+      -54,   -54,   -54,   -54,   -54,   -54,   -54,   -54,   -54,   -54,
+      -54,   -54,   -54,   -54,   -54,   -54,   -54,   -54,   -54,   -54,
+      -54,   -54,   -54,   -54,   -54,   -54,   -54,   -54,    66,    66,
+       66,    66,    66,    66,    66,    66,    66,    66,   -54,   -54,
+      -54,   -54,   -54,   -54,   -54,    66,    66,    66,    66,    66,
+       66,    66,    66,    66,    66,    66,    66,    66,    66,    66,
+       66,    66,    66,    66,    66,    66,    66,    66,    66,    66,
+       66,   -54,   -54,   -54,   -54,    66,   -54,    66,    66,    66,
+       66,    66,    66,    66,    66,    66,    66,    66,    66,    66,
+       66,    66,    66,    66,    66,    66,    66,    66,    66,    66,
+       66,    66,    66,   -54,   -54,   -54,   -54,   -54,   -54,   -54,
+      -54,   -54,   -54,   -54,   -54,   -54,   -54,   -54,   -54,   -54,
+      -54,   -54,   -54,   -54,   -54,   -54,   -54,   -54,   -54,   -54,
+      -54,   -54,   -54,   -54,   -54,   -54,   -54,   -54,   -54,   -54,
+      -54,   -54,   -54,   -54,   -54,   -54,   -54,   -54,   -54,   -54,
+      -54,   -54,   -54,   -54,   -54,   -54,   -54,   -54,   -54,   -54,
+      -54,   -54,   -54,   -54,   -54,   -54,   -54,   -54,   -54,   -54,
+      -54,   -54,   -54,   -54,   -54,   -54,   -54,   -54,   -54,   -54,
+      -54,   -54,   -54,   -54,   -54,   -54,   -54,   -54,   -54,   -54,
+      -54,   -54,   -54,   -54,   -54,   -54,   -54,   -54,   -54,   -54,
+      -54,   -54,   -54,   -54,   -54,   -54,   -54,   -54,   -54,   -54,
+      -54,   -54,   -54,   -54,   -54,   -54,   -54,   -54,   -54,   -54,
+      -54,   -54,   -54,   -54,   -54,   -54,   -54,   -54,   -54,   -54,
+      -54,   -54,   -54,   -54,   -54,   -54
+    },
+
+    {
+        5,   -55,   -55,   -55,   -55,   -55,   -55,   -55,   -55,   -55,
+      -55,   -55,   -55,   -55,   -55,   -55,   -55,   -55,   -55,   -55,
+      -55,   -55,   -55,   -55,   -55,   -55,   -55,   -55,   -55,   -55,
+      -55,   -55,   -55,   -55,   -55,    67,   -55,   -55,   -55,   -55,
+      -55,   -55,    67,   -55,   -55,   -55,   -55,   -55,    67,    67,
+       67,    67,    67,    67,    67,    67,    67,    67,   -55,   -55,
+      -55,   -55,   -55,    67,    67,    68,    68,    68,    68,    68,
+       68,    68,    68,    68,    68,    68,    68,    68,    68,    68,
+       68,    68,    68,    68,    68,    68,    68,    68,    68,    68,
+       68,   -55,   -55,   -55,   -55,    68,   -55,    68,    68,    68,
+       68,    68,    68,    68,    68,    68,    68,    68,    68,    68,
+       68,    68,    68,    68,    68,    68,    68,    68,    68,    68,
+       68,    68,    68,   -55,   -55,   -55,   -55,   -55,   -55,   -55,
+      -55,   -55,   -55,   -55,   -55,   -55,   -55,   -55,   -55,   -55,
+      -55,   -55,   -55,   -55,   -55,   -55,   -55,   -55,   -55,   -55,
+      -55,   -55,   -55,   -55,   -55,   -55,   -55,   -55,   -55,   -55,
+      -55,   -55,   -55,   -55,   -55,   -55,   -55,   -55,   -55,   -55,
+      -55,   -55,   -55,   -55,   -55,   -55,   -55,   -55,   -55,   -55,
+      -55,   -55,   -55,   -55,   -55,   -55,   -55,   -55,   -55,   -55,
+      -55,   -55,   -55,   -55,   -55,   -55,   -55,   -55,   -55,   -55,
+      -55,   -55,   -55,   -55,   -55,   -55,   -55,   -55,   -55,   -55,
+      -55,   -55,   -55,   -55,   -55,   -55,   -55,   -55,   -55,   -55,
+      -55,   -55,   -55,   -55,   -55,   -55,   -55,   -55,   -55,   -55,
+      -55,   -55,   -55,   -55,   -55,   -55,   -55,   -55,   -55,   -55,
+      -55,   -55,   -55,   -55,   -55,   -55,   -55,   -55,   -55,   -55,
+      -55,   -55,   -55,   -55,   -55,   -55
+    },
+
+    {
+        5,   -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,
+      -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,
+      -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,
+      -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,
+      -56,   -56,    56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,
+      -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,
+      -56,   -56,   -56,    56,   -56,   -56,   -56,   -56,   -56,   -56,
+      -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,
+      -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,
+      -56,    56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,
+      -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,
+      -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,
+      -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,
+      -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,
+      -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,
+      -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,
+      -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,
+      -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,
+      -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,
+      -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,
+      -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,
+      -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,
+      -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,
+      -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,
+      -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,   -56,
+      -56,   -56,   -56,   -56,   -56,   -56
+    },
+
+    {
+        5,   -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,
+      -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,
+      -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,
+      -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,
+      -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,
+      -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,
+      -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,
+      -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,
+      -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,
+      -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,
+      -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,
+      -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,
+      -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,
+      -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,
+      -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,
+      -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,
+      -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,
+      -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,
+      -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,
+      -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,
+      -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,
+      -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,
+      -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,
+      -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,
+      -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,   -57,
+      -57,   -57,   -57,   -57,   -57,   -57
+    },
+
+    {
+        5,   -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,
+      -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,
+      -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,
+      -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,
+      -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,
+      -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,
+      -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,
+      -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,
+      -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,
+      -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,
+      -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,
+      -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,
+      -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,
+      -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,
+      -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,
+      -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,
+      -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,
+      -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,
+      -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,
+      -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,
+      -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,
+      -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,
+      -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,
+      -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,
+      -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,   -58,
+      -58,   -58,   -58,   -58,   -58,   -58
+    },
+
+    {
+        5,   -59,   -59,   -59,   -59,   -59,   -59,   -59,   -59,   -59,
+      -59,   -59,   -59,   -59,   -59,   -59,   -59,   -59,   -59,   -59,
+      -59,   -59,   -59,   -59,   -59,   -59,   -59,   -59,   -59,   -59,
+      -59,   -59,   -59,   -59,   -59,   -59,   -59,   -59,   -59,   -59,
+      -59,   -59,   -59,   -59,   -59,   -59,   -59,   -59,    59,    59,
+       59,    59,    59,    59,    59,    59,    59,    59,   -59,   -59,
+      -59,   -59,   -59,   -59,   -59,    59,    59,    59,    59,    59,
+       59,    59,    59,    59,    59,    59,    59,    59,    59,    59,
+       59,    59,    59,    59,    59,    59,    59,    59,    59,    59,
+       59,   -59,   -59,   -59,   -59,    59,   -59,    59,    59,    59,
+       59,    59,    59,    59,    59,    59,    59,    59,    59,    59,
+       59,    59,    59,    59,    59,    59,    59,    59,    59,    59,
+       59,    59,    59,   -59,   -59,   -59,   -59,   -59,   -59,   -59,
+      -59,   -59,   -59,   -59,   -59,   -59,   -59,   -59,   -59,   -59,
+      -59,   -59,   -59,   -59,   -59,   -59,   -59,   -59,   -59,   -59,
+      -59,   -59,   -59,   -59,   -59,   -59,   -59,   -59,   -59,   -59,
+      -59,   -59,   -59,   -59,   -59,   -59,   -59,   -59,   -59,   -59,
+      -59,   -59,   -59,   -59,   -59,   -59,   -59,   -59,   -59,   -59,
+      -59,   -59,   -59,   -59,   -59,   -59,   -59,   -59,   -59,   -59,
+      -59,   -59,   -59,   -59,   -59,   -59,   -59,   -59,   -59,   -59,
+      -59,   -59,   -59,   -59,   -59,   -59,   -59,   -59,   -59,   -59,
+      -59,   -59,   -59,   -59,   -59,   -59,   -59,   -59,   -59,   -59,
+      -59,   -59,   -59,   -59,   -59,   -59,   -59,   -59,   -59,   -59,
+      -59,   -59,   -59,   -59,   -59,   -59,   -59,   -59,   -59,   -59,
+      -59,   -59,   -59,   -59,   -59,   -59,   -59,   -59,   -59,   -59,
+      -59,   -59,   -59,   -59,   -59,   -59
+    },
+
+    {
+        5,   -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,
+      -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,
+      -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,
+      -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,
+      -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,
+      -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,
+      -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,
+      -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,
+      -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,
+      -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,
+      -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,
+      -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,
+      -60,   -60,   -60,   -60,   -60,    69,   -60,   -60,   -60,   -60,
+      -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,
+      -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,
+      -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,
+      -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,
+      -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,
+      -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,
+      -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,
+      -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,
+      -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,
+      -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,
+      -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,
+      -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,   -60,
+      -60,   -60,   -60,   -60,   -60,   -60
+    },
+
+    {
+        5,   -61,   -61,   -61,   -61,   -61,   -61,   -61,   -61,   -61,
+      -61,   -61,   -61,   -61,   -61,   -61,   -61,   -61,   -61,   -61,
+      -61,   -61,   -61,   -61,   -61,   -61,   -61,   -61,   -61,   -61,
+      -61,   -61,   -61,   -61,   -61,   -61,   -61,   -61,   -61,   -61,
+      -61,   -61,   -61,   -61,   -61,   -61,   -61,   -61,    70,    70,
+       70,    70,    70,    70,    70,    70,    70,    70,   -61,   -61,
+      -61,   -61,   -61,   -61,   -61,    70,    70,    70,    70,    70,
+       70,    70,    70,    70,    70,    70,    70,    70,    70,    70,
+       70,    70,    70,    70,    70,    70,    70,    70,    70,    70,
+       70,   -61,   -61,   -61,   -61,    70,   -61,    70,    70,    70,
+       70,    70,    70,    70,    70,    70,    70,    70,    70,    70,
+       70,    70,    70,    70,    70,    70,    70,    70,    70,    70,
+       70,    70,    70,   -61,   -61,    69,   -61,   -61,   -61,   -61,
+      -61,   -61,   -61,   -61,   -61,   -61,   -61,   -61,   -61,   -61,
+      -61,   -61,   -61,   -61,   -61,   -61,   -61,   -61,   -61,   -61,
+      -61,   -61,   -61,   -61,   -61,   -61,   -61,   -61,   -61,   -61,
+      -61,   -61,   -61,   -61,   -61,   -61,   -61,   -61,   -61,   -61,
+      -61,   -61,   -61,   -61,   -61,   -61,   -61,   -61,   -61,   -61,
+      -61,   -61,   -61,   -61,   -61,   -61,   -61,   -61,   -61,   -61,
+      -61,   -61,   -61,   -61,   -61,   -61,   -61,   -61,   -61,   -61,
+      -61,   -61,   -61,   -61,   -61,   -61,   -61,   -61,   -61,   -61,
+      -61,   -61,   -61,   -61,   -61,   -61,   -61,   -61,   -61,   -61,
+      -61,   -61,   -61,   -61,   -61,   -61,   -61,   -61,   -61,   -61,
+      -61,   -61,   -61,   -61,   -61,   -61,   -61,   -61,   -61,   -61,
+      -61,   -61,   -61,   -61,   -61,   -61,   -61,   -61,   -61,   -61,
+      -61,   -61,   -61,   -61,   -61,   -61
+    },
+
+    {
+        5,   -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,
+      -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,
+      -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,
+      -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,
+      -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,
+      -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,
+      -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,
+      -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,
+      -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,
+      -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,
+      -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,
+      -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,
+      -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,
+      -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,
+      -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,
+      -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,
+      -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,
+      -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,
+      -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,
+      -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,
+      -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,
+      -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,
+      -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,
+      -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,
+      -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,   -62,
+      -62,   -62,   -62,   -62,   -62,   -62
+    },
+
+    {
+        5,   -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,
+      -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,
+      -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,
+      -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,
+      -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,
+      -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,
+      -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,
+      -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,
+      -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,
+      -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,
+      -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,
+      -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,
+      -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,
+      -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,
+      -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,
+      -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,
+      -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,
+      -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,
+      -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,
+      -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,
+      -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,
+      -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,
+      -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,
+      -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,
+      -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,   -63,
+      -63,   -63,   -63,   -63,   -63,   -63
+    },
+
+    {
+        5,   -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,
+      -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,
+      -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,
+      -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,
+      -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,
+      -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,
+      -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,
+      -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,
+      -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,
+      -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,
+      -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,
+      -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,
+      -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,
+      -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,
+      -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,
+      -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,
+      -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,
+      -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,
+      -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,
+      -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,
+      -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,
+      -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,
+      -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,
+      -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,
+      -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,   -64,
+      -64,   -64,   -64,   -64,   -64,   -64
+    },
+
+    {
+        5,   -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,
+      -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,
+      -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,
+      -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,
+      -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,
+      -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,
+      -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,
+      -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,
+      -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,
+      -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,
+      -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,
+      -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,
+      -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,
+      -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,
+      -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,
+      -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,
+      -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,
+      -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,
+      -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,
+      -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,
+      -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,
+      -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,
+      -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,
+      -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,
+      -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,   -65,
+      -65,   -65,   -65,   -65,   -65,   -65
+    },
+
+    {
+        5,   -66,   -66,   -66,   -66,   -66,   -66,   -66,   -66,   -66,
+      -66,   -66,   -66,   -66,   -66,   -66,   -66,   -66,   -66,   -66,
+      -66,   -66,   -66,   -66,   -66,   -66,   -66,   -66,   -66,   -66,
+      -66,   -66,   -66,   -66,   -66,   -66,   -66,   -66,   -66,   -66,
+      -66,   -66,   -66,   -66,   -66,   -66,   -66,   -66,    66,    66,
+       66,    66,    66,    66,    66,    66,    66,    66,   -66,   -66,
+      -66,   -66,   -66,   -66,   -66,    66,    66,    66,    66,    66,
+       66,    66,    66,    66,    66,    66,    66,    66,    66,    66,
+       66,    66,    66,    66,    66,    66,    66,    66,    66,    66,
+       66,   -66,   -66,   -66,   -66,    66,   -66,    66,    66,    66,
+       66,    66,    66,    66,    66,    66,    66,    66,    66,    66,
+       66,    66,    66,    66,    66,    66,    66,    66,    66,    66,
+       66,    66,    66,   -66,   -66,   -66,   -66,   -66,   -66,   -66,
+      -66,   -66,   -66,   -66,   -66,   -66,   -66,   -66,   -66,   -66,
+      -66,   -66,   -66,   -66,   -66,   -66,   -66,   -66,   -66,   -66,
+      -66,   -66,   -66,   -66,   -66,   -66,   -66,   -66,   -66,   -66,
+      -66,   -66,   -66,   -66,   -66,   -66,   -66,   -66,   -66,   -66,
+      -66,   -66,   -66,   -66,   -66,   -66,   -66,   -66,   -66,   -66,
+      -66,   -66,   -66,   -66,   -66,   -66,   -66,   -66,   -66,   -66,
+      -66,   -66,   -66,   -66,   -66,   -66,   -66,   -66,   -66,   -66,
+      -66,   -66,   -66,   -66,   -66,   -66,   -66,   -66,   -66,   -66,
+      -66,   -66,   -66,   -66,   -66,   -66,   -66,   -66,   -66,   -66,
+      -66,   -66,   -66,   -66,   -66,   -66,   -66,   -66,   -66,   -66,
+      -66,   -66,   -66,   -66,   -66,   -66,   -66,   -66,   -66,   -66,
+      -66,   -66,   -66,   -66,   -66,   -66,   -66,   -66,   -66,   -66,
+      -66,   -66,   -66,   -66,   -66,   -66
+    },
+
+    {
+        5,   -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,
+      -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,
+      -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,
+      -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,
+      -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,
+      -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,
+      -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,
+      -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,
+      -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,
+      -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,
+      -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,
+      -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,
+      -67,   -67,   -67,   -67,   -67,    71,   -67,   -67,   -67,   -67,
+      -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,
+      -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,
+      -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,
+      -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,
+      -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,
+      -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,
+      -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,
+      -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,
+      -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,
+      -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,
+      -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,
+      -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,   -67,
+      -67,   -67,   -67,   -67,   -67,   -67
+    },
+
+    {
+        5,   -68,   -68,   -68,   -68,   -68,   -68,   -68,   -68,   -68,
+      -68,   -68,   -68,   -68,   -68,   -68,   -68,   -68,   -68,   -68,
+      -68,   -68,   -68,   -68,   -68,   -68,   -68,   -68,   -68,   -68,
+      -68,   -68,   -68,   -68,   -68,   -68,   -68,   -68,   -68,   -68,
+      -68,   -68,   -68,   -68,   -68,   -68,   -68,   -68,    72,    72,
+       72,    72,    72,    72,    72,    72,    72,    72,   -68,   -68,
+      -68,   -68,   -68,   -68,   -68,    72,    72,    72,    72,    72,
+       72,    72,    72,    72,    72,    72,    72,    72,    72,    72,
+       72,    72,    72,    72,    72,    72,    72,    72,    72,    72,
+       72,   -68,   -68,   -68,   -68,    72,   -68,    72,    72,    72,
+       72,    72,    72,    72,    72,    72,    72,    72,    72,    72,
+       72,    72,    72,    72,    72,    72,    72,    72,    72,    72,
+       72,    72,    72,   -68,   -68,    71,   -68,   -68,   -68,   -68,
+      -68,   -68,   -68,   -68,   -68,   -68,   -68,   -68,   -68,   -68,
+      -68,   -68,   -68,   -68,   -68,   -68,   -68,   -68,   -68,   -68,
+      -68,   -68,   -68,   -68,   -68,   -68,   -68,   -68,   -68,   -68,
+      -68,   -68,   -68,   -68,   -68,   -68,   -68,   -68,   -68,   -68,
+      -68,   -68,   -68,   -68,   -68,   -68,   -68,   -68,   -68,   -68,
+      -68,   -68,   -68,   -68,   -68,   -68,   -68,   -68,   -68,   -68,
+      -68,   -68,   -68,   -68,   -68,   -68,   -68,   -68,   -68,   -68,
+      -68,   -68,   -68,   -68,   -68,   -68,   -68,   -68,   -68,   -68,
+      -68,   -68,   -68,   -68,   -68,   -68,   -68,   -68,   -68,   -68,
+      -68,   -68,   -68,   -68,   -68,   -68,   -68,   -68,   -68,   -68,
+      -68,   -68,   -68,   -68,   -68,   -68,   -68,   -68,   -68,   -68,
+      -68,   -68,   -68,   -68,   -68,   -68,   -68,   -68,   -68,   -68,
+      -68,   -68,   -68,   -68,   -68,   -68
+    },
+
+    {
+        5,   -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,
+      -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,
+      -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,
+      -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,
+      -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,
+      -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,
+      -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,
+      -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,
+      -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,
+      -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,
+      -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,
+      -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,
+      -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,
+      -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,
+      -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,
+      -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,
+      -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,
+      -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,
+      -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,
+      -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,
+      -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,
+      -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,
+      -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,
+      -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,
+      -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,   -69,
+      -69,   -69,   -69,   -69,   -69,   -69
+    },
+
+    {
+        5,   -70,   -70,   -70,   -70,   -70,   -70,   -70,   -70,   -70,
+      -70,   -70,   -70,   -70,   -70,   -70,   -70,   -70,   -70,   -70,
+      -70,   -70,   -70,   -70,   -70,   -70,   -70,   -70,   -70,   -70,
+      -70,   -70,   -70,   -70,   -70,   -70,   -70,   -70,   -70,   -70,
+      -70,   -70,   -70,   -70,   -70,   -70,   -70,   -70,    70,    70,
+       70,    70,    70,    70,    70,    70,    70,    70,   -70,   -70,
+      -70,   -70,   -70,   -70,   -70,    70,    70,    70,    70,    70,
+       70,    70,    70,    70,    70,    70,    70,    70,    70,    70,
+       70,    70,    70,    70,    70,    70,    70,    70,    70,    70,
+       70,   -70,   -70,   -70,   -70,    70,   -70,    70,    70,    70,
+       70,    70,    70,    70,    70,    70,    70,    70,    70,    70,
+       70,    70,    70,    70,    70,    70,    70,    70,    70,    70,
+       70,    70,    70,   -70,   -70,    69,   -70,   -70,   -70,   -70,
+      -70,   -70,   -70,   -70,   -70,   -70,   -70,   -70,   -70,   -70,
+      -70,   -70,   -70,   -70,   -70,   -70,   -70,   -70,   -70,   -70,
+      -70,   -70,   -70,   -70,   -70,   -70,   -70,   -70,   -70,   -70,
+      -70,   -70,   -70,   -70,   -70,   -70,   -70,   -70,   -70,   -70,
+      -70,   -70,   -70,   -70,   -70,   -70,   -70,   -70,   -70,   -70,
+      -70,   -70,   -70,   -70,   -70,   -70,   -70,   -70,   -70,   -70,
+      -70,   -70,   -70,   -70,   -70,   -70,   -70,   -70,   -70,   -70,
+      -70,   -70,   -70,   -70,   -70,   -70,   -70,   -70,   -70,   -70,
+      -70,   -70,   -70,   -70,   -70,   -70,   -70,   -70,   -70,   -70,
+      -70,   -70,   -70,   -70,   -70,   -70,   -70,   -70,   -70,   -70,
+      -70,   -70,   -70,   -70,   -70,   -70,   -70,   -70,   -70,   -70,
+      -70,   -70,   -70,   -70,   -70,   -70,   -70,   -70,   -70,   -70,
+      -70,   -70,   -70,   -70,   -70,   -70
+    },
+
+    {
+        5,   -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,
+      -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,
+      -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,
+      -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,
+      -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,
+      -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,
+      -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,
+      -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,
+      -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,
+      -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,
+      -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,
+      -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,
+      -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,
+      -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,
+      -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,
+      -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,
+      -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,
+      -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,
+      -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,
+      -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,
+      -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,
+      -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,
+      -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,
+      -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,
+      -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,   -71,
+      -71,   -71,   -71,   -71,   -71,   -71
+    },
+
+    {
+        5,   -72,   -72,   -72,   -72,   -72,   -72,   -72,   -72,   -72,
+      -72,   -72,   -72,   -72,   -72,   -72,   -72,   -72,   -72,   -72,
+      -72,   -72,   -72,   -72,   -72,   -72,   -72,   -72,   -72,   -72,
+      -72,   -72,   -72,   -72,   -72,   -72,   -72,   -72,   -72,   -72,
+      -72,   -72,   -72,   -72,   -72,   -72,   -72,   -72,    72,    72,
+       72,    72,    72,    72,    72,    72,    72,    72,   -72,   -72,
+      -72,   -72,   -72,   -72,   -72,    72,    72,    72,    72,    72,
+       72,    72,    72,    72,    72,    72,    72,    72,    72,    72,
+       72,    72,    72,    72,    72,    72,    72,    72,    72,    72,
+       72,   -72,   -72,   -72,   -72,    72,   -72,    72,    72,    72,
+       72,    72,    72,    72,    72,    72,    72,    72,    72,    72,
+       72,    72,    72,    72,    72,    72,    72,    72,    72,    72,
+       72,    72,    72,   -72,   -72,    71,   -72,   -72,   -72,   -72,
+      -72,   -72,   -72,   -72,   -72,   -72,   -72,   -72,   -72,   -72,
+      -72,   -72,   -72,   -72,   -72,   -72,   -72,   -72,   -72,   -72,
+      -72,   -72,   -72,   -72,   -72,   -72,   -72,   -72,   -72,   -72,
+      -72,   -72,   -72,   -72,   -72,   -72,   -72,   -72,   -72,   -72,
+      -72,   -72,   -72,   -72,   -72,   -72,   -72,   -72,   -72,   -72,
+      -72,   -72,   -72,   -72,   -72,   -72,   -72,   -72,   -72,   -72,
+      -72,   -72,   -72,   -72,   -72,   -72,   -72,   -72,   -72,   -72,
+      -72,   -72,   -72,   -72,   -72,   -72,   -72,   -72,   -72,   -72,
+      -72,   -72,   -72,   -72,   -72,   -72,   -72,   -72,   -72,   -72,
+      -72,   -72,   -72,   -72,   -72,   -72,   -72,   -72,   -72,   -72,
+      -72,   -72,   -72,   -72,   -72,   -72,   -72,   -72,   -72,   -72,
+      -72,   -72,   -72,   -72,   -72,   -72,   -72,   -72,   -72,   -72,
+      -72,   -72,   -72,   -72,   -72,   -72
+    },
+    } ;
+
+static yyconst flex_int16_t yy_accept[73] =
+    {   0,
+        0,    0,    0,    0,   38,   37,   35,   36,    2,    7,
+        1,   14,   30,    6,   37,    3,    2,   31,   28,   28,
+       37,   25,   15,   24,   23,   16,   19,   35,    2,    1,
+        1,   13,   11,    0,   32,   28,    6,    4,    6,    0,
+       34,    3,   28,   28,    0,   27,   28,   10,    8,    9,
+       33,   15,   22,   20,    0,   16,   18,   17,   11,    0,
+        0,   28,    5,   29,   26,   20,    0,    0,   12,    0,
+       21,    0
+    } ;
+
+static yyconst yy_state_type yy_NUL_trans[73] =
+    {   0,
+        0,    0,    0,    0,    0,    0,    0,    0,    0,    0,
+        0,    0,    0,    0,    0,    0,    0,    0,    0,    0,
+        0,    0,    0,    0,    0,    0,    0,    0,    0,    0,
+        0,    0,    0,    0,    0,    0,    0,    0,    0,    0,
+        0,    0,    0,    0,    0,    0,    0,    0,    0,    0,
+        0,    0,    0,    0,    0,    0,    0,    0,    0,    0,
+        0,    0,    0,    0,    0,    0,    0,    0,    0,    0,
+        0,    0
+    } ;
+
+/* The intent behind this definition is that it'll catch
+ * any uses of REJECT which flex missed.
+ */
+#define REJECT reject_used_but_not_detected
+#define yymore() yymore_used_but_not_detected
+#define YY_MORE_ADJ 0
+#define YY_RESTORE_YY_MORE_OFFSET
+#line 1 "lexer.l"
+#line 2 "lexer.l"
+void lexer_push_token(shell_ctx_t *, char *, const size_t, const int);
+void lexer_push_op(shell_ctx_t *, char *, const size_t, const int);
+void lexer_push_control(shell_ctx_t *, char *, const size_t, const int);
+void lexer_word_part(shell_ctx_t *, char *, const size_t);
+void lexer_glob_part(shell_ctx_t *, char *, const size_t);
+void lexer_literal_part(shell_ctx_t *, char *, const size_t);
+void lexer_word_append(shell_ctx_t *, const char *, const size_t);
+void lexer_word_end(shell_ctx_t *);
+void lexer_expand(shell_ctx_t *, const char *, const size_t, const bool);
+void lexer_unterminated(shell_ctx_t *);
+void lexer_end_input(shell_ctx_t *);
+void lexer_terminate_words(shell_ctx_t *);
+void lexer_echo(yyscan_t, const char *, const size_t);
+/* termios.h has a flag by that name */
+#undef ECHO
+#define ECHO lexer_echo(yyscanner, yytext, yyleng)
+#define YY_NO_INPUT 1
+#line 475 "lex.yy.c"
+
+#define INITIAL 0
+#define DQUOTE 1
+
+#ifndef YY_NO_UNISTD_H
+/* Special case for "unistd.h", since it is non-ANSI. We include it way
+ * down here because we want the user's section 1 to have been scanned first.
+ * The user has a chance to override it with an option.
+ */
+#include <unistd.h>
+#endif
+
+#define YY_EXTRA_TYPE shell_ctx_t *
+
+/* Holds the entire state of the reentrant scanner. */
+struct yyguts_t
+    {
+
+    /* User-defined. Not touched by flex. */
+    YY_EXTRA_TYPE yyextra_r;
+
+    /* The rest are the same as the globals declared in the non-reentrant scanner. */
+    FILE *yyin_r, *yyout_r;
+    size_t yy_buffer_stack_top; /**< index of top of stack. */
+    size_t yy_buffer_stack_max; /**< capacity of stack. */
+    YY_BUFFER_STATE * yy_buffer_stack; /**< Stack as an array. */
+    char yy_hold_char;
+    yy_size_t yy_n_chars;
+    yy_size_t yyleng_r;
+    char *yy_c_buf_p;
+    int yy_init;
+    int yy_start;
+    int yy_did_buffer_switch_on_eof;
+    int yy_start_stack_ptr;
+    int yy_start_stack_depth;
+    int *yy_start_stack;
+    yy_state_type yy_last_accepting_state;
+    char* yy_last_accepting_cpos;
+
+    int yylineno_r;
+    int yy_flex_debug_r;
+
+    char *yytext_r;
+    int yy_more_flag;
+    int yy_more_len;
+
+    }; /* end struct yyguts_t */
+
+static int yy_init_globals (yyscan_t yyscanner );
+
+int yylex_init (yyscan_t* scanner);
+
+int yylex_init_extra (YY_EXTRA_TYPE user_defined, yyscan_t* scanner);
+
+/* Accessor methods to globals.
+   These are made visible to non-reentrant scanners for convenience. */
+
+int yylex_destroy (yyscan_t yyscanner );
+
+int yyget_debug (yyscan_t yyscanner );
+
+void yyset_debug (int debug_flag ,yyscan_t yyscanner );
+
+YY_EXTRA_TYPE yyget_extra (yyscan_t yyscanner );
+
+void yyset_extra (YY_EXTRA_TYPE user_defined ,yyscan_t yyscanner );
+
+FILE *yyget_in (yyscan_t yyscanner );
+
+void yyset_in  (FILE * in_str ,yyscan_t yyscanner );
+
+FILE *yyget_out (yyscan_t yyscanner );
+
+void yyset_out  (FILE * out_str ,yyscan_t yyscanner );
+
+yy_size_t yyget_leng (yyscan_t yyscanner );
+
+char *yyget_text (yyscan_t yyscanner );
+
+int yyget_lineno (yyscan_t yyscanner );
+
+void yyset_lineno (int line_number ,yyscan_t yyscanner );
+
+int yyget_column  (yyscan_t yyscanner );
+
+void yyset_column (int column_no ,yyscan_t yyscanner );
+
+/* Macros after this point can all be overridden by user definitions in
+ * section 1.
+ */
+
+#ifndef YY_SKIP_YYWRAP
+#ifdef __cplusplus
+extern "C" int yywrap (yyscan_t yyscanner );
+#else
+extern int yywrap (yyscan_t yyscanner );
+#endif
+#endif
+
+#ifndef yytext_ptr
+static void yy_flex_strncpy (char *,yyconst char *,int ,yyscan_t yyscanner);
+#endif
+
+#ifdef YY_NEED_STRLEN
+static int yy_flex_strlen (yyconst char * ,yyscan_t yyscanner);
+#endif
+
+#ifndef YY_NO_INPUT
+
+#ifdef __cplusplus
+static int yyinput (yyscan_t yyscanner );
+#else
+static int input (yyscan_t yyscanner );
+#endif
+
+#endif
+
+/* Amount of stuff to slurp up with each read. */
+#ifndef YY_READ_BUF_SIZE
+#define YY_READ_BUF_SIZE 8192
+#endif
+
+/* Copy whatever the last rule matched to the standard output. */
+#ifndef ECHO
+/* This used to be an fputs(), but since the string might contain NUL's,
+ * we now use fwrite().
+ */
+#define ECHO fwrite( yytext, yyleng, 1, yyout )
+#endif
+
+/* Gets input and stuffs it into "buf".  number of characters read, or YY_NULL,
+ * is returned in "result".
+ */
+#ifndef YY_INPUT
+#define YY_INPUT(buf,result,max_size) \
+    if ( YY_CURRENT_BUFFER_LVALUE->yy_is_interactive ) \
+        { \
+        int c = '*'; \
+        yy_size_t n; \
+        for ( n = 0; n < max_size && \
+                 (c = getc( yyin )) != EOF && c != '\n'; ++n ) \
+            buf[n] = (char) c; \
+        if ( c == '\n' ) \
+            buf[n++] = (char) c; \
+        if ( c == EOF && ferror( yyin ) ) \
+            YY_FATAL_ERROR( "input in flex scanner failed" ); \
+        result = n; \
+        } \
+    else \
+        { \
+        errno=0; \
+        while ( (result = fread(buf, 1, max_size, yyin))==0 && ferror(yyin)) \
+            { \
+            if( errno != EINTR) \
+                { \
+                YY_FATAL_ERROR( "input in flex scanner failed" ); \
+                break; \
+                } \
+            errno=0; \
+            clearerr(yyin); \
+            } \
+        }\
+\
+
+#endif
+
+/* No semi-colon after return; correct usage is to write "yyterminate();" -
+ * we don't want an extra ';' after the "return" because that will cause
+ * some compilers to complain about unreachable statements.
+ */
+#ifndef yyterminate
+#define yyterminate() return YY_NULL
+#endif
+
+/* Number of entries by which start-condition stack grows. */
+#ifndef YY_START_STACK_INCR
+#define YY_START_STACK_INCR 25
+#endif
+
+/* Report a fatal error. */
+#ifndef YY_FATAL_ERROR
+#define YY_FATAL_ERROR(msg) yy_fatal_error( msg , yyscanner)
+#endif
+
+/* end tables serialization structures and prototypes */
+
+/* Default declaration of generated scanner - a define so the user can
+ * easily add parameters.
+ */
+#ifndef YY_DECL
+#define YY_DECL_IS_OURS 1
+
+extern int yylex (yyscan_t yyscanner);
+
+#define YY_DECL int yylex (yyscan_t yyscanner)
+#endif /* !YY_DECL */
+
+/* Code executed at the beginning of each rule, after yytext and yyleng
+ * have been set up.
+ */
+#ifndef YY_USER_ACTION
+#define YY_USER_ACTION
+#endif
+
+/* Code executed at the end of each rule. */
+#ifndef YY_BREAK
+#define YY_BREAK break;
+#endif
+
+#define YY_RULE_SETUP \
+    YY_USER_ACTION
+
+/** The main scanner function which does all the work.
+ */
+YY_DECL
+{
+    register yy_state_type yy_current_state;
+    register char *yy_cp, *yy_bp;
+    register int yy_act;
+    struct yyguts_t * yyg = (struct yyguts_t*)yyscanner;
+
+#line 9 "lexer.l"
+
+#line 657 "lex.yy.c"
+
+    if ( !yyg->yy_init )
+        {
+        yyg->yy_init = 1;
+
+#ifdef YY_USER_INIT
+        YY_USER_INIT;
+#endif
+
+        if ( ! yyg->yy_start )
+            yyg->yy_start = 1; /* first start state */
+
+        if ( ! yyin )
+            yyin = stdin;
+
+
+        if ( ! YY_CURRENT_BUFFER ) {
+            yyensure_buffer_stack (yyscanner);
+            YY_CURRENT_BUFFER_LVALUE =
+                yy_create_buffer(yyin,YY_BUF_SIZE ,yyscanner);
+        }
+
+        yy_load_buffer_state(yyscanner );
+        }
+
+    while ( 1 )     /* loops until end-of-file is reached */
+        {
+        yy_cp = yyg->yy_c_buf_p;
+
+        /* Support of yytext. */
+        *yy_cp = yyg->yy_hold_char;
+
+        /* yy_bp points to the position in yy_ch_buf of the start of
+         * the current run.
+         */
+        yy_bp = yy_cp;
+
+        yy_current_state = yyg->yy_start;
+yy_match:
+        while ( (yy_current_state = yy_nxt[yy_current_state][ YY_SC_TO_UI(*yy_cp) ]) > 0 )
+            {
+            if ( yy_accept[yy_current_state] )
+                {
+                yyg->yy_last_accepting_state = yy_current_state;
+                yyg->yy_last_accepting_cpos = yy_cp;
+                }
+
+            ++yy_cp;
+            }
+
+        yy_current_state = -yy_current_state;
+
+yy_find_action:
+        yy_act = yy_accept[yy_current_state];
+
+        YY_DO_BEFORE_ACTION;
+
+do_action:  /* This label is used only to access EOF actions. */
+
+        switch ( yy_act )
+    { /* beginning of action switch */
+            case 0: /* must back up */
+            /* undo the effects of YY_DO_BEFORE_ACTION */
+            *yy_cp = yyg->yy_hold_char;
+            yy_cp = yyg->yy_last_accepting_cpos + 1;
+            yy_current_state = yyg->yy_last_accepting_state;
+            goto yy_find_action;
+
+case 1:
+YY_RULE_SETUP
+#line 29 "lexer.l"
+{
+                          /* a comment, unless it is inside a word */
+                          if (yyextra->in_word) {
+                              yyless(1);
+                              lexer_word_part(yyextra, yytext, 1);
+                          }
+                      }
+    YY_BREAK
+case 2:
+YY_RULE_SETUP
+#line 36 "lexer.l"
+lexer_word_part(yyextra, yytext, yyleng);
+    YY_BREAK
+case 3:
+YY_RULE_SETUP
+#line 37 "lexer.l"
+lexer_glob_part(yyextra, yytext, yyleng);
+    YY_BREAK
+case 4:
+/* rule 4 can match eol */
+YY_RULE_SETUP
+#line 38 "lexer.l"
+lexer_word_part(yyextra, yytext + 1, yyleng - 2);
+    YY_BREAK
+case 5:
+/* rule 5 can match eol */
+YY_RULE_SETUP
+#line 39 "lexer.l"
+lexer_literal_part(yyextra, yytext + 1, yyleng - 2);
+    YY_BREAK
+case 6:
+/* rule 6 can match eol */
+YY_RULE_SETUP
+#line 40 "lexer.l"
+lexer_unterminated(yyextra);
+    YY_BREAK
+case 7:
+YY_RULE_SETUP
+#line 41 "lexer.l"
+{
+                          lexer_word_part(yyextra, yytext + 1, 0);
+                          BEGIN(DQUOTE);
+                      }
+    YY_BREAK
+case 8:
+/* rule 8 can match eol */
+YY_RULE_SETUP
+#line 45 "lexer.l"
+/* a line continuation, the word goes on */
+    YY_BREAK
+case 9:
+YY_RULE_SETUP
+#line 46 "lexer.l"
+lexer_literal_part(yyextra, yytext + 1, 1);
+    YY_BREAK
+case 10:
+YY_RULE_SETUP
+#line 47 "lexer.l"
+lexer_word_part(yyextra, yytext + 1, 1);
+    YY_BREAK
+case 11:
+YY_RULE_SETUP
+#line 48 "lexer.l"
+lexer_expand(yyextra, yytext + 1, yyleng - 1, true);
+    YY_BREAK
+case 12:
+YY_RULE_SETUP
+#line 49 "lexer.l"
+lexer_expand(yyextra, yytext + 2, yyleng - 3, true);
+    YY_BREAK
+case 13:
+YY_RULE_SETUP
+#line 50 "lexer.l"
+lexer_expand(yyextra, yytext + 1, 1, true);
+    YY_BREAK
+case 14:
+YY_RULE_SETUP
+#line 51 "lexer.l"
+lexer_word_part(yyextra, yytext, 1);
+    YY_BREAK
+case 15:
+/* rule 15 can match eol */
+YY_RULE_SETUP
+#line 52 "lexer.l"
+lexer_word_part(yyextra, yytext, yyleng);
+    YY_BREAK
+case 16:
+YY_RULE_SETUP
+#line 53 "lexer.l"
+lexer_literal_part(yyextra, yytext, yyleng);
+    YY_BREAK
+case 17:
+YY_RULE_SETUP
+#line 54 "lexer.l"
+lexer_word_part(yyextra, yytext + 1, 1);
+    YY_BREAK
+case 18:
+/* rule 18 can match eol */
+YY_RULE_SETUP
+#line 55 "lexer.l"
+/* a line continuation inside quotes */
+    YY_BREAK
+case 19:
+YY_RULE_SETUP
+#line 56 "lexer.l"
+lexer_word_part(yyextra, yytext, 1);
+    YY_BREAK
+case 20:
+YY_RULE_SETUP
+#line 57 "lexer.l"
+lexer_expand(yyextra, yytext + 1, yyleng - 1, false);
+    YY_BREAK
+case 21:
+YY_RULE_SETUP
+#line 58 "lexer.l"
+lexer_expand(yyextra, yytext + 2, yyleng - 3, false);
+    YY_BREAK
+case 22:
+YY_RULE_SETUP
+#line 59 "lexer.l"
+lexer_expand(yyextra, yytext + 1, 1, false);
+    YY_BREAK
+case 23:
+YY_RULE_SETUP
+#line 60 "lexer.l"
+lexer_word_part(yyextra, yytext, 1);
+    YY_BREAK
+case 24:
+YY_RULE_SETUP
+#line 61 "lexer.l"
+BEGIN(INITIAL);
+    YY_BREAK
+case 25:
+YY_RULE_SETUP
+#line 62 "lexer.l"
+{
+                          lexer_word_end(yyextra);
+                          lexer_push_token(yyextra, "|", 1, TOK_PIPE);
+                          yyextra->num_commands += 1;
+                      }
+    YY_BREAK
+case 26:
+YY_RULE_SETUP
+#line 67 "lexer.l"
+{
+                          lexer_word_end(yyextra);
+                          lexer_push_token(yyextra, "<<<", 3, TOK_HERE_STR);
+                      }
+    YY_BREAK
+case 27:
+YY_RULE_SETUP
+#line 71 "lexer.l"
+{
+                          lexer_word_end(yyextra);
+                          lexer_push_token(yyextra, "<<", 2, TOK_HEREDOC);
+                      }
+    YY_BREAK
+case 28:
+YY_RULE_SETUP
+#line 75 "lexer.l"
+lexer_push_op(yyextra, yytext, yyleng, TOK_REDIR);
+    YY_BREAK
+case 29:
+YY_RULE_SETUP
+#line 76 "lexer.l"
+lexer_push_op(yyextra, yytext, yyleng, TOK_REDIR_DUP);
+    YY_BREAK
+case 30:
+YY_RULE_SETUP
+#line 77 "lexer.l"
+lexer_push_control(yyextra, "&", 1, TOK_BKG);
+    YY_BREAK
+case 31:
+YY_RULE_SETUP
+#line 78 "lexer.l"
+lexer_push_control(yyextra, ";", 1, TOK_SEMI);
+    YY_BREAK
+case 32:
+YY_RULE_SETUP
+#line 79 "lexer.l"
+lexer_push_control(yyextra, "&&", 2, TOK_AND);
+    YY_BREAK
+case 33:
+YY_RULE_SETUP
+#line 80 "lexer.l"
+lexer_push_control(yyextra, "||", 2, TOK_OR);
+    YY_BREAK
+case 34:
+YY_RULE_SETUP
+#line 81 "lexer.l"
+lexer_push_control(yyextra, "()", 2, TOK_PARENS);
+    YY_BREAK
+case 35:
+YY_RULE_SETUP
+#line 82 "lexer.l"
+lexer_word_end(yyextra);
+    YY_BREAK
+case 36:
+/* rule 36 can match eol */
+YY_RULE_SETUP
+#line 83 "lexer.l"
+{
+                          lexer_word_end(yyextra);
+                          return 1; /* end of a command line */
+                      }
+    YY_BREAK
+case 37:
+YY_RULE_SETUP
+#line 87 "lexer.l"
+ECHO;
+    YY_BREAK
+#line 810 "lex.yy.c"
+case YY_STATE_EOF(INITIAL):
+case YY_STATE_EOF(DQUOTE):
+    yyterminate();
+
+    case YY_END_OF_BUFFER:
+        {
+        /* Amount of text matched not including the EOB char. */
+        int yy_amount_of_matched_text = (int) (yy_cp - yyg->yytext_ptr) - 1;
+
+        /* Undo the effects of YY_DO_BEFORE_ACTION. */
+        *yy_cp = yyg->yy_hold_char;
+        YY_RESTORE_YY_MORE_OFFSET
+
+        if ( YY_CURRENT_BUFFER_LVALUE->yy_buffer_status == YY_BUFFER_NEW )
+            {
+            /* We're scanning a new file or input source.  It's
+             * possible that this happened because the user
+             * just pointed yyin at a new source and called
+             * yylex().  If so, then we have to assure
+             * consistency between YY_CURRENT_BUFFER and our
+             * globals.  Here is the right place to do so, because
+             * this is the first action (other than possibly a
+             * back-up) that will match for the new input source.
+             */
+            yyg->yy_n_chars = YY_CURRENT_BUFFER_LVALUE->yy_n_chars;
+            YY_CURRENT_BUFFER_LVALUE->yy_input_file = yyin;
+            YY_CURRENT_BUFFER_LVALUE->yy_buffer_status = YY_BUFFER_NORMAL;
+            }
+
+        /* Note that here we test for yy_c_buf_p "<=" to the position
+         * of the first EOB in the buffer, since yy_c_buf_p will
+         * already have been incremented past the NUL character
+         * (since all states make transitions on EOB to the
+         * end-of-buffer state).  Contrast this with the test
+         * in input().
+         */
+        if ( yyg->yy_c_buf_p <= &YY_CURRENT_BUFFER_LVALUE->yy_ch_buf[yyg->yy_n_chars] )
+            { /* This was really a NUL. */
+            yy_state_type yy_next_state;
+
+            yyg->yy_c_buf_p = yyg->yytext_ptr + yy_amount_of_matched_text;
+
+            yy_current_state = yy_get_previous_state( yyscanner );
+
+            /* Okay, we're now positioned to make the NUL
+             * transition.  We couldn't have
+             * yy_get_previous_state() go ahead and do it
+             * for us because it doesn't know how to deal
+             * with the possibility of jamming (and we don't
+             * want to build jamming into it because then it
+             * will run more slowly).
+             */
+
+            yy_next_state = yy_try_NUL_trans( yy_current_state ,yyscanner);
+
+            yy_bp = yyg->yytext_ptr + YY_MORE_ADJ;
+
+            if ( yy_next_state )
+                {
+                /* Consume the NUL. */
+                yy_cp = ++yyg->yy_c_buf_p;
+                yy_current_state = yy_next_state;
+                goto yy_match;
+                }
+
+            else
+                {
+                yy_cp = yyg->yy_c_buf_p;
+                goto yy_find_action;
+                }
+            }
+
+        else switch ( yy_get_next_buffer( yyscanner ) )
+            {
+            case EOB_ACT_END_OF_FILE:
+                {
+                yyg->yy_did_buffer_switch_on_eof = 0;
+
+                if ( yywrap(yyscanner ) )
+                    {
+                    /* Note: because we've taken care in
+                     * yy_get_next_buffer() to have set up
+                     * yytext, we can now set up
+                     * yy_c_buf_p so that if some total
+                     * hoser (like flex itself) wants to
+                     * call the scanner after we return the
+                     * YY_NULL, it'll still work - another
+                     * YY_NULL will get returned.
+                     */
+                    yyg->yy_c_buf_p = yyg->yytext_ptr + YY_MORE_ADJ;
+
+                    yy_act = YY_STATE_EOF(YY_START);
+                    goto do_action;
+                    }
+
+                else
+                    {
+                    if ( ! yyg->yy_did_buffer_switch_on_eof )
+                        YY_NEW_FILE;
+                    }
+                break;
+                }
+
+            case EOB_ACT_CONTINUE_SCAN:
+                yyg->yy_c_buf_p =
+                    yyg->yytext_ptr + yy_amount_of_matched_text;
+
+                yy_current_state = yy_get_previous_state( yyscanner );
+
+                yy_cp = yyg->yy_c_buf_p;
+                yy_bp = yyg->yytext_ptr + YY_MORE_ADJ;
+                goto yy_match;
+
+            case EOB_ACT_LAST_MATCH:
+                yyg->yy_c_buf_p =
+                &YY_CURRENT_BUFFER_LVALUE->yy_ch_buf[yyg->yy_n_chars];
+
+                yy_current_state = yy_get_previous_state( yyscanner );
+
+                yy_cp = yyg->yy_c_buf_p;
+                yy_bp = yyg->yytext_ptr + YY_MORE_ADJ;
+                goto yy_find_action;
+            }
+        break;
+        }
+
+    default:
+        YY_FATAL_ERROR(
+            "fatal flex scanner internal error--no action found" );
+    } /* end of action switch */
+        } /* end of scanning one token */
+} /* end of yylex */
+
+/* yy_get_next_buffer - try to read in a new buffer
+ *
+ * Returns a code representing an action:
+ *  EOB_ACT_LAST_MATCH -
+ *  EOB_ACT_CONTINUE_SCAN - continue scanning from current position
+ *  EOB_ACT_END_OF_FILE - end of file
+ */
+static int yy_get_next_buffer (yyscan_t yyscanner)
+{
+    struct yyguts_t * yyg = (struct yyguts_t*)yyscanner;
+        register char *dest = YY_CURRENT_BUFFER_LVALUE->yy_ch_buf;
+    register char *source = yyg->yytext_ptr;
+    register int number_to_move, i;
+    int ret_val;
+
+    if ( yyg->yy_c_buf_p > &YY_CURRENT_BUFFER_LVALUE->yy_ch_buf[yyg->yy_n_chars + 1] )
+        YY_FATAL_ERROR(
+        "fatal flex scanner internal error--end of buffer missed" );
+
+    if ( YY_CURRENT_BUFFER_LVALUE->yy_fill_buffer == 0 )
+        { /* Don't try to fill the buffer, so this is an EOF. */
+        if ( yyg->yy_c_buf_p - yyg->yytext_ptr - YY_MORE_ADJ == 1 )
+            {
+            /* We matched a single character, the EOB, so
+             * treat this as a final EOF.
+             */
+            return EOB_ACT_END_OF_FILE;
+            }
+
+        else
+            {
+            /* We matched some text prior to the EOB, first
+             * process it.
+             */
+            return EOB_ACT_LAST_MATCH;
+            }
+        }
+
+    /* Try to read more data. */
+
+    /* First move last chars to start of buffer. */
+    number_to_move = (int) (yyg->yy_c_buf_p - yyg->yytext_ptr) - 1;
+
+    for ( i = 0; i < number_to_move; ++i )
+        *(dest++) = *(source++);
+
+    if ( YY_CURRENT_BUFFER_LVALUE->yy_buffer_status == YY_BUFFER_EOF_PENDING )
+        /* don't do the read, it's not guaranteed to return an EOF,
+         * just force an EOF
+         */
+        YY_CURRENT_BUFFER_LVALUE->yy_n_chars = yyg->yy_n_chars = 0;
+
+    else
+        {
+            yy_size_t num_to_read =
+            YY_CURRENT_BUFFER_LVALUE->yy_buf_size - number_to_move - 1;
+
+        while ( num_to_read <= 0 )
+            { /* Not enough room in the buffer - grow it. */
+
+            /* just a shorter name for the current buffer */
+            YY_BUFFER_STATE b = YY_CURRENT_BUFFER;
+
+            int yy_c_buf_p_offset =
+                (int) (yyg->yy_c_buf_p - b->yy_ch_buf);
+
+            if ( b->yy_is_our_buffer )
+                {
+                yy_size_t new_size = b->yy_buf_size * 2;
+
+                if ( new_size <= 0 )
+                    b->yy_buf_size += b->yy_buf_size / 8;
+                else
+                    b->yy_buf_size *= 2;
+
+                b->yy_ch_buf = (char *)
+                    /* Include room in for 2 EOB chars. */
+                    yyrealloc((void *) b->yy_ch_buf,b->yy_buf_size + 2 ,yyscanner );
+                }
+            else
+                /* Can't grow it, we don't own it. */
+                b->yy_ch_buf = 0;
+
+            if ( ! b->yy_ch_buf )
+                YY_FATAL_ERROR(
+                "fatal error - scanner input buffer overflow" );
+
+            yyg->yy_c_buf_p = &b->yy_ch_buf[yy_c_buf_p_offset];
+
+            num_to_read = YY_CURRENT_BUFFER_LVALUE->yy_buf_size -
+                        number_to_move - 1;
+
+            }
+
+        if ( num_to_read > YY_READ_BUF_SIZE )
+            num_to_read = YY_READ_BUF_SIZE;
+
+        /* Read in more data. */
+        YY_INPUT( (&YY_CURRENT_BUFFER_LVALUE->yy_ch_buf[number_to_move]),
+            yyg->yy_n_chars, num_to_read );
+
+        YY_CURRENT_BUFFER_LVALUE->yy_n_chars = yyg->yy_n_chars;
+        }
+
+    if ( yyg->yy_n_chars == 0 )
+        {
+        if ( number_to_move == YY_MORE_ADJ )
+            {
+            ret_val = EOB_ACT_END_OF_FILE;
+            yyrestart(yyin ,yyscanner);
+            }
+
+        else
+            {
+            ret_val = EOB_ACT_LAST_MATCH;
+            YY_CURRENT_BUFFER_LVALUE->yy_buffer_status =
+                YY_BUFFER_EOF_PENDING;
+            }
+        }
+
+    else
+        ret_val = EOB_ACT_CONTINUE_SCAN;
+
+    if ((yy_size_t) (yyg->yy_n_chars + number_to_move) > YY_CURRENT_BUFFER_LVALUE->yy_buf_size) {
+        /* Extend the array by 50%, plus the number we really need. */
+        yy_size_t new_size = yyg->yy_n_chars + number_to_move + (yyg->yy_n_chars >> 1);
+        YY_CURRENT_BUFFER_LVALUE->yy_ch_buf = (char *) yyrealloc((void *) YY_CURRENT_BUFFER_LVALUE->yy_ch_buf,new_size ,yyscanner );
+        if ( ! YY_CURRENT_BUFFER_LVALUE->yy_ch_buf )
+            YY_FATAL_ERROR( "out of dynamic memory in yy_get_next_buffer()" );
+    }
+
+    yyg->yy_n_chars += number_to_move;
+    YY_CURRENT_BUFFER_LVALUE->yy_ch_buf[yyg->yy_n_chars] = YY_END_OF_BUFFER_CHAR;
+    YY_CURRENT_BUFFER_LVALUE->yy_ch_buf[yyg->yy_n_chars + 1] = YY_END_OF_BUFFER_CHAR;
+
+    yyg->yytext_ptr = &YY_CURRENT_BUFFER_LVALUE->yy_ch_buf[0];
+
+    return ret_val;
+}
+
+/* yy_get_previous_state - get the state just before the EOB char was reached */
+
+    static yy_state_type yy_get_previous_state (yyscan_t yyscanner)
+{
+    struct yyguts_t * yyg = (struct yyguts_t*)yyscanner;
+    register yy_state_type yy_current_state;
+    register char *yy_cp;
+    
+    yy_current_state = yyg->yy_start;
+
+    for ( yy_cp = yyg->yytext_ptr + YY_MORE_ADJ; yy_cp < yyg->yy_c_buf_p; ++yy_cp )
+        {
+        if ( *yy_cp )
+            {
+            yy_current_state = yy_nxt[yy_current_state][YY_SC_TO_UI(*yy_cp)];
+            }
+        else
+            yy_current_state = yy_NUL_trans[yy_current_state];
+        if ( yy_accept[yy_current_state] )
+            {
+            yyg->yy_last_accepting_state = yy_current_state;
+            yyg->yy_last_accepting_cpos = yy_cp;
+            }
+        }
+
+    return yy_current_state;
+}
+
+/* yy_try_NUL_trans - try to make a transition on the NUL character
+ *
+ * synopsis
+ *  next_state = yy_try_NUL_trans( current_state );
+ */
+    static yy_state_type yy_try_NUL_trans  (yy_state_type yy_current_state , yyscan_t yyscanner)
+{
+    struct yyguts_t * yyg = (struct yyguts_t*)yyscanner;
+    register int yy_is_jam;
+        register char *yy_cp = yyg->yy_c_buf_p;
+
+    yy_current_state = yy_NUL_trans[yy_current_state];
+    yy_is_jam = (yy_current_state == 73);
+
+    if ( ! yy_is_jam )
+        {
+        if ( yy_accept[yy_current_state] )
+            {
+            yyg->yy_last_accepting_state = yy_current_state;
+            yyg->yy_last_accepting_cpos = yy_cp;
+            }
+        }
+
+    return yy_is_jam ? 0 : yy_current_state;
+}
+
+#ifndef YY_NO_INPUT
+#ifdef __cplusplus
+    static int yyinput (yyscan_t yyscanner)
+#else
+    static int input  (yyscan_t yyscanner)
+#endif
+
+{
+    int c;
+    struct yyguts_t * yyg = (struct yyguts_t*)yyscanner;
+    
+    *yyg->yy_c_buf_p = yyg->yy_hold_char;
+
+    if ( *yyg->yy_c_buf_p == YY_END_OF_BUFFER_CHAR )
+        {
+        /* yy_c_buf_p now points to the character we want to return.
+         * If this occurs *before* the EOB characters, then it's a
+         * valid NUL; if not, then we've hit the end of the buffer.
+         */
+        if ( yyg->yy_c_buf_p < &YY_CURRENT_BUFFER_LVALUE->yy_ch_buf[yyg->yy_n_chars] )
+            /* This was really a NUL. */
+            *yyg->yy_c_buf_p = '\0';
+
+        else
+            { /* need more input */
+            yy_size_t offset = yyg->yy_c_buf_p - yyg->yytext_ptr;
+            ++yyg->yy_c_buf_p;
+
+            switch ( yy_get_next_buffer( yyscanner ) )
+                {
+                case EOB_ACT_LAST_MATCH:
+                    /* This happens because yy_g_n_b()
+                     * sees that we've accumulated a
+                     * token and flags that we need to
+                     * try matching the token before
+                     * proceeding.  But for input(),
+                     * there's no matching to consider.
+                     * So convert the EOB_ACT_LAST_MATCH
+                     * to EOB_ACT_END_OF_FILE.
+                     */
+
+                    /* Reset buffer status. */
+                    yyrestart(yyin ,yyscanner);
+
+                    /*FALLTHROUGH*/
+
+                case EOB_ACT_END_OF_FILE:
+                    {
+                    if ( yywrap(yyscanner ) )
+                        return 0;
+
+                    if ( ! yyg->yy_did_buffer_switch_on_eof )
+                        YY_NEW_FILE;
+#ifdef __cplusplus
+                    return yyinput(yyscanner);
+#else
+                    return input(yyscanner);
+#endif
+                    }
+
+                case EOB_ACT_CONTINUE_SCAN:
+                    yyg->yy_c_buf_p = yyg->yytext_ptr + offset;
+                    break;
+                }
+            }
+        }
+
+    c = *(unsigned char *) yyg->yy_c_buf_p;    /* cast for 8-bit char's */
+    *yyg->yy_c_buf_p = '\0';   /* preserve yytext */
+    yyg->yy_hold_char = *++yyg->yy_c_buf_p;
+
+    return c;
+}
+#endif  /* ifndef YY_NO_INPUT */
+
+/** Immediately switch to a different input stream.
+ * @param input_file A readable stream.
+ * @param yyscanner The scanner object.
+ * @note This function does not reset the start condition to @c INITIAL .
+ */
+    void yyrestart  (FILE * input_file , yyscan_t yyscanner)
+{
+    struct yyguts_t * yyg = (struct yyguts_t*)yyscanner;
+    
+    if ( ! YY_CURRENT_BUFFER ){
+        yyensure_buffer_stack (yyscanner);
+        YY_CURRENT_BUFFER_LVALUE =
+            yy_create_buffer(yyin,YY_BUF_SIZE ,yyscanner);
+    }
+
+    yy_init_buffer(YY_CURRENT_BUFFER,input_file ,yyscanner);
+    yy_load_buffer_state(yyscanner );
+}
+
+/** Switch to a different input buffer.
+ * @param new_buffer The new input buffer.
+ * @param yyscanner The scanner object.
+ */
+    void yy_switch_to_buffer  (YY_BUFFER_STATE  new_buffer , yyscan_t yyscanner)
+{
+    struct yyguts_t * yyg = (struct yyguts_t*)yyscanner;
+    
+    /* TODO. We should be able to replace this entire function body
+     * with
+     *      yypop_buffer_state(yyscanner);
+     *      yypush_buffer_state(new_buffer);
+     */
+    yyensure_buffer_stack (yyscanner);
+    if ( YY_CURRENT_BUFFER == new_buffer )
+        return;
+
+    if ( YY_CURRENT_BUFFER )
+        {
+        /* Flush out information for old buffer. */
+        *yyg->yy_c_buf_p = yyg->yy_hold_char;
+        YY_CURRENT_BUFFER_LVALUE->yy_buf_pos = yyg->yy_c_buf_p;
+        YY_CURRENT_BUFFER_LVALUE->yy_n_chars = yyg->yy_n_chars;
+        }
+
+    YY_CURRENT_BUFFER_LVALUE = new_buffer;
+    yy_load_buffer_state(yyscanner );
+
+    /* We don't actually know whether we did this switch during
+     * EOF (yywrap()) processing, but the only time this flag
+     * is looked at is after yywrap() is called, so it's safe
+     * to go ahead and always set it.
+     */
+    yyg->yy_did_buffer_switch_on_eof = 1;
+}
+
+static void yy_load_buffer_state  (yyscan_t yyscanner)
+{
+    struct yyguts_t * yyg = (struct yyguts_t*)yyscanner;
+        yyg->yy_n_chars = YY_CURRENT_BUFFER_LVALUE->yy_n_chars;
+    yyg->yytext_ptr = yyg->yy_c_buf_p = YY_CURRENT_BUFFER_LVALUE->yy_buf_pos;
+    yyin = YY_CURRENT_BUFFER_LVALUE->yy_input_file;
+    yyg->yy_hold_char = *yyg->yy_c_buf_p;
+}
+
+/** Allocate and initialize an input buffer state.
+ * @param file A readable stream.
+ * @param size The character buffer size in bytes. When in doubt, use @c YY_BUF_SIZE.
+ * @param yyscanner The scanner object.
+ * @return the allocated buffer state.
+ */
+    YY_BUFFER_STATE yy_create_buffer  (FILE * file, int  size , yyscan_t yyscanner)
+{
+    YY_BUFFER_STATE b;
+    
+    b = (YY_BUFFER_STATE) yyalloc(sizeof( struct yy_buffer_state ) ,yyscanner );
+    if ( ! b )
+        YY_FATAL_ERROR( "out of dynamic memory in yy_create_buffer()" );
+
+    b->yy_buf_size = size;
+
+    /* yy_ch_buf has to be 2 characters longer than the size given because
+     * we need to put in 2 end-of-buffer characters.
+     */
+    b->yy_ch_buf = (char *) yyalloc(b->yy_buf_size + 2 ,yyscanner );
+    if ( ! b->yy_ch_buf )
+        YY_FATAL_ERROR( "out of dynamic memory in yy_create_buffer()" );
+
+    b->yy_is_our_buffer = 1;
+
+    yy_init_buffer(b,file ,yyscanner);
+
+    return b;
+}
+
+/** Destroy the buffer.
+ * @param b a buffer created with yy_create_buffer()
+ * @param yyscanner The scanner object.
+ */
+    void yy_delete_buffer (YY_BUFFER_STATE  b , yyscan_t yyscanner)
+{
+    struct yyguts_t * yyg = (struct yyguts_t*)yyscanner;
+    
+    if ( ! b )
+        return;
+
+    if ( b == YY_CURRENT_BUFFER ) /* Not sure if we should pop here. */
+        YY_CURRENT_BUFFER_LVALUE = (YY_BUFFER_STATE) 0;
+
+    if ( b->yy_is_our_buffer )
+        yyfree((void *) b->yy_ch_buf ,yyscanner );
+
+    yyfree((void *) b ,yyscanner );
+}
+
+#ifndef __cplusplus
+extern int isatty (int );
+#endif /* __cplusplus */
+    
+/* Initializes or reinitializes a buffer.
+ * This function is sometimes called more than once on the same buffer,
+ * such as during a yyrestart() or at EOF.
+ */
+    static void yy_init_buffer  (YY_BUFFER_STATE  b, FILE * file , yyscan_t yyscanner)
+
+{
+    struct yyguts_t * yyg = (struct yyguts_t*)yyscanner;
+    int oerrno = errno;
+    
+    yy_flush_buffer(b ,yyscanner);
+
+    b->yy_input_file = file;
+    b->yy_fill_buffer = 1;
+
+    /* If b is the current buffer, then yy_init_buffer was _probably_
+     * called from yyrestart() or through yy_get_next_buffer.
+     * In that case, we don't want to reset the lineno or column.
+     */
+    if (b != YY_CURRENT_BUFFER){
+        b->yy_bs_lineno = 1;
+        b->yy_bs_column = 0;
+    }
+
+        b->yy_is_interactive = file ? (isatty( fileno(file) ) > 0) : 0;
+    
+    errno = oerrno;
+}
+
+/** Discard all buffered characters. On the next scan, YY_INPUT will be called.
+ * @param b the buffer state to be flushed, usually @c YY_CURRENT_BUFFER.
+ * @param yyscanner The scanner object.
+ */
+    void yy_flush_buffer (YY_BUFFER_STATE  b , yyscan_t yyscanner)
+{
+    struct yyguts_t * yyg = (struct yyguts_t*)yyscanner;
+        if ( ! b )
+        return;
+
+    b->yy_n_chars = 0;
+
+    /* We always need two end-of-buffer characters.  The first causes
+     * a transition to the end-of-buffer state.  The second causes
+     * a jam in that state.
+     */
+    b->yy_ch_buf[0] = YY_END_OF_BUFFER_CHAR;
+    b->yy_ch_buf[1] = YY_END_OF_BUFFER_CHAR;
+
+    b->yy_buf_pos = &b->yy_ch_buf[0];
+
+    b->yy_at_bol = 1;
+    b->yy_buffer_status = YY_BUFFER_NEW;
+
+    if ( b == YY_CURRENT_BUFFER )
+        yy_load_buffer_state(yyscanner );
+}
+
+/** Pushes the new state onto the stack. The new state becomes
+ *  the current state. This function will allocate the stack
+ *  if necessary.
+ *  @param new_buffer The new state.
+ * @param yyscanner The scanner object.
+ */
+void yypush_buffer_state (YY_BUFFER_STATE new_buffer , yyscan_t yyscanner)
+{
+    struct yyguts_t * yyg = (struct yyguts_t*)yyscanner;
+        if (new_buffer == NULL)
+        return;
+
+    yyensure_buffer_stack(yyscanner);
+
+    /* This block is copied from yy_switch_to_buffer. */
+    if ( YY_CURRENT_BUFFER )
+        {
+        /* Flush out information for old buffer. */
+        *yyg->yy_c_buf_p = yyg->yy_hold_char;
+        YY_CURRENT_BUFFER_LVALUE->yy_buf_pos = yyg->yy_c_buf_p;
+        YY_CURRENT_BUFFER_LVALUE->yy_n_chars = yyg->yy_n_chars;
+        }
+
+    /* Only push if top exists. Otherwise, replace top. */
+    if (YY_CURRENT_BUFFER)
+        yyg->yy_buffer_stack_top++;
+    YY_CURRENT_BUFFER_LVALUE = new_buffer;
+
+    /* copied from yy_switch_to_buffer. */
+    yy_load_buffer_state(yyscanner );
+    yyg->yy_did_buffer_switch_on_eof = 1;
+}
+
+/** Removes and deletes the top of the stack, if present.
+ *  The next element becomes the new top.
+ * @param yyscanner The scanner object.
+ */
+void yypop_buffer_state (yyscan_t yyscanner)
+{
+    struct yyguts_t * yyg = (struct yyguts_t*)yyscanner;
+        if (!YY_CURRENT_BUFFER)
+        return;
+
+    yy_delete_buffer(YY_CURRENT_BUFFER ,yyscanner);
+    YY_CURRENT_BUFFER_LVALUE = NULL;
+    if (yyg->yy_buffer_stack_top > 0)
+        --yyg->yy_buffer_stack_top;
+
+    if (YY_CURRENT_BUFFER) {
+        yy_load_buffer_state(yyscanner );
+        yyg->yy_did_buffer_switch_on_eof = 1;
+    }
+}
+
+/* Allocates the stack if it does not exist.
+ *  Guarantees space for at least one push.
+ */
+static void yyensure_buffer_stack (yyscan_t yyscanner)
+{
+    struct yyguts_t * yyg = (struct yyguts_t*)yyscanner;
+    yy_size_t num_to_alloc;
+    
+    if (!yyg->yy_buffer_stack) {
+
+        /* First allocation is just for 2 elements, since we don't know if this
+         * scanner will even need a stack. We use 2 instead of 1 to avoid an
+         * immediate realloc on the next call.
+         */
+        num_to_alloc = 1;
+        yyg->yy_buffer_stack = (struct yy_buffer_state**)yyalloc
+                                (num_to_alloc * sizeof(struct yy_buffer_state*)
+                                , yyscanner);
+        if ( ! yyg->yy_buffer_stack )
+            YY_FATAL_ERROR( "out of dynamic memory in yyensure_buffer_stack()" );
+                                  
+        memset(yyg->yy_buffer_stack, 0, num_to_alloc * sizeof(struct yy_buffer_state*));
+                
+        yyg->yy_buffer_stack_max = num_to_alloc;
+        yyg->yy_buffer_stack_top = 0;
+        return;
+    }
+
+    if (yyg->yy_buffer_stack_top >= (yyg->yy_buffer_stack_max) - 1){
+
+        /* Increase the buffer to prepare for a possible push. */
+        int grow_size = 8 /* arbitrary grow size */;
+
+        num_to_alloc = yyg->yy_buffer_stack_max + grow_size;
+        yyg->yy_buffer_stack = (struct yy_buffer_state**)yyrealloc
+                                (yyg->yy_buffer_stack,
+                                num_to_alloc * sizeof(struct yy_buffer_state*)
+                                , yyscanner);
+        if ( ! yyg->yy_buffer_stack )
+            YY_FATAL_ERROR( "out of dynamic memory in yyensure_buffer_stack()" );
+
+        /* zero only the new slots.*/
+        memset(yyg->yy_buffer_stack + yyg->yy_buffer_stack_max, 0, grow_size * sizeof(struct yy_buffer_state*));
+        yyg->yy_buffer_stack_max = num_to_alloc;
+    }
+}
+
+/** Setup the input buffer state to scan directly from a user-specified character buffer.
+ * @param base the character buffer
+ * @param size the size in bytes of the character buffer
+ * @param yyscanner The scanner object.
+ * @return the newly allocated buffer state object. 
+ */
+YY_BUFFER_STATE yy_scan_buffer  (char * base, yy_size_t  size , yyscan_t yyscanner)
+{
+    YY_BUFFER_STATE b;
+    
+    if ( size < 2 ||
+         base[size-2] != YY_END_OF_BUFFER_CHAR ||
+         base[size-1] != YY_END_OF_BUFFER_CHAR )
+        /* They forgot to leave room for the EOB's. */
+        return 0;
+
+    b = (YY_BUFFER_STATE) yyalloc(sizeof( struct yy_buffer_state ) ,yyscanner );
+    if ( ! b )
+        YY_FATAL_ERROR( "out of dynamic memory in yy_scan_buffer()" );
+
+    b->yy_buf_size = size - 2;  /* "- 2" to take care of EOB's */
+    b->yy_buf_pos = b->yy_ch_buf = base;
+    b->yy_is_our_buffer = 0;
+    b->yy_input_file = 0;
+    b->yy_n_chars = b->yy_buf_size;
+    b->yy_is_interactive = 0;
+    b->yy_at_bol = 1;
+    b->yy_fill_buffer = 0;
+    b->yy_buffer_status = YY_BUFFER_NEW;
+
+    yy_switch_to_buffer(b ,yyscanner );
+
+    return b;
+}
+
+/** Setup the input buffer state to scan a string. The next call to yylex() will
+ * scan from a @e copy of @a str.
+ * @param yystr a NUL-terminated string to scan
+ * @param yyscanner The scanner object.
+ * @return the newly allocated buffer state object.
+ * @note If you want to scan bytes that may contain NUL values, then use
+ *       yy_scan_bytes() instead.
+ */
+YY_BUFFER_STATE yy_scan_string (yyconst char * yystr , yyscan_t yyscanner)
+{
+    
+    return yy_scan_bytes(yystr,strlen(yystr) ,yyscanner);
+}
+
+/** Setup the input buffer state to scan the given bytes. The next call to yylex() will
+ * scan from a @e copy of @a bytes.
+ * @param bytes the byte buffer to scan
+ * @param len the number of bytes in the buffer pointed to by @a bytes.
+ * @param yyscanner The scanner object.
+ * @return the newly allocated buffer state object.
+ */
+YY_BUFFER_STATE yy_scan_bytes  (yyconst char * yybytes, yy_size_t  _yybytes_len , yyscan_t yyscanner)
+{
+    YY_BUFFER_STATE b;
+    char *buf;
+    yy_size_t n, i;
+    
+    /* Get memory for full buffer, including space for trailing EOB's. */
+    n = _yybytes_len + 2;
+    buf = (char *) yyalloc(n ,yyscanner );
+    if ( ! buf )
+        YY_FATAL_ERROR( "out of dynamic memory in yy_scan_bytes()" );
+
+    for ( i = 0; i < _yybytes_len; ++i )
+        buf[i] = yybytes[i];
+
+    buf[_yybytes_len] = buf[_yybytes_len+1] = YY_END_OF_BUFFER_CHAR;
+
+    b = yy_scan_buffer(buf,n ,yyscanner);
+    if ( ! b )
+        YY_FATAL_ERROR( "bad buffer in yy_scan_bytes()" );
+
+    /* It's okay to grow etc. this buffer, and we should throw it
+     * away when we're done.
+     */
+    b->yy_is_our_buffer = 1;
+
+    return b;
+}
+
+#ifndef YY_EXIT_FAILURE
+#define YY_EXIT_FAILURE 2
+#endif
+
+static void yy_fatal_error (yyconst char* msg , yyscan_t yyscanner)
+{
+        (void) fprintf( stderr, "%s\n", msg );
+    exit( YY_EXIT_FAILURE );
+}
+
+/* Redefine yyless() so it works in section 3 code. */
+
+#undef yyless
+#define yyless(n) \
+    do \
+        { \
+        /* Undo effects of setting up yytext. */ \
+        int yyless_macro_arg = (n); \
+        YY_LESS_LINENO(yyless_macro_arg);\
+        yytext[yyleng] = yyg->yy_hold_char; \
+        yyg->yy_c_buf_p = yytext + yyless_macro_arg; \
+        yyg->yy_hold_char = *yyg->yy_c_buf_p; \
+        *yyg->yy_c_buf_p = '\0'; \
+        yyleng = yyless_macro_arg; \
+        } \
+    while ( 0 )
+
+/* Accessor  methods (get/set functions) to struct members. */
+
+/** Get the user-defined data for this scanner.
+ * @param yyscanner The scanner object.
+ */
+YY_EXTRA_TYPE yyget_extra  (yyscan_t yyscanner)
+{
+    struct yyguts_t * yyg = (struct yyguts_t*)yyscanner;
+    return yyextra;
+}
+
+/** Get the current line number.
+ * @param yyscanner The scanner object.
+ */
+int yyget_lineno  (yyscan_t yyscanner)
+{
+    struct yyguts_t * yyg = (struct yyguts_t*)yyscanner;
+    
+        if (! YY_CURRENT_BUFFER)
+            return 0;
+    
+    return yylineno;
+}
+
+/** Get the current column number.
+ * @param yyscanner The scanner object.
+ */
+int yyget_column  (yyscan_t yyscanner)
+{
+    struct yyguts_t * yyg = (struct yyguts_t*)yyscanner;
+    
+        if (! YY_CURRENT_BUFFER)
+            return 0;
+    
+    return yycolumn;
+}
+
+/** Get the input stream.
+ * @param yyscanner The scanner object.
+ */
+FILE *yyget_in  (yyscan_t yyscanner)
+{
+    struct yyguts_t * yyg = (struct yyguts_t*)yyscanner;
+        return yyin;
+}
+
+/** Get the output stream.
+ * @param yyscanner The scanner object.
+ */
+FILE *yyget_out  (yyscan_t yyscanner)
+{
+    struct yyguts_t * yyg = (struct yyguts_t*)yyscanner;
+        return yyout;
+}
+
+/** Get the length of the current token.
+ * @param yyscanner The scanner object.
+ */
+yy_size_t yyget_leng  (yyscan_t yyscanner)
+{
+    struct yyguts_t * yyg = (struct yyguts_t*)yyscanner;
+        return yyleng;
+}
+
+/** Get the current token.
+ * @param yyscanner The scanner object.
+ */
+
+char *yyget_text  (yyscan_t yyscanner)
+{
+    struct yyguts_t * yyg = (struct yyguts_t*)yyscanner;
+        return yytext;
+}
+
+/** Set the user-defined data. This data is never touched by the scanner.
+ * @param user_defined The data to be associated with this scanner.
+ * @param yyscanner The scanner object.
+ */
+void yyset_extra (YY_EXTRA_TYPE  user_defined , yyscan_t yyscanner)
+{
+    struct yyguts_t * yyg = (struct yyguts_t*)yyscanner;
+    yyextra = user_defined ;
+}
+
+/** Set the current line number.
+ * @param line_number
+ * @param yyscanner The scanner object.
+ */
+void yyset_lineno (int  line_number , yyscan_t yyscanner)
+{
+    struct yyguts_t * yyg = (struct yyguts_t*)yyscanner;
+
+        /* lineno is only valid if an input buffer exists. */
+        if (! YY_CURRENT_BUFFER )
+           yy_fatal_error( "yyset_lineno called with no buffer" , yyscanner); 
+    
+    yylineno = line_number;
+}
+
+/** Set the current column.
+ * @param line_number
+ * @param yyscanner The scanner object.
+ */
+void yyset_column (int  column_no , yyscan_t yyscanner)
+{
+    struct yyguts_t * yyg = (struct yyguts_t*)yyscanner;
+
+        /* column is only valid if an input buffer exists. */
+        if (! YY_CURRENT_BUFFER )
+           yy_fatal_error( "yyset_column called with no buffer" , yyscanner); 
+    
+    yycolumn = column_no;
+}
+
+/** Set the input stream. This does not discard the current
+ * input buffer.
+ * @param in_str A readable stream.
+ * 
+ * @see yy_switch_to_buffer
+ */
+void yyset_in (FILE *  in_str , yyscan_t yyscanner)
+{
+    struct yyguts_t * yyg = (struct yyguts_t*)yyscanner;
+        yyin = in_str ;
+}
+
+void yyset_out (FILE *  out_str , yyscan_t yyscanner)
+{
+    struct yyguts_t * yyg = (struct yyguts_t*)yyscanner;
+        yyout = out_str ;
+}
+
+int yyget_debug  (yyscan_t yyscanner)
+{
+    struct yyguts_t * yyg = (struct yyguts_t*)yyscanner;
+        return yy_flex_debug;
+}
+
+void yyset_debug (int  bdebug , yyscan_t yyscanner)
+{
+    struct yyguts_t * yyg = (struct yyguts_t*)yyscanner;
+        yy_flex_debug = bdebug ;
+}
+
+/* Accessor methods for yylval and yylloc */
+
+/* User-visible API */
+
+/* yylex_init is special because it creates the scanner itself, so it is
+ * the ONLY reentrant function that doesn't take the scanner as the last argument.
+ * That's why we explicitly handle the declaration, instead of using our macros.
+ */
+
+int yylex_init(yyscan_t* ptr_yy_globals)
+
+{
+    if (ptr_yy_globals == NULL){
+        errno = EINVAL;
+        return 1;
+    }
+
+    *ptr_yy_globals = (yyscan_t) yyalloc ( sizeof( struct yyguts_t ), NULL );
+
+    if (*ptr_yy_globals == NULL){
+        errno = ENOMEM;
+        return 1;
+    }
+
+    /* By setting to 0xAA, we expose bugs in yy_init_globals. Leave at 0x00 for releases. */
+    memset(*ptr_yy_globals,0x00,sizeof(struct yyguts_t));
+
+    return yy_init_globals ( *ptr_yy_globals );
+}
+
+/* yylex_init_extra has the same functionality as yylex_init, but follows the
+ * convention of taking the scanner as the last argument. Note however, that
+ * this is a *pointer* to a scanner, as it will be allocated by this call (and
+ * is the reason, too, why this function also must handle its own declaration).
+ * The user defined value in the first argument will be available to yyalloc in
+ * the yyextra field.
+ */
+
+int yylex_init_extra(YY_EXTRA_TYPE yy_user_defined,yyscan_t* ptr_yy_globals )
+
+{
+    struct yyguts_t dummy_yyguts;
+
+    yyset_extra (yy_user_defined, &dummy_yyguts);
+
+    if (ptr_yy_globals == NULL){
+        errno = EINVAL;
+        return 1;
+    }
+	
+    *ptr_yy_globals = (yyscan_t) yyalloc ( sizeof( struct yyguts_t ), &dummy_yyguts );
+	
+    if (*ptr_yy_globals == NULL){
+        errno = ENOMEM;
+        return 1;
+    }
+    
+    /* By setting to 0xAA, we expose bugs in
+    yy_init_globals. Leave at 0x00 for releases. */
+    memset(*ptr_yy_globals,0x00,sizeof(struct yyguts_t));
+    
+    yyset_extra (yy_user_defined, *ptr_yy_globals);
+    
+    return yy_init_globals ( *ptr_yy_globals );
+}
+
+static int yy_init_globals (yyscan_t yyscanner)
+{
+    struct yyguts_t * yyg = (struct yyguts_t*)yyscanner;
+        /* Initialization is the same as for the non-reentrant scanner.
+     * This function is called from yylex_destroy(), so don't allocate here.
+     */
+
+    yyg->yy_buffer_stack = 0;
+    yyg->yy_buffer_stack_top = 0;
+    yyg->yy_buffer_stack_max = 0;
+    yyg->yy_c_buf_p = (char *) 0;
+    yyg->yy_init = 0;
+    yyg->yy_start = 0;
+
+    yyg->yy_start_stack_ptr = 0;
+    yyg->yy_start_stack_depth = 0;
+    yyg->yy_start_stack =  NULL;
+
+/* Defined in main.c */
+#ifdef YY_STDINIT
+    yyin = stdin;
+    yyout = fopen(".flex_errors", "w");
+#else
+    yyin = (FILE *) 0;
+    yyout = (FILE *) 0;
+#endif
+
+    /* For future reference: Set errno on error, since we are called by
+     * yylex_init()
+     */
+    return 0;
+}
+
+/* yylex_destroy is for both reentrant and non-reentrant scanners. */
+int yylex_destroy  (yyscan_t yyscanner)
+{
+    struct yyguts_t * yyg = (struct yyguts_t*)yyscanner;
+    
+    /* Pop the buffer stack, destroying each element. */
+    while(YY_CURRENT_BUFFER){
+        yy_delete_buffer(YY_CURRENT_BUFFER ,yyscanner );
+        YY_CURRENT_BUFFER_LVALUE = NULL;
+        yypop_buffer_state(yyscanner);
+    }
+
+    /* Destroy the stack itself. */
+    yyfree(yyg->yy_buffer_stack ,yyscanner);
+    yyg->yy_buffer_stack = NULL;
+
+    /* Destroy the start condition stack. */
+        yyfree(yyg->yy_start_stack ,yyscanner );
+        yyg->yy_start_stack = NULL;
+
+    /* Reset the globals. This is important in a non-reentrant scanner so the next time
+     * yylex() is called, initialization will occur. */
+    yy_init_globals( yyscanner);
+
+    /* Destroy the main struct (reentrant only). */
+    yyfree ( yyscanner , yyscanner );
+    yyscanner = NULL;
+    return 0;
+}
+
+/*
+ * Internal utility routines.
+ */
+
+#ifndef yytext_ptr
+static void yy_flex_strncpy (char* s1, yyconst char * s2, int n , yyscan_t yyscanner)
+{
+    register int i;
+    for ( i = 0; i < n; ++i )
+        s1[i] = s2[i];
+}
+#endif
+
+#ifdef YY_NEED_STRLEN
+static int yy_flex_strlen (yyconst char * s , yyscan_t yyscanner)
+{
+    register int n;
+    for ( n = 0; s[n]; ++n )
+        ;
+
+    return n;
+}
+#endif
+
+void *yyalloc (yy_size_t  size , yyscan_t yyscanner)
+{
+    return (void *) malloc( size );
+}
+
+void *yyrealloc  (void * ptr, yy_size_t  size , yyscan_t yyscanner)
+{
+    /* The cast to (char *) in the following accommodates both
+     * implementations that use char* generic pointers, and those
+     * that use void* generic pointers.  It works with the latter
+     * because both ANSI C and C++ allow castless assignment from
+     * any pointer type to void*, and deal with argument conversions
+     * as though doing an assignment.
+     */
+    return (void *) realloc( (char *) ptr, size );
+}
+
+void yyfree (void * ptr , yyscan_t yyscanner)
+{
+    free( (char *) ptr );   /* see yyrealloc() for (char *) cast */
+}
+
+#define YYTABLES_NAME "yytables"
+
+#line 87 "lexer.l"
+
+bool lexer_init(shell_ctx_t * p_ctx) {
+    p_ctx->p_buffer_state = NULL;
+    return yylex_init_extra(p_ctx, &p_ctx->scanner) == 0;
+}
+
+void lexer_destroy(shell_ctx_t * p_ctx) {
+    FILE * p_errors = yyget_out(p_ctx->scanner);
+    if (p_errors) fclose(p_errors);
+    /* also deletes the buffer state, which never owned its characters */
+    yylex_destroy(p_ctx->scanner);
+    p_ctx->scanner = NULL;
+    p_ctx->p_buffer_state = NULL;
+}
+
+void lexer_push_token(shell_ctx_t * p_ctx, char * text, const size_t len, const int tag) {
+    const token_t tok = { text, len, tag };
+    if (!vec_push(&p_ctx->tokens, &tok)) {
+        puts(VEC_PUSH_ERROR_MSG);
+        exit(EXIT_FAILURE);
+    }
+}
+
+void lexer_push_op(shell_ctx_t * p_ctx, char * text, const size_t len, const int tag) {
+    /* a copy, the operator may start right where the word before it ends,
+       and lexer_next_line terminates words in place */
+    lexer_word_end(p_ctx);
+    char * copy = arena_strndup(&p_ctx->arena, text, len);
+    if (!copy) {
+        puts(VEC_PUSH_ERROR_MSG);
+        exit(EXIT_FAILURE);
+    }
+    lexer_push_token(p_ctx, copy, len, tag);
+}
+
+void lexer_push_control(shell_ctx_t * p_ctx, char * text, const size_t len, const int tag) {
+    /* anything of these but a trailing & makes the line a script */
+    lexer_word_end(p_ctx);
+    lexer_push_token(p_ctx, text, len, tag);
+    p_ctx->num_controls += 1;
+}
+
+void lexer_word_part(shell_ctx_t * p_ctx, char * text, const size_t len) {
+    /* text lies in the line, after everything the word holds so far, so
+       unless an expansion moved the word out of the line the piece can be
+       slid back against it: quotes and backslashes are simply squeezed out */
+    if (!p_ctx->in_word) {
+        p_ctx->word = text;
+        p_ctx->word_len = len;
+        p_ctx->word_capacity = 0;
+        p_ctx->in_word = true;
+    } else if (p_ctx->word_capacity == 0) {
+        memmove(p_ctx->word + p_ctx->word_len, text, len);
+        p_ctx->word_len += len;
+    } else {
+        lexer_word_append(p_ctx, text, len);
+    }
+}
+
+void lexer_glob_part(shell_ctx_t * p_ctx, char * text, const size_t len) {
+    /* unquoted *, ? or [, the word is a pattern for glob_expand */
+    lexer_word_part(p_ctx, text, len);
+    p_ctx->word_glob = true;
+}
+
+void lexer_literal_part(shell_ctx_t * p_ctx, char * text, const size_t len) {
+    /* a quoted or escaped one, which keeps the whole word from being
+       expanded (sh would only treat this part literally) */
+    lexer_word_part(p_ctx, text, len);
+    p_ctx->word_literal = true;
+}
+
+void lexer_word_append(shell_ctx_t * p_ctx, const char * text, const size_t len) {
+    /* text from outside the line, the word moves to the arena for good */
+    if (!p_ctx->in_word) {
+        p_ctx->word_len = 0;
+        p_ctx->word_capacity = 0;
+        p_ctx->in_word = true;
+    }
+    const size_t size = p_ctx->word_len + len + 1;
+    if (p_ctx->word_capacity < size) {
+        const size_t capacity = size < 64 ? 64 : size * 2;
+        char * word = arena_alloc(&p_ctx->arena, capacity);
+        if (!word) {
+            puts(VEC_PUSH_ERROR_MSG);
+            exit(EXIT_FAILURE);
+        }
+        if (p_ctx->word_len) memcpy(word, p_ctx->word, p_ctx->word_len);
+        p_ctx->word = word;
+        p_ctx->word_capacity = capacity;
+    }
+    memcpy(p_ctx->word + p_ctx->word_len, text, len);
+    p_ctx->word_len += len;
+    p_ctx->word[p_ctx->word_len] = '\0';
+}
+
+void lexer_word_end(shell_ctx_t * p_ctx) {
+    if (!p_ctx->in_word) return;
+    const bool glob = p_ctx->word_glob && !p_ctx->word_literal;
+    int tag = glob ? TOK_GLOB : TOK_WORD;
+    if (p_ctx->word_expands) {
+        /* a template for script_expand_word, which needs to know whether
+           the rest of the word allows globbing */
+        tag = p_ctx->word_literal ? TOK_TEMPLATE_LITERAL : glob ? TOK_TEMPLATE_GLOB : TOK_TEMPLATE;
+    }
+    p_ctx->in_word = p_ctx->word_glob = p_ctx->word_literal = p_ctx->word_expands = false;
+    if (tag == TOK_GLOB) p_ctx->num_globs += 1;
+    lexer_push_token(p_ctx, p_ctx->word, p_ctx->word_len, tag);
+}
+
+void lexer_expand(shell_ctx_t * p_ctx, const char * name, const size_t len, const bool split) {
+    /* $NAME, ${NAME} and the special parameters; outside double quotes
+       the value is split into words at blanks, and an empty one leaves no
+       word behind */
+    if (p_ctx->defer) {
+        /* compiled code expands it every time it runs, the name is kept
+           between markers (see script_expand_word) */
+        const char mark = split ? SCRIPT_EXPAND : SCRIPT_QUOTED;
+        const char end = SCRIPT_END;
+        lexer_word_append(p_ctx, &mark, 1);
+        lexer_word_append(p_ctx, name, len);
+        lexer_word_append(p_ctx, &end, 1);
+        p_ctx->word_expands = true;
+        return;
+    }
+    char number[16];
+    const char * value = shell_param(p_ctx, name, len, number);
+    /* the value can change before the line comes round again */
+    p_ctx->plan_line = NULL;
+    if (!split) {
+        lexer_word_append(p_ctx, value ? value : "", value ? strlen(value) : 0);
+        if (value && strpbrk(value, "*?[")) p_ctx->word_literal = true;
+        return;
+    }
+    if (!value) return;
+    while (*value) {
+        const size_t blanks = strspn(value, " \t\n");
+        if (blanks) {
+            lexer_word_end(p_ctx);
+            value += blanks;
+            continue;
+        }
+        const size_t part = strcspn(value, " \t\n");
+        lexer_word_append(p_ctx, value, part);
+        /* unquoted, so a pattern in the value is expanded as well */
+        if (strcspn(value, "*?[") < part) p_ctx->word_glob = true;
+        value += part;
+    }
+}
+
+void lexer_unterminated(shell_ctx_t * p_ctx) {
+    /* the rest of the input is one open quote, nothing of it runs; a script
+       being compiled may still get the lines that close it */
+    if (p_ctx->defer) {
+        p_ctx->unterminated = true;
+    } else {
+        puts("ERROR: unterminated quote");
+    }
+    p_ctx->in_word = p_ctx->word_glob = p_ctx->word_literal = p_ctx->word_expands = false;
+    p_ctx->tokens.npos = 0;
+    p_ctx->num_commands = 1;
+    p_ctx->num_globs = 0;
+    p_ctx->num_controls = 0;
+    p_ctx->plan_line = NULL;
+}
+
+void lexer_open_buffer(shell_ctx_t * p_ctx, char * buffer, const size_t size) {
+    /* the last two bytes of the buffer must be NUL */
+    if (!p_ctx->p_buffer_state) {
+        p_ctx->p_buffer_state = yy_scan_buffer(buffer, size, p_ctx->scanner);
+        return;
+    }
+    /* the buffer state is allocated once and then re-pointed at every new
+       line, rather than going through yy_scan_buffer and yy_delete_buffer */
+    struct yy_buffer_state * p_state = p_ctx->p_buffer_state;
+    p_state->yy_buf_pos = p_state->yy_ch_buf = buffer;
+    p_state->yy_buf_size = size - 2;
+    p_state->yy_n_chars = size - 2;
+    p_state->yy_at_bol = 1;
+    p_state->yy_buffer_status = YY_BUFFER_NEW;
+    yy_load_buffer_state(p_ctx->scanner);
+}
+
+int lexer_next_line(shell_ctx_t * p_ctx) {
+    /* tokenizes up to the next newline, returns 0 at the end of input */
+    const int more_lines = yylex(p_ctx->scanner);
+    if (!more_lines) lexer_end_input(p_ctx);
+    lexer_terminate_words(p_ctx);
+    return more_lines;
+}
+
+void lexer_scan_script(shell_ctx_t * p_ctx, char * buffer, const size_t size) {
+    /* all the lines of a script at once, each one ended by a TOK_NEWLINE
+       that points at where the next line starts */
+    lexer_open_buffer(p_ctx, buffer, size);
+    while (yylex(p_ctx->scanner)) lexer_push_token(p_ctx, lexer_cursor(p_ctx), 0, TOK_NEWLINE);
+    lexer_end_input(p_ctx);
+    lexer_terminate_words(p_ctx);
+}
+
+void lexer_end_input(shell_ctx_t * p_ctx) {
+    struct yyguts_t * yyg = (struct yyguts_t *)p_ctx->scanner;
+    if (YY_START == DQUOTE) {
+        lexer_unterminated(p_ctx);
+        BEGIN(INITIAL);
+    }
+    /* the input ended without a newline after the last word */
+    lexer_word_end(p_ctx);
+}
+
+void lexer_terminate_words(shell_ctx_t * p_ctx) {
+    /* the scanner is past every token of the line now, so the character
+       after each word can be overwritten to terminate it in place */
+    token_t * tokens = (token_t *)p_ctx->tokens.data;
+    for (size_t i = 0; i < p_ctx->tokens.npos; i += 1) {
+        if (tokens[i].tag == TOK_WORD || tokens[i].tag == TOK_GLOB) {
+            tokens[i].text[tokens[i].len] = '\0';
+        }
+    }
+}
+
+char * lexer_cursor(shell_ctx_t * p_ctx) {
+    /* where the scanner will resume, with the character that flex keeps
+       swapped out for a NUL put back */
+    struct yyguts_t * yyg = (struct yyguts_t *)p_ctx->scanner;
+    *yyg->yy_c_buf_p = yyg->yy_hold_char;
+    return yyg->yy_c_buf_p;
+}
+
+void lexer_echo(yyscan_t scanner, const char * text, const size_t len) {
+    /* unmatched input is logged, the file is only created once there is
+       some, rather than on every start */
+    FILE * p_errors = yyget_out(scanner);
+    if (!p_errors) {
+        p_errors = fopen(".flex_errors", "w");
+        if (!p_errors) return;
+        yyset_out(p_errors, scanner);
+    }
+    fwrite(text, len, 1, p_errors);
+}
+
+void lexer_close_buffer(shell_ctx_t * p_ctx) {
+    /* nothing to release, see lexer_open_buffer */
+}
+
+void lexer_parse_buffer(shell_ctx_t * p_ctx, char * buffer, const size_t size) {
+    lexer_open_buffer(p_ctx, buffer, size);
+    lexer_next_line(p_ctx);
+    lexer_close_buffer(p_ctx);
+}
@@ -14,18 +14,58 @@
 /*  limitations under the License.                                            */
 /* ========================================================================== */
 
-#define _POSIX_C_SOURCE 1
+#define _POSIX_C_SOURCE 200809L
 #include <sys/param.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <signal.h>
 #include <unistd.h>
 #include <string.h>
+#include <ctype.h>
 #include <stdio.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <errno.h>
+#include <spawn.h>
 #include <time.h>
 #include <pwd.h>
+#include <dirent.h>
+#include <termios.h>
+#ifdef __linux__
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#endif
+
+extern char ** environ;
+/* not exposed under _POSIX_C_SOURCE, but part of every libc we target */
+pid_t wait4(pid_t, int *, int, struct rusage *);
+#if defined(__linux__) && !defined(F_SETPIPE_SZ)
+#define F_SETPIPE_SZ 1031
+#endif
+#ifdef __linux__
+/* glibc only declares these for _GNU_SOURCE */
+int memfd_create(const char *, unsigned int);
+int pipe2(int[2], int);
+int accept4(int, struct sockaddr *, socklen_t *, int);
+long syscall(long, ...);
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 1U
+#endif
+#ifndef SOCK_CLOEXEC
+#define SOCK_CLOEXEC 02000000
+#endif
+#endif
 
 char * strdup(const char * str) {
     const size_t len = strlen(str);
@@ -39,2353 +79,5672 @@ char * strdup(const char * str) {
     return new_str;
 }
 
+typedef struct arena_block_t {
+    struct arena_block_t * next;
+    size_t capacity;
+    size_t used;
+    char data[];
+} arena_block_t;
+
+typedef struct arena_t {
+    arena_block_t * first;
+    arena_block_t * current;
+    size_t num_blocks;
+} arena_t;
+
+/* BUMP ALLOCATOR FOR DATA THAT ONLY LIVES UNTIL THE NEXT LINE IS READ */
+void * arena_alloc(arena_t *, const size_t);
+char * arena_strndup(arena_t *, const char *, const size_t);
+void arena_reset(arena_t *);
+void arena_free(arena_t *);
+
 typedef struct vec_t {
     char * data;
     size_t len;
     size_t npos;
     size_t elem_size;
+    arena_t * p_arena;
 } vec_t;
 
 /* VECTOR DATA STRUCTURE IMPLEMENTATION */
 int vec_init(vec_t *, const size_t);
+int vec_init_arena(vec_t *, arena_t *, const size_t);
+int vec_reserve(vec_t *, const size_t);
 int vec_push(vec_t *, const void *);
+void vec_shrink(vec_t *);
 void vec_clear(vec_t *, void (*)(vec_t *));
 void vec_free(vec_t * p_vec, void (*)(vec_t *));
 
-static const char * VEC_INIT_ERROR_MSG = "ERROR: failed to initialize vector";
 static const char * VEC_PUSH_ERROR_MSG = "ERROR: failed to push to vector";
 
 /* VARIOUS CONSTANTS USED IN PROGRAM */
 enum {
-    READ_BUFFER_SIZE = 512,
+    READ_BLOCK_SIZE = 65536,
     VEC_GROWTH_RATE = 2,
-    NUM_BUILTINS = 2
+    VEC_INIT_CAPACITY = 16,
+    VEC_SHRINK_CAPACITY = 4096,
+    BUILTIN_SLOTS = 128,
+    HASH_INIT_CAPACITY = 64,
+    JOB_INIT_CAPACITY = 16,
+    PLAN_CACHE_CAPACITY = 64,
+    PLAN_CACHE_BUCKETS = 128,
+    DIR_CACHE_CAPACITY = 16,
+    DIR_READ_SIZE = 32768,
+    HISTORY_INIT_ENTRIES = 1024,
+    SCRIPT_CACHE_CAPACITY = 32,
+    /* for loops nested in one script or function, and nested calls */
+    SCRIPT_MAX_DEPTH = 32,
+    FUNC_MAX_DEPTH = 256,
+    /* marks a taken slot of the trigram table, above the three bytes */
+    TRIGRAM_USED = 1 << 24,
+    EVENTS_BATCH = 32,
+    PRINTF_SPEC_SIZE = 32,
+    /* where run_builtin parks the descriptors it redirects, above any
+       that a single digit redirection can name */
+    REDIR_SAVE_FD = 10,
+    TRACE_BUFFER_SIZE = 1024,
+    TRACE_LABEL_SIZE = 16,
+    ARENA_BLOCK_SIZE = 16384,
+    ARENA_ALIGN = sizeof(void *)
 };
 
+typedef struct token_t {
+    /* points into the input buffer, NUL terminated in place once the line
+       has been scanned (operators point at a string literal or a copy in
+       the arena, and so do words built from an expansion) */
+    char * text;
+    size_t len;
+    int tag;
+} token_t;
+
+enum _token {
+    TOK_WORD,
+    /* a word with an unquoted *, ? or [ in it, glob_expand turns it into
+       plain words before the parser sees it */
+    TOK_GLOB,
+    TOK_PIPE,
+    /* [n]<, [n]>, [n]>>, &> and &>>, a file name follows */
+    TOK_REDIR,
+    /* [n]>&m and [n]<&m */
+    TOK_REDIR_DUP,
+    TOK_HEREDOC,
+    TOK_HERE_STR,
+    TOK_BKG,
+    /* the rest only make it into scripts, see script_compile: ;, &&, ||,
+       the () of a function definition and the end of each line */
+    TOK_SEMI,
+    TOK_AND,
+    TOK_OR,
+    TOK_PARENS,
+    TOK_NEWLINE,
+    /* a word with expansions left in it, the second kind is also a pattern
+       and the third is never one */
+    TOK_TEMPLATE,
+    TOK_TEMPLATE_GLOB,
+    TOK_TEMPLATE_LITERAL,
+    /* never scanned, stands for the end of the line in PARSE_TABLE */
+    TOK_END,
+    NUM_TOKEN_TAGS
+};
+
+#ifndef YY_TYPEDEF_YY_SCANNER_T
+#define YY_TYPEDEF_YY_SCANNER_T
+typedef void * yyscan_t;
+#endif
+
+/* everything the scanner, parser and launcher share while evaluating a line,
+   one per shell instance so that several inputs can be parsed concurrently */
+typedef struct shell_ctx_t {
+    yyscan_t scanner;
+    struct yy_buffer_state * p_buffer_state;
+    vec_t tokens;
+    /* the word being put together from adjacent pieces of plain text,
+       quotes, escapes and expansions: in place in the line until text from
+       elsewhere is added (word_capacity 0), then in the arena */
+    char * word;
+    size_t word_len;
+    size_t word_capacity;
+    bool in_word;
+    /* the word has an unquoted pattern character, or a quoted one */
+    bool word_glob;
+    bool word_literal;
+    /* the word has an expansion put off until it runs, see defer */
+    bool word_expands;
+    /* how many TOK_GLOB the line has, glob_expand is skipped without */
+    int num_globs;
+    /* how many ;, &&, ||, (), and & the line has, see script_eval */
+    int num_controls;
+    /* set for the context scripts are compiled in: expansions become
+       markers in the word rather than values, and an open quote at the
+       end of the input is only flagged, more lines may close it */
+    bool defer;
+    bool unterminated;
+    /* owns the argv arrays and commands of the line being evaluated */
+    arena_t arena;
+    int num_commands;
+    bool bkg_proc;
+    /* process group for the job being launched, -1 keeps the shell's own
+       and 0 starts a new one led by the first process */
+    pid_t job_pgid;
+    /* the job being launched gets the terminal once its group exists */
+    bool job_foreground;
+    /* exit status of the last foreground job, shell style (128 + signal) */
+    int last_status;
+    /* $1 and on, of the function being run or else of the script */
+    char ** params;
+    int num_params;
+    /* how many script_run and function calls are under way */
+    int script_depth;
+    int call_depth;
+    /* set when the line starts with the time keyword */
+    bool timed;
+    /* the rest of a batch input, which is where heredoc bodies are read
+       from (from stdin when p_input is NULL) */
+    char * p_input;
+    char * p_input_end;
+    /* stdin for the process being launched, when it has a heredoc */
+    int here_fd;
+    /* set for a --serve connection: jobs are handed back in p_job instead
+       of being waited for, and exit only ends the connection */
+    bool serving;
+    /* the connection's own stream, for reporting its background jobs */
+    FILE * p_report;
+    /* set for -c and scripts: exit ends the input rather than the process,
+       and main returns last_status */
+    bool batch;
+    bool exited;
+    struct job_t * p_job;
+    /* the cached plan the line was restored from, or else the key it gets
+       stored under once it has parsed (plan_line is NULL when it can't be) */
+    const struct plan_t * p_plan;
+    size_t plan_hash;
+    char * plan_line;
+    size_t plan_line_len;
+    /* the same copy of the line, kept even when it can't be cached, for a
+       script to be compiled from */
+    char * line;
+    size_t line_len;
+} shell_ctx_t;
+
 /* INTERFACE WITH FLEX SCANNER */
-extern FILE * yyin, * yyout;
-void lexer_set_target(vec_t *);
-void lexer_parse_buffer(char *);
+bool lexer_init(shell_ctx_t *);
+void lexer_destroy(shell_ctx_t *);
+void lexer_parse_buffer(shell_ctx_t *, char *, const size_t);
+void lexer_open_buffer(shell_ctx_t *, char *, const size_t);
+int lexer_next_line(shell_ctx_t *);
+void lexer_scan_script(shell_ctx_t *, char *, const size_t);
+char * lexer_cursor(shell_ctx_t *);
+void lexer_close_buffer(shell_ctx_t *);
+void lexer_word_append(shell_ctx_t *, const char *, const size_t);
+void lexer_word_end(shell_ctx_t *);
+void lexer_expand(shell_ctx_t *, const char *, const size_t, const bool);
+const char * shell_param(shell_ctx_t *, const char *, const size_t, char *);
+
+/* the pipe descriptors of one pipeline stage, -1 where there is none: in
+   and out become its stdin and stdout, next is the read end of its output
+   pipe, meant for the following stage and closed in this one */
+typedef struct pipe_ends_t {
+    int in;
+    int out;
+    int next;
+} pipe_ends_t;
+
+/* one redirection, applied in the order they appear on the line */
+typedef struct redir_t {
+    /* the file to open, NULL to make fd a copy of dup_fd instead */
+    char * path;
+    int flags;
+    int fd;
+    int dup_fd;
+} redir_t;
 
 typedef struct command_t {
     char ** argv;
-    char * dest, * src;
+    redir_t * redirs;
+    int num_redirs;
+    /* document fed to stdin by <<< and <<, here_delim ends a heredoc whose
+       body has not been read yet */
+    char * here;
+    size_t here_len;
+    char * here_delim;
     bool is_bkg_proc;
 } command_t;
 
+typedef struct hash_entry_t {
+    char * name;
+    char * path;
+    unsigned hits;
+} hash_entry_t;
+
+typedef struct hash_table_t {
+    hash_entry_t * entries;
+    size_t capacity;
+    size_t count;
+    char * path_env;
+} hash_table_t;
+
+/* COMMAND HASH TABLE, CACHES PATH LOOKUPS FOR launch_process */
+const char * hash_lookup(hash_table_t *, const char *, const bool);
+void hash_clear(hash_table_t *);
+void hash_print(hash_table_t *);
+char * find_in_path(const char *, const char *);
+size_t hash_bytes(const char *, const size_t);
+
+static const char * DEFAULT_PATH = "/bin:/usr/bin";
+
+/* a shell variable, kept as one "NAME=value" string (just "NAME" when it
+   was exported before it had a value), so that the environment of a child
+   can point straight at it; inherited ones stay in environ until changed */
+typedef struct var_t {
+    char * entry;
+    size_t name_len;
+    size_t hash;
+    bool exported;
+    bool owned;
+} var_t;
+
+/* open addressing with linear probing, entry NULL marks a free slot */
+typedef struct var_table_t {
+    var_t * vars;
+    size_t capacity;
+    size_t count;
+    /* what children get as their environment, the exported entries with a
+       value; only rebuilt once an export, unset or assignment invalidated it */
+    char ** envp;
+    size_t envp_capacity;
+    bool envp_stale;
+} var_table_t;
+
+/* SHELL VARIABLES, EXPORTED TO CHILDREN THROUGH A CACHED envp */
+bool var_table_init(var_table_t *, char **);
+bool var_grow(var_table_t *);
+var_t * var_find(var_table_t *, const char *, const size_t);
+const char * var_get(var_table_t *, const char *, const size_t);
+bool var_set(var_table_t *, const char *, const size_t, const char *, const bool);
+void var_unset(var_table_t *, const char *, const size_t);
+char ** var_envp(var_table_t *);
+size_t var_name_len(const char *);
+int var_assign(char **);
+
+/* the names in one directory, reused for as long as its inode and mtime
+   stay the same */
+typedef struct dir_listing_t {
+    bool valid;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    /* read within the second of the last change, so another change could
+       still come without moving mtime, and it has to be read again */
+    bool racy;
+    size_t last_use;
+    /* NUL separated, offsets says where each one starts; both buffers are
+       kept for the next directory when the listing is replaced */
+    char * names;
+    size_t names_len;
+    size_t names_capacity;
+    size_t * offsets;
+    size_t num_names;
+    size_t offsets_capacity;
+} dir_listing_t;
+
+/* the directories globbed most recently, replaced least recently used */
+typedef struct dir_cache_t {
+    dir_listing_t listings[DIR_CACHE_CAPACITY];
+    size_t clock;
+    size_t hits;
+    size_t reads;
+} dir_cache_t;
+
+/* PATHNAME EXPANSION, OVER DIRECTORY LISTINGS CACHED WHILE UNCHANGED */
+void glob_expand(shell_ctx_t *);
+void glob_walk(shell_ctx_t *, vec_t *, char *, size_t, const char *);
+bool glob_is_pattern(const char *, const size_t);
+bool glob_match(const char *, const size_t, const char *);
+size_t glob_match_char(const char *, const size_t, const size_t, const unsigned char);
+int glob_compare(const void *, const void *);
+const dir_listing_t * dir_cache_get(dir_cache_t *, const char *);
+bool dir_read(dir_listing_t *, const int);
+bool dir_add_name(dir_listing_t *, const char *, const size_t);
+struct timespec stat_mtime(const struct stat *);
+
+/* the entries of the history holding one trigram, oldest first */
+typedef struct trigram_t {
+    unsigned key;
+    unsigned num_ids;
+    unsigned capacity;
+    unsigned * ids;
+} trigram_t;
+
+/* every line typed at a terminal, in one file that all shells append to
+   (a single O_APPEND write per line, so concurrent ones never interleave)
+   and that is read through a read only mapping of it */
+typedef struct history_t {
+    bool open;
+    int fd;
+    const char * map;
+    size_t map_len;
+    /* where every entry starts, plus where the last one ends */
+    size_t * offsets;
+    size_t num_entries;
+    size_t offsets_capacity;
+    /* the end of this shell's last line, so a search can skip itself */
+    off_t last_end;
+    /* open addressing on the three bytes, built lazily for the entries
+       before num_indexed on the first search that needs it */
+    trigram_t * trigrams;
+    size_t trigrams_capacity;
+    size_t num_trigrams;
+    size_t num_indexed;
+} history_t;
+
+/* COMMAND HISTORY, AN APPEND ONLY LOG WITH A TRIGRAM INDEX */
+bool history_open(history_t *);
+void history_append(history_t *, const char *, const size_t);
+bool history_sync(history_t *);
+void history_reset(history_t *);
+bool history_index(history_t *);
+trigram_t * history_trigram(history_t *, const unsigned, const bool);
+size_t history_find(history_t *, const char *, const size_t, size_t);
+bool history_contains(const history_t *, const size_t, const char *, const size_t);
+void history_print(const history_t *, const size_t);
+
+/* everything shell_eval derives from a line, with its own copy of the
+   strings so that it can outlive the line */
+typedef struct plan_t {
+    size_t hash;
+    char * line;
+    size_t line_len;
+    token_t * tokens;
+    size_t num_tokens;
+    /* the parsed pipeline */
+    command_t * commands;
+    int num_commands;
+    bool bkg_proc;
+    bool timed;
+    /* one block holds all of the above, reused when the entry is evicted */
+    char * storage;
+    size_t storage_capacity;
+    /* bucket chain and recency list, as indices, -1 ends both */
+    int chain;
+    int prev, next;
+} plan_t;
+
+typedef struct plan_cache_t {
+    plan_t entries[PLAN_CACHE_CAPACITY];
+    int buckets[PLAN_CACHE_BUCKETS];
+    int num_entries;
+    /* most and least recently used */
+    int head, tail;
+    size_t hits;
+    size_t misses;
+} plan_cache_t;
+
+/* LRU CACHE OF PARSED LINES, SO REPEATED LINES SKIP THE LEXER AND PARSER */
+void plan_cache_init(plan_cache_t *);
+bool plan_cache_lookup(plan_cache_t *, shell_ctx_t *, const char *, const size_t);
+void plan_cache_store(plan_cache_t *, shell_ctx_t *, const command_t *, const int);
+
+/* bytecode words hold the opcode in the low byte and its argument, an
+   index or a jump target, above it */
+enum _script_op {
+    OP_RUN,          /* runs pipelines[arg] */
+    OP_JUMP,
+    OP_JUMP_FALSE,   /* jumps when $? is not 0 */
+    OP_JUMP_TRUE,    /* jumps when $? is 0 */
+    OP_NOT,
+    OP_STATUS,       /* sets $? to arg */
+    OP_FOR_INIT,     /* expands the words of loops[arg] */
+    OP_FOR_NEXT,     /* assigns the next one, or leaves the loop */
+    OP_DEFINE,       /* defines funcs[arg] */
+    OP_RETURN,       /* returns arg, or $? for SCRIPT_ARG_NONE */
+    OP_END,
+    SCRIPT_OP_BITS = 8,
+    SCRIPT_ARG_NONE = 0xffffff
+};
+
+/* what a template word (TOK_TEMPLATE) wraps the names it expands in */
+enum _script_mark {
+    SCRIPT_EXPAND = 1,
+    SCRIPT_QUOTED = 2,
+    SCRIPT_END = 3
+};
+
+static const char * SCRIPT_MARKS = "\1\2";
+
+/* the tokens of one pipeline, lexed once and copied for every run */
+typedef struct script_pipeline_t {
+    token_t * tokens;
+    size_t num_tokens;
+    int num_commands;
+    int num_globs;
+    /* some of the tokens are templates */
+    bool expand;
+} script_pipeline_t;
+
+typedef struct script_loop_t {
+    char * name;
+    size_t name_len;
+    /* pipelines[words] holds the words after in, -1 stands for "$@" */
+    int words;
+    /* how many for loops it is nested in, which picks its frame */
+    unsigned depth;
+    unsigned exit;
+} script_loop_t;
+
+typedef struct script_func_t {
+    char * name;
+    unsigned entry;
+} script_func_t;
+
+/* a compiled script, everything in it comes from its own arena; kept
+   alive by the cache and by every function it defined */
+typedef struct script_t {
+    size_t hash;
+    char * text;
+    size_t text_len;
+    int refs;
+    size_t last_use;
+    arena_t arena;
+    /* of unsigned, script_pipeline_t, script_loop_t and script_func_t */
+    vec_t code;
+    vec_t pipelines;
+    vec_t loops;
+    vec_t funcs;
+} script_t;
+
+/* the items of a for loop being run, one per nesting depth */
+typedef struct script_frame_t {
+    char ** items;
+    size_t num_items;
+    size_t next;
+} script_frame_t;
+
+/* recursive descent over the tokens of a script, in one pass */
+typedef struct script_compiler_t {
+    script_t * p_script;
+    const token_t * tokens;
+    size_t num_tokens;
+    size_t pos;
+    /* the loops around the code being compiled, innermost last, where
+       continue jumps to; loop_base is the first one in this function */
+    unsigned loop_tops[SCRIPT_MAX_DEPTH];
+    int num_loops;
+    int loop_base;
+    unsigned for_depth;
+    bool in_func;
+    /* of unsigned code indices: jumps of && and || lists waiting for a
+       target, and break jumps (code index * SCRIPT_MAX_DEPTH + loop level) */
+    vec_t pending;
+    vec_t breaks;
+    /* the lexer's copy of the text, which TOK_NEWLINE tokens point into */
+    const char * text;
+    struct script_failure_t * p_failure;
+} script_compiler_t;
+
+/* why script_compile returned NULL, for script_eval to carry on from */
+typedef struct script_failure_t {
+    /* the tokens ran out, more lines might complete the script */
+    bool incomplete;
+    /* the delimiters of the heredocs on the line that failed (of char *,
+       valid until the next compile), whose bodies start at here_offset in
+       the text or else in the input after it */
+    vec_t heredocs;
+    size_t here_offset;
+} script_failure_t;
+
+enum _script_keyword {
+    KW_NONE,
+    KW_IF,
+    KW_THEN,
+    KW_ELIF,
+    KW_ELSE,
+    KW_FI,
+    KW_WHILE,
+    KW_UNTIL,
+    KW_FOR,
+    KW_DO,
+    KW_DONE,
+    KW_LBRACE,
+    KW_RBRACE,
+    KW_BANG,
+    KW_BREAK,
+    KW_CONTINUE,
+    KW_RETURN,
+    NUM_KEYWORDS
+};
+
+/* indexed by _script_keyword */
+static const char * SCRIPT_KEYWORDS[] = {
+    "", "if", "then", "elif", "else", "fi", "while", "until", "for", "do", "done",
+    "{", "}", "!", "break", "continue", "return"
+};
+
+typedef struct script_cache_t {
+    script_t * scripts[SCRIPT_CACHE_CAPACITY];
+    size_t clock;
+    size_t hits;
+    size_t compiles;
+} script_cache_t;
+
+typedef struct function_t {
+    char * name;
+    size_t hash;
+    script_t * p_script;
+    unsigned entry;
+} function_t;
+
+/* open addressing with linear probing, name NULL marks a free slot */
+typedef struct function_table_t {
+    function_t * funcs;
+    size_t capacity;
+    size_t count;
+} function_table_t;
+
+/* SCRIPTS: if, while, for, functions, && || and ;, COMPILED TO BYTECODE */
+void script_eval(shell_ctx_t *);
+bool script_is_script(shell_ctx_t *);
+int script_keyword(const token_t *);
+bool script_read_line(shell_ctx_t *, const char **, size_t *, char **);
+bool script_more_input(shell_ctx_t *, vec_t *);
+void script_skip_heredocs(shell_ctx_t *, const vec_t *, const script_failure_t *);
+script_t * script_compile(const char *, const size_t, script_failure_t *);
+void script_release(script_t *);
+script_t * script_cache_find(script_cache_t *, const char *, const size_t);
+void script_cache_store(script_cache_t *, script_t *);
+unsigned script_emit(script_compiler_t *, const int, const unsigned);
+void script_patch(script_compiler_t *, const unsigned, const unsigned);
+void script_push(vec_t *, const unsigned);
+int script_peek(script_compiler_t *);
+bool script_error(script_compiler_t *);
+bool script_expect(script_compiler_t *, const int);
+void script_skip_newlines(script_compiler_t *);
+bool script_list(script_compiler_t *, const unsigned);
+bool script_and_or(script_compiler_t *);
+bool script_command(script_compiler_t *);
+bool script_is_compound(const int);
+bool script_simple(script_compiler_t *);
+void script_heredocs(script_compiler_t *);
+bool script_if(script_compiler_t *);
+bool script_while(script_compiler_t *);
+bool script_for(script_compiler_t *);
+bool script_loop_body(script_compiler_t *, const unsigned);
+bool script_jump(script_compiler_t *, const int);
+bool script_function(script_compiler_t *);
+int script_pipeline_add(script_compiler_t *, const size_t, const size_t);
+int script_run(shell_ctx_t *, script_t *, unsigned);
+void script_run_pipeline(shell_ctx_t *, const script_pipeline_t *);
+void script_push_tokens(shell_ctx_t *, const script_pipeline_t *);
+void script_expand_word(shell_ctx_t *, const token_t *);
+void script_for_init(shell_ctx_t *, const script_t *, const script_loop_t *, script_frame_t *);
+bool script_interrupted(shell_ctx_t *);
+function_t * function_find(function_table_t *, const char *);
+bool function_define(function_table_t *, const char *, script_t *, const unsigned);
+
+/* GROWABLE LINE BUFFER, REUSED FOR EVERY LINE READ BY shell_read */
+typedef struct input_buffer_t {
+    char * data;
+    size_t capacity;
+    size_t len;
+} input_buffer_t;
+
+enum _proc_state {
+    PROC_RUNNING,
+    PROC_STOPPED,
+    PROC_DONE
+};
+
+typedef struct process_t {
+    pid_t pid;
+    int state;
+    int status;
+    /* filled in by wait4 when the process terminates */
+    struct rusage usage;
+    struct timespec finished;
+    /* readable once the process exits, -1 where pidfds are unavailable */
+    int pidfd;
+} process_t;
+
+typedef struct job_t {
+    int id;
+    pid_t pgid;
+    process_t * procs;
+    int num_procs;
+    int procs_capacity;
+    /* processes that have not terminated, and how many of those are stopped */
+    int num_live;
+    int num_stopped;
+    bool is_bkg;
+    bool timed;
+    /* the --serve connection a background job is reported to when it is
+       done, NULL for the shell's own stdout */
+    FILE * p_report;
+    struct timespec started;
+    char * cmdline;
+    size_t cmdline_capacity;
+    /* links finished jobs until they are reported, and removed jobs until
+       they are reused */
+    struct job_t * p_next;
+} job_t;
+
+typedef struct pid_slot_t {
+    /* 0 marks an empty slot, -1 a slot whose process has terminated */
+    pid_t pid;
+    int job_id;
+    int proc_idx;
+} pid_slot_t;
+
+typedef struct job_table_t {
+    /* indexed by job id - 1, NULL where a job has been removed */
+    job_t ** jobs;
+    int num_slots;
+    int capacity;
+    /* maps every live pid to its job, so reaping never scans the table */
+    pid_slot_t * pids;
+    size_t pid_capacity;
+    size_t pid_used;
+    size_t pid_live;
+    job_t * p_done;
+    job_t * p_free;
+} job_table_t;
+
+/* JOB TABLE, FED BY events_wait */
+bool job_table_init(job_table_t *);
+job_t * job_create(job_table_t *, shell_ctx_t *, const int, const bool);
+bool job_add_process(job_table_t *, job_t *, const pid_t);
+void job_remove(job_table_t *, job_t *);
+job_t * job_find(job_table_t *, const char *);
+job_t * job_find_pid(job_table_t *, const pid_t);
+job_t * job_current(job_table_t *);
+void job_reap(job_table_t *);
+void job_reap_pid(job_table_t *, const pid_t);
+int job_wait(job_table_t *, job_t *);
+int wait_status_code(const int);
+void job_continue(job_t *);
+void job_print(FILE *, job_t *, const bool);
+void job_print_usage(job_t *, FILE *);
+void job_log_usage(job_t *, FILE *);
+void job_flush(job_table_t *, const bool);
+void job_notify(job_table_t *, const bool);
+
+/* everything the shell waits on, in one set: child exits and signals are
+   dealt with inside events_wait, input descriptors are handed back to the
+   caller through events_next, once per events_watch */
+typedef struct events_t {
+#ifdef __linux__
+    int epoll_fd;
+    int signal_fd;
+#else
+    /* written to by the SIGCHLD handler, slot 0 of fds is its read end */
+    int signal_pipe[2];
+    struct pollfd * fds;
+    int num_fds;
+    int fds_capacity;
+#endif
+    /* the mask to restore in children */
+    sigset_t saved_mask;
+    /* input descriptors reported ready and not yet taken by events_next */
+    vec_t ready;
+    /* set when SIGINT came in, cleared by whoever acts on it */
+    bool interrupted;
+} events_t;
+
+/* EVENT LOOP, EPOLL WITH A SIGNALFD AND PIDFDS ON LINUX, POLL ELSEWHERE */
+bool events_init(events_t *, const bool);
+void events_free(events_t *);
+void events_child(events_t *);
+bool events_watch(events_t *, const int);
+void events_unwatch(events_t *, const int);
+void events_watch_pid(events_t *, process_t *);
+void events_wait(events_t *, const int);
+int events_next(events_t *);
+
+enum _event_kind {
+    EVENT_SIGNAL,
+    EVENT_INPUT,
+    EVENT_PID
+};
+
+enum _trace_phase {
+    TRACE_READ,
+    TRACE_LEX,
+    TRACE_PARSE,
+    TRACE_LAUNCH,
+    TRACE_WAIT,
+    TRACE_BUILTIN,
+    NUM_TRACE_PHASES
+};
+
+/* the event name, and what the integer argument of its events means */
+static const char * TRACE_PHASE_NAMES[NUM_TRACE_PHASES] = {
+    "read", "lex", "parse", "launch", "wait", "builtin"
+};
+static const char * TRACE_ARG_NAMES[NUM_TRACE_PHASES] = {
+    "bytes", "cached", "commands", "pid", "status", "status"
+};
+
+typedef struct trace_event_t {
+    long long start_ns;
+    long long dur_ns;
+    int phase;
+    int arg;
+    char label[TRACE_LABEL_SIZE];
+} trace_event_t;
+
+/* events are kept in memory and written out as Chrome trace events
+   (chrome://tracing, Perfetto) whenever the buffer fills up */
+typedef struct trace_t {
+    FILE * p_out;
+    pid_t pid;
+    size_t num_events;
+    trace_event_t events[TRACE_BUFFER_SIZE];
+} trace_t;
+
+/* TRACING OF THE READ-EVAL LOOP (-T or SHELL_TRACE) */
+bool trace_open(trace_t *, const char *);
+long long trace_begin();
+void trace_end(const int, const long long, const char *, const int);
+void trace_flush();
+void json_write_string(FILE *, const char *);
+
+/* always on, each one a plain increment where the event happens; the
+   shell has no threads, and children count into copies of their own */
+typedef struct metrics_t {
+    size_t lines_read;
+    size_t tokens_lexed;
+    size_t vec_grows;
+    size_t arena_bytes;
+    size_t spawns;
+    size_t exec_failures;
+    size_t children_reaped;
+    size_t parse_ns;
+    size_t job_wall_ns;
+} metrics_t;
+
+/* one row of stats, and one counter of the Prometheus text */
+typedef struct metric_t {
+    const char * name;
+    const char * help;
+    const size_t * p_value;
+} metric_t;
+
+/* RUNTIME COUNTERS, PRINTED BY stats AND SERVED BY --metrics */
+void metrics_print(FILE *, const bool);
+long long metrics_now();
+
+typedef int (* builtin_fn_t)(shell_ctx_t *, int, char **);
+
+typedef struct builtin_t {
+    const char * name;
+    builtin_fn_t fn;
+} builtin_t;
+
+/* perfect hash over BUILTIN_LIST, the seed is searched for at startup */
+typedef struct builtin_table_t {
+    const builtin_t * slots[BUILTIN_SLOTS];
+    size_t seed;
+} builtin_table_t;
+
+/* SHELL BUILTINS, FOUND BY NAME THROUGH A PERFECT HASH */
+bool builtin_table_init(builtin_table_t *);
+const builtin_t * builtin_find(builtin_table_t *, const char *);
+const builtin_t * command_builtin(const char *);
+int run_builtin(shell_ctx_t *, const builtin_t *, command_t *);
+int fork_builtin(shell_ctx_t *, command_t *, const builtin_t *, const pipe_ends_t *);
+int builtin_exit(shell_ctx_t *, int, char **);
+int builtin_cd(shell_ctx_t *, int, char **);
+int builtin_hash(shell_ctx_t *, int, char **);
+int builtin_stats(shell_ctx_t *, int, char **);
+int builtin_jobs(shell_ctx_t *, int, char **);
+int builtin_wait(shell_ctx_t *, int, char **);
+int builtin_fg(shell_ctx_t *, int, char **);
+int builtin_bg(shell_ctx_t *, int, char **);
+int builtin_parallel(shell_ctx_t *, int, char **);
+int builtin_echo(shell_ctx_t *, int, char **);
+int builtin_true(shell_ctx_t *, int, char **);
+int builtin_false(shell_ctx_t *, int, char **);
+int builtin_printf(shell_ctx_t *, int, char **);
+int builtin_test(shell_ctx_t *, int, char **);
+int builtin_pwd(shell_ctx_t *, int, char **);
+int builtin_export(shell_ctx_t *, int, char **);
+int builtin_unset(shell_ctx_t *, int, char **);
+int builtin_history(shell_ctx_t *, int, char **);
+int builtin_function(shell_ctx_t *, int, char **);
+
+static const builtin_t BUILTIN_LIST[] = {
+    {"exit", builtin_exit},
+    {"cd", builtin_cd},
+    {"hash", builtin_hash},
+    {"stats", builtin_stats},
+    {"jobs", builtin_jobs},
+    {"wait", builtin_wait},
+    {"fg", builtin_fg},
+    {"bg", builtin_bg},
+    {"parallel", builtin_parallel},
+    {"echo", builtin_echo},
+    {"true", builtin_true},
+    {"false", builtin_false},
+    {"printf", builtin_printf},
+    {"test", builtin_test},
+    {"[", builtin_test},
+    {"pwd", builtin_pwd},
+    {"export", builtin_export},
+    {"unset", builtin_unset},
+    {"history", builtin_history}
+};
+
+/* stands in for every function, which is run like a builtin */
+static const builtin_t FUNCTION_BUILTIN = {"function", builtin_function};
+
+/* one client of --serve, with a shell context of its own */
+typedef struct serve_conn_t {
+    int fd;
+    FILE * p_out;
+    shell_ctx_t ctx;
+    /* received and not evaluated yet */
+    char * data;
+    size_t len;
+    size_t capacity;
+    /* the line being evaluated, with room for the scanner's NULs */
+    input_buffer_t line;
+    /* the peer is done sending, the connection closes once it is idle */
+    bool eof;
+} serve_conn_t;
+
+typedef struct server_t {
+    int listen_fd;
+    /* stdin for every job, connections only carry command lines */
+    int null_fd;
+    /* the shell's own stdin, stdout and stderr, parked while a line runs */
+    int saved_fds[3];
+    /* each connection to it gets the counters as Prometheus text, -1 when
+       there is no --metrics */
+    int metrics_fd;
+    /* of serve_conn_t *, a context must not move once its scanner exists */
+    vec_t conns;
+} server_t;
+
+/* SERVER MODE, COMMAND LINES OVER A UNIX SOCKET TO A RESIDENT SHELL */
+int shell_serve(const char *, const char *);
+int serve_socket(const char *);
+int serve_accept_fd(const int);
+void serve_child(server_t *);
+bool serve_listen(server_t *, const char *);
+void serve_accept(server_t *);
+void serve_metrics(server_t *);
+void serve_receive(serve_conn_t *);
+bool serve_run(server_t *, serve_conn_t *);
+void serve_collect(server_t *);
+void serve_close(serve_conn_t *);
+
 /* CORE SHELL IMPLEMENTATION */
-void shell_read(char *, vec_t *);
-void shell_eval(vec_t *);
-int launch_process(command_t *, const int, int[], int);
-void launch_process_chain(vec_t *);
-int parse_single_command(vec_t *, command_t *);
-int parse_multiple_commands(vec_t * restrict, vec_t * restrict);
-char ** slice_argv_from_vec(vec_t *, const size_t, const size_t);
+bool shell_ctx_init(shell_ctx_t *);
+void shell_ctx_reset(shell_ctx_t *);
+void shell_ctx_free(shell_ctx_t *);
+void shell_read(shell_ctx_t *, input_buffer_t *);
+void shell_scan(shell_ctx_t *, input_buffer_t *);
+void shell_eval(shell_ctx_t *);
+void shell_batch(shell_ctx_t *, char *, const size_t);
+char * read_script(const char *, size_t *);
+char * copy_script(const char *, size_t *);
+bool parse_size(const char *, size_t *);
+int pipe_open(int[2]);
+void set_pipe_size(const int);
+int here_open(const char *, const size_t);
+void heredoc_read(shell_ctx_t *, command_t *);
+void heredoc_shadow(command_t *);
+int redir_parse(const token_t *, char *, redir_t *);
+int redir_apply(const redir_t *);
+void redir_report(FILE *, const redir_t *);
+int launch_process(shell_ctx_t *, command_t *, const pipe_ends_t *);
+int start_process(shell_ctx_t *, command_t *, const pipe_ends_t *);
+int spawn_process(shell_ctx_t *, command_t *, const char *, const pipe_ends_t *);
+int fork_process(shell_ctx_t *, command_t *, const char *, const pipe_ends_t *);
+void child_redirect(shell_ctx_t *, command_t *, const pipe_ends_t *);
+void launch_process_chain(shell_ctx_t *, command_t *, const int);
+void shell_run_job(shell_ctx_t *, job_t *);
+int parse_commands(shell_ctx_t *, command_t **);
+void terminal_hand_over(const pid_t);
+void terminal_reclaim(const bool);
+void shell_identity_init();
 void print_intro_msg();
 void disp_prompt();
 
-int global_num_pipes;
-int global_num_commands = 1;
 bool global_print_shell_context = true;
-bool global_bkg_proc = false;
-int global_builtin_idxs[NUM_BUILTINS];
-int global_num_builtins = 0;
+bool global_use_fork = false;
+hash_table_t global_hash_table;
+var_table_t global_vars;
+trace_t global_trace;
+events_t global_events;
+builtin_table_t global_builtins;
+plan_cache_t global_plans;
+dir_cache_t global_dir_cache;
+history_t global_history;
+script_cache_t global_scripts;
+function_table_t global_functions;
+/* where scripts are lexed, apart from the line they came from */
+shell_ctx_t global_script_ctx;
+/* set in --serve mode, for forked builtins to shed its descriptors */
+server_t * global_server = NULL;
+job_table_t global_jobs;
+/* heap allocations made by the read-eval loop, stays flat once warmed up */
+size_t global_loop_allocs = 0;
+metrics_t global_metrics;
+/* when set (-s), every finished job appends one JSON line of stats here */
+FILE * global_stats_log = NULL;
+/* capacity requested for pipeline pipes (-p), 0 keeps the kernel default;
+   opt-in, as every big pipe counts against fs.pipe-user-pages-soft and
+   past it the kernel gives all of the user's new pipes a page or two */
+size_t global_pipe_size = 0;
+/* set when commands are typed at a terminal, see shell_read */
+bool global_tty_input = false;
+/* every job gets a process group of its own (at a terminal, and --serve),
+   otherwise only background jobs do */
+bool global_job_control = false;
+/* the terminal modes to put back whenever a job gives the terminal up */
+struct termios global_tty_modes;
+/* looked up once, interactive shells only; getlogin can mean reading utmp */
+const char * global_user = NULL;
+char * global_prompt = NULL;
+
+/* in the order stats prints them; a name ending in _ns is in seconds in
+   the Prometheus text */
+static const metric_t METRICS[] = {
+    {"loop_allocs", "Heap allocations made by the read-eval loop.", &global_loop_allocs},
+    {"plan_hits", "Lines restored from the plan cache.", &global_plans.hits},
+    {"plan_misses", "Lines lexed and parsed.", &global_plans.misses},
+    {"glob_dir_hits", "Directory listings reused by globbing.", &global_dir_cache.hits},
+    {"glob_dir_reads", "Directories read by globbing.", &global_dir_cache.reads},
+    {"script_hits", "Scripts found compiled in the cache.", &global_scripts.hits},
+    {"script_compiles", "Scripts compiled.", &global_scripts.compiles},
+    {"lines_read", "Command lines read.", &global_metrics.lines_read},
+    {"tokens_lexed", "Tokens produced by the scanner.", &global_metrics.tokens_lexed},
+    {"vec_grows", "Times a vector outgrew its storage.", &global_metrics.vec_grows},
+    {"arena_bytes", "Bytes handed out by the line arenas.", &global_metrics.arena_bytes},
+    {"spawns", "Processes started, spawned or forked.", &global_metrics.spawns},
+    {"exec_failures", "Commands that could not be started.", &global_metrics.exec_failures},
+    {"children_reaped", "Child processes that terminated.", &global_metrics.children_reaped},
+    {"parse_ns", "Time spent parsing lines.", &global_metrics.parse_ns},
+    {"job_wall_ns", "Wall clock time of finished jobs.", &global_metrics.job_wall_ns}
+};
 
-void token_vec_clear_policy(vec_t * p_vec) {
-    char ** vec_contents = (char **)p_vec->data;
-    for (size_t i = 0; i < p_vec->npos; i++) {
-        if (vec_contents[i]) free(vec_contents[i]);
-        vec_contents[i] = NULL;
-    }
-}
+static const char * CTX_INIT_ERROR_MSG = "ERROR: failed to initialize the shell";
+static const char * USAGE_MSG =
+    "ERROR: usage: myshell [-n] [-F] [-s <log>] [-p <size>] [-T <trace>] "
+    "[-c <commands> | <script> [args...] | --serve <socket> [--metrics <socket>]]";
 
+#ifndef __linux__
 void sigchld_handler(int sig) {
-    while (waitpid(-1, NULL, WNOHANG) > 0);
+    /* reaping happens in events_wait, the handler only wakes it up; when
+       the pipe is full a wakeup is already pending */
+    const int saved_errno = errno;
+    const ssize_t res = write(global_events.signal_pipe[1], "", 1);
+    (void)res;
+    errno = saved_errno;
 }
+#endif
 
 int main(int argc, char ** argv) {
-    signal(SIGCHLD, sigchld_handler);
-    if (argc >= 2) {
-        if (strcmp("-n", argv[1]) == 0) {
+    if (!job_table_init(&global_jobs)) {
+        perror("ERROR: jobs");
+        return EXIT_FAILURE;
+    }
+    plan_cache_init(&global_plans);
+    if (!var_table_init(&global_vars, environ) || !builtin_table_init(&global_builtins)) {
+        puts(CTX_INIT_ERROR_MSG);
+        return EXIT_FAILURE;
+    }
+    const char * command_str = NULL;
+    const char * script_path = NULL;
+    const char * serve_path = NULL;
+    const char * metrics_path = NULL;
+    char ** script_args = NULL;
+    int num_script_args = 0;
+    const char * trace_path = getenv("SHELL_TRACE");
+    for (int i = 1; i < argc; i += 1) {
+        if (strcmp("-n", argv[i]) == 0) {
             global_print_shell_context = false;
+        } else if (strcmp("-F", argv[i]) == 0) {
+            global_use_fork = true;
+        } else if (strcmp("-s", argv[i]) == 0 && i + 1 < argc && !global_stats_log) {
+            global_stats_log = fopen(argv[++i], "a");
+            if (!global_stats_log) {
+                perror("ERROR: stats log");
+                return EXIT_FAILURE;
+            }
+            /* one line per job, so a tail -f sees each job as it ends */
+            setvbuf(global_stats_log, NULL, _IOLBF, 0);
+        } else if (strcmp("-T", argv[i]) == 0 && i + 1 < argc) {
+            trace_path = argv[++i];
+        } else if (strcmp("-p", argv[i]) == 0 && i + 1 < argc) {
+            if (!parse_size(argv[++i], &global_pipe_size)) {
+                puts(USAGE_MSG);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp("-c", argv[i]) == 0 && i + 1 < argc && !script_path && !serve_path) {
+            command_str = argv[++i];
+        } else if (strcmp("--serve", argv[i]) == 0 && i + 1 < argc &&
+                   !script_path && !command_str) {
+            serve_path = argv[++i];
+        } else if (strcmp("--metrics", argv[i]) == 0 && i + 1 < argc) {
+            metrics_path = argv[++i];
+        } else if ((argv[i][0] != '-' || argv[i][1] == '\0') &&
+                   !script_path && !command_str && !serve_path) {
+            /* whatever follows is for the script, $1 and on */
+            script_path = argv[i];
+            script_args = argv + i + 1;
+            num_script_args = argc - i - 1;
+            break;
+        } else {
+            puts(USAGE_MSG);
+            return EXIT_FAILURE;
         }
     }
-    char buffer[READ_BUFFER_SIZE];
-    vec_t token_vec;
-    if (!vec_init(&token_vec, sizeof(char *))) {
-        puts(VEC_INIT_ERROR_MSG);
+    if (metrics_path && !serve_path) {
+        puts(USAGE_MSG);
+        return EXIT_FAILURE;
+    }
+    if (trace_path && trace_path[0] && !trace_open(&global_trace, trace_path)) {
+        perror("ERROR: trace");
+        return EXIT_FAILURE;
+    }
+    global_tty_input = !command_str && !script_path && !serve_path && isatty(STDIN_FILENO);
+    /* only a shell at a terminal takes SIGINT for itself, a script still
+       dies of it along with its job */
+    if (!events_init(&global_events, global_tty_input)) {
+        perror("ERROR: events");
+        return EXIT_FAILURE;
+    }
+    global_job_control = global_tty_input;
+    if (global_tty_input) {
+        tcgetattr(STDIN_FILENO, &global_tty_modes);
+        /* not fatal, the shell just runs without its history */
+        history_open(&global_history);
+    }
+    if (serve_path) return shell_serve(serve_path, metrics_path);
+    input_buffer_t input;
+    memset(&input, 0, sizeof(input_buffer_t));
+    shell_ctx_t ctx;
+    if (!shell_ctx_init(&ctx)) {
+        puts(CTX_INIT_ERROR_MSG);
         return EXIT_FAILURE;
     }
-    lexer_set_target(&token_vec);
-    if (global_print_shell_context) print_intro_msg();
+    ctx.params = script_args;
+    ctx.num_params = num_script_args;
+    if (command_str || script_path) {
+        /* batch mode, the whole input is scanned at once and there is no
+           prompt or login message */
+        size_t len;
+        char * input = command_str ? copy_script(command_str, &len)
+                                   : read_script(script_path, &len);
+        if (!input) {
+            perror("ERROR: script");
+            return EXIT_FAILURE;
+        }
+        ctx.batch = true;
+        shell_batch(&ctx, input, len);
+        free(input);
+        const int status = ctx.last_status;
+        shell_ctx_free(&ctx);
+        return status;
+    }
+    if (global_print_shell_context) {
+        shell_identity_init();
+        print_intro_msg();
+    }
     while (true) {
+        job_notify(&global_jobs, global_print_shell_context);
         if (global_print_shell_context) disp_prompt();
-        shell_read(buffer, &token_vec);
-        shell_eval(&token_vec);
-        vec_clear(&token_vec, token_vec_clear_policy);
+        shell_ctx_reset(&ctx);
+        shell_read(&ctx, &input);
+        shell_eval(&ctx);
+    }
+}
+
+void shell_identity_init() {
+    global_user = getlogin();
+    if (!global_user) {
+        /* no controlling terminal, or no utmp entry for it */
+        struct passwd * pw = getpwuid(getuid());
+        global_user = pw ? pw->pw_name : "?";
     }
+    global_user = strdup(global_user);
+    global_prompt = malloc(strlen(global_user) + 3);
+    if (!global_prompt) {
+        puts("ERROR: malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    sprintf(global_prompt, "%s$ ", global_user);
 }
 
 void disp_prompt() {
-    printf("%s$ ", getlogin());
+    fputs(global_prompt, stdout);
 }
 
 void print_intro_msg() {
+    /* the only use of local time, so batch runs never load the timezone */
     time_t current_time;
     struct tm * time_info;
     char time_str[9];
     time(&current_time);
     time_info = localtime(&current_time);
     strftime(time_str, sizeof(time_str), "%H:%M:%S", time_info);
-    printf("login by %s, at %s\n", getlogin(), time_str);
+    printf("login by %s, at %s\n", global_user, time_str);
 }
 
-void shell_read(char * buffer, vec_t * p_vec) {
-    global_num_commands = 1;
-    global_num_builtins = 0;
-    memset(global_builtin_idxs, -1, 2 * sizeof(int));
-    memset(buffer, 0, READ_BUFFER_SIZE);
-    if (fgets(buffer, READ_BUFFER_SIZE, stdin)) {
-        lexer_parse_buffer(buffer);
-        return;
-    }
-    vec_free(p_vec, token_vec_clear_policy);
-    if (yyout) fclose(yyout);
-    exit(EXIT_SUCCESS);
+void terminal_hand_over(const pid_t pgid) {
+    /* SIGTTOU is blocked, so this works from wherever the shell is */
+    if (global_tty_input) tcsetpgrp(STDIN_FILENO, pgid);
 }
 
-void command_vec_clear_policy(vec_t * p_vec) {
-    command_t * commands = (command_t *)p_vec->data;
-    for (size_t i = 0; i < p_vec->npos; i++) {
-        if (commands[i].argv) {
-            free(commands[i].argv);
-        }
+void terminal_reclaim(const bool keep_modes) {
+    if (!global_tty_input) return;
+    tcsetpgrp(STDIN_FILENO, getpgrp());
+    /* a job that finished meant its stty, one that was stopped or killed
+       may have left the terminal in any state */
+    if (keep_modes) {
+        tcgetattr(STDIN_FILENO, &global_tty_modes);
+    } else {
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &global_tty_modes);
     }
 }
 
-enum _parse {
-    PARSE_SUCCESS,
-    PARSE_ERROR,
-};
+bool shell_ctx_init(shell_ctx_t * p_ctx) {
+    memset(p_ctx, 0, sizeof(shell_ctx_t));
+    if (!vec_init(&p_ctx->tokens, sizeof(token_t))) return false;
+    if (!lexer_init(p_ctx)) {
+        vec_free(&p_ctx->tokens, NULL);
+        return false;
+    }
+    shell_ctx_reset(p_ctx);
+    return true;
+}
 
-enum _pipe {
-    PIPE_NONE,
-    PIPE_OUT,
-    PIPE_IN
-};
+void shell_ctx_reset(shell_ctx_t * p_ctx) {
+    /* drops everything the previous line left behind, buffers are kept */
+    vec_clear(&p_ctx->tokens, NULL);
+    vec_shrink(&p_ctx->tokens);
+    arena_reset(&p_ctx->arena);
+    p_ctx->num_commands = 1;
+    p_ctx->in_word = p_ctx->word_glob = p_ctx->word_literal = p_ctx->word_expands = false;
+    p_ctx->num_globs = 0;
+    p_ctx->num_controls = 0;
+    p_ctx->bkg_proc = false;
+    p_ctx->job_pgid = -1;
+    p_ctx->job_foreground = false;
+    p_ctx->timed = false;
+    p_ctx->p_plan = NULL;
+    p_ctx->plan_line = NULL;
+    p_ctx->line = NULL;
+    p_ctx->p_input = NULL;
+    p_ctx->here_fd = -1;
+    p_ctx->p_job = NULL;
+}
 
-enum _builtin {
-    CMD_EXIT,
-    CMD_CD
-};
+void shell_ctx_free(shell_ctx_t * p_ctx) {
+    lexer_destroy(p_ctx);
+    vec_free(&p_ctx->tokens, NULL);
+    arena_free(&p_ctx->arena);
+}
 
-int parse_builtin_cmds(vec_t * p_vec) {
-    /* more than two commands without a pipe should alse be an error */
-    if (global_num_builtins > 1) return PARSE_ERROR;
-    if (global_num_builtins == 1 && global_num_commands > 1) {
-        return PARSE_ERROR;
-    }
-    for (int i = 0; i < NUM_BUILTINS; i += 1) {
-        if (global_builtin_idxs[i] > 1) {
-            return PARSE_ERROR;
+void shell_read(shell_ctx_t * p_ctx, input_buffer_t * p_input) {
+    /* getline only reallocates when a line is longer than any before it */
+    const size_t capacity = p_input->capacity;
+    const long long read_start = trace_begin();
+    if (global_tty_input) {
+        /* a terminal hands over one line per read, so nothing is left in
+           the stdio buffer and it is safe to wait for the descriptor;
+           jobs are reaped and ^C seen meanwhile */
+        events_watch(&global_events, STDIN_FILENO);
+        while (events_next(&global_events) != STDIN_FILENO) {
+            events_wait(&global_events, -1);
+            if (global_events.interrupted) {
+                /* the terminal already dropped what was typed */
+                global_events.interrupted = false;
+                events_unwatch(&global_events, STDIN_FILENO);
+                putchar('\n');
+                trace_end(TRACE_READ, read_start, NULL, 0);
+                return;
+            }
         }
     }
-    return PARSE_SUCCESS;
+    const ssize_t len = getline(&p_input->data, &p_input->capacity, stdin);
+    trace_end(TRACE_READ, read_start, NULL, len);
+    if (p_input->capacity != capacity) global_loop_allocs += 1;
+    if (len > 0) {
+        p_input->len = len;
+        if (global_tty_input) history_append(&global_history, p_input->data, len);
+        shell_scan(p_ctx, p_input);
+        return;
+    }
+    /* end of input, the status is that of the last command, as in sh */
+    const int status = p_ctx->last_status;
+    free(p_input->data);
+    shell_ctx_free(p_ctx);
+    exit(status);
 }
 
-void eval_builtin_cmds(vec_t * p_vec) {
-    for (int i = 0; i < NUM_BUILTINS; i += 1) {
-        if (global_builtin_idxs[i] != -1) {
-            switch (i) {
-            case CMD_EXIT:
-                vec_free(p_vec, token_vec_clear_policy);
-                if (yyout) fclose(yyout);
-                exit(EXIT_SUCCESS);
-                
-            case CMD_CD:
-                switch (p_vec->npos) {
-                case 1: {
-                    char * home_dir = getenv("HOME");
-                    if (!home_dir) {
-                        struct passwd * pw = getpwuid(getuid());
-                        home_dir = pw->pw_dir;
-                    }
-                    int res = chdir(home_dir);
-                    if (res == -1) perror("ERROR: cd");
-                    } break;
-                    
-                case 2: {
-                    char ** vec_contents = (char **)p_vec->data;
-                    int res = chdir(vec_contents[1]);
-                    if (res == -1) perror("ERROR: cd");
-                    } break;
-                    
-                default:
-                    puts("ERROR: usage: cd <dir>");
-                    break;
-                }
-                break;
-            }
+void shell_scan(shell_ctx_t * p_ctx, input_buffer_t * p_input) {
+    /* restores the line from the plan cache, or else tokenizes it */
+    if (p_input->capacity < p_input->len + 2) {
+        /* the scanner needs a second NUL after the one getline wrote */
+        char * data = realloc(p_input->data, p_input->len + 2);
+        if (!data) {
+            puts("ERROR: realloc failed");
+            exit(EXIT_FAILURE);
         }
+        p_input->data = data;
+        p_input->capacity = p_input->len + 2;
+        global_loop_allocs += 1;
     }
+    p_input->data[p_input->len] = p_input->data[p_input->len + 1] = '\0';
+    const size_t line_len = p_input->len - (p_input->len && p_input->data[p_input->len - 1] == '\n');
+    const long long lex_start = trace_begin();
+    const bool cached = plan_cache_lookup(&global_plans, p_ctx, p_input->data, line_len);
+    global_metrics.lines_read += 1;
+    if (!cached) {
+        lexer_parse_buffer(p_ctx, p_input->data, p_input->len + 2);
+        global_metrics.tokens_lexed += p_ctx->tokens.npos;
+    }
+    trace_end(TRACE_LEX, lex_start, NULL, cached);
 }
 
-static const char * PARSE_ERROR_MSG = "ERROR: invalid input";
+void shell_batch(shell_ctx_t * p_ctx, char * buffer, const size_t len) {
+    /* one scanner pass over the whole input, the lexer hands back control
+       at the end of every line so that it can be evaluated */
+    lexer_open_buffer(p_ctx, buffer, len + 2);
+    char * p_line = buffer;
+    char * const p_end = buffer + len;
+    p_ctx->p_input_end = p_end;
+    bool more_lines;
+    do {
+        shell_ctx_reset(p_ctx);
+        char * p_newline = memchr(p_line, '\n', p_end - p_line);
+        const size_t line_len = (p_newline ? p_newline : p_end) - p_line;
+        more_lines = p_newline != NULL;
+        const long long lex_start = trace_begin();
+        const bool cached = plan_cache_lookup(&global_plans, p_ctx, p_line, line_len);
+        global_metrics.lines_read += 1;
+        if (cached) {
+            /* the scanner never saw this line, point it at the next one */
+            p_line += line_len + more_lines;
+            if (more_lines) lexer_open_buffer(p_ctx, p_line, p_end - p_line + 2);
+        } else {
+            more_lines = lexer_next_line(p_ctx);
+            global_metrics.tokens_lexed += p_ctx->tokens.npos;
+            char * p_next = lexer_cursor(p_ctx);
+            /* a quoted string ran on past the newline, not worth caching */
+            if (p_next != p_line + line_len + (p_newline != NULL)) p_ctx->plan_line = NULL;
+            p_line = p_next;
+        }
+        trace_end(TRACE_LEX, lex_start, NULL, cached);
+        p_ctx->p_input = p_line;
+        shell_eval(p_ctx);
+        if (p_ctx->p_input != p_line) {
+            /* heredoc bodies were taken from the input, skip over them */
+            p_line = p_ctx->p_input;
+            more_lines = p_line < p_end;
+            if (more_lines) lexer_open_buffer(p_ctx, p_line, p_end - p_line + 2);
+        }
+        job_notify(&global_jobs, false);
+    } while (more_lines && !p_ctx->exited);
+    lexer_close_buffer(p_ctx);
+}
 
-void shell_eval(vec_t * p_vec) {
-    /* special case, no parse error when the input contains nothing */
-    if (p_vec->npos == 0) return;
-    int prs_res = parse_builtin_cmds(p_vec);
-    if (prs_res != PARSE_ERROR && global_num_builtins != 0) {
-        eval_builtin_cmds(p_vec);
-        return;
-    } else if (prs_res == PARSE_ERROR) {
-        puts(PARSE_ERROR_MSG);
-        return;
+int shell_serve(const char * path, const char * metrics_path) {
+    /* one resident shell for many clients: each connection sends command
+       lines and gets back their output followed by one JSON line per
+       command line, with its exit status and, for a job, its rusage */
+    server_t server;
+    memset(&server, 0, sizeof(server_t));
+    server.metrics_fd = -1;
+    global_server = &server;
+    global_print_shell_context = false;
+    /* so that a connection's job can be signalled as a whole */
+    global_job_control = true;
+    /* a client that hangs up early must not take the server with it, the
+       jobs get the old mask back along with the rest (see events_init) */
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGPIPE);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    if (!vec_init(&server.conns, sizeof(serve_conn_t *)) || !serve_listen(&server, path)) {
+        perror("ERROR: serve");
+        return EXIT_FAILURE;
     }
-    if (global_num_commands == 1) {
-        command_t command;
-        memset(&command, 0, sizeof(command_t));
-        const int res = parse_single_command(p_vec, &command);
-        if (res == PARSE_ERROR) {
-            puts(PARSE_ERROR_MSG);
-            return;
-        }
-        int pid, status;
-        pid = launch_process(&command, PIPE_NONE, NULL, 0);
-        if (!global_bkg_proc) {
-            if (pid) {
-                waitpid(pid, &status, WUNTRACED | WCONTINUED);
-            }
-        } else {
-            global_bkg_proc = false;
+    if (metrics_path && ((server.metrics_fd = serve_socket(metrics_path)) == -1 ||
+                         !events_watch(&global_events, server.metrics_fd))) {
+        perror("ERROR: metrics");
+        return EXIT_FAILURE;
+    }
+    while (true) {
+        const int fd = events_next(&global_events);
+        if (fd == -1) {
+            events_wait(&global_events, -1);
+            serve_collect(&server);
+            continue;
         }
-        free(command.argv);
-    } else {
-        vec_t command_vec;
-        if (!vec_init(&command_vec, sizeof(command_t))) {
-            puts(VEC_INIT_ERROR_MSG);
-            exit(EXIT_FAILURE);
+        if (fd == server.listen_fd) {
+            serve_accept(&server);
+            events_watch(&global_events, server.listen_fd);
+            continue;
         }
-        const int res = parse_multiple_commands(p_vec, &command_vec);
-        if (res == PARSE_ERROR) {
-            puts(PARSE_ERROR_MSG);
-            return;
+        if (fd == server.metrics_fd) {
+            serve_metrics(&server);
+            events_watch(&global_events, server.metrics_fd);
+            continue;
         }
-        launch_process_chain(&command_vec);
-        vec_free(&command_vec, command_vec_clear_policy);
-    }
-}
-
-int parse_single_command(vec_t * p_vec, command_t * p_command) {
-    global_num_pipes = 0;
-    char ** vec_contents = (char **)p_vec->data;
-    if (p_vec->npos == 0) return PARSE_ERROR;
-    bool seen_command = false;
-    char next;
-    for (int idx = 0; idx < p_vec->npos; idx += 1) {
-        switch (vec_contents[idx][0]) {
-        case '<':
-            if (idx + 1 == p_vec->npos) return PARSE_ERROR;
-            next = vec_contents[idx + 1][0];
-            if (next == '>' || next == '<' || next == '|') return PARSE_ERROR;
-            if (!p_command->argv) {
-                p_command->argv = slice_argv_from_vec(p_vec, 0, idx - 1);
-            }
-            if (idx + 1 == p_vec->npos) return PARSE_ERROR;
-            p_command->src = vec_contents[idx + 1];
-            idx += 1;
-            break;
-            
-        case '>':
-            if (idx + 1 == p_vec->npos) return PARSE_ERROR;
-            next = vec_contents[idx + 1][0];
-            if (next == '>' || next == '<' || next == '|') return PARSE_ERROR;
-            if (!p_command->argv) {
-                p_command->argv = slice_argv_from_vec(p_vec, 0, idx - 1);
-            }
-            if (idx + 1 == p_vec->npos) return PARSE_ERROR;
-            p_command->dest = vec_contents[idx + 1];
-            idx += 1;
-            break;
-            
-        case '&':
-            if (idx + 1 != p_vec->npos) return PARSE_ERROR;
-            if (!p_command->argv) {
-                p_command->argv = slice_argv_from_vec(p_vec, 0, idx - 1);
-            }
-            global_bkg_proc = true;
-            break;
-            
-        default:
-            if (idx + 1 == p_vec->npos && !seen_command) {
-                if (!p_command->argv) {
-                    p_command->argv = slice_argv_from_vec(p_vec, 0, idx);
-                }
-                seen_command = true;
+        serve_conn_t ** conns = (serve_conn_t **)server.conns.data;
+        for (size_t i = 0; i < server.conns.npos; i += 1) {
+            if (conns[i]->fd != fd) continue;
+            serve_receive(conns[i]);
+            if (!serve_run(&server, conns[i])) {
+                serve_close(conns[i]);
+                conns[i] = conns[--server.conns.npos];
             }
             break;
         }
     }
-    return PARSE_SUCCESS;
 }
 
-int parse_multiple_commands(vec_t * restrict p_vec, vec_t * restrict p_command_vec) {
-    char ** token_vec_contents = (char **)p_vec->data;
-    command_t current_command;
-    memset(&current_command, 0, sizeof(command_t));
-    char current_first_character = token_vec_contents[0][0];
-    size_t command_start_idx = 0;
-    /* seek the end of the first command */
-    size_t idx = 0;
-    while (current_first_character != '|' &&
-           current_first_character != '<' &&
-           current_first_character != '&') {
-        if (current_first_character == '>') {
-            return PARSE_ERROR;
-        }
-        idx += 1;
-        current_first_character = token_vec_contents[idx][0];
+int serve_socket(const char * path) {
+    /* a listening unix socket at path, -1 with errno set on failure */
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
     }
-    current_command.argv = slice_argv_from_vec(p_vec, command_start_idx, idx - 1);
-    if (current_first_character == '<' && idx + 3 < p_vec->npos) {
-        current_command.src = token_vec_contents[idx + 1];
-        /* skip the file name, as well as the anticipated pipe */
-        idx += 2;
+    strcpy(addr.sun_path, path);
+#ifdef __linux__
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) return -1;
+#else
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) return -1;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+#endif
+    /* a socket left behind by an earlier server is replaced */
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, SOMAXCONN) == -1) {
+        const int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
     }
-    idx += 1;
-    command_start_idx = idx;
-    if (!vec_push(p_command_vec, &current_command)) {
-        puts(VEC_PUSH_ERROR_MSG);
-        exit(EXIT_FAILURE);
+    return fd;
+}
+
+int serve_accept_fd(const int listen_fd) {
+    /* the connection is close-on-exec from the start */
+#ifdef __linux__
+    return accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+#else
+    const int fd = accept(listen_fd, NULL, NULL);
+    if (fd != -1) fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+#endif
+}
+
+void serve_child(server_t * p_server) {
+    /* in a child that runs a builtin without an exec: none of the server's
+       descriptors may outlive the server's own use of them */
+    close(p_server->listen_fd);
+    if (p_server->metrics_fd != -1) close(p_server->metrics_fd);
+    close(p_server->null_fd);
+    for (int i = 0; i < 3; i += 1) {
+        if (p_server->saved_fds[i] != -1) close(p_server->saved_fds[i]);
     }
-    memset(&current_command, 0, sizeof(command_t));
-    bool seen_command = false;
-    char next;
-    for (; idx < p_vec->npos; idx += 1) {
-        switch (token_vec_contents[idx][0]) {
-        case '|':
-            if (!seen_command) return PARSE_ERROR;
-            if (idx + 1 == p_vec->npos) return PARSE_ERROR;
-            next = token_vec_contents[idx + 1][0];
-            if (next == '<' || next == '>' || next == '&') return PARSE_ERROR;
-            current_command.argv = slice_argv_from_vec(p_vec, command_start_idx, idx - 1);
-            command_start_idx = idx + 1;
-            if (!vec_push(p_command_vec, &current_command)) {
-                puts(VEC_PUSH_ERROR_MSG);
-                exit(EXIT_FAILURE);
-            }
-            memset(&current_command, 0, sizeof(command_t));
-            seen_command = false;
-            break;
-            
-        case '<':
-            return PARSE_ERROR;
-            
-        case '>':
-            if (!seen_command) return PARSE_ERROR;
-            if (idx + 1 == p_vec->npos) return PARSE_ERROR;
-            for (int inner_idx = idx; inner_idx < p_vec->npos - 1; inner_idx += 1) {
-                const char current_char = token_vec_contents[inner_idx][0];
-                if (current_char == '|') {
-                    return PARSE_ERROR;
-                }
-            }
-            next = token_vec_contents[idx + 1][0];
-            if (next == '<' || next == '>' || next == '&') return PARSE_ERROR;
-            current_command.argv = slice_argv_from_vec(p_vec, command_start_idx, idx - 1);
-            current_command.dest = token_vec_contents[idx + 1];
-            if (!vec_push(p_command_vec, &current_command)) {
-                puts(VEC_PUSH_ERROR_MSG);
-                exit(EXIT_FAILURE);
-            }
-            memset(&current_command, 0, sizeof(command_t));
-            seen_command = false;
-            idx += 1;
-            break;
-            
-        case '&':
-            if (idx + 1 != p_vec->npos) return PARSE_ERROR;
-            if (seen_command) {
-                current_command.argv = slice_argv_from_vec(p_vec, command_start_idx, idx - 1);
-                if (!vec_push(p_command_vec, &current_command)) {
-                    puts(VEC_PUSH_ERROR_MSG);
-                    exit(EXIT_FAILURE);
-                }
-                seen_command = false;
-            }
-            global_bkg_proc = true;
-            break;
-            
-        default:
-            if (!seen_command) {
-                command_start_idx = idx;
-                seen_command = true;
-            }
-            break;
-        }
+    serve_conn_t ** conns = (serve_conn_t **)p_server->conns.data;
+    for (size_t i = 0; i < p_server->conns.npos; i += 1) close(conns[i]->fd);
+}
+
+bool serve_listen(server_t * p_server, const char * path) {
+    p_server->null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (p_server->null_fd == -1) return false;
+    p_server->listen_fd = serve_socket(path);
+    if (p_server->listen_fd == -1) return false;
+    for (int i = 0; i < 3; i += 1) {
+        p_server->saved_fds[i] = fcntl(i, F_DUPFD_CLOEXEC, REDIR_SAVE_FD);
     }
-    if (seen_command) {
-        current_command.argv = slice_argv_from_vec(p_vec, command_start_idx, idx - 1);
-        if (!vec_push(p_command_vec, &current_command)) {
-            puts(VEC_PUSH_ERROR_MSG);
-            exit(EXIT_FAILURE);
-        }
+    return events_watch(&global_events, p_server->listen_fd);
+}
+
+void serve_accept(server_t * p_server) {
+    const int fd = serve_accept_fd(p_server->listen_fd);
+    if (fd == -1) return;
+    serve_conn_t * p_conn = calloc(1, sizeof(serve_conn_t));
+    if (!p_conn || !shell_ctx_init(&p_conn->ctx)) {
+        puts(CTX_INIT_ERROR_MSG);
+        free(p_conn);
+        close(fd);
+        return;
+    }
+    p_conn->fd = fd;
+    p_conn->p_out = fdopen(fd, "w");
+    p_conn->ctx.serving = true;
+    p_conn->ctx.p_report = p_conn->p_out;
+    if (!p_conn->p_out || !events_watch(&global_events, fd) ||
+        !vec_push(&p_server->conns, &p_conn)) {
+        puts(VEC_PUSH_ERROR_MSG);
+        serve_close(p_conn);
     }
-    return PARSE_SUCCESS;
 }
 
-void launch_process_chain(vec_t * p_vec) {
-    command_t * commands = (command_t *)p_vec->data;
-    const int num_commands = p_vec->npos;
-    global_num_pipes = num_commands;
-    int fd[2 * num_commands];
-    int idx;
-    for (idx = 0; idx < num_commands; idx += 1) {
-        pipe(&fd[2 * idx]);
+void serve_metrics(server_t * p_server) {
+    /* the whole text fits in the socket buffer, so a scraper that never
+       reads cannot hold the server up */
+    const int fd = serve_accept_fd(p_server->metrics_fd);
+    if (fd == -1) return;
+    FILE * p_out = fdopen(fd, "w");
+    if (!p_out) {
+        close(fd);
+        return;
     }
-    int pids[num_commands];
-    int status;
-    memset(pids, 0, num_commands * sizeof(int));
-    /* launch the first process, it cannot have input piped in */
-    pids[0] = launch_process(&commands[0], PIPE_OUT, fd, 0);
-    for (idx = 1; idx < num_commands - 1; idx += 1) {
-        pids[idx] = launch_process(&commands[idx], PIPE_OUT | PIPE_IN, fd, idx);
+    metrics_print(p_out, true);
+    fclose(p_out);
+}
+
+void serve_receive(serve_conn_t * p_conn) {
+    /* one read per wakeup, whatever it brings is appended */
+    if (p_conn->capacity - p_conn->len < READ_BLOCK_SIZE) {
+        char * data = realloc(p_conn->data, p_conn->len + READ_BLOCK_SIZE);
+        if (!data) {
+            p_conn->eof = true;
+            return;
+        }
+        p_conn->data = data;
+        p_conn->capacity = p_conn->len + READ_BLOCK_SIZE;
     }
-    pids[idx] = launch_process(&commands[idx], PIPE_IN, fd, idx);
-    for (idx = 0; idx < num_commands * 2; idx += 1) {
-        close(fd[idx]);
+    const ssize_t res = read(p_conn->fd, p_conn->data + p_conn->len, READ_BLOCK_SIZE);
+    if (res > 0) {
+        p_conn->len += res;
+    } else if (res == 0 || errno != EINTR) {
+        p_conn->eof = true;
     }
-    if (!global_bkg_proc) {
-        /* if not a bkg proc chain, wait for all of the commands to finish */
-        for (idx = 0; idx < num_commands; idx += 1) {
-            if (pids[idx]) {
-                waitpid(pids[idx], &status, WUNTRACED | WCONTINUED);
+}
+
+bool serve_run(server_t * p_server, serve_conn_t * p_conn) {
+    /* evaluates the complete lines received so far, until one of them
+       starts a job; returns false once the connection is finished with */
+    shell_ctx_t * p_ctx = &p_conn->ctx;
+    while (!p_ctx->p_job && !p_ctx->exited) {
+        char * p_newline = memchr(p_conn->data, '\n', p_conn->len);
+        if (!p_newline && (!p_conn->eof || p_conn->len == 0)) break;
+        const size_t line_len = p_newline ? (size_t)(p_newline - p_conn->data) + 1 : p_conn->len;
+        shell_ctx_reset(p_ctx);
+        if (p_conn->line.capacity < line_len + 2) {
+            char * data = realloc(p_conn->line.data, line_len + 2);
+            if (!data) return false;
+            p_conn->line.data = data;
+            p_conn->line.capacity = line_len + 2;
+        }
+        memcpy(p_conn->line.data, p_conn->data, line_len);
+        p_conn->line.len = line_len;
+        shell_scan(p_ctx, &p_conn->line);
+        /* heredoc bodies come from what the client has sent so far */
+        p_ctx->p_input = p_conn->data + line_len;
+        p_ctx->p_input_end = p_conn->data + p_conn->len;
+        /* the line's output, and any error it causes, go to the client */
+        dup2(p_server->null_fd, STDIN_FILENO);
+        dup2(p_conn->fd, STDOUT_FILENO);
+        dup2(p_conn->fd, STDERR_FILENO);
+        shell_eval(p_ctx);
+        fflush(stdout);
+        fflush(stderr);
+        for (int i = 0; i < 3; i += 1) dup2(p_server->saved_fds[i], i);
+        const size_t used = p_ctx->p_input - p_conn->data;
+        p_conn->len -= used;
+        memmove(p_conn->data, p_conn->data + used, p_conn->len);
+        if (!p_ctx->p_job) {
+            fprintf(p_conn->p_out, "{\"status\":%d}\n", p_ctx->last_status);
+            fflush(p_conn->p_out);
+        }
+    }
+    /* a running job holds back the rest, serve_collect carries on */
+    if (p_ctx->p_job) return true;
+    if (p_ctx->exited || p_conn->eof) return false;
+    return events_watch(&global_events, p_conn->fd);
+}
+
+void serve_collect(server_t * p_server) {
+    /* reports the jobs that finished; a line run in the meantime (wait, say)
+       may have reaped more, so this goes on until nothing is left, and only
+       then are the jobs recycled */
+    bool progress = true;
+    while (progress) {
+        progress = false;
+        serve_conn_t ** conns = (serve_conn_t **)p_server->conns.data;
+        for (size_t i = 0; i < p_server->conns.npos; i += 1) {
+            shell_ctx_t * p_ctx = &conns[i]->ctx;
+            job_t * p_job = p_ctx->p_job;
+            if (!p_job || p_job->num_live > 0) continue;
+            p_ctx->last_status = wait_status_code(p_job->procs[p_job->num_procs - 1].status);
+            job_log_usage(p_job, conns[i]->p_out);
+            fflush(conns[i]->p_out);
+            p_ctx->p_job = NULL;
+            progress = true;
+            if (!serve_run(p_server, conns[i])) {
+                serve_close(conns[i]);
+                conns[i--] = conns[--p_server->conns.npos];
             }
         }
+    }
+    job_flush(&global_jobs, false);
+}
+
+void serve_close(serve_conn_t * p_conn) {
+    /* a job still running is left to finish on its own, and nobody is
+       left to tell about its background ones */
+    for (int i = 0; i < global_jobs.num_slots; i += 1) {
+        job_t * p_job = global_jobs.jobs[i];
+        if (p_job && p_job->p_report == p_conn->p_out) p_job->p_report = NULL;
+    }
+    events_unwatch(&global_events, p_conn->fd);
+    if (p_conn->p_out) {
+        fclose(p_conn->p_out);
     } else {
-        global_bkg_proc = false;
+        close(p_conn->fd);
     }
+    shell_ctx_free(&p_conn->ctx);
+    free(p_conn->data);
+    free(p_conn->line.data);
+    free(p_conn);
 }
 
-int launch_process(command_t * p_command, const int options, int fd[], int idx) {
-    enum pid_kind {
-        child = 0,
-        error = -1
-    };
-    int pid = fork();
-    switch (pid) {
-    case child:
-        if (p_command->dest) {
-            FILE * p_target = fopen(p_command->dest, "w");
-            fclose(stdout);
-            dup(fileno(p_target));
-            if (p_target) {
-                fclose(p_target);
+char * read_script(const char * path, size_t * p_len) {
+    const int fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+    if (fd == -1) return NULL;
+    struct stat st;
+    size_t capacity = READ_BLOCK_SIZE;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        capacity = (size_t)st.st_size + READ_BLOCK_SIZE;
+    }
+    char * buffer = malloc(capacity);
+    size_t len = 0;
+    while (buffer) {
+        /* always leave room for the two NULs that the scanner wants */
+        if (capacity - len < READ_BLOCK_SIZE + 2) {
+            char * new_buffer = realloc(buffer, capacity * 2);
+            if (!new_buffer) {
+                free(buffer);
+                buffer = NULL;
+                break;
             }
+            buffer = new_buffer;
+            capacity *= 2;
         }
-        if (options & PIPE_OUT) {
-            dup2(fd[idx * 2 + 1], STDOUT_FILENO);
+        const ssize_t res = read(fd, buffer + len, capacity - len - 2);
+        if (res > 0) {
+            len += res;
+        } else if (res == 0) {
+            break;
+        } else if (errno != EINTR) {
+            free(buffer);
+            buffer = NULL;
         }
-        if (p_command->src) {
-            FILE * p_source = fopen(p_command->src, "r");
-            fclose(stdin);
-            dup(fileno(p_source));
-            if (p_source) {
-                fclose(p_source);
-            }
+    }
+    if (fd != STDIN_FILENO) close(fd);
+    if (!buffer) return NULL;
+    buffer[len] = buffer[len + 1] = '\0';
+    *p_len = len;
+    return buffer;
+}
+
+char * copy_script(const char * str, size_t * p_len) {
+    const size_t len = strlen(str);
+    char * buffer = malloc(len + 2);
+    if (!buffer) return NULL;
+    memcpy(buffer, str, len);
+    buffer[len] = buffer[len + 1] = '\0';
+    *p_len = len;
+    return buffer;
+}
+
+bool parse_size(const char * str, size_t * p_size) {
+    /* a byte count with an optional k or m suffix */
+    char * p_end;
+    const unsigned long value = strtoul(str, &p_end, 10);
+    if (p_end == str) return false;
+    switch (*p_end) {
+    case '\0': *p_size = value; return true;
+    case 'k': case 'K': *p_size = value << 10; break;
+    case 'm': case 'M': *p_size = value << 20; break;
+    default: return false;
+    }
+    return p_end[1] == '\0';
+}
+
+int pipe_open(int fd[2]) {
+    /* close-on-exec from the start, so that an exec'd stage only keeps the
+       ends it dup'd onto its stdin and stdout, whatever else is open */
+#ifdef __linux__
+    if (pipe2(fd, O_CLOEXEC) == -1) return -1;
+#else
+    if (pipe(fd) == -1) return -1;
+    fcntl(fd[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fd[1], F_SETFD, FD_CLOEXEC);
+#endif
+    return 0;
+}
+
+void set_pipe_size(const int fd) {
+    /* fewer context switches between stages that move a lot of data; past
+       fs.pipe-max-size or the per-user quota the kernel refuses, and the
+       pipe simply keeps its default capacity */
+#ifdef F_SETPIPE_SZ
+    if (global_pipe_size) fcntl(fd, F_SETPIPE_SZ, (int)global_pipe_size);
+#else
+    (void)fd;
+#endif
+}
+
+int here_open(const char * doc, const size_t len) {
+    /* returns a descriptor that reads back doc, a pipe when it fits in one
+       write and otherwise an anonymous memory file, never a temp file */
+    int fd;
+    if (len <= PIPE_BUF) {
+        int here_pipe[2];
+        if (pipe_open(here_pipe) == -1) {
+            perror("ERROR: heredoc");
+            return -1;
         }
-        if (options & PIPE_IN) {
-            /* negative index because the input comes from the previous command */
-            dup2(fd[idx * 2 - 2], STDIN_FILENO);
+        const ssize_t res = write(here_pipe[1], doc, len);
+        close(here_pipe[1]);
+        if (res != (ssize_t)len) {
+            perror("ERROR: heredoc");
+            close(here_pipe[0]);
+            return -1;
         }
-        /* close all file descriptors */
-        for (int i = 0; i < global_num_pipes * 2; i++) {
-            close(fd[i]);
+        fd = here_pipe[0];
+    } else {
+#ifdef __linux__
+        fd = memfd_create("heredoc", MFD_CLOEXEC);
+#else
+        char path[] = "/tmp/myshell-heredoc-XXXXXX";
+        fd = mkstemp(path);
+        if (fd != -1) unlink(path);
+#endif
+        if (fd == -1) {
+            perror("ERROR: heredoc");
+            return -1;
         }
-        execvp(p_command->argv[0], p_command->argv);
-        perror("ERROR: exec");
-        exit(EXIT_FAILURE);
-        
-    case error:
-        perror("ERROR: fork");
-        return error;
+        size_t written = 0;
+        while (written < len) {
+            const ssize_t res = write(fd, doc + written, len - written);
+            if (res == -1 && errno == EINTR) continue;
+            if (res <= 0) {
+                perror("ERROR: heredoc");
+                close(fd);
+                return -1;
+            }
+            written += res;
+        }
+        lseek(fd, 0, SEEK_SET);
     }
-    return pid;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
 }
 
-char ** slice_argv_from_vec(vec_t * p_vec,
-                            const size_t start_pos,
-                            const size_t end_pos) {
-    const size_t cp_size = sizeof(char *);
-    const size_t len = (end_pos + 2 - start_pos) * cp_size;
-    char ** argv = malloc(len);
-    memcpy(argv, p_vec->data + start_pos * cp_size, len - cp_size);
-    argv[len / cp_size - 1] = NULL;
-    return argv;
+void heredoc_read(shell_ctx_t * p_ctx, command_t * p_command) {
+    /* the body is every line up to one that is just the delimiter, or up to
+       the end of the input, like bash does */
+    const char * delim = p_command->here_delim;
+    const size_t delim_len = strlen(delim);
+    p_command->here_delim = NULL;
+    if (p_ctx->p_input) {
+        /* batch input stays around, so the body is left where it is */
+        char * p_body = p_ctx->p_input;
+        char * p_line = p_body;
+        char * const p_end = p_ctx->p_input_end;
+        while (p_line < p_end) {
+            char * p_newline = memchr(p_line, '\n', p_end - p_line);
+            const size_t line_len = (p_newline ? p_newline : p_end) - p_line;
+            char * p_next = p_newline ? p_newline + 1 : p_end;
+            if (line_len == delim_len && memcmp(p_line, delim, delim_len) == 0) {
+                p_command->here = p_body;
+                p_command->here_len = p_line - p_body;
+                p_ctx->p_input = p_next;
+                heredoc_shadow(p_command);
+                return;
+            }
+            p_line = p_next;
+        }
+        p_command->here = p_body;
+        p_command->here_len = p_end - p_body;
+        p_ctx->p_input = p_end;
+        heredoc_shadow(p_command);
+        return;
+    }
+    vec_t body;
+    vec_init_arena(&body, &p_ctx->arena, 1);
+    char * line = NULL;
+    size_t capacity = 0;
+    while (true) {
+        if (global_print_shell_context) fputs("> ", stdout);
+        fflush(stdout);
+        const ssize_t len = getline(&line, &capacity, stdin);
+        if (len <= 0) break;
+        const size_t line_len = len - (line[len - 1] == '\n');
+        if (line_len == delim_len && memcmp(line, delim, delim_len) == 0) break;
+        if (!vec_reserve(&body, body.npos + len)) {
+            puts(VEC_PUSH_ERROR_MSG);
+            exit(EXIT_FAILURE);
+        }
+        memcpy(body.data + body.npos, line, len);
+        body.npos += len;
+    }
+    free(line);
+    p_command->here = body.data;
+    p_command->here_len = body.npos;
+    heredoc_shadow(p_command);
 }
 
-int vec_init(vec_t * p_vec, const size_t elem_size) {
-    p_vec->data = calloc(1, elem_size);
-    if (!p_vec->data) return 0;
-    p_vec->len = elem_size;
-    p_vec->npos = 0;
-    p_vec->elem_size = elem_size;
-    return 1;
+void heredoc_shadow(command_t * p_command) {
+    /* any redirection of stdin still in the list came after the heredoc
+       (see parse_drop_stdin), so the body was read only to skip it */
+    for (int i = 0; i < p_command->num_redirs; i += 1) {
+        if (p_command->redirs[i].fd == STDIN_FILENO) p_command->here = NULL;
+    }
 }
 
-int vec_push(vec_t * p_vec, const void * p_element) {
-    const size_t elem_size = p_vec->elem_size;
-    if (p_vec->len >= (p_vec->npos + 1) * elem_size) {
-        memcpy(p_vec->data + p_vec->npos * elem_size, p_element, elem_size);
-        p_vec->npos += 1;
+int redir_parse(const token_t * p_op, char * path, redir_t * p_redir) {
+    /* decodes a redirection operator, returns how many entries it took */
+    const char * op = p_op->text;
+    const char * const p_end = op + p_op->len;
+    const bool both = op[0] == '&';
+    int fd = -1;
+    if (both) {
+        op += 1;
+    } else if (op[0] >= '0' && op[0] <= '9') {
+        fd = op[0] - '0';
+        op += 1;
+    }
+    const bool input = op[0] == '<';
+    if (fd == -1) fd = input ? STDIN_FILENO : STDOUT_FILENO;
+    p_redir->fd = fd;
+    if (p_op->tag == TOK_REDIR_DUP) {
+        p_redir->path = NULL;
+        p_redir->flags = 0;
+        p_redir->dup_fd = p_end[-1] - '0';
+        return 1;
+    }
+    p_redir->path = path;
+    p_redir->dup_fd = -1;
+    if (input) {
+        p_redir->flags = O_RDONLY;
     } else {
-        char * new_data = malloc(p_vec->len * VEC_GROWTH_RATE);
-        if (!new_data) return 0;
-        memcpy(new_data, p_vec->data, p_vec->len);
-        free(p_vec->data);
-        p_vec->data = new_data;
-        memcpy(p_vec->data + p_vec->npos * elem_size, p_element, elem_size);
-        p_vec->npos += 1;
-        p_vec->len *= VEC_GROWTH_RATE;
+        p_redir->flags = O_WRONLY | O_CREAT | (p_end - op == 2 ? O_APPEND : O_TRUNC);
     }
-    return 1;
+    if (!both) return 1;
+    /* &> is > followed by 2>&1 */
+    p_redir[1].path = NULL;
+    p_redir[1].flags = 0;
+    p_redir[1].fd = STDERR_FILENO;
+    p_redir[1].dup_fd = STDOUT_FILENO;
+    return 2;
 }
 
-void vec_clear(vec_t * p_vec, void (* policy)(vec_t *)) {
-    policy(p_vec);
-    p_vec->npos = 0;
+int redir_apply(const redir_t * p_redir) {
+    /* raw descriptors only, returns -1 with errno set on failure */
+    if (!p_redir->path) {
+        return dup2(p_redir->dup_fd, p_redir->fd) == -1 ? -1 : 0;
+    }
+    const int fd = open(p_redir->path, p_redir->flags | O_CLOEXEC, 0666);
+    if (fd == -1) return -1;
+    if (fd == p_redir->fd) {
+        /* opened straight into the free slot, dup2 won't clear the flag */
+        fcntl(fd, F_SETFD, 0);
+        return 0;
+    }
+    const int res = dup2(fd, p_redir->fd);
+    close(fd);
+    return res == -1 ? -1 : 0;
 }
 
-void vec_free(vec_t * p_vec, void (* policy)(vec_t *)) {
-    policy(p_vec);
-    p_vec->npos = 0;
-    free(p_vec->data);
-}
-
-/* FOR REFERENCE: FLEX SOURCE CODE */
-/* %{ */
-/* vec_t * p_global_lexer_target; */
-/* %} */
-/* %option noyywrap */
-/* %option nounput */
-/* %option noinput */
-/* %% */
-/* "cd"                  { */
-/*                           char * tok = strdup(yytext); */
-/*                           vec_push(p_global_lexer_target, &tok); */
-/*                           global_builtin_idxs[CMD_CD] = global_num_commands - 1; */
-/*                           global_num_builtins += 1; */
-/*                       } */
-/* "exit"                { */
-/*                           char * tok = strdup(yytext); */
-/*                           vec_push(p_global_lexer_target, &tok); */
-/*                           global_builtin_idxs[CMD_EXIT] = global_num_commands - 1; */
-/*                           global_num_builtins += 1; */
-/*                       } */
-/* "|"                   { */
-/*                           char * tok = strdup(yytext); */
-/*                           vec_push(p_global_lexer_target, &tok); */
-/*                           global_num_commands += 1; */
-/*                       } */
-/* "<"|">"|"&"           { */
-/*                           char * tok = strdup(yytext); */
-/*                           vec_push(p_global_lexer_target, &tok); */
-/*                       } */
-/* [a-zA-Z0-9~@:_/.-]+   { */
-/*                           char * tok = strdup(yytext); */
-/*                           vec_push(p_global_lexer_target, &tok); */
-/*                       } */
-/* [ \n\t]+ /\* Ignore whitespace... *\/ */
-/* %% */
-/* YY_BUFFER_STATE global_buffer_state; */
-/* void lexer_set_target(vec_t * p_target) { */
-/*     p_global_lexer_target = p_target; */
-/* } */
-/* void lexer_parse_buffer(char * buffer) { */
-/*     yy_scan_buffer(buffer, READ_BUFFER_SIZE); */
-/*     yylex(); */
-/*     yy_delete_buffer(YY_CURRENT_BUFFER); */
-/* } */
-
-#line 3 "lex.yy.c"
-
-#define  YY_INT_ALIGNED short int
-
-/* A lexical scanner generated by flex */
-
-#define FLEX_SCANNER
-#define YY_FLEX_MAJOR_VERSION 2
-#define YY_FLEX_MINOR_VERSION 5
-#define YY_FLEX_SUBMINOR_VERSION 35
-#if YY_FLEX_SUBMINOR_VERSION > 0
-#define FLEX_BETA
-#endif
+void redir_report(FILE * p_out, const redir_t * p_redir) {
+    if (p_redir->path) {
+        fprintf(p_out, "ERROR: %s: %s\n", p_redir->path, strerror(errno));
+    } else {
+        fprintf(p_out, "ERROR: %d: %s\n", p_redir->dup_fd, strerror(errno));
+    }
+}
 
-/* First, we deal with  platform-specific or compiler-specific issues. */
+enum _parse {
+    PARSE_SUCCESS,
+    PARSE_ERROR,
+};
 
-/* begin standard C headers. */
-#include <stdio.h>
-#include <string.h>
-#include <errno.h>
-#include <stdlib.h>
+enum _parse_state {
+    STATE_START,    /* a command name has to come next */
+    STATE_ARGS,     /* in a command, after its name */
+    STATE_REDIR,    /* after <, > and the like, the file name comes next */
+    STATE_HEREDOC,  /* after <<, the delimiter has to come next */
+    STATE_HERE_STR, /* after <<<, the string has to come next */
+    STATE_BKG,      /* after &, only the end of the line may follow */
+    NUM_PARSE_STATES
+};
 
-/* end standard C headers. */
+enum _parse_action {
+    ACT_ERROR,
+    ACT_ARG,
+    ACT_REDIR,
+    ACT_HEREDOC,
+    ACT_HERE_STR,
+    ACT_PIPE,
+    ACT_BKG,
+    ACT_END,
+    ACT_NONE
+};
 
-/* flex integer type definitions */
+typedef struct parse_transition_t {
+    unsigned char state;
+    unsigned char action;
+} parse_transition_t;
+
+/* indexed by state and token tag, anything missing is a parse error */
+static const parse_transition_t PARSE_TABLE[NUM_PARSE_STATES][NUM_TOKEN_TAGS] = {
+    [STATE_START] = {
+        [TOK_WORD] = {STATE_ARGS, ACT_ARG}
+    },
+    [STATE_ARGS] = {
+        [TOK_WORD] = {STATE_ARGS, ACT_ARG},
+        [TOK_PIPE] = {STATE_START, ACT_PIPE},
+        [TOK_REDIR] = {STATE_REDIR, ACT_NONE},
+        [TOK_REDIR_DUP] = {STATE_ARGS, ACT_REDIR},
+        [TOK_HEREDOC] = {STATE_HEREDOC, ACT_NONE},
+        [TOK_HERE_STR] = {STATE_HERE_STR, ACT_NONE},
+        [TOK_BKG] = {STATE_BKG, ACT_BKG},
+        [TOK_END] = {STATE_START, ACT_END}
+    },
+    [STATE_REDIR] = {
+        [TOK_WORD] = {STATE_ARGS, ACT_REDIR}
+    },
+    [STATE_HEREDOC] = {
+        [TOK_WORD] = {STATE_ARGS, ACT_HEREDOC}
+    },
+    [STATE_HERE_STR] = {
+        [TOK_WORD] = {STATE_ARGS, ACT_HERE_STR}
+    },
+    [STATE_BKG] = {
+        [TOK_END] = {STATE_START, ACT_END}
+    }
+};
 
-#ifndef FLEXINT_H
-#define FLEXINT_H
+size_t builtin_hash_name(const char * name, const size_t seed) {
+    size_t hash = 2166136261u ^ seed;
+    while (*name) {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+    return hash & (BUILTIN_SLOTS - 1);
+}
 
-/* C99 systems have <inttypes.h>. Non-C99 systems may or may not. */
+bool builtin_table_init(builtin_table_t * p_table) {
+    /* tries seeds until no two names share a slot, so that a lookup is one
+       hash and at most one string compare */
+    const size_t num_builtins = sizeof(BUILTIN_LIST) / sizeof(builtin_t);
+    for (size_t seed = 0; seed < 1024; seed += 1) {
+        memset(p_table->slots, 0, sizeof(p_table->slots));
+        size_t i;
+        for (i = 0; i < num_builtins; i += 1) {
+            const size_t slot = builtin_hash_name(BUILTIN_LIST[i].name, seed);
+            if (p_table->slots[slot]) break;
+            p_table->slots[slot] = &BUILTIN_LIST[i];
+        }
+        if (i == num_builtins) {
+            p_table->seed = seed;
+            return true;
+        }
+    }
+    return false;
+}
 
-#if defined (__STDC_VERSION__) && __STDC_VERSION__ >= 199901L
+const builtin_t * builtin_find(builtin_table_t * p_table, const char * name) {
+    const builtin_t * p_builtin = p_table->slots[builtin_hash_name(name, p_table->seed)];
+    return p_builtin && strcmp(p_builtin->name, name) == 0 ? p_builtin : NULL;
+}
 
-/* C99 says to define __STDC_LIMIT_MACROS before including stdint.h,
- * if you want the limit (max/min) macros for int types. 
- */
-#ifndef __STDC_LIMIT_MACROS
-#define __STDC_LIMIT_MACROS 1
-#endif
+const builtin_t * command_builtin(const char * name) {
+    /* a function comes before a builtin of the same name, as in sh */
+    if (function_find(&global_functions, name)) return &FUNCTION_BUILTIN;
+    return builtin_find(&global_builtins, name);
+}
 
-#include <inttypes.h>
-typedef int8_t flex_int8_t;
-typedef uint8_t flex_uint8_t;
-typedef int16_t flex_int16_t;
-typedef uint16_t flex_uint16_t;
-typedef int32_t flex_int32_t;
-typedef uint32_t flex_uint32_t;
-typedef uint64_t flex_uint64_t;
-#else
-typedef signed char flex_int8_t;
-typedef short int flex_int16_t;
-typedef int flex_int32_t;
-typedef unsigned char flex_uint8_t; 
-typedef unsigned short int flex_uint16_t;
-typedef unsigned int flex_uint32_t;
-#endif /* ! C99 */
-
-/* Limits of integral types. */
-#ifndef INT8_MIN
-#define INT8_MIN               (-128)
-#endif
-#ifndef INT16_MIN
-#define INT16_MIN              (-32767-1)
-#endif
-#ifndef INT32_MIN
-#define INT32_MIN              (-2147483647-1)
-#endif
-#ifndef INT8_MAX
-#define INT8_MAX               (127)
-#endif
-#ifndef INT16_MAX
-#define INT16_MAX              (32767)
-#endif
-#ifndef INT32_MAX
-#define INT32_MAX              (2147483647)
-#endif
-#ifndef UINT8_MAX
-#define UINT8_MAX              (255U)
-#endif
-#ifndef UINT16_MAX
-#define UINT16_MAX             (65535U)
-#endif
-#ifndef UINT32_MAX
-#define UINT32_MAX             (4294967295U)
-#endif
+int builtin_argc(char ** argv) {
+    int argc = 0;
+    while (argv[argc]) argc += 1;
+    return argc;
+}
 
-#endif /* ! FLEXINT_H */
+int run_builtin(shell_ctx_t * p_ctx, const builtin_t * p_builtin, command_t * p_command) {
+    /* a builtin that is the whole line runs in the shell itself, with its
+       redirections applied to the shell's own descriptors meanwhile */
+    fflush(stdout);
+    fflush(stderr);
+    const int num_redirs = p_command->num_redirs;
+    /* what each redirected descriptor was before, -1 if it was closed; the
+       descriptors are noted too, a function resets the arena they are in */
+    int saved[num_redirs + 1];
+    int fds[num_redirs + 1];
+    int saved_in = -1;
+    if (p_command->here) {
+        const int fd = here_open(p_command->here, p_command->here_len);
+        if (fd == -1) return 1;
+        saved_in = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, REDIR_SAVE_FD);
+        dup2(fd, STDIN_FILENO);
+        close(fd);
+    }
+    int applied = 0;
+    int failed = -1;
+    while (applied < num_redirs) {
+        const redir_t * p_redir = &p_command->redirs[applied];
+        fds[applied] = p_redir->fd;
+        saved[applied] = fcntl(p_redir->fd, F_DUPFD_CLOEXEC, REDIR_SAVE_FD);
+        applied += 1;
+        if (redir_apply(p_redir) == -1) {
+            failed = errno;
+            break;
+        }
+    }
+    int status = 1;
+    if (failed == -1) {
+        const long long start = trace_begin();
+        status = p_builtin->fn(p_ctx, builtin_argc(p_command->argv), p_command->argv);
+        trace_end(TRACE_BUILTIN, start, p_builtin->name, status);
+        fflush(stdout);
+        fflush(stderr);
+    }
+    /* undone backwards, so a descriptor redirected twice ends up where it
+       was before the first */
+    for (int i = applied - 1; i >= 0; i -= 1) {
+        if (saved[i] == -1) {
+            close(fds[i]);
+        } else {
+            dup2(saved[i], fds[i]);
+            close(saved[i]);
+        }
+    }
+    if (saved_in != -1) {
+        dup2(saved_in, STDIN_FILENO);
+        close(saved_in);
+    }
+    /* whatever stdio read ahead from a redirected stdin is of no use now */
+    if (saved_in != -1 || applied) clearerr(stdin);
+    if (failed != -1) {
+        errno = failed;
+        redir_report(stdout, &p_command->redirs[applied - 1]);
+    }
+    return status;
+}
+
+int fork_builtin(shell_ctx_t * p_ctx, command_t * p_command, const builtin_t * p_builtin,
+                 const pipe_ends_t * p_pipe) {
+    /* a builtin between pipes or in the background gets a child of its own,
+       without the exec a spawned command would need */
+    const pid_t pid = fork();
+    if (pid >= 0 && p_ctx->job_pgid >= 0) setpgid(pid, p_ctx->job_pgid);
+    if (pid == 0) {
+        if (p_ctx->job_foreground && p_ctx->job_pgid == 0) tcsetpgrp(STDIN_FILENO, getpid());
+        events_child(&global_events);
+        child_redirect(p_ctx, p_command, p_pipe);
+        if (global_server) serve_child(global_server);
+        /* anything it runs (a function can run jobs) is waited for here,
+           without the terminal */
+        global_tty_input = global_job_control = p_ctx->serving = false;
+        const int status = p_builtin->fn(p_ctx, builtin_argc(p_command->argv), p_command->argv);
+        fflush(stdout);
+        _exit(status);
+    }
+    if (pid == -1) perror("ERROR: fork");
+    return pid;
+}
 
-#ifdef __cplusplus
+int builtin_exit(shell_ctx_t * p_ctx, int argc, char ** argv) {
+    /* without an argument, the status of the last command */
+    const int status = argc > 1 ? atoi(argv[1]) & 255 : p_ctx->last_status;
+    if (p_ctx->serving || p_ctx->batch) {
+        p_ctx->exited = true;
+        return status;
+    }
+    shell_ctx_free(p_ctx);
+    exit(status);
+}
+
+int builtin_cd(shell_ctx_t * p_ctx, int argc, char ** argv) {
+    const char * dir;
+    switch (argc) {
+    case 1:
+        dir = var_get(&global_vars, "HOME", 4);
+        if (!dir) {
+            struct passwd * pw = getpwuid(getuid());
+            dir = pw->pw_dir;
+        }
+        break;
 
-/* The "const" storage-class-modifier is valid. */
-#define YY_USE_CONST
+    case 2:
+        dir = argv[1];
+        break;
 
-#else   /* ! __cplusplus */
+    default:
+        puts("ERROR: usage: cd <dir>");
+        return 2;
+    }
+    if (chdir(dir) == -1) {
+        perror("ERROR: cd");
+        return 1;
+    }
+    return 0;
+}
 
-/* C99 requires __STDC__ to be defined as 1. */
-#if defined (__STDC__)
+int builtin_hash(shell_ctx_t * p_ctx, int argc, char ** argv) {
+    if (argc == 1) {
+        hash_print(&global_hash_table);
+        return 0;
+    }
+    int status = 0;
+    for (int i = 1; i < argc; i += 1) {
+        if (strcmp(argv[i], "-r") == 0) {
+            hash_clear(&global_hash_table);
+        } else if (!hash_lookup(&global_hash_table, argv[i], true)) {
+            printf("ERROR: hash: %s: not found\n", argv[i]);
+            status = 1;
+        }
+    }
+    return status;
+}
 
-#define YY_USE_CONST
+int builtin_stats(shell_ctx_t * p_ctx, int argc, char ** argv) {
+    /* stats -p prints the counters as Prometheus text instead */
+    const bool prometheus = argc == 2 && strcmp(argv[1], "-p") == 0;
+    if (argc > 1 && !prometheus) {
+        puts("ERROR: usage: stats [-p]");
+        return 1;
+    }
+    if (!prometheus) printf("arena_blocks %zu\n", p_ctx->arena.num_blocks);
+    metrics_print(stdout, prometheus);
+    return 0;
+}
 
-#endif  /* defined (__STDC__) */
-#endif  /* ! __cplusplus */
+int builtin_jobs(shell_ctx_t * p_ctx, int argc, char ** argv) {
+    const bool show_pids = argc > 1 && strcmp(argv[1], "-l") == 0;
+    job_reap(&global_jobs);
+    for (int i = 0; i < global_jobs.num_slots; i += 1) {
+        if (global_jobs.jobs[i]) job_print(stdout, global_jobs.jobs[i], show_pids);
+    }
+    return 0;
+}
 
-#ifdef YY_USE_CONST
-#define yyconst const
-#else
-#define yyconst
-#endif
+int builtin_wait(shell_ctx_t * p_ctx, int argc, char ** argv) {
+    if (argc == 1) {
+        for (int i = 0; i < global_jobs.num_slots; i += 1) {
+            job_t * p_job = global_jobs.jobs[i];
+            if (p_job && p_job->is_bkg && p_job->num_live > p_job->num_stopped) {
+                job_wait(&global_jobs, p_job);
+            }
+        }
+        return 0;
+    }
+    int status = 0;
+    for (int i = 1; i < argc; i += 1) {
+        job_t * p_job = NULL;
+        if (argv[i][0] == '%') {
+            p_job = job_find(&global_jobs, argv[i]);
+        } else {
+            p_job = job_find_pid(&global_jobs, (pid_t)atol(argv[i]));
+        }
+        if (!p_job) {
+            printf("ERROR: wait: %s: no such job\n", argv[i]);
+            status = 127;
+            continue;
+        }
+        status = job_wait(&global_jobs, p_job);
+    }
+    return status;
+}
 
-/* Returned upon end-of-file. */
-#define YY_NULL 0
+job_t * resume_job(const char * name, int argc, char ** argv, const bool foreground) {
+    job_reap(&global_jobs);
+    job_t * p_job = argc > 1 ? job_find(&global_jobs, argv[1]) : job_current(&global_jobs);
+    if (!p_job || p_job->num_live == 0) {
+        printf("ERROR: %s: no such job\n", name);
+        return NULL;
+    }
+    /* the terminal first, or the job would stop again as soon as it reads */
+    if (foreground && p_job->pgid != getpgrp()) terminal_hand_over(p_job->pgid);
+    job_continue(p_job);
+    return p_job;
+}
 
-/* Promotes a possibly negative, possibly signed char to an unsigned
- * integer for use as an array index.  If the signed char is negative,
- * we want to instead treat it as an 8-bit unsigned char, hence the
- * double cast.
- */
-#define YY_SC_TO_UI(c) ((unsigned int) (unsigned char) c)
+int builtin_fg(shell_ctx_t * p_ctx, int argc, char ** argv) {
+    job_t * p_job = resume_job("fg", argc, argv, true);
+    if (!p_job) return 1;
+    p_job->is_bkg = false;
+    puts(p_job->cmdline);
+    const int status = job_wait(&global_jobs, p_job);
+    terminal_reclaim(p_job->num_live == 0 && status < 128);
+    return status;
+}
 
-/* Enter a start condition.  This macro really ought to take a parameter,
- * but we do it the disgusting crufty way forced on us by the ()-less
- * definition of BEGIN.
- */
-#define BEGIN (yy_start) = 1 + 2 *
+int builtin_bg(shell_ctx_t * p_ctx, int argc, char ** argv) {
+    job_t * p_job = resume_job("bg", argc, argv, false);
+    if (!p_job) return 1;
+    p_job->is_bkg = true;
+    printf("[%d] %s &\n", p_job->id, p_job->cmdline);
+    return 0;
+}
 
-/* Translate the current start state into a value that can be later handed
- * to BEGIN to return to the state.  The YYSTATE alias is for lex
- * compatibility.
- */
-#define YY_START (((yy_start) - 1) / 2)
-#define YYSTATE YY_START
+int builtin_echo(shell_ctx_t * p_ctx, int argc, char ** argv) {
+    const bool newline = !(argc > 1 && strcmp(argv[1], "-n") == 0);
+    for (int i = newline ? 1 : 2; i < argc; i += 1) {
+        if (i > (newline ? 1 : 2)) putchar(' ');
+        fputs(argv[i], stdout);
+    }
+    if (newline) putchar('\n');
+    return 0;
+}
 
-/* Action number for EOF rule of a given start state. */
-#define YY_STATE_EOF(state) (YY_END_OF_BUFFER + state + 1)
+int builtin_true(shell_ctx_t * p_ctx, int argc, char ** argv) {
+    return 0;
+}
 
-/* Special action meaning "start processing a new file". */
-#define YY_NEW_FILE yyrestart(yyin  )
+int builtin_false(shell_ctx_t * p_ctx, int argc, char ** argv) {
+    return 1;
+}
 
-#define YY_END_OF_BUFFER_CHAR 0
+const char * printf_escape(const char * p_c) {
+    /* prints the escape sequence after a backslash and skips past it */
+    switch (*p_c) {
+    case 'n': putchar('\n'); break;
+    case 't': putchar('\t'); break;
+    case 'r': putchar('\r'); break;
+    case 'a': putchar('\a'); break;
+    case '\\': putchar('\\'); break;
+    case '\0': putchar('\\'); return p_c;
+    default: putchar('\\'); putchar(*p_c); break;
+    }
+    return p_c + 1;
+}
 
-/* Size of default input buffer. */
-#ifndef YY_BUF_SIZE
-#define YY_BUF_SIZE 16384
-#endif
+int builtin_printf(shell_ctx_t * p_ctx, int argc, char ** argv) {
+    if (argc < 2) {
+        puts("ERROR: usage: printf <format> [args...]");
+        return 2;
+    }
+    const char * format = argv[1];
+    int next_arg = 2;
+    /* like POSIX printf, the format is reused until the arguments run out */
+    do {
+        const int first_arg = next_arg;
+        const char * p_c = format;
+        while (*p_c) {
+            if (*p_c == '\\') {
+                p_c = printf_escape(p_c + 1);
+                continue;
+            }
+            if (*p_c != '%') {
+                putchar(*p_c++);
+                continue;
+            }
+            if (p_c[1] == '%') {
+                putchar('%');
+                p_c += 2;
+                continue;
+            }
+            /* copy the flags, width and precision, then pass them on */
+            char spec[PRINTF_SPEC_SIZE];
+            size_t len = 0;
+            spec[len++] = *p_c++;
+            while (*p_c && strchr("-+ #0123456789.", *p_c) && len < PRINTF_SPEC_SIZE - 3) {
+                spec[len++] = *p_c++;
+            }
+            const char conversion = *p_c ? *p_c++ : 's';
+            const char * arg = next_arg < argc ? argv[next_arg++] : NULL;
+            switch (conversion) {
+            case 'd':
+            case 'i':
+                spec[len++] = 'l';
+                spec[len++] = 'd';
+                spec[len] = '\0';
+                printf(spec, arg ? strtol(arg, NULL, 0) : 0L);
+                break;
+
+            case 'u':
+            case 'x':
+            case 'X':
+            case 'o':
+                spec[len++] = 'l';
+                spec[len++] = conversion;
+                spec[len] = '\0';
+                printf(spec, arg ? strtoul(arg, NULL, 0) : 0UL);
+                break;
 
-/* The state buf must be large enough to hold one state per character in the main buffer.
- */
-#define YY_STATE_BUF_SIZE   ((YY_BUF_SIZE + 2) * sizeof(yy_state_type))
+            case 'c':
+                spec[len++] = 'c';
+                spec[len] = '\0';
+                printf(spec, arg ? arg[0] : '\0');
+                break;
 
-#ifndef YY_TYPEDEF_YY_BUFFER_STATE
-#define YY_TYPEDEF_YY_BUFFER_STATE
-typedef struct yy_buffer_state *YY_BUFFER_STATE;
-#endif
+            default:
+                spec[len++] = 's';
+                spec[len] = '\0';
+                printf(spec, arg ? arg : "");
+                break;
+            }
+        }
+        if (next_arg == first_arg) break;
+    } while (next_arg < argc);
+    return 0;
+}
+
+bool test_unary(const char * op, const char * arg, int * p_result) {
+    struct stat st;
+    if (strcmp(op, "-n") == 0) {
+        *p_result = arg[0] != '\0';
+    } else if (strcmp(op, "-z") == 0) {
+        *p_result = arg[0] == '\0';
+    } else if (strcmp(op, "-e") == 0) {
+        *p_result = stat(arg, &st) == 0;
+    } else if (strcmp(op, "-f") == 0) {
+        *p_result = stat(arg, &st) == 0 && S_ISREG(st.st_mode);
+    } else if (strcmp(op, "-d") == 0) {
+        *p_result = stat(arg, &st) == 0 && S_ISDIR(st.st_mode);
+    } else if (strcmp(op, "-s") == 0) {
+        *p_result = stat(arg, &st) == 0 && st.st_size > 0;
+    } else if (strcmp(op, "-L") == 0 || strcmp(op, "-h") == 0) {
+        *p_result = lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+    } else if (strcmp(op, "-r") == 0) {
+        *p_result = access(arg, R_OK) == 0;
+    } else if (strcmp(op, "-w") == 0) {
+        *p_result = access(arg, W_OK) == 0;
+    } else if (strcmp(op, "-x") == 0) {
+        *p_result = access(arg, X_OK) == 0;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool test_binary(const char * lhs, const char * op, const char * rhs, int * p_result) {
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) {
+        *p_result = strcmp(lhs, rhs) == 0;
+        return true;
+    }
+    if (strcmp(op, "!=") == 0) {
+        *p_result = strcmp(lhs, rhs) != 0;
+        return true;
+    }
+    static const char * INT_OPS[] = {"-eq", "-ne", "-lt", "-le", "-gt", "-ge"};
+    int i = 0;
+    while (i < 6 && strcmp(op, INT_OPS[i]) != 0) i += 1;
+    if (i == 6) return false;
+    const long a = strtol(lhs, NULL, 10), b = strtol(rhs, NULL, 10);
+    const bool results[] = {a == b, a != b, a < b, a <= b, a > b, a >= b};
+    *p_result = results[i];
+    return true;
+}
+
+bool test_eval(const int argc, char ** argv, int * p_result) {
+    /* the POSIX rules, which go by the number of arguments */
+    switch (argc) {
+    case 0:
+        *p_result = 0;
+        return true;
+
+    case 1:
+        *p_result = argv[0][0] != '\0';
+        return true;
+
+    case 2:
+        if (strcmp(argv[0], "!") == 0) {
+            *p_result = argv[1][0] == '\0';
+            return true;
+        }
+        return test_unary(argv[0], argv[1], p_result);
+
+    case 3:
+        if (test_binary(argv[0], argv[1], argv[2], p_result)) return true;
+        break;
+    }
+    if (strcmp(argv[0], "!") == 0 && test_eval(argc - 1, argv + 1, p_result)) {
+        *p_result = !*p_result;
+        return true;
+    }
+    return false;
+}
+
+int builtin_test(shell_ctx_t * p_ctx, int argc, char ** argv) {
+    if (strcmp(argv[0], "[") == 0) {
+        if (strcmp(argv[argc - 1], "]") != 0) {
+            puts("ERROR: [: missing ]");
+            return 2;
+        }
+        argc -= 1;
+    }
+    int result;
+    if (!test_eval(argc - 1, argv + 1, &result)) {
+        printf("ERROR: %s: invalid expression\n", argv[0]);
+        return 2;
+    }
+    return result ? 0 : 1;
+}
+
+int builtin_export(shell_ctx_t * p_ctx, int argc, char ** argv) {
+    if (argc == 1) {
+        /* in a form that can be read back in */
+        for (size_t i = 0; i < global_vars.capacity; i += 1) {
+            const var_t * p_var = &global_vars.vars[i];
+            if (!p_var->entry || !p_var->exported) continue;
+            if (p_var->entry[p_var->name_len] == '=') {
+                printf("export %.*s='%s'\n", (int)p_var->name_len, p_var->entry,
+                       p_var->entry + p_var->name_len + 1);
+            } else {
+                printf("export %s\n", p_var->entry);
+            }
+        }
+        return 0;
+    }
+    int status = 0;
+    for (int i = 1; i < argc; i += 1) {
+        const size_t len = var_name_len(argv[i]);
+        if (!len || (argv[i][len] != '=' && argv[i][len] != '\0')) {
+            printf("ERROR: export: %s: not a valid name\n", argv[i]);
+            status = 1;
+            continue;
+        }
+        const char * value = argv[i][len] == '=' ? argv[i] + len + 1 : NULL;
+        if (!var_set(&global_vars, argv[i], len, value, true)) {
+            puts("ERROR: export: out of memory");
+            status = 1;
+        }
+    }
+    return status;
+}
+
+int builtin_unset(shell_ctx_t * p_ctx, int argc, char ** argv) {
+    int status = 0;
+    for (int i = 1; i < argc; i += 1) {
+        const size_t len = var_name_len(argv[i]);
+        if (!len || argv[i][len] != '\0') {
+            printf("ERROR: unset: %s: not a valid name\n", argv[i]);
+            status = 1;
+            continue;
+        }
+        var_unset(&global_vars, argv[i], len);
+    }
+    return status;
+}
+
+int builtin_history(shell_ctx_t * p_ctx, int argc, char ** argv) {
+    /* history [count] lists the latest entries, history -s text the ones
+       containing text, newest first, as a reverse search would find them */
+    history_t * p_hist = &global_history;
+    if (!p_hist->open && !history_open(p_hist)) {
+        perror("ERROR: history");
+        return 1;
+    }
+    if (!history_sync(p_hist)) {
+        puts("ERROR: history: failed to read the history file");
+        return 1;
+    }
+    if (argc == 3 && strcmp(argv[1], "-s") == 0) {
+        const size_t len = strlen(argv[2]);
+        size_t found = history_find(p_hist, argv[2], len, p_hist->num_entries);
+        for (; found; found = history_find(p_hist, argv[2], len, found - 1)) {
+            /* not the history -s line that is running this */
+            if ((off_t)p_hist->offsets[found] == p_hist->last_end) continue;
+            history_print(p_hist, found - 1);
+        }
+        return 0;
+    }
+    size_t count = p_hist->num_entries;
+    if (argc == 2) {
+        char * end;
+        count = strtoul(argv[1], &end, 10);
+        if (*end || argv[1][0] == '\0') argc = 0;
+    }
+    if (argc > 2 || argc == 0) {
+        puts("ERROR: usage: history [count] | history -s <text>");
+        return 1;
+    }
+    const size_t first = count < p_hist->num_entries ? p_hist->num_entries - count : 0;
+    for (size_t i = first; i < p_hist->num_entries; i += 1) history_print(p_hist, i);
+    return 0;
+}
+
+int builtin_function(shell_ctx_t * p_ctx, int argc, char ** argv) {
+    /* runs the body of the function argv[0] with argv[1] and on as $1 and
+       on; they are copied out of the arena, which the body resets */
+    function_t * p_func = function_find(&global_functions, argv[0]);
+    if (p_ctx->call_depth == FUNC_MAX_DEPTH) {
+        printf("ERROR: %s: maximum function nesting level exceeded\n", argv[0]);
+        return 1;
+    }
+    size_t size = argc * sizeof(char *);
+    for (int i = 1; i < argc; i += 1) size += strlen(argv[i]) + 1;
+    char ** params = malloc(size);
+    if (!params) {
+        puts("ERROR: malloc failed");
+        return 1;
+    }
+    char * p_strings = (char *)(params + argc);
+    for (int i = 1; i < argc; i += 1) {
+        const size_t len = strlen(argv[i]) + 1;
+        params[i - 1] = memcpy(p_strings, argv[i], len);
+        p_strings += len;
+    }
+    char ** saved_params = p_ctx->params;
+    const int saved_num_params = p_ctx->num_params;
+    p_ctx->params = params;
+    p_ctx->num_params = argc - 1;
+    /* the body may redefine the function it is running */
+    script_t * p_script = p_func->p_script;
+    p_script->refs += 1;
+    p_ctx->call_depth += 1;
+    const int status = script_run(p_ctx, p_script, p_func->entry);
+    p_ctx->call_depth -= 1;
+    script_release(p_script);
+    p_ctx->params = saved_params;
+    p_ctx->num_params = saved_num_params;
+    free(params);
+    return status;
+}
+
+int builtin_pwd(shell_ctx_t * p_ctx, int argc, char ** argv) {
+    char cwd[MAXPATHLEN];
+    if (!getcwd(cwd, sizeof(cwd))) {
+        perror("ERROR: pwd");
+        return 1;
+    }
+    puts(cwd);
+    return 0;
+}
+
+static const char * PARSE_ERROR_MSG = "ERROR: invalid input";
+static const char * JOB_ERROR_MSG = "ERROR: failed to create job";
+static const char * PARALLEL_USAGE_MSG =
+    "ERROR: usage: parallel [-j <jobs>] <command> [args...] [::: <items...>]";
+
+void shell_eval(shell_ctx_t * p_ctx) {
+    /* special case, no parse error when the input contains nothing */
+    if (p_ctx->tokens.npos == 0) return;
+    /* a line restored from the plan cache has been through all of this */
+    const plan_t * p_plan = p_ctx->p_plan;
+    if (!p_plan && p_ctx->line && script_is_script(p_ctx)) {
+        /* more than one pipeline, the line goes through script_compile */
+        script_eval(p_ctx);
+        return;
+    }
+    token_t * tokens = (token_t *)p_ctx->tokens.data;
+    if (!p_plan && tokens[0].tag == TOK_WORD && strcmp(tokens[0].text, "time") == 0) {
+        /* a prefix rather than a command, it times the whole pipeline */
+        p_ctx->timed = true;
+        p_ctx->tokens.npos -= 1;
+        memmove(tokens, tokens + 1, p_ctx->tokens.npos * sizeof(token_t));
+        if (p_ctx->tokens.npos == 0) return;
+    }
+    command_t * commands;
+    if (p_plan) {
+        /* read only from here on, so the launcher can use the plan's copy */
+        commands = p_plan->commands;
+    } else {
+        if (p_ctx->num_globs) glob_expand(p_ctx);
+        const long long parse_start = trace_begin();
+        const long long parse_ns = metrics_now();
+        const int res = parse_commands(p_ctx, &commands);
+        global_metrics.parse_ns += metrics_now() - parse_ns;
+        trace_end(TRACE_PARSE, parse_start, NULL, p_ctx->num_commands);
+        if (res == PARSE_ERROR) {
+            puts(PARSE_ERROR_MSG);
+            return;
+        }
+        for (int i = 0; i < p_ctx->num_commands; i += 1) {
+            if (commands[i].here_delim) heredoc_read(p_ctx, &commands[i]);
+        }
+        plan_cache_store(&global_plans, p_ctx, commands, p_ctx->num_commands);
+    }
+    if (p_ctx->num_commands == 1 && !p_ctx->bkg_proc && commands[0].argv[0] &&
+        var_name_len(commands[0].argv[0]) && strchr(commands[0].argv[0], '=')) {
+        /* NAME=value, the shell's own variable unless it is exported */
+        p_ctx->last_status = var_assign(commands[0].argv);
+        return;
+    }
+    if (p_ctx->num_commands == 1 && !p_ctx->bkg_proc) {
+        const builtin_t * p_builtin = command_builtin(commands[0].argv[0]);
+        if (p_builtin) {
+            p_ctx->last_status = run_builtin(p_ctx, p_builtin, &commands[0]);
+            return;
+        }
+    }
+    if (p_ctx->num_commands == 1) {
+        job_t * p_job = job_create(&global_jobs, p_ctx, 1, p_ctx->bkg_proc);
+        if (!p_job) {
+            puts(JOB_ERROR_MSG);
+            return;
+        }
+        const int pid = launch_process(p_ctx, &commands[0], NULL);
+        if (pid > 0) job_add_process(&global_jobs, p_job, pid);
+        shell_run_job(p_ctx, p_job);
+    } else {
+        launch_process_chain(p_ctx, commands, p_ctx->num_commands);
+    }
+}
+
+int parse_drop_stdin(command_t * p_command) {
+    /* a heredoc replaces earlier redirections of stdin, returns how many
+       entries were dropped from the end of the line's redirection list */
+    int kept = 0;
+    for (int i = 0; i < p_command->num_redirs; i += 1) {
+        if (p_command->redirs[i].fd != STDIN_FILENO) {
+            p_command->redirs[kept++] = p_command->redirs[i];
+        }
+    }
+    const int dropped = p_command->num_redirs - kept;
+    p_command->num_redirs = kept;
+    return dropped;
+}
+
+int parse_commands(shell_ctx_t * p_ctx, command_t ** p_commands) {
+    /* a single pass over the tokens, driven by PARSE_TABLE, that fills all
+       of the line's commands and their argvs from one arena allocation */
+    const token_t * tokens = (const token_t *)p_ctx->tokens.data;
+    const size_t num_tokens = p_ctx->tokens.npos;
+    const int num_commands = p_ctx->num_commands;
+    command_t * commands = arena_alloc(&p_ctx->arena, num_commands * sizeof(command_t)
+                                       + (num_tokens + num_commands) * sizeof(char *));
+    memset(commands, 0, num_commands * sizeof(command_t));
+    char ** argv = (char **)(commands + num_commands);
+    command_t * p_command = commands;
+    p_command->argv = argv;
+    /* redirections are rare, room for them is only made once one shows up
+       and every command's entries follow those of the one before */
+    redir_t * p_redirs = NULL;
+    int state = STATE_START;
+    for (size_t idx = 0; idx <= num_tokens; idx += 1) {
+        const int tag = idx < num_tokens ? tokens[idx].tag : TOK_END;
+        const parse_transition_t next = PARSE_TABLE[state][tag];
+        switch (next.action) {
+        case ACT_ERROR:
+            return PARSE_ERROR;
+
+        case ACT_ARG:
+            *argv++ = tokens[idx].text;
+            break;
+
+        case ACT_REDIR: {
+            /* at most one entry per token, &> takes two but has a file name */
+            if (!p_redirs) p_redirs = arena_alloc(&p_ctx->arena, num_tokens * sizeof(redir_t));
+            if (!p_command->num_redirs) p_command->redirs = p_redirs;
+            const bool dup = tokens[idx].tag == TOK_REDIR_DUP;
+            const token_t * p_op = dup ? &tokens[idx] : &tokens[idx - 1];
+            const int added = redir_parse(p_op, dup ? NULL : tokens[idx].text, p_redirs);
+            /* whichever redirection of stdin comes last wins, a pending
+               heredoc body still has to be read past though */
+            if (p_redirs->fd == STDIN_FILENO) p_command->here = NULL;
+            p_command->num_redirs += added;
+            p_redirs += added;
+            break;
+        }
+
+        case ACT_HEREDOC:
+            /* the body comes from the lines after this one, so the line
+               means something different every time and is not cached */
+            p_command->here_delim = tokens[idx].text;
+            p_command->here = NULL;
+            p_redirs -= parse_drop_stdin(p_command);
+            p_ctx->plan_line = NULL;
+            break;
+
+        case ACT_HERE_STR: {
+            /* the string with a newline added, as bash does */
+            const size_t len = tokens[idx].len;
+            char * doc = arena_alloc(&p_ctx->arena, len + 2);
+            memcpy(doc, tokens[idx].text, len);
+            doc[len] = '\n';
+            doc[len + 1] = '\0';
+            p_command->here = doc;
+            p_command->here_len = len + 1;
+            p_command->here_delim = NULL;
+            p_redirs -= parse_drop_stdin(p_command);
+            break;
+        }
+
+        case ACT_PIPE:
+            /* the scanner counted the pipes, so there is always a next one */
+            *argv++ = NULL;
+            p_command += 1;
+            p_command->argv = argv;
+            break;
+
+        case ACT_BKG:
+            p_ctx->bkg_proc = true;
+            break;
+
+        case ACT_END:
+            *argv++ = NULL;
+            break;
+        }
+        state = next.state;
+    }
+    *p_commands = commands;
+    return PARSE_SUCCESS;
+}
+
+void launch_process_chain(shell_ctx_t * p_ctx, command_t * commands, const int num_commands) {
+    job_t * p_job = job_create(&global_jobs, p_ctx, num_commands, p_ctx->bkg_proc);
+    if (!p_job) {
+        puts(JOB_ERROR_MSG);
+        return;
+    }
+    /* each pipe is made just before the stage that writes to it, and the
+       shell lets go of both ends as soon as their stages have them, so no
+       more than three pipe descriptors are ever open, however long the
+       pipeline */
+    pipe_ends_t ends = {-1, -1, -1};
+    for (int idx = 0; idx < num_commands; idx += 1) {
+        ends.in = ends.next;
+        ends.out = ends.next = -1;
+        if (idx < num_commands - 1) {
+            int fd[2];
+            if (pipe_open(fd) == -1) {
+                /* the stages launched so far see end of file and finish */
+                perror("ERROR: pipe");
+                if (ends.in != -1) close(ends.in);
+                break;
+            }
+            set_pipe_size(fd[1]);
+            ends.out = fd[1];
+            ends.next = fd[0];
+        }
+        const int pid = launch_process(p_ctx, &commands[idx], &ends);
+        if (ends.in != -1) close(ends.in);
+        if (ends.out != -1) close(ends.out);
+        if (pid > 0) job_add_process(&global_jobs, p_job, pid);
+    }
+    shell_run_job(p_ctx, p_job);
+}
+
+void shell_run_job(shell_ctx_t * p_ctx, job_t * p_job) {
+    if (p_job->num_procs == 0) {
+        /* nothing was launched, the error has been reported already */
+        job_remove(&global_jobs, p_job);
+        p_ctx->last_status = 127;
+        return;
+    }
+    if (p_ctx->serving && p_ctx->script_depth == 0 && !p_job->is_bkg) {
+        /* shell_serve reports it once it finishes, and serves others
+           meanwhile; a script has to wait for it before going on */
+        p_ctx->p_job = p_job;
+    } else if (!p_job->is_bkg) {
+        /* if not a bkg proc chain, wait for all of the commands to finish */
+        p_ctx->last_status = job_wait(&global_jobs, p_job);
+        if (p_ctx->job_foreground) {
+            terminal_reclaim(p_job->num_live == 0 && p_ctx->last_status < 128);
+        }
+        /* the ^C the terminal echoed is not followed by a newline */
+        if (global_tty_input && p_ctx->last_status == 128 + SIGINT) putchar('\n');
+    } else if (p_ctx->serving) {
+        /* the line is answered now, and the job reported when it is done,
+           like at a terminal */
+        p_job->p_report = p_ctx->p_report;
+        printf("[%d] %d\n", p_job->id, (int)p_job->procs[p_job->num_procs - 1].pid);
+    } else if (global_print_shell_context) {
+        printf("[%d] %d\n", p_job->id, (int)p_job->procs[p_job->num_procs - 1].pid);
+    }
+}
+
+int builtin_parallel(shell_ctx_t * p_ctx, int num_args, char ** args) {
+    /* runs the command once per item, the items come after ::: or one per
+       line from stdin, with at most -j (default: online cpus) at a time */
+    const int num_tokens = num_args;
+    long max_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    if (max_jobs < 1) max_jobs = 1;
+    int start = 1;
+    if (start + 1 < num_tokens && strcmp(args[start], "-j") == 0) {
+        char * p_end;
+        max_jobs = strtol(args[start + 1], &p_end, 10);
+        if (*p_end != '\0' || max_jobs < 1) {
+            puts(PARALLEL_USAGE_MSG);
+            return 2;
+        }
+        start += 2;
+    }
+    int sep = start;
+    while (sep < num_tokens && strcmp(args[sep], ":::") != 0) sep += 1;
+    if (sep == start) {
+        puts(PARALLEL_USAGE_MSG);
+        return 2;
+    }
+    /* a single argv is enough, posix_spawn and fork copy it right away */
+    const int argc = sep - start + 1;
+    char ** argv = arena_alloc(&p_ctx->arena, (argc + 1) * sizeof(char *));
+    for (int i = start; i < sep; i += 1) argv[i - start] = args[i];
+    argv[argc] = NULL;
+    command_t command;
+    memset(&command, 0, sizeof(command_t));
+    command.argv = argv;
+    job_t ** running = arena_alloc(&p_ctx->arena, max_jobs * sizeof(job_t *));
+    long num_running = 0;
+    int num_failed = 0;
+    int next_item = sep + 1;
+    char * line = NULL;
+    size_t line_capacity = 0;
+    bool more_items = true;
+    while (true) {
+        while (more_items && num_running < max_jobs) {
+            if (sep < num_tokens) {
+                if (next_item == num_tokens) {
+                    more_items = false;
+                    break;
+                }
+                argv[argc - 1] = args[next_item++];
+            } else {
+                const ssize_t len = getline(&line, &line_capacity, stdin);
+                if (len <= 0) {
+                    more_items = false;
+                    break;
+                }
+                if (line[len - 1] == '\n') line[len - 1] = '\0';
+                if (line[0] == '\0') continue;
+                argv[argc - 1] = line;
+            }
+            job_t * p_job = job_create(&global_jobs, p_ctx, 1, false);
+            if (!p_job) {
+                puts(JOB_ERROR_MSG);
+                more_items = false;
+                break;
+            }
+            /* many at once, the terminal stays with the shell and a ^C
+               is passed on to all of them below */
+            p_ctx->job_foreground = false;
+            const int pid = launch_process(p_ctx, &command, NULL);
+            if (pid <= 0 || !job_add_process(&global_jobs, p_job, pid)) {
+                job_remove(&global_jobs, p_job);
+                num_failed += 1;
+                continue;
+            }
+            running[num_running++] = p_job;
+        }
+        if (num_running == 0) break;
+        /* sleep until the reaper has news, then refill the freed slots */
+        events_wait(&global_events, -1);
+        if (global_events.interrupted) {
+            global_events.interrupted = false;
+            more_items = false;
+            if (global_tty_input) putchar('\n');
+            for (long i = 0; i < num_running; i += 1) {
+                if (running[i]->pgid != getpgrp()) kill(-running[i]->pgid, SIGINT);
+            }
+        }
+        for (long i = 0; i < num_running;) {
+            job_t * p_job = running[i];
+            if (p_job->num_live > p_job->num_stopped) {
+                i += 1;
+                continue;
+            }
+            if (p_job->num_live > 0) {
+                /* stopped, it is left to fg and bg like any other job */
+                p_job->is_bkg = true;
+                job_print(stdout, p_job, false);
+            } else if (wait_status_code(p_job->procs[0].status) != 0) {
+                num_failed += 1;
+            }
+            running[i] = running[--num_running];
+        }
+        /* finished jobs go back to the free list, so ids stay small; a
+           server leaves that to serve_collect, which still has to report
+           the jobs of other connections that finished meanwhile */
+        if (!p_ctx->serving) job_flush(&global_jobs, global_print_shell_context);
+    }
+    free(line);
+    /* like GNU parallel, the status is the number of failed jobs */
+    return num_failed > 101 ? 101 : num_failed;
+}
 
-#ifndef YY_TYPEDEF_YY_SIZE_T
-#define YY_TYPEDEF_YY_SIZE_T
-typedef size_t yy_size_t;
+int launch_process(shell_ctx_t * p_ctx, command_t * p_command, const pipe_ends_t * p_pipe) {
+    const long long start = trace_begin();
+    if (p_command->here) {
+        /* opened here and closed once the child has its copy */
+        p_ctx->here_fd = here_open(p_command->here, p_command->here_len);
+        if (p_ctx->here_fd == -1) return -1;
+    }
+    const int pid = start_process(p_ctx, p_command, p_pipe);
+    if (pid > 0) {
+        global_metrics.spawns += 1;
+    } else {
+        /* not found, or the spawn or fork failed; an exec failing in a
+           forked child (-F) only shows in its exit status */
+        global_metrics.exec_failures += 1;
+    }
+    if (pid > 0 && p_ctx->job_pgid == 0) {
+        /* the first process leads the group, and a foreground job gets the
+           terminal before it is likely to read it; a forked leader has
+           already taken it, a spawned one has no way to */
+        p_ctx->job_pgid = pid;
+        if (p_ctx->job_foreground) terminal_hand_over(pid);
+    }
+    if (p_ctx->here_fd != -1) {
+        close(p_ctx->here_fd);
+        p_ctx->here_fd = -1;
+    }
+    trace_end(TRACE_LAUNCH, start, p_command->argv[0], pid);
+    return pid;
+}
+
+int start_process(shell_ctx_t * p_ctx, command_t * p_command, const pipe_ends_t * p_pipe) {
+    /* keep whatever the shell printed ahead of the job's own output */
+    fflush(stdout);
+    const char * name = p_command->argv[0];
+    const builtin_t * p_builtin = command_builtin(name);
+    if (p_builtin) {
+        return fork_builtin(p_ctx, p_command, p_builtin, p_pipe);
+    }
+    const char * path = name;
+    if (!strchr(name, '/')) {
+        path = hash_lookup(&global_hash_table, name, false);
+        if (!path) {
+            printf("ERROR: %s: command not found\n", name);
+            return -1;
+        }
+    }
+#ifdef _POSIX_SPAWN
+    /* posix_spawn avoids copying the shell's page tables for every job, fork
+       is only used where spawn is unavailable or explicitly requested (-F) */
+    if (!global_use_fork) {
+        int pid = spawn_process(p_ctx, p_command, path, p_pipe);
+        if (pid == -1 && errno == ENOENT && path != name) {
+            /* the cached location went away, search PATH again */
+            path = hash_lookup(&global_hash_table, name, true);
+            if (!path) {
+                printf("ERROR: %s: command not found\n", name);
+                return -1;
+            }
+            pid = spawn_process(p_ctx, p_command, path, p_pipe);
+        }
+        if (pid == -1) perror("ERROR: spawn");
+        return pid;
+    }
 #endif
+    return fork_process(p_ctx, p_command, path, p_pipe);
+}
 
-extern yy_size_t yyleng;
-
-#define EOB_ACT_CONTINUE_SCAN 0
-#define EOB_ACT_END_OF_FILE 1
-#define EOB_ACT_LAST_MATCH 2
-
-    #define YY_LESS_LINENO(n)
-    
-/* Return all but the first "n" matched characters back to the input stream. */
-#define yyless(n) \
-    do \
-        { \
-        /* Undo effects of setting up yytext. */ \
-        int yyless_macro_arg = (n); \
-        YY_LESS_LINENO(yyless_macro_arg);\
-        *yy_cp = (yy_hold_char); \
-        YY_RESTORE_YY_MORE_OFFSET \
-        (yy_c_buf_p) = yy_cp = yy_bp + yyless_macro_arg - YY_MORE_ADJ; \
-        YY_DO_BEFORE_ACTION; /* set up yytext again */ \
-        } \
-    while ( 0 )
-
-#define unput(c) yyunput( c, (yytext_ptr)  )
-
-#ifndef YY_STRUCT_YY_BUFFER_STATE
-#define YY_STRUCT_YY_BUFFER_STATE
-struct yy_buffer_state
-    {
-    FILE *yy_input_file;
-
-    char *yy_ch_buf;        /* input buffer */
-    char *yy_buf_pos;       /* current position in input buffer */
-
-    /* Size of input buffer in bytes, not including room for EOB
-     * characters.
-     */
-    yy_size_t yy_buf_size;
-
-    /* Number of characters read into yy_ch_buf, not including EOB
-     * characters.
-     */
-    yy_size_t yy_n_chars;
-
-    /* Whether we "own" the buffer - i.e., we know we created it,
-     * and can realloc() it to grow it, and should free() it to
-     * delete it.
-     */
-    int yy_is_our_buffer;
-
-    /* Whether this is an "interactive" input source; if so, and
-     * if we're using stdio for input, then we want to use getc()
-     * instead of fread(), to make sure we stop fetching input after
-     * each newline.
-     */
-    int yy_is_interactive;
-
-    /* Whether we're considered to be at the beginning of a line.
-     * If so, '^' rules will be active on the next match, otherwise
-     * not.
-     */
-    int yy_at_bol;
-
-    int yy_bs_lineno; /**< The line count. */
-    int yy_bs_column; /**< The column count. */
-    
-    /* Whether to try to fill the input buffer when we reach the
-     * end of it.
-     */
-    int yy_fill_buffer;
-
-    int yy_buffer_status;
-
-#define YY_BUFFER_NEW 0
-#define YY_BUFFER_NORMAL 1
-    /* When an EOF's been seen but there's still some text to process
-     * then we mark the buffer as YY_EOF_PENDING, to indicate that we
-     * shouldn't try reading from the input source any more.  We might
-     * still have a bunch of tokens to match, though, because of
-     * possible backing-up.
-     *
-     * When we actually see the EOF, we change the status to "new"
-     * (via yyrestart()), so that the user can continue scanning by
-     * just pointing yyin at a new input file.
-     */
-#define YY_BUFFER_EOF_PENDING 2
+int spawn_process(shell_ctx_t * p_ctx, command_t * p_command, const char * path,
+                  const pipe_ends_t * p_pipe) {
+    posix_spawn_file_actions_t actions;
+    int res = posix_spawn_file_actions_init(&actions);
+    if (res != 0) {
+        errno = res;
+        return -1;
+    }
+    /* same order as child_redirect, the pipes first so that 2>&1 and the
+       like see them; the pipe ends and here_fd are close-on-exec, the
+       exec closes them without a file action each */
+    if (p_pipe && p_pipe->out != -1) {
+        posix_spawn_file_actions_adddup2(&actions, p_pipe->out, STDOUT_FILENO);
+    }
+    if (p_pipe && p_pipe->in != -1) {
+        posix_spawn_file_actions_adddup2(&actions, p_pipe->in, STDIN_FILENO);
+    }
+    if (p_ctx->here_fd != -1) {
+        posix_spawn_file_actions_adddup2(&actions, p_ctx->here_fd, STDIN_FILENO);
+    }
+    for (int i = 0; i < p_command->num_redirs; i += 1) {
+        const redir_t * p_redir = &p_command->redirs[i];
+        if (p_redir->path) {
+            posix_spawn_file_actions_addopen(&actions, p_redir->fd, p_redir->path,
+                                             p_redir->flags, 0666);
+        } else {
+            posix_spawn_file_actions_adddup2(&actions, p_redir->dup_fd, p_redir->fd);
+        }
+    }
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    /* the signals the event loop blocks for itself are the job's again */
+    short flags = POSIX_SPAWN_SETSIGMASK;
+    posix_spawnattr_setsigmask(&attr, &global_events.saved_mask);
+    if (p_ctx->job_pgid >= 0) {
+        flags |= POSIX_SPAWN_SETPGROUP;
+        posix_spawnattr_setpgroup(&attr, p_ctx->job_pgid);
+    }
+    posix_spawnattr_setflags(&attr, flags);
+    pid_t pid;
+    res = posix_spawn(&pid, path, &actions, &attr, p_command->argv, var_envp(&global_vars));
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    if (res != 0) {
+        errno = res;
+        return -1;
+    }
+    return pid;
+}
 
+int fork_process(shell_ctx_t * p_ctx, command_t * p_command, const char * path,
+                 const pipe_ends_t * p_pipe) {
+    enum pid_kind {
+        child = 0,
+        error = -1
     };
-#endif /* !YY_STRUCT_YY_BUFFER_STATE */
+    int pid = fork();
+    /* set on both sides of the fork, whichever runs first wins the race */
+    if (pid >= 0 && p_ctx->job_pgid >= 0) setpgid(pid, p_ctx->job_pgid);
+    switch (pid) {
+    case child:
+        /* the leader of a foreground job takes the terminal itself as well,
+           while SIGTTOU is still blocked */
+        if (p_ctx->job_foreground && p_ctx->job_pgid == 0) tcsetpgrp(STDIN_FILENO, getpid());
+        sigprocmask(SIG_SETMASK, &global_events.saved_mask, NULL);
+        child_redirect(p_ctx, p_command, p_pipe);
+        execve(path, p_command->argv, var_envp(&global_vars));
+        perror("ERROR: exec");
+        exit(EXIT_FAILURE);
+        
+    case error:
+        perror("ERROR: fork");
+        return error;
+    }
+    return pid;
+}
 
-/* Stack of input buffers. */
-static size_t yy_buffer_stack_top = 0; /**< index of top of stack. */
-static size_t yy_buffer_stack_max = 0; /**< capacity of stack. */
-static YY_BUFFER_STATE * yy_buffer_stack = 0; /**< Stack as an array. */
+void child_redirect(shell_ctx_t * p_ctx, command_t * p_command, const pipe_ends_t * p_pipe) {
+    /* descriptors only, the stdio streams stay usable for builtins; the
+       pipes go first and the redirections can then override them, as in
+       bash, so that cmd 2>&1 | less sends both streams down the pipe */
+    if (p_pipe) {
+        if (p_pipe->out != -1) dup2(p_pipe->out, STDOUT_FILENO);
+        if (p_pipe->in != -1) dup2(p_pipe->in, STDIN_FILENO);
+        /* the only pipe descriptors the shell holds while it launches a
+           stage, a forked builtin would otherwise keep them open */
+        if (p_pipe->out != -1) close(p_pipe->out);
+        if (p_pipe->in != -1) close(p_pipe->in);
+        if (p_pipe->next != -1) close(p_pipe->next);
+    }
+    if (p_ctx->here_fd != -1) {
+        dup2(p_ctx->here_fd, STDIN_FILENO);
+        close(p_ctx->here_fd);
+    }
+    for (int i = 0; i < p_command->num_redirs; i += 1) {
+        if (redir_apply(&p_command->redirs[i]) == -1) {
+            redir_report(stderr, &p_command->redirs[i]);
+            _exit(EXIT_FAILURE);
+        }
+    }
+}
 
-/* We provide macros for accessing buffer states in case in the
- * future we want to put the buffer states in a more general
- * "scanner state".
- *
- * Returns the top of the stack, or NULL.
- */
-#define YY_CURRENT_BUFFER ( (yy_buffer_stack) \
-                          ? (yy_buffer_stack)[(yy_buffer_stack_top)] \
-                          : NULL)
-
-/* Same as previous macro, but useful when we know that the buffer stack is not
- * NULL or when we need an lvalue. For internal use only.
- */
-#define YY_CURRENT_BUFFER_LVALUE (yy_buffer_stack)[(yy_buffer_stack_top)]
-
-/* yy_hold_char holds the character lost when yytext is formed. */
-static char yy_hold_char;
-static yy_size_t yy_n_chars;        /* number of characters read into yy_ch_buf */
-yy_size_t yyleng;
-
-/* Points to current character in buffer. */
-static char *yy_c_buf_p = (char *) 0;
-static int yy_init = 0;     /* whether we need to initialize */
-static int yy_start = 0;    /* start state number */
-
-/* Flag which is used to allow yywrap()'s to do buffer switches
- * instead of setting up a fresh yyin.  A bit of a hack ...
- */
-static int yy_did_buffer_switch_on_eof;
-
-void yyrestart (FILE *input_file  );
-void yy_switch_to_buffer (YY_BUFFER_STATE new_buffer  );
-YY_BUFFER_STATE yy_create_buffer (FILE *file,int size  );
-void yy_delete_buffer (YY_BUFFER_STATE b  );
-void yy_flush_buffer (YY_BUFFER_STATE b  );
-void yypush_buffer_state (YY_BUFFER_STATE new_buffer  );
-void yypop_buffer_state (void );
-
-static void yyensure_buffer_stack (void );
-static void yy_load_buffer_state (void );
-static void yy_init_buffer (YY_BUFFER_STATE b,FILE *file  );
-
-#define YY_FLUSH_BUFFER yy_flush_buffer(YY_CURRENT_BUFFER )
-
-YY_BUFFER_STATE yy_scan_buffer (char *base,yy_size_t size  );
-YY_BUFFER_STATE yy_scan_string (yyconst char *yy_str  );
-YY_BUFFER_STATE yy_scan_bytes (yyconst char *bytes,yy_size_t len  );
-
-void *yyalloc (yy_size_t  );
-void *yyrealloc (void *,yy_size_t  );
-void yyfree (void *  );
-
-#define yy_new_buffer yy_create_buffer
-
-#define yy_set_interactive(is_interactive) \
-    { \
-    if ( ! YY_CURRENT_BUFFER ){ \
-        yyensure_buffer_stack (); \
-        YY_CURRENT_BUFFER_LVALUE =    \
-            yy_create_buffer(yyin,YY_BUF_SIZE ); \
-    } \
-    YY_CURRENT_BUFFER_LVALUE->yy_is_interactive = is_interactive; \
-    }
-
-#define yy_set_bol(at_bol) \
-    { \
-    if ( ! YY_CURRENT_BUFFER ){\
-        yyensure_buffer_stack (); \
-        YY_CURRENT_BUFFER_LVALUE =    \
-            yy_create_buffer(yyin,YY_BUF_SIZE ); \
-    } \
-    YY_CURRENT_BUFFER_LVALUE->yy_at_bol = at_bol; \
-    }
-
-#define YY_AT_BOL() (YY_CURRENT_BUFFER_LVALUE->yy_at_bol)
-
-/* Begin user sect3 */
-
-#define yywrap(n) 1
-#define YY_SKIP_YYWRAP
-
-typedef unsigned char YY_CHAR;
-
-FILE *yyin = (FILE *) 0, *yyout = (FILE *) 0;
-
-typedef int yy_state_type;
-
-extern int yylineno;
-
-int yylineno = 1;
-
-extern char *yytext;
-#define yytext_ptr yytext
-
-static yy_state_type yy_get_previous_state (void );
-static yy_state_type yy_try_NUL_trans (yy_state_type current_state  );
-static int yy_get_next_buffer (void );
-static void yy_fatal_error (yyconst char msg[]  );
-
-/* Done after the current pattern has been matched and before the
- * corresponding action - sets up yytext.
- */
-#define YY_DO_BEFORE_ACTION \
-    (yytext_ptr) = yy_bp; \
-    yyleng = (yy_size_t) (yy_cp - yy_bp); \
-    (yy_hold_char) = *yy_cp; \
-    *yy_cp = '\0'; \
-    (yy_c_buf_p) = yy_cp;
-
-#define YY_NUM_RULES 8
-#define YY_END_OF_BUFFER 9
-/* This struct is not used in this scanner,
-   but its presence is necessary. */
-struct yy_trans_info
-    {
-    flex_int32_t yy_verify;
-    flex_int32_t yy_nxt;
-    };
-static yyconst flex_int16_t yy_accept[25] =
-    {   0,
-        0,    0,    9,    8,    7,    8,    4,    6,    6,    6,
-        3,    7,    0,    5,    0,    6,    1,    6,    0,    5,
-        0,    6,    2,    0
-    } ;
-
-static yyconst flex_int32_t yy_ec[256] =
-    {   0,
-        1,    1,    1,    1,    1,    1,    1,    1,    2,    3,
-        1,    1,    1,    1,    1,    1,    1,    1,    1,    1,
-        1,    1,    1,    1,    1,    1,    1,    1,    1,    1,
-        1,    2,    1,    4,    1,    1,    1,    5,    1,    1,
-        1,    1,    1,    1,    6,    6,    6,    6,    6,    6,
-        6,    6,    6,    6,    6,    6,    6,    6,    1,    7,
-        1,    8,    1,    6,    6,    6,    6,    6,    6,    6,
-        6,    6,    6,    6,    6,    6,    6,    6,    6,    6,
-        6,    6,    6,    6,    6,    6,    6,    6,    6,    6,
-        1,    9,    1,    1,    6,    1,    6,    6,   10,   11,
-
-       12,    6,    6,    6,   13,    6,    6,    6,    6,    6,
-        6,    6,    6,    6,    6,   14,    6,    6,    6,   15,
-        6,    6,    1,   16,    1,    6,    1,    1,    1,    1,
-        1,    1,    1,    1,    1,    1,    1,    1,    1,    1,
-        1,    1,    1,    1,    1,    1,    1,    1,    1,    1,
-        1,    1,    1,    1,    1,    1,    1,    1,    1,    1,
-        1,    1,    1,    1,    1,    1,    1,    1,    1,    1,
-        1,    1,    1,    1,    1,    1,    1,    1,    1,    1,
-        1,    1,    1,    1,    1,    1,    1,    1,    1,    1,
-        1,    1,    1,    1,    1,    1,    1,    1,    1,    1,
-
-        1,    1,    1,    1,    1,    1,    1,    1,    1,    1,
-        1,    1,    1,    1,    1,    1,    1,    1,    1,    1,
-        1,    1,    1,    1,    1,    1,    1,    1,    1,    1,
-        1,    1,    1,    1,    1,    1,    1,    1,    1,    1,
-        1,    1,    1,    1,    1,    1,    1,    1,    1,    1,
-        1,    1,    1,    1,    1
-    } ;
-
-static yyconst flex_int32_t yy_meta[17] =
-    {   0,
-        1,    1,    1,    1,    1,    2,    1,    1,    1,    2,
-        2,    2,    2,    2,    2,    1
-    } ;
-
-static yyconst flex_int16_t yy_base[28] =
-    {   0,
-        0,    0,   39,   46,   15,   15,   46,    0,   27,   22,
-       46,   18,   18,   46,   25,    0,    0,   20,   21,   22,
-       32,   18,    0,   46,   41,   21,   43
-    } ;
-
-static yyconst flex_int16_t yy_def[28] =
-    {   0,
-       24,    1,   24,   24,   24,   25,   24,   26,   26,   26,
-       24,   24,   25,   24,   27,   26,   26,   26,   25,   25,
-       27,   26,   26,    0,   24,   24,   24
-    } ;
-
-static yyconst flex_int16_t yy_nxt[63] =
-    {   0,
-        4,    5,    5,    6,    7,    8,    7,    7,    4,    9,
-        8,   10,    8,    8,    8,   11,   12,   12,   14,   12,
-       12,   14,   16,   15,   14,   14,   15,   13,   20,   15,
-       15,   23,   22,   21,   13,   20,   18,   17,   24,   24,
-       21,   13,   13,   19,   19,    3,   24,   24,   24,   24,
-       24,   24,   24,   24,   24,   24,   24,   24,   24,   24,
-       24,   24
-    } ;
-
-static yyconst flex_int16_t yy_chk[63] =
-    {   0,
-        1,    1,    1,    1,    1,    1,    1,    1,    1,    1,
-        1,    1,    1,    1,    1,    1,    5,    5,    6,   12,
-       12,   13,   26,    6,   19,   20,   13,   15,   15,   19,
-       20,   22,   18,   15,   21,   21,   10,    9,    3,    0,
-       21,   25,   25,   27,   27,   24,   24,   24,   24,   24,
-       24,   24,   24,   24,   24,   24,   24,   24,   24,   24,
-       24,   24
-    } ;
-
-static yy_state_type yy_last_accepting_state;
-static char *yy_last_accepting_cpos;
-
-extern int yy_flex_debug;
-int yy_flex_debug = 0;
-
-/* The intent behind this definition is that it'll catch
- * any uses of REJECT which flex missed.
- */
-#define REJECT reject_used_but_not_detected
-#define yymore() yymore_used_but_not_detected
-#define YY_MORE_ADJ 0
-#define YY_RESTORE_YY_MORE_OFFSET
-char *yytext;
-#line 1 "lexer.l"
-#line 2 "lexer.l"
-vec_t * p_global_lexer_target;
-#define YY_NO_INPUT 1
-#line 475 "lex.yy.c"
-
-#define INITIAL 0
-
-#ifndef YY_NO_UNISTD_H
-/* Special case for "unistd.h", since it is non-ANSI. We include it way
- * down here because we want the user's section 1 to have been scanned first.
- * The user has a chance to override it with an option.
- */
-#include <unistd.h>
-#endif
+int vec_init(vec_t * p_vec, const size_t elem_size) {
+    p_vec->data = malloc(VEC_INIT_CAPACITY * elem_size);
+    if (!p_vec->data) return 0;
+    p_vec->len = VEC_INIT_CAPACITY * elem_size;
+    p_vec->npos = 0;
+    p_vec->elem_size = elem_size;
+    p_vec->p_arena = NULL;
+    return 1;
+}
 
-#ifndef YY_EXTRA_TYPE
-#define YY_EXTRA_TYPE void *
-#endif
+int vec_init_arena(vec_t * p_vec, arena_t * p_arena, const size_t elem_size) {
+    /* storage comes from the arena, and goes away when it is reset */
+    p_vec->data = arena_alloc(p_arena, VEC_INIT_CAPACITY * elem_size);
+    p_vec->len = VEC_INIT_CAPACITY * elem_size;
+    p_vec->npos = 0;
+    p_vec->elem_size = elem_size;
+    p_vec->p_arena = p_arena;
+    return 1;
+}
 
-static int yy_init_globals (void );
+int vec_reserve(vec_t * p_vec, const size_t capacity) {
+    /* makes room for capacity elements, growing geometrically so that a
+       run of pushes costs amortized constant time */
+    const size_t wanted = capacity * p_vec->elem_size;
+    if (p_vec->len >= wanted) return 1;
+    global_metrics.vec_grows += 1;
+    size_t new_len = p_vec->len * VEC_GROWTH_RATE;
+    if (new_len < wanted) new_len = wanted;
+    char * new_data;
+    if (p_vec->p_arena) {
+        /* arena memory cannot be resized, the old block dies with the line */
+        new_data = arena_alloc(p_vec->p_arena, new_len);
+        if (!new_data) return 0;
+        memcpy(new_data, p_vec->data, p_vec->npos * p_vec->elem_size);
+    } else {
+        new_data = realloc(p_vec->data, new_len);
+        if (!new_data) return 0;
+        global_loop_allocs += 1;
+    }
+    p_vec->data = new_data;
+    p_vec->len = new_len;
+    return 1;
+}
 
-/* Accessor methods to globals.
-   These are made visible to non-reentrant scanners for convenience. */
+int vec_push(vec_t * p_vec, const void * p_element) {
+    const size_t elem_size = p_vec->elem_size;
+    if (p_vec->len < (p_vec->npos + 1) * elem_size &&
+        !vec_reserve(p_vec, p_vec->npos + 1)) return 0;
+    memcpy(p_vec->data + p_vec->npos * elem_size, p_element, elem_size);
+    p_vec->npos += 1;
+    return 1;
+}
 
-int yylex_destroy (void );
+void vec_shrink(vec_t * p_vec) {
+    /* gives back what one pathological line grew the vector to, so it
+       does not stay resident for the rest of the session */
+    const size_t elem_size = p_vec->elem_size;
+    if (p_vec->p_arena || p_vec->len <= VEC_SHRINK_CAPACITY * elem_size) return;
+    size_t new_len = VEC_INIT_CAPACITY * elem_size;
+    if (new_len < p_vec->npos * elem_size) new_len = p_vec->npos * elem_size;
+    char * new_data = realloc(p_vec->data, new_len);
+    if (!new_data) return;
+    p_vec->data = new_data;
+    p_vec->len = new_len;
+}
 
-int yyget_debug (void );
+void vec_clear(vec_t * p_vec, void (* policy)(vec_t *)) {
+    if (policy) policy(p_vec);
+    p_vec->npos = 0;
+}
 
-void yyset_debug (int debug_flag  );
+void vec_free(vec_t * p_vec, void (* policy)(vec_t *)) {
+    if (policy) policy(p_vec);
+    p_vec->npos = 0;
+    if (!p_vec->p_arena) free(p_vec->data);
+}
 
-YY_EXTRA_TYPE yyget_extra (void );
+void * arena_alloc(arena_t * p_arena, const size_t size) {
+    const size_t aligned = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    arena_block_t * p_prev = NULL;
+    arena_block_t * p_block = p_arena->current;
+    while (p_block && p_block->capacity - p_block->used < aligned) {
+        /* blocks past the current one are left over from longer lines */
+        p_prev = p_block;
+        p_block = p_block->next;
+        if (p_block) p_block->used = 0;
+    }
+    if (!p_block) {
+        const size_t capacity = aligned > ARENA_BLOCK_SIZE ? aligned : ARENA_BLOCK_SIZE;
+        p_block = malloc(sizeof(arena_block_t) + capacity);
+        if (!p_block) {
+            puts("ERROR: malloc failed");
+            exit(EXIT_FAILURE);
+        }
+        p_block->next = NULL;
+        p_block->capacity = capacity;
+        p_block->used = 0;
+        if (p_prev) {
+            p_prev->next = p_block;
+        } else {
+            p_arena->first = p_block;
+        }
+        p_arena->num_blocks += 1;
+        global_loop_allocs += 1;
+    }
+    p_arena->current = p_block;
+    void * p_mem = p_block->data + p_block->used;
+    p_block->used += aligned;
+    global_metrics.arena_bytes += aligned;
+    return p_mem;
+}
 
-void yyset_extra (YY_EXTRA_TYPE user_defined  );
+char * arena_strndup(arena_t * p_arena, const char * str, const size_t len) {
+    char * new_str = arena_alloc(p_arena, len + 1);
+    memcpy(new_str, str, len);
+    new_str[len] = '\0';
+    return new_str;
+}
 
-FILE *yyget_in (void );
+void arena_reset(arena_t * p_arena) {
+    /* everything handed out since the last reset is released at once, the
+       blocks themselves are kept for the next line */
+    p_arena->current = p_arena->first;
+    if (p_arena->first) p_arena->first->used = 0;
+}
 
-void yyset_in  (FILE * in_str  );
+void arena_free(arena_t * p_arena) {
+    arena_block_t * p_block = p_arena->first;
+    while (p_block) {
+        arena_block_t * p_next = p_block->next;
+        free(p_block);
+        p_block = p_next;
+    }
+    memset(p_arena, 0, sizeof(arena_t));
+}
 
-FILE *yyget_out (void );
+size_t hash_string(const char * str) {
+    /* FNV-1a */
+    size_t hash = 2166136261u;
+    while (*str) {
+        hash ^= (unsigned char)*str++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
 
-void yyset_out  (FILE * out_str  );
+char * find_in_path(const char * path_env, const char * name) {
+    char candidate[MAXPATHLEN];
+    struct stat st;
+    const char * dir = path_env;
+    while (dir) {
+        const char * end = strchr(dir, ':');
+        const int dir_len = end ? (int)(end - dir) : (int)strlen(dir);
+        /* an empty PATH entry means the current directory */
+        const int len = dir_len ? snprintf(candidate, sizeof(candidate), "%.*s/%s",
+                                           dir_len, dir, name)
+                                : snprintf(candidate, sizeof(candidate), "./%s", name);
+        if (len > 0 && len < (int)sizeof(candidate) &&
+            stat(candidate, &st) == 0 && S_ISREG(st.st_mode) &&
+            access(candidate, X_OK) == 0) {
+            return strdup(candidate);
+        }
+        dir = end ? end + 1 : NULL;
+    }
+    return NULL;
+}
 
-yy_size_t yyget_leng (void );
+int hash_grow(hash_table_t * p_table) {
+    const size_t capacity = p_table->capacity ? p_table->capacity * 2 : HASH_INIT_CAPACITY;
+    hash_entry_t * entries = calloc(capacity, sizeof(hash_entry_t));
+    if (!entries) return 0;
+    for (size_t i = 0; i < p_table->capacity; i += 1) {
+        if (p_table->entries[i].name) {
+            size_t idx = hash_string(p_table->entries[i].name) & (capacity - 1);
+            while (entries[idx].name) idx = (idx + 1) & (capacity - 1);
+            entries[idx] = p_table->entries[i];
+        }
+    }
+    free(p_table->entries);
+    p_table->entries = entries;
+    p_table->capacity = capacity;
+    return 1;
+}
 
-char *yyget_text (void );
+const char * hash_lookup(hash_table_t * p_table, const char * name, const bool refresh) {
+    const char * path_env = var_get(&global_vars, "PATH", 4);
+    if (!path_env) path_env = DEFAULT_PATH;
+    /* every cached location is stale once PATH has changed */
+    if (!p_table->path_env || strcmp(p_table->path_env, path_env) != 0) {
+        hash_clear(p_table);
+        p_table->path_env = strdup(path_env);
+    }
+    if ((p_table->count + 1) * 2 > p_table->capacity && !hash_grow(p_table)) {
+        return NULL;
+    }
+    const size_t mask = p_table->capacity - 1;
+    size_t idx = hash_string(name) & mask;
+    while (p_table->entries[idx].name) {
+        hash_entry_t * p_entry = &p_table->entries[idx];
+        if (strcmp(p_entry->name, name) == 0) {
+            if (refresh || !p_entry->path) {
+                free(p_entry->path);
+                p_entry->path = find_in_path(path_env, name);
+            }
+            if (p_entry->path) p_entry->hits += 1;
+            return p_entry->path;
+        }
+        idx = (idx + 1) & mask;
+    }
+    /* misses are not cached, the command might be installed later on */
+    char * path = find_in_path(path_env, name);
+    if (!path) return NULL;
+    p_table->entries[idx].name = strdup(name);
+    p_table->entries[idx].path = path;
+    p_table->entries[idx].hits = 1;
+    p_table->count += 1;
+    return path;
+}
 
-int yyget_lineno (void );
+void hash_clear(hash_table_t * p_table) {
+    for (size_t i = 0; i < p_table->capacity; i += 1) {
+        free(p_table->entries[i].name);
+        free(p_table->entries[i].path);
+    }
+    if (p_table->entries) {
+        memset(p_table->entries, 0, p_table->capacity * sizeof(hash_entry_t));
+    }
+    p_table->count = 0;
+    free(p_table->path_env);
+    p_table->path_env = NULL;
+}
 
-void yyset_lineno (int line_number  );
+void hash_print(hash_table_t * p_table) {
+    if (p_table->count == 0) {
+        puts("hash: hash table empty");
+        return;
+    }
+    puts("hits\tcommand");
+    for (size_t i = 0; i < p_table->capacity; i += 1) {
+        if (p_table->entries[i].path) {
+            printf("%4u\t%s\n", p_table->entries[i].hits, p_table->entries[i].path);
+        }
+    }
+}
 
-/* Macros after this point can all be overridden by user definitions in
- * section 1.
- */
+bool var_table_init(var_table_t * p_table, char ** env) {
+    /* the inherited entries are borrowed, not copied, until they change */
+    memset(p_table, 0, sizeof(var_table_t));
+    p_table->capacity = HASH_INIT_CAPACITY;
+    p_table->vars = calloc(p_table->capacity, sizeof(var_t));
+    if (!p_table->vars) return false;
+    for (; *env; env += 1) {
+        const char * equals = strchr(*env, '=');
+        if (!equals || equals == *env) continue;
+        const size_t len = equals - *env;
+        if (var_find(p_table, *env, len)) continue;
+        if ((p_table->count + 1) * 2 > p_table->capacity && !var_grow(p_table)) return false;
+        const size_t hash = hash_bytes(*env, len);
+        const size_t mask = p_table->capacity - 1;
+        size_t idx = hash & mask;
+        while (p_table->vars[idx].entry) idx = (idx + 1) & mask;
+        p_table->vars[idx] = (var_t){*env, len, hash, true, false};
+        p_table->count += 1;
+    }
+    p_table->envp_stale = true;
+    return true;
+}
 
-#ifndef YY_SKIP_YYWRAP
-#ifdef __cplusplus
-extern "C" int yywrap (void );
-#else
-extern int yywrap (void );
-#endif
-#endif
+bool var_grow(var_table_t * p_table) {
+    const size_t capacity = p_table->capacity * 2;
+    var_t * vars = calloc(capacity, sizeof(var_t));
+    if (!vars) return false;
+    for (size_t i = 0; i < p_table->capacity; i += 1) {
+        if (!p_table->vars[i].entry) continue;
+        size_t idx = p_table->vars[i].hash & (capacity - 1);
+        while (vars[idx].entry) idx = (idx + 1) & (capacity - 1);
+        vars[idx] = p_table->vars[i];
+    }
+    free(p_table->vars);
+    p_table->vars = vars;
+    p_table->capacity = capacity;
+    return true;
+}
 
-#ifndef yytext_ptr
-static void yy_flex_strncpy (char *,yyconst char *,int );
-#endif
+var_t * var_find(var_table_t * p_table, const char * name, const size_t len) {
+    const size_t hash = hash_bytes(name, len);
+    const size_t mask = p_table->capacity - 1;
+    for (size_t idx = hash & mask; p_table->vars[idx].entry; idx = (idx + 1) & mask) {
+        var_t * p_var = &p_table->vars[idx];
+        if (p_var->hash == hash && p_var->name_len == len &&
+            memcmp(p_var->entry, name, len) == 0) return p_var;
+    }
+    return NULL;
+}
 
-#ifdef YY_NEED_STRLEN
-static int yy_flex_strlen (yyconst char * );
-#endif
+const char * var_get(var_table_t * p_table, const char * name, const size_t len) {
+    /* the value, or NULL when unset */
+    const var_t * p_var = var_find(p_table, name, len);
+    if (!p_var || p_var->entry[len] != '=') return NULL;
+    return p_var->entry + len + 1;
+}
 
-#ifndef YY_NO_INPUT
+bool var_set(var_table_t * p_table, const char * name, const size_t len,
+             const char * value, const bool exported) {
+    /* a NULL value keeps the current one, for export NAME */
+    var_t * p_var = var_find(p_table, name, len);
+    if (!p_var) {
+        if ((p_table->count + 1) * 2 > p_table->capacity && !var_grow(p_table)) return false;
+        const size_t hash = hash_bytes(name, len);
+        const size_t mask = p_table->capacity - 1;
+        size_t idx = hash & mask;
+        while (p_table->vars[idx].entry) idx = (idx + 1) & mask;
+        p_var = &p_table->vars[idx];
+        *p_var = (var_t){NULL, len, hash, false, false};
+    }
+    if (value || !p_var->entry) {
+        const size_t size = len + (value ? strlen(value) + 1 : 0) + 1;
+        char * entry = malloc(size);
+        if (!entry) {
+            if (!p_var->entry) p_var->name_len = 0;
+            return false;
+        }
+        memcpy(entry, name, len);
+        if (value) {
+            entry[len] = '=';
+            strcpy(entry + len + 1, value);
+        } else {
+            entry[len] = '\0';
+        }
+        if (!p_var->entry) p_table->count += 1;
+        if (p_var->owned) free(p_var->entry);
+        p_var->entry = entry;
+        p_var->owned = true;
+    }
+    if (exported) p_var->exported = true;
+    if (p_var->exported) p_table->envp_stale = true;
+    return true;
+}
 
-#ifdef __cplusplus
-static int yyinput (void );
-#else
-static int input (void );
-#endif
+void var_unset(var_table_t * p_table, const char * name, const size_t len) {
+    var_t * p_var = var_find(p_table, name, len);
+    if (!p_var) return;
+    if (p_var->exported) p_table->envp_stale = true;
+    if (p_var->owned) free(p_var->entry);
+    /* shift the rest of the cluster back over the hole, so that lookups
+       never need tombstones */
+    const size_t mask = p_table->capacity - 1;
+    size_t hole = p_var - p_table->vars;
+    for (size_t idx = (hole + 1) & mask; p_table->vars[idx].entry; idx = (idx + 1) & mask) {
+        const size_t home = p_table->vars[idx].hash & mask;
+        /* movable unless its home lies cyclically in (hole, idx] */
+        if (((idx - home) & mask) >= ((idx - hole) & mask)) {
+            p_table->vars[hole] = p_table->vars[idx];
+            hole = idx;
+        }
+    }
+    p_table->vars[hole].entry = NULL;
+    p_table->count -= 1;
+}
 
-#endif
+char ** var_envp(var_table_t * p_table) {
+    /* spawns reuse the same array until the exported set changes */
+    if (!p_table->envp_stale) return p_table->envp;
+    if (p_table->envp_capacity < p_table->count + 1) {
+        char ** envp = realloc(p_table->envp, (p_table->count + 1) * sizeof(char *));
+        /* out of memory, the children get the environment the shell had */
+        if (!envp) return environ;
+        p_table->envp = envp;
+        p_table->envp_capacity = p_table->count + 1;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < p_table->capacity; i += 1) {
+        const var_t * p_var = &p_table->vars[i];
+        if (p_var->entry && p_var->exported && p_var->entry[p_var->name_len] == '=') {
+            p_table->envp[n++] = p_var->entry;
+        }
+    }
+    p_table->envp[n] = NULL;
+    p_table->envp_stale = false;
+    return p_table->envp;
+}
 
-/* Amount of stuff to slurp up with each read. */
-#ifndef YY_READ_BUF_SIZE
-#define YY_READ_BUF_SIZE 8192
-#endif
+size_t var_name_len(const char * word) {
+    /* the length of the name word starts with, 0 if it doesn't */
+    if (!(isalpha((unsigned char)word[0]) || word[0] == '_')) return 0;
+    size_t len = 1;
+    while (isalnum((unsigned char)word[len]) || word[len] == '_') len += 1;
+    return len;
+}
 
-/* Copy whatever the last rule matched to the standard output. */
-#ifndef ECHO
-/* This used to be an fputs(), but since the string might contain NUL's,
- * we now use fwrite().
- */
-#define ECHO fwrite( yytext, yyleng, 1, yyout )
-#endif
+const char * shell_param(shell_ctx_t * p_ctx, const char * name, const size_t len, char * number) {
+    /* the value $name stands for, NULL when unset; number has room for the
+       digits of $? and $#, and $@ is joined in the arena */
+    if (len == 1) {
+        const int index = name[0] - '0';
+        switch (name[0]) {
+        case '?':
+            snprintf(number, 16, "%d", p_ctx->last_status);
+            return number;
+
+        case '#':
+            snprintf(number, 16, "%d", p_ctx->num_params);
+            return number;
+
+        case '0':
+            return "myshell";
+
+        case '@':
+        case '*': {
+            size_t size = 1;
+            for (int i = 0; i < p_ctx->num_params; i += 1) size += strlen(p_ctx->params[i]) + 1;
+            char * joined = arena_alloc(&p_ctx->arena, size);
+            char * p_end = joined;
+            for (int i = 0; i < p_ctx->num_params; i += 1) {
+                if (i) *p_end++ = ' ';
+                const size_t param_len = strlen(p_ctx->params[i]);
+                memcpy(p_end, p_ctx->params[i], param_len);
+                p_end += param_len;
+            }
+            *p_end = '\0';
+            return joined;
+        }
 
-/* Gets input and stuffs it into "buf".  number of characters read, or YY_NULL,
- * is returned in "result".
- */
-#ifndef YY_INPUT
-#define YY_INPUT(buf,result,max_size) \
-    if ( YY_CURRENT_BUFFER_LVALUE->yy_is_interactive ) \
-        { \
-        int c = '*'; \
-        yy_size_t n; \
-        for ( n = 0; n < max_size && \
-                 (c = getc( yyin )) != EOF && c != '\n'; ++n ) \
-            buf[n] = (char) c; \
-        if ( c == '\n' ) \
-            buf[n++] = (char) c; \
-        if ( c == EOF && ferror( yyin ) ) \
-            YY_FATAL_ERROR( "input in flex scanner failed" ); \
-        result = n; \
-        } \
-    else \
-        { \
-        errno=0; \
-        while ( (result = fread(buf, 1, max_size, yyin))==0 && ferror(yyin)) \
-            { \
-            if( errno != EINTR) \
-                { \
-                YY_FATAL_ERROR( "input in flex scanner failed" ); \
-                break; \
-                } \
-            errno=0; \
-            clearerr(yyin); \
-            } \
-        }\
-\
+        default:
+            if (index >= 1 && index <= 9) return index <= p_ctx->num_params ? p_ctx->params[index - 1] : NULL;
+        }
+    }
+    return var_get(&global_vars, name, len);
+}
 
-#endif
+int var_assign(char ** argv) {
+    /* a line of NAME=value words only; NAME=value cmd is not supported */
+    for (int i = 0; argv[i]; i += 1) {
+        const size_t len = var_name_len(argv[i]);
+        if (!len || argv[i][len] != '=') {
+            printf("ERROR: %s: assignments before a command are not supported\n", argv[0]);
+            return 2;
+        }
+    }
+    for (int i = 0; argv[i]; i += 1) {
+        const size_t len = var_name_len(argv[i]);
+        if (!var_set(&global_vars, argv[i], len, argv[i] + len + 1, false)) {
+            puts("ERROR: out of memory");
+            return 1;
+        }
+    }
+    return 0;
+}
 
-/* No semi-colon after return; correct usage is to write "yyterminate();" -
- * we don't want an extra ';' after the "return" because that will cause
- * some compilers to complain about unreachable statements.
- */
-#ifndef yyterminate
-#define yyterminate() return YY_NULL
-#endif
+void glob_expand(shell_ctx_t * p_ctx) {
+    /* replaces each TOK_GLOB with the names it matches, sorted, or with
+       itself as a plain word when it matches none, as sh does; the word
+       after a redirection or heredoc operator is never expanded */
+    const size_t num_tokens = p_ctx->tokens.npos;
+    token_t * tokens = arena_alloc(&p_ctx->arena, num_tokens * sizeof(token_t));
+    memcpy(tokens, p_ctx->tokens.data, num_tokens * sizeof(token_t));
+    vec_t matches;
+    vec_init_arena(&matches, &p_ctx->arena, sizeof(char *));
+    char path[MAXPATHLEN];
+    p_ctx->tokens.npos = 0;
+    for (size_t i = 0; i < num_tokens; i += 1) {
+        token_t tok = tokens[i];
+        const int prev = i > 0 ? tokens[i - 1].tag : TOK_END;
+        const bool target = prev == TOK_REDIR || prev == TOK_HEREDOC || prev == TOK_HERE_STR;
+        size_t num_matches = 0;
+        if (tok.tag == TOK_GLOB) {
+            tok.tag = TOK_WORD;
+            if (!target && glob_is_pattern(tok.text, tok.len)) {
+                /* what it matches can change before the line comes again */
+                p_ctx->plan_line = NULL;
+                matches.npos = 0;
+                glob_walk(p_ctx, &matches, path, 0, tok.text);
+                num_matches = matches.npos;
+                qsort(matches.data, num_matches, sizeof(char *), glob_compare);
+            }
+        }
+        for (size_t j = 0; j < num_matches; j += 1) {
+            char * name = ((char **)matches.data)[j];
+            const token_t match = { name, strlen(name), TOK_WORD };
+            if (!vec_push(&p_ctx->tokens, &match)) {
+                puts(VEC_PUSH_ERROR_MSG);
+                exit(EXIT_FAILURE);
+            }
+        }
+        if (!num_matches && !vec_push(&p_ctx->tokens, &tok)) {
+            puts(VEC_PUSH_ERROR_MSG);
+            exit(EXIT_FAILURE);
+        }
+    }
+    p_ctx->num_globs = 0;
+}
 
-/* Number of entries by which start-condition stack grows. */
-#ifndef YY_START_STACK_INCR
-#define YY_START_STACK_INCR 25
-#endif
+void glob_walk(shell_ctx_t * p_ctx, vec_t * p_matches, char * path, size_t len,
+               const char * pattern) {
+    /* path holds the len characters matched so far, pattern the rest; one
+       component at a time, and only the ones with a pattern in them list
+       a directory */
+    while (*pattern == '/') {
+        if (len + 1 >= MAXPATHLEN) return;
+        path[len++] = '/';
+        pattern += 1;
+    }
+    const char * end = strchr(pattern, '/');
+    if (!end) end = pattern + strlen(pattern);
+    const size_t part_len = end - pattern;
+    path[len] = '\0';
+    if (!glob_is_pattern(pattern, part_len)) {
+        if (len + part_len >= MAXPATHLEN) return;
+        memcpy(path + len, pattern, part_len);
+        len += part_len;
+        path[len] = '\0';
+        struct stat st;
+        if (*end) {
+            glob_walk(p_ctx, p_matches, path, len, end);
+        } else if (lstat(path, &st) == 0) {
+            char * match = arena_strndup(&p_ctx->arena, path, len);
+            if (match) vec_push(p_matches, &match);
+        }
+        return;
+    }
+    const dir_listing_t * p_dir = dir_cache_get(&global_dir_cache, len ? path : ".");
+    if (!p_dir) return;
+    /* the names to descend into are copied out first, looking inside them
+       can load other listings over this one */
+    vec_t dirs;
+    if (*end) vec_init_arena(&dirs, &p_ctx->arena, sizeof(char *));
+    for (size_t i = 0; i < p_dir->num_names; i += 1) {
+        const char * name = p_dir->names + p_dir->offsets[i];
+        /* dot files only match a pattern that starts with a dot as well */
+        if (name[0] == '.' && pattern[0] != '.') continue;
+        if (!glob_match(pattern, part_len, name)) continue;
+        const size_t name_len = strlen(name);
+        if (len + name_len >= MAXPATHLEN) continue;
+        if (*end) {
+            char * copy = arena_strndup(&p_ctx->arena, name, name_len);
+            if (copy) vec_push(&dirs, &copy);
+            continue;
+        }
+        char * match = arena_alloc(&p_ctx->arena, len + name_len + 1);
+        if (!match) continue;
+        memcpy(match, path, len);
+        memcpy(match + len, name, name_len + 1);
+        vec_push(p_matches, &match);
+    }
+    if (!*end) return;
+    for (size_t i = 0; i < dirs.npos; i += 1) {
+        const char * name = ((char **)dirs.data)[i];
+        const size_t name_len = strlen(name);
+        memcpy(path + len, name, name_len);
+        glob_walk(p_ctx, p_matches, path, len + name_len, end);
+    }
+}
 
-/* Report a fatal error. */
-#ifndef YY_FATAL_ERROR
-#define YY_FATAL_ERROR(msg) yy_fatal_error( msg )
-#endif
+bool glob_is_pattern(const char * text, const size_t len) {
+    /* a [ only opens a bracket expression when a ] comes after it, so the
+       test builtin's [ is left alone */
+    for (size_t i = 0; i < len; i += 1) {
+        if (text[i] == '*' || text[i] == '?') return true;
+        if (text[i] == '[' && memchr(text + i + 1, ']', len - i - 1)) return true;
+    }
+    return false;
+}
 
-/* end tables serialization structures and prototypes */
+bool glob_match(const char * pattern, const size_t len, const char * name) {
+    /* iterative, remembering only the last *: a mismatch resumes right
+       after it with the * taking one more character, so matching is
+       O(len * strlen(name)) at worst instead of exponential */
+    size_t p = 0;
+    size_t star_p = 0;
+    const char * star_name = NULL;
+    while (*name) {
+        if (p < len && pattern[p] == '*') {
+            star_p = ++p;
+            star_name = name;
+            continue;
+        }
+        const size_t next = p < len ? glob_match_char(pattern, len, p, *name) : 0;
+        if (next) {
+            p = next;
+            name += 1;
+        } else if (star_name) {
+            p = star_p;
+            name = ++star_name;
+        } else {
+            return false;
+        }
+    }
+    while (p < len && pattern[p] == '*') p += 1;
+    return p == len;
+}
 
-/* Default declaration of generated scanner - a define so the user can
- * easily add parameters.
- */
-#ifndef YY_DECL
-#define YY_DECL_IS_OURS 1
+size_t glob_match_char(const char * pattern, const size_t len, const size_t p,
+                       const unsigned char c) {
+    /* matches c against the ?, [...] or character at p, giving where the
+       pattern goes on from, 0 for a mismatch */
+    if (pattern[p] == '?') return p + 1;
+    if (pattern[p] != '[') return (unsigned char)pattern[p] == c ? p + 1 : 0;
+    size_t i = p + 1;
+    const bool negate = i < len && (pattern[i] == '!' || pattern[i] == '^');
+    if (negate) i += 1;
+    const size_t first = i;
+    bool found = false;
+    /* a ] right at the start is one of the characters */
+    while (i < len && (pattern[i] != ']' || i == first)) {
+        const unsigned char lo = pattern[i];
+        unsigned char hi = lo;
+        if (i + 2 < len && pattern[i + 1] == '-' && pattern[i + 2] != ']') {
+            hi = pattern[i + 2];
+            i += 3;
+        } else {
+            i += 1;
+        }
+        if (lo <= c && c <= hi) found = true;
+    }
+    /* never closed, so the [ is just a character */
+    if (i >= len) return c == '[' ? p + 1 : 0;
+    return found != negate ? i + 1 : 0;
+}
 
-extern int yylex (void);
+int glob_compare(const void * p_a, const void * p_b) {
+    return strcmp(*(char * const *)p_a, *(char * const *)p_b);
+}
 
-#define YY_DECL int yylex (void)
-#endif /* !YY_DECL */
+const dir_listing_t * dir_cache_get(dir_cache_t * p_cache, const char * path) {
+    /* one stat when the listing is cached, rather than reading the whole
+       directory again */
+    struct stat st;
+    if (stat(path, &st) == -1 || !S_ISDIR(st.st_mode)) return NULL;
+    const struct timespec mtime = stat_mtime(&st);
+    p_cache->clock += 1;
+    dir_listing_t * p_slot = &p_cache->listings[0];
+    for (int i = 0; i < DIR_CACHE_CAPACITY; i += 1) {
+        dir_listing_t * p_dir = &p_cache->listings[i];
+        if (p_dir->valid && p_dir->dev == st.st_dev && p_dir->ino == st.st_ino) {
+            if (!p_dir->racy && p_dir->mtime.tv_sec == mtime.tv_sec &&
+                p_dir->mtime.tv_nsec == mtime.tv_nsec) {
+                p_dir->last_use = p_cache->clock;
+                p_cache->hits += 1;
+                return p_dir;
+            }
+            p_slot = p_dir;
+            break;
+        }
+        /* otherwise a free slot, or the least recently used */
+        if (p_slot->valid && (!p_dir->valid || p_dir->last_use < p_slot->last_use)) p_slot = p_dir;
+    }
+    p_slot->valid = false;
+    const int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) return NULL;
+    /* the key comes from before the read, a change made during it leaves
+       the listing stale */
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return NULL;
+    }
+    p_slot->dev = st.st_dev;
+    p_slot->ino = st.st_ino;
+    p_slot->mtime = stat_mtime(&st);
+    p_slot->racy = time(NULL) <= p_slot->mtime.tv_sec;
+    p_slot->last_use = p_cache->clock;
+    p_cache->reads += 1;
+    if (!dir_read(p_slot, fd)) return NULL;
+    p_slot->valid = true;
+    return p_slot;
+}
 
-/* Code executed at the beginning of each rule, after yytext and yyleng
- * have been set up.
- */
-#ifndef YY_USER_ACTION
-#define YY_USER_ACTION
+#if defined(__linux__) && defined(SYS_getdents64)
+/* what getdents64 fills its buffer with, glibc only declares it for
+   _GNU_SOURCE */
+typedef struct dirent64_t {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+} dirent64_t;
 #endif
 
-/* Code executed at the end of each rule. */
-#ifndef YY_BREAK
-#define YY_BREAK break;
+bool dir_read(dir_listing_t * p_dir, const int fd) {
+    /* fills the listing with every name but . and .., closes fd */
+    p_dir->names_len = 0;
+    p_dir->num_names = 0;
+    bool ok = true;
+#if defined(__linux__) && defined(SYS_getdents64)
+    /* straight from the kernel, a buffer full of names per call instead of
+       readdir's copy of every entry */
+    uint64_t buffer[DIR_READ_SIZE / sizeof(uint64_t)];
+    for (;;) {
+        const long res = syscall(SYS_getdents64, fd, buffer, sizeof(buffer));
+        if (res <= 0) {
+            ok = res == 0;
+            break;
+        }
+        for (long pos = 0; pos < res && ok;) {
+            const dirent64_t * p_ent = (const dirent64_t *)((char *)buffer + pos);
+            pos += p_ent->d_reclen;
+            const char * name = p_ent->d_name;
+            if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2]))) continue;
+            ok = dir_add_name(p_dir, name, strlen(name));
+        }
+        if (!ok) break;
+    }
+    close(fd);
+#else
+    DIR * p_stream = fdopendir(fd);
+    if (!p_stream) {
+        close(fd);
+        return false;
+    }
+    for (struct dirent * p_ent; ok && (p_ent = readdir(p_stream));) {
+        const char * name = p_ent->d_name;
+        if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2]))) continue;
+        ok = dir_add_name(p_dir, name, strlen(name));
+    }
+    closedir(p_stream);
 #endif
+    return ok;
+}
 
-#define YY_RULE_SETUP \
-    YY_USER_ACTION
-
-/** The main scanner function which does all the work.
- */
-YY_DECL
-{
-    register yy_state_type yy_current_state;
-    register char *yy_cp, *yy_bp;
-    register int yy_act;
-    
-#line 9 "lexer.l"
+bool dir_add_name(dir_listing_t * p_dir, const char * name, const size_t len) {
+    if (p_dir->names_len + len + 1 > p_dir->names_capacity) {
+        size_t capacity = p_dir->names_capacity ? p_dir->names_capacity * 2 : DIR_READ_SIZE;
+        while (capacity < p_dir->names_len + len + 1) capacity *= 2;
+        char * names = realloc(p_dir->names, capacity);
+        if (!names) return false;
+        p_dir->names = names;
+        p_dir->names_capacity = capacity;
+    }
+    if (p_dir->num_names == p_dir->offsets_capacity) {
+        const size_t capacity = p_dir->offsets_capacity ? p_dir->offsets_capacity * 2 : 256;
+        size_t * offsets = realloc(p_dir->offsets, capacity * sizeof(size_t));
+        if (!offsets) return false;
+        p_dir->offsets = offsets;
+        p_dir->offsets_capacity = capacity;
+    }
+    p_dir->offsets[p_dir->num_names++] = p_dir->names_len;
+    memcpy(p_dir->names + p_dir->names_len, name, len + 1);
+    p_dir->names_len += len + 1;
+    return true;
+}
 
-#line 657 "lex.yy.c"
+struct timespec stat_mtime(const struct stat * p_st) {
+#ifdef __linux__
+    return p_st->st_mtim;
+#else
+    /* whole seconds only, which the racy check copes with */
+    const struct timespec mtime = { p_st->st_mtime, 0 };
+    return mtime;
+#endif
+}
 
-    if ( !(yy_init) )
-        {
-        (yy_init) = 1;
+bool history_open(history_t * p_hist) {
+    /* $HISTFILE, or ~/.myshell_history */
+    char path[MAXPATHLEN];
+    const char * file = var_get(&global_vars, "HISTFILE", 8);
+    const char * home = var_get(&global_vars, "HOME", 4);
+    if (file && file[0]) {
+        snprintf(path, sizeof(path), "%s", file);
+    } else if (home) {
+        snprintf(path, sizeof(path), "%s/.myshell_history", home);
+    } else {
+        errno = ENOENT;
+        return false;
+    }
+    p_hist->fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (p_hist->fd == -1) return false;
+    p_hist->offsets = malloc(HISTORY_INIT_ENTRIES * sizeof(size_t));
+    if (!p_hist->offsets) {
+        close(p_hist->fd);
+        return false;
+    }
+    p_hist->offsets_capacity = HISTORY_INIT_ENTRIES;
+    p_hist->offsets[0] = 0;
+    p_hist->last_end = -1;
+    p_hist->open = true;
+    return true;
+}
 
-#ifdef YY_USER_INIT
-        YY_USER_INIT;
-#endif
+void history_append(history_t * p_hist, const char * line, const size_t len) {
+    /* blank lines, and ones starting with a blank as in bash's
+       ignorespace, are left out */
+    if (!p_hist->open || line[0] == ' ' || line[0] == '\t' || line[0] == '\n') return;
+    struct iovec parts[2] = {{(void *)line, len}, {"\n", 1}};
+    const int num_parts = line[len - 1] == '\n' ? 1 : 2;
+    /* one write of the whole entry, O_APPEND puts it after everything any
+       other shell wrote */
+    if (writev(p_hist->fd, parts, num_parts) > 0) {
+        p_hist->last_end = lseek(p_hist->fd, 0, SEEK_CUR);
+    }
+}
 
-        if ( ! (yy_start) )
-            (yy_start) = 1; /* first start state */
+bool history_sync(history_t * p_hist) {
+    /* maps whatever was appended since the last call, by this shell or any
+       other, and finds the entries in it; a line still being written (no
+       newline yet) waits for the next time */
+    struct stat st;
+    if (fstat(p_hist->fd, &st) == -1) return false;
+    size_t size = st.st_size;
+    if (size < p_hist->offsets[p_hist->num_entries]) history_reset(p_hist);
+    if (size > p_hist->map_len) {
+        if (p_hist->map) munmap((void *)p_hist->map, p_hist->map_len);
+        void * map = mmap(NULL, size, PROT_READ, MAP_SHARED, p_hist->fd, 0);
+        if (map == MAP_FAILED) {
+            p_hist->map = NULL;
+            p_hist->map_len = 0;
+            history_reset(p_hist);
+            return false;
+        }
+        p_hist->map = map;
+        p_hist->map_len = size;
+    }
+    size_t pos = p_hist->offsets[p_hist->num_entries];
+    while (pos < size) {
+        const char * newline = memchr(p_hist->map + pos, '\n', size - pos);
+        if (!newline) break;
+        if (p_hist->num_entries + 1 == p_hist->offsets_capacity) {
+            const size_t capacity = p_hist->offsets_capacity * 2;
+            size_t * offsets = realloc(p_hist->offsets, capacity * sizeof(size_t));
+            if (!offsets) return false;
+            p_hist->offsets = offsets;
+            p_hist->offsets_capacity = capacity;
+        }
+        pos = newline - p_hist->map + 1;
+        p_hist->offsets[++p_hist->num_entries] = pos;
+    }
+    return true;
+}
 
-        if ( ! yyin )
-            yyin = stdin;
+void history_reset(history_t * p_hist) {
+    /* the file was truncated under us, every entry is read again */
+    for (size_t i = 0; i < p_hist->trigrams_capacity; i += 1) free(p_hist->trigrams[i].ids);
+    free(p_hist->trigrams);
+    p_hist->trigrams = NULL;
+    p_hist->trigrams_capacity = p_hist->num_trigrams = 0;
+    p_hist->num_entries = p_hist->num_indexed = 0;
+}
 
-        if ( ! yyout )
-            yyout = fopen(".flex_errors", "w");
+bool history_index(history_t * p_hist) {
+    /* adds every entry not indexed yet to the posting list of each of its
+       trigrams, once per entry, so the lists stay sorted by entry */
+    for (; p_hist->num_indexed < p_hist->num_entries; p_hist->num_indexed += 1) {
+        const size_t id = p_hist->num_indexed;
+        const unsigned char * text = (const unsigned char *)p_hist->map + p_hist->offsets[id];
+        const size_t len = p_hist->offsets[id + 1] - p_hist->offsets[id] - 1;
+        for (size_t i = 0; i + 3 <= len; i += 1) {
+            const unsigned key = (unsigned)text[i] << 16 | text[i + 1] << 8 | text[i + 2];
+            trigram_t * p_tri = history_trigram(p_hist, key, true);
+            if (!p_tri) return false;
+            if (p_tri->num_ids && p_tri->ids[p_tri->num_ids - 1] == id) continue;
+            if (p_tri->num_ids == p_tri->capacity) {
+                const unsigned capacity = p_tri->capacity ? p_tri->capacity * 2 : 4;
+                unsigned * ids = realloc(p_tri->ids, capacity * sizeof(unsigned));
+                if (!ids) return false;
+                p_tri->ids = ids;
+                p_tri->capacity = capacity;
+            }
+            p_tri->ids[p_tri->num_ids++] = id;
+        }
+    }
+    return true;
+}
 
-        if ( ! YY_CURRENT_BUFFER ) {
-            yyensure_buffer_stack ();
-            YY_CURRENT_BUFFER_LVALUE =
-                yy_create_buffer(yyin,YY_BUF_SIZE );
+trigram_t * history_trigram(history_t * p_hist, const unsigned key, const bool add) {
+    if (add && (p_hist->num_trigrams + 1) * 2 > p_hist->trigrams_capacity) {
+        const size_t capacity = p_hist->trigrams_capacity ? p_hist->trigrams_capacity * 2
+                                                          : HASH_INIT_CAPACITY;
+        trigram_t * trigrams = calloc(capacity, sizeof(trigram_t));
+        if (!trigrams) return NULL;
+        for (size_t i = 0; i < p_hist->trigrams_capacity; i += 1) {
+            const trigram_t * p_tri = &p_hist->trigrams[i];
+            if (!p_tri->key) continue;
+            size_t idx = (p_tri->key * 2654435761u) & (capacity - 1);
+            while (trigrams[idx].key) idx = (idx + 1) & (capacity - 1);
+            trigrams[idx] = *p_tri;
         }
+        free(p_hist->trigrams);
+        p_hist->trigrams = trigrams;
+        p_hist->trigrams_capacity = capacity;
+    }
+    if (!p_hist->trigrams_capacity) return NULL;
+    const unsigned used = key | TRIGRAM_USED;
+    const size_t mask = p_hist->trigrams_capacity - 1;
+    size_t idx = (used * 2654435761u) & mask;
+    for (; p_hist->trigrams[idx].key; idx = (idx + 1) & mask) {
+        if (p_hist->trigrams[idx].key == used) return &p_hist->trigrams[idx];
+    }
+    if (!add) return NULL;
+    p_hist->trigrams[idx].key = used;
+    p_hist->num_trigrams += 1;
+    return &p_hist->trigrams[idx];
+}
 
-        yy_load_buffer_state( );
+size_t history_find(history_t * p_hist, const char * text, const size_t len, size_t before) {
+    /* the newest entry before the given one that contains text, as its
+       number from 1, or 0; only the entries holding the rarest trigram of
+       text are looked at, newest first */
+    if (len < 3 || !history_index(p_hist)) {
+        while (before-- > 0) {
+            if (history_contains(p_hist, before, text, len)) return before + 1;
         }
+        return 0;
+    }
+    const trigram_t * p_rarest = NULL;
+    for (size_t i = 0; i + 3 <= len; i += 1) {
+        const unsigned char * tri = (const unsigned char *)text + i;
+        const trigram_t * p_tri =
+            history_trigram(p_hist, (unsigned)tri[0] << 16 | tri[1] << 8 | tri[2], false);
+        if (!p_tri) return 0;
+        if (!p_rarest || p_tri->num_ids < p_rarest->num_ids) p_rarest = p_tri;
+    }
+    size_t lo = 0;
+    size_t hi = p_rarest->num_ids;
+    while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if (p_rarest->ids[mid] < before) lo = mid + 1;
+        else hi = mid;
+    }
+    while (lo-- > 0) {
+        const size_t id = p_rarest->ids[lo];
+        if (history_contains(p_hist, id, text, len)) return id + 1;
+    }
+    return 0;
+}
 
-    while ( 1 )     /* loops until end-of-file is reached */
-        {
-        yy_cp = (yy_c_buf_p);
+bool history_contains(const history_t * p_hist, const size_t id, const char * text,
+                      const size_t len) {
+    const char * entry = p_hist->map + p_hist->offsets[id];
+    const char * end = p_hist->map + p_hist->offsets[id + 1] - 1;
+    if (!len) return true;
+    while ((size_t)(end - entry) >= len) {
+        const char * first = memchr(entry, text[0], end - entry - len + 1);
+        if (!first) return false;
+        if (memcmp(first, text, len) == 0) return true;
+        entry = first + 1;
+    }
+    return false;
+}
 
-        /* Support of yytext. */
-        *yy_cp = (yy_hold_char);
+void history_print(const history_t * p_hist, const size_t id) {
+    const size_t len = p_hist->offsets[id + 1] - p_hist->offsets[id] - 1;
+    printf("%6zu  %.*s\n", id + 1, (int)len, p_hist->map + p_hist->offsets[id]);
+}
 
-        /* yy_bp points to the position in yy_ch_buf of the start of
-         * the current run.
-         */
-        yy_bp = yy_cp;
+size_t hash_bytes(const char * data, const size_t len) {
+    /* FNV-1a, like hash_string but the line is not NUL terminated */
+    size_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i += 1) {
+        hash ^= (unsigned char)data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
 
-        yy_current_state = (yy_start);
-yy_match:
-        do
-            {
-            register YY_CHAR yy_c = yy_ec[YY_SC_TO_UI(*yy_cp)];
-            if ( yy_accept[yy_current_state] )
-                {
-                (yy_last_accepting_state) = yy_current_state;
-                (yy_last_accepting_cpos) = yy_cp;
-                }
-            while ( yy_chk[yy_base[yy_current_state] + yy_c] != yy_current_state )
-                {
-                yy_current_state = (int) yy_def[yy_current_state];
-                if ( yy_current_state >= 25 )
-                    yy_c = yy_meta[(unsigned int) yy_c];
-                }
-            yy_current_state = yy_nxt[yy_base[yy_current_state] + (unsigned int) yy_c];
-            ++yy_cp;
-            }
-        while ( yy_base[yy_current_state] != 46 );
-
-yy_find_action:
-        yy_act = yy_accept[yy_current_state];
-        if ( yy_act == 0 )
-            { /* have to back up */
-            yy_cp = (yy_last_accepting_cpos);
-            yy_current_state = (yy_last_accepting_state);
-            yy_act = yy_accept[yy_current_state];
-            }
+void plan_cache_init(plan_cache_t * p_cache) {
+    memset(p_cache, 0, sizeof(plan_cache_t));
+    memset(p_cache->buckets, -1, sizeof(p_cache->buckets));
+    p_cache->head = p_cache->tail = -1;
+}
 
-        YY_DO_BEFORE_ACTION;
-
-do_action:  /* This label is used only to access EOF actions. */
-
-        switch ( yy_act )
-    { /* beginning of action switch */
-            case 0: /* must back up */
-            /* undo the effects of YY_DO_BEFORE_ACTION */
-            *yy_cp = (yy_hold_char);
-            yy_cp = (yy_last_accepting_cpos);
-            yy_current_state = (yy_last_accepting_state);
-            goto yy_find_action;
-
-case 1:
-YY_RULE_SETUP
-#line 10 "lexer.l"
-{
-                          char * tok = strdup(yytext);
-                          vec_push(p_global_lexer_target, &tok);
-                          global_builtin_idxs[CMD_CD] = global_num_commands - 1;
-                          global_num_builtins += 1;
-                      }
-    YY_BREAK
-case 2:
-YY_RULE_SETUP
-#line 16 "lexer.l"
-{
-                          char * tok = strdup(yytext);
-                          vec_push(p_global_lexer_target, &tok);
-                          global_builtin_idxs[CMD_EXIT] = global_num_commands - 1;
-                          global_num_builtins += 1;
-                      }
-    YY_BREAK
-case 3:
-YY_RULE_SETUP
-#line 22 "lexer.l"
-{
-                          char * tok = strdup(yytext);
-                          vec_push(p_global_lexer_target, &tok);
-                          global_num_commands += 1;
-                      }
-    YY_BREAK
-case 4:
-YY_RULE_SETUP
-#line 27 "lexer.l"
-{
-                          char * tok = strdup(yytext);
-                          vec_push(p_global_lexer_target, &tok);
-                      }
-    YY_BREAK
-case 5:
-/* rule 5 can match eol */
-YY_RULE_SETUP
-#line 31 "lexer.l"
-{
-                          size_t len = strlen(yytext) - 2;
-                          if (len > 0) {
-                              char * tok = malloc(len + 1);
-                              memcpy(tok, yytext + 1, len);
-                              tok[len] = '\0';
-                              vec_push(p_global_lexer_target, &tok);
-                          }
-                      }
-    YY_BREAK
-case 6:
-YY_RULE_SETUP
-#line 40 "lexer.l"
-{
-                          char * tok = strdup(yytext);
-                          vec_push(p_global_lexer_target, &tok);
-                      }
-    YY_BREAK
-case 7:
-/* rule 7 can match eol */
-YY_RULE_SETUP
-#line 44 "lexer.l"
-/* Ignore whitespace... */
-    YY_BREAK
-case 8:
-YY_RULE_SETUP
-#line 45 "lexer.l"
-ECHO;
-    YY_BREAK
-#line 810 "lex.yy.c"
-case YY_STATE_EOF(INITIAL):
-    yyterminate();
-
-    case YY_END_OF_BUFFER:
-        {
-        /* Amount of text matched not including the EOB char. */
-        int yy_amount_of_matched_text = (int) (yy_cp - (yytext_ptr)) - 1;
-
-        /* Undo the effects of YY_DO_BEFORE_ACTION. */
-        *yy_cp = (yy_hold_char);
-        YY_RESTORE_YY_MORE_OFFSET
-
-        if ( YY_CURRENT_BUFFER_LVALUE->yy_buffer_status == YY_BUFFER_NEW )
-            {
-            /* We're scanning a new file or input source.  It's
-             * possible that this happened because the user
-             * just pointed yyin at a new source and called
-             * yylex().  If so, then we have to assure
-             * consistency between YY_CURRENT_BUFFER and our
-             * globals.  Here is the right place to do so, because
-             * this is the first action (other than possibly a
-             * back-up) that will match for the new input source.
-             */
-            (yy_n_chars) = YY_CURRENT_BUFFER_LVALUE->yy_n_chars;
-            YY_CURRENT_BUFFER_LVALUE->yy_input_file = yyin;
-            YY_CURRENT_BUFFER_LVALUE->yy_buffer_status = YY_BUFFER_NORMAL;
-            }
+void plan_unlink(plan_cache_t * p_cache, const int idx) {
+    plan_t * p_plan = &p_cache->entries[idx];
+    if (p_plan->prev != -1) p_cache->entries[p_plan->prev].next = p_plan->next;
+    else p_cache->head = p_plan->next;
+    if (p_plan->next != -1) p_cache->entries[p_plan->next].prev = p_plan->prev;
+    else p_cache->tail = p_plan->prev;
+}
 
-        /* Note that here we test for yy_c_buf_p "<=" to the position
-         * of the first EOB in the buffer, since yy_c_buf_p will
-         * already have been incremented past the NUL character
-         * (since all states make transitions on EOB to the
-         * end-of-buffer state).  Contrast this with the test
-         * in input().
-         */
-        if ( (yy_c_buf_p) <= &YY_CURRENT_BUFFER_LVALUE->yy_ch_buf[(yy_n_chars)] )
-            { /* This was really a NUL. */
-            yy_state_type yy_next_state;
-
-            (yy_c_buf_p) = (yytext_ptr) + yy_amount_of_matched_text;
-
-            yy_current_state = yy_get_previous_state(  );
-
-            /* Okay, we're now positioned to make the NUL
-             * transition.  We couldn't have
-             * yy_get_previous_state() go ahead and do it
-             * for us because it doesn't know how to deal
-             * with the possibility of jamming (and we don't
-             * want to build jamming into it because then it
-             * will run more slowly).
-             */
-
-            yy_next_state = yy_try_NUL_trans( yy_current_state );
-
-            yy_bp = (yytext_ptr) + YY_MORE_ADJ;
-
-            if ( yy_next_state )
-                {
-                /* Consume the NUL. */
-                yy_cp = ++(yy_c_buf_p);
-                yy_current_state = yy_next_state;
-                goto yy_match;
-                }
+void plan_push_front(plan_cache_t * p_cache, const int idx) {
+    plan_t * p_plan = &p_cache->entries[idx];
+    p_plan->prev = -1;
+    p_plan->next = p_cache->head;
+    if (p_cache->head != -1) p_cache->entries[p_cache->head].prev = idx;
+    p_cache->head = idx;
+    if (p_cache->tail == -1) p_cache->tail = idx;
+}
 
-            else
-                {
-                yy_cp = (yy_c_buf_p);
-                goto yy_find_action;
-                }
-            }
+bool plan_cache_lookup(plan_cache_t * p_cache, shell_ctx_t * p_ctx,
+                       const char * line, const size_t len) {
+    /* on a hit the context is set up as if the line had just been lexed,
+       on a miss it remembers the key for plan_cache_store */
+    if (len == 0) return false;
+    const size_t hash = hash_bytes(line, len);
+    int idx = p_cache->buckets[hash & (PLAN_CACHE_BUCKETS - 1)];
+    while (idx != -1) {
+        const plan_t * p_plan = &p_cache->entries[idx];
+        if (p_plan->hash == hash && p_plan->line_len == len &&
+            memcmp(p_plan->line, line, len) == 0) break;
+        idx = p_plan->chain;
+    }
+    if (idx == -1) {
+        p_cache->misses += 1;
+        p_ctx->plan_hash = hash;
+        p_ctx->plan_line = p_ctx->line = arena_strndup(&p_ctx->arena, line, len);
+        p_ctx->plan_line_len = p_ctx->line_len = len;
+        return false;
+    }
+    p_cache->hits += 1;
+    plan_unlink(p_cache, idx);
+    plan_push_front(p_cache, idx);
+    const plan_t * p_plan = &p_cache->entries[idx];
+    if (!vec_reserve(&p_ctx->tokens, p_ctx->tokens.npos + p_plan->num_tokens)) {
+        puts(VEC_PUSH_ERROR_MSG);
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < p_plan->num_tokens; i += 1) {
+        if (!vec_push(&p_ctx->tokens, &p_plan->tokens[i])) {
+            puts(VEC_PUSH_ERROR_MSG);
+            exit(EXIT_FAILURE);
+        }
+    }
+    p_ctx->num_commands = p_plan->num_commands;
+    p_ctx->bkg_proc = p_plan->bkg_proc;
+    p_ctx->timed = p_plan->timed;
+    p_ctx->p_plan = p_plan;
+    return true;
+}
 
-        else switch ( yy_get_next_buffer(  ) )
-            {
-            case EOB_ACT_END_OF_FILE:
-                {
-                (yy_did_buffer_switch_on_eof) = 0;
-
-                if ( yywrap( ) )
-                    {
-                    /* Note: because we've taken care in
-                     * yy_get_next_buffer() to have set up
-                     * yytext, we can now set up
-                     * yy_c_buf_p so that if some total
-                     * hoser (like flex itself) wants to
-                     * call the scanner after we return the
-                     * YY_NULL, it'll still work - another
-                     * YY_NULL will get returned.
-                     */
-                    (yy_c_buf_p) = (yytext_ptr) + YY_MORE_ADJ;
-
-                    yy_act = YY_STATE_EOF(YY_START);
-                    goto do_action;
-                    }
-
-                else
-                    {
-                    if ( ! (yy_did_buffer_switch_on_eof) )
-                        YY_NEW_FILE;
-                    }
-                break;
-                }
+size_t plan_argc(char ** argv) {
+    size_t argc = 0;
+    if (argv) while (argv[argc]) argc += 1;
+    return argc;
+}
 
-            case EOB_ACT_CONTINUE_SCAN:
-                (yy_c_buf_p) =
-                    (yytext_ptr) + yy_amount_of_matched_text;
+char * plan_copy_str(char ** p_strings, const char * str, const size_t len) {
+    char * copy = *p_strings;
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    *p_strings += len + 1;
+    return copy;
+}
 
-                yy_current_state = yy_get_previous_state(  );
+void plan_cache_store(plan_cache_t * p_cache, shell_ctx_t * p_ctx,
+                      const command_t * commands, const int num_commands) {
+    if (!p_ctx->plan_line) return;
+    const token_t * tokens = (const token_t *)p_ctx->tokens.data;
+    const size_t num_tokens = p_ctx->tokens.npos;
+    /* pointer sized data first, then the strings */
+    size_t num_ptrs = 0;
+    size_t num_redirs = 0;
+    size_t str_size = p_ctx->plan_line_len + 1;
+    for (size_t i = 0; i < num_tokens; i += 1) str_size += tokens[i].len + 1;
+    for (int i = 0; i < num_commands; i += 1) {
+        const size_t argc = plan_argc(commands[i].argv);
+        num_ptrs += argc + 1;
+        for (size_t j = 0; j < argc; j += 1) str_size += strlen(commands[i].argv[j]) + 1;
+        num_redirs += commands[i].num_redirs;
+        for (int j = 0; j < commands[i].num_redirs; j += 1) {
+            if (commands[i].redirs[j].path) str_size += strlen(commands[i].redirs[j].path) + 1;
+        }
+        if (commands[i].here) str_size += commands[i].here_len + 1;
+    }
+    const size_t size = num_tokens * sizeof(token_t) + num_commands * sizeof(command_t)
+                      + num_redirs * sizeof(redir_t) + num_ptrs * sizeof(char *) + str_size;
+    /* a free slot, or else the least recently used plan and its storage */
+    const bool evict = p_cache->num_entries == PLAN_CACHE_CAPACITY;
+    const int idx = evict ? p_cache->tail : p_cache->num_entries;
+    plan_t * p_plan = &p_cache->entries[idx];
+    if (p_plan->storage_capacity < size) {
+        /* on failure the cache is left as it was, the line just isn't kept */
+        char * storage = realloc(p_plan->storage, size);
+        if (!storage) return;
+        global_loop_allocs += 1;
+        p_plan->storage = storage;
+        p_plan->storage_capacity = size;
+    }
+    if (evict) {
+        plan_unlink(p_cache, idx);
+        int * p_link = &p_cache->buckets[p_plan->hash & (PLAN_CACHE_BUCKETS - 1)];
+        while (*p_link != idx) p_link = &p_cache->entries[*p_link].chain;
+        *p_link = p_plan->chain;
+    } else {
+        p_cache->num_entries += 1;
+    }
+    p_plan->tokens = (token_t *)p_plan->storage;
+    p_plan->commands = (command_t *)(p_plan->tokens + num_tokens);
+    redir_t * p_redirs = (redir_t *)(p_plan->commands + num_commands);
+    char ** p_argv = (char **)(p_redirs + num_redirs);
+    char * p_strings = (char *)(p_argv + num_ptrs);
+    p_plan->hash = p_ctx->plan_hash;
+    p_plan->line_len = p_ctx->plan_line_len;
+    p_plan->line = plan_copy_str(&p_strings, p_ctx->plan_line, p_ctx->plan_line_len);
+    p_plan->num_tokens = num_tokens;
+    for (size_t i = 0; i < num_tokens; i += 1) {
+        p_plan->tokens[i] = tokens[i];
+        p_plan->tokens[i].text = plan_copy_str(&p_strings, tokens[i].text, tokens[i].len);
+    }
+    for (int i = 0; i < num_commands; i += 1) {
+        command_t * p_command = &p_plan->commands[i];
+        *p_command = commands[i];
+        const size_t argc = plan_argc(commands[i].argv);
+        p_command->argv = p_argv;
+        for (size_t j = 0; j < argc; j += 1) {
+            p_argv[j] = plan_copy_str(&p_strings, commands[i].argv[j], strlen(commands[i].argv[j]));
+        }
+        p_argv[argc] = NULL;
+        p_argv += argc + 1;
+        p_command->redirs = p_redirs;
+        for (int j = 0; j < commands[i].num_redirs; j += 1) {
+            p_redirs[j] = commands[i].redirs[j];
+            const char * path = commands[i].redirs[j].path;
+            if (path) p_redirs[j].path = plan_copy_str(&p_strings, path, strlen(path));
+        }
+        p_redirs += commands[i].num_redirs;
+        if (commands[i].here) {
+            p_command->here = plan_copy_str(&p_strings, commands[i].here, commands[i].here_len);
+        }
+    }
+    p_plan->num_commands = p_ctx->num_commands;
+    p_plan->bkg_proc = p_ctx->bkg_proc;
+    p_plan->timed = p_ctx->timed;
+    int * p_bucket = &p_cache->buckets[p_plan->hash & (PLAN_CACHE_BUCKETS - 1)];
+    p_plan->chain = *p_bucket;
+    *p_bucket = idx;
+    plan_push_front(p_cache, idx);
+    p_ctx->plan_line = NULL;
+}
 
-                yy_cp = (yy_c_buf_p);
-                yy_bp = (yytext_ptr) + YY_MORE_ADJ;
-                goto yy_match;
+void script_eval(shell_ctx_t * p_ctx) {
+    /* the line is compiled on its own, or together with the lines after it
+       while it leaves a compound command open; compiled scripts are kept
+       by their text, so one that comes round again is only run */
+    vec_t text;
+    vec_init_arena(&text, &p_ctx->arena, 1);
+    if (!vec_reserve(&text, p_ctx->line_len)) {
+        puts(VEC_PUSH_ERROR_MSG);
+        exit(EXIT_FAILURE);
+    }
+    memcpy(text.data, p_ctx->line, p_ctx->line_len);
+    text.npos = p_ctx->line_len;
+    script_t * p_script;
+    while (!(p_script = script_cache_find(&global_scripts, text.data, text.npos))) {
+        script_failure_t failure;
+        p_script = script_compile(text.data, text.npos, &failure);
+        if (p_script) {
+            script_cache_store(&global_scripts, p_script);
+            break;
+        }
+        if (!failure.incomplete) {
+            /* the bodies are not commands, whatever became of the rest */
+            script_skip_heredocs(p_ctx, &text, &failure);
+            p_ctx->last_status = 2;
+            return;
+        }
+        if (!script_more_input(p_ctx, &text)) {
+            puts("ERROR: syntax error: unexpected end of input");
+            p_ctx->last_status = 2;
+            return;
+        }
+    }
+    /* the cache could let go of it while it runs */
+    p_script->refs += 1;
+    script_run(p_ctx, p_script, 0);
+    script_release(p_script);
+}
 
-            case EOB_ACT_LAST_MATCH:
-                (yy_c_buf_p) =
-                &YY_CURRENT_BUFFER_LVALUE->yy_ch_buf[(yy_n_chars)];
+bool script_is_script(shell_ctx_t * p_ctx) {
+    /* a control operator or a leading keyword; one pipeline sent to the
+       background still goes the usual way */
+    const token_t * tokens = (const token_t *)p_ctx->tokens.data;
+    int num_controls = p_ctx->num_controls;
+    if (tokens[p_ctx->tokens.npos - 1].tag == TOK_BKG) num_controls -= 1;
+    return num_controls > 0 || script_keyword(&tokens[0]) != KW_NONE;
+}
 
-                yy_current_state = yy_get_previous_state(  );
+int script_keyword(const token_t * p_tok) {
+    /* only a bare word is one, and only where a command could start */
+    if (p_tok->tag != TOK_WORD || p_tok->len > 8) return KW_NONE;
+    for (int kw = KW_IF; kw < NUM_KEYWORDS; kw += 1) {
+        if (strcmp(p_tok->text, SCRIPT_KEYWORDS[kw]) == 0) return kw;
+    }
+    return KW_NONE;
+}
 
-                yy_cp = (yy_c_buf_p);
-                yy_bp = (yytext_ptr) + YY_MORE_ADJ;
-                goto yy_find_action;
-            }
-        break;
+bool script_read_line(shell_ctx_t * p_ctx, const char ** p_line, size_t * p_len, char ** p_buffer) {
+    /* the next line without its newline, taken from the rest of a batch
+       input the way heredoc bodies are, or else read from stdin into
+       *p_buffer, which the caller frees; false at the end of input */
+    *p_buffer = NULL;
+    if (p_ctx->p_input) {
+        char * const p_end = p_ctx->p_input_end;
+        if (p_ctx->p_input >= p_end) return false;
+        *p_line = p_ctx->p_input;
+        char * p_newline = memchr(*p_line, '\n', p_end - *p_line);
+        *p_len = (p_newline ? p_newline : p_end) - *p_line;
+        p_ctx->p_input = p_newline ? p_newline + 1 : p_end;
+    } else {
+        if (global_print_shell_context) fputs("> ", stdout);
+        fflush(stdout);
+        size_t capacity = 0;
+        const ssize_t res = getline(p_buffer, &capacity, stdin);
+        if (res <= 0) {
+            free(*p_buffer);
+            *p_buffer = NULL;
+            return false;
         }
+        if (global_tty_input) history_append(&global_history, *p_buffer, res);
+        *p_line = *p_buffer;
+        *p_len = res - ((*p_buffer)[res - 1] == '\n');
+    }
+    global_metrics.lines_read += 1;
+    return true;
+}
 
-    default:
-        YY_FATAL_ERROR(
-            "fatal flex scanner internal error--no action found" );
-    } /* end of action switch */
-        } /* end of scanning one token */
-} /* end of yylex */
-
-/* yy_get_next_buffer - try to read in a new buffer
- *
- * Returns a code representing an action:
- *  EOB_ACT_LAST_MATCH -
- *  EOB_ACT_CONTINUE_SCAN - continue scanning from current position
- *  EOB_ACT_END_OF_FILE - end of file
- */
-static int yy_get_next_buffer (void)
-{
-        register char *dest = YY_CURRENT_BUFFER_LVALUE->yy_ch_buf;
-    register char *source = (yytext_ptr);
-    register int number_to_move, i;
-    int ret_val;
-
-    if ( (yy_c_buf_p) > &YY_CURRENT_BUFFER_LVALUE->yy_ch_buf[(yy_n_chars) + 1] )
-        YY_FATAL_ERROR(
-        "fatal flex scanner internal error--end of buffer missed" );
-
-    if ( YY_CURRENT_BUFFER_LVALUE->yy_fill_buffer == 0 )
-        { /* Don't try to fill the buffer, so this is an EOF. */
-        if ( (yy_c_buf_p) - (yytext_ptr) - YY_MORE_ADJ == 1 )
-            {
-            /* We matched a single character, the EOB, so
-             * treat this as a final EOF.
-             */
-            return EOB_ACT_END_OF_FILE;
-            }
+bool script_more_input(shell_ctx_t * p_ctx, vec_t * p_text) {
+    /* appends the next line to the text */
+    const char * line;
+    size_t len;
+    char * buffer;
+    if (!script_read_line(p_ctx, &line, &len, &buffer)) return false;
+    if (!vec_reserve(p_text, p_text->npos + len + 1)) {
+        puts(VEC_PUSH_ERROR_MSG);
+        exit(EXIT_FAILURE);
+    }
+    p_text->data[p_text->npos++] = '\n';
+    memcpy(p_text->data + p_text->npos, line, len);
+    p_text->npos += len;
+    free(buffer);
+    return true;
+}
 
-        else
-            {
-            /* We matched some text prior to the EOB, first
-             * process it.
-             */
-            return EOB_ACT_LAST_MATCH;
+void script_skip_heredocs(shell_ctx_t * p_ctx, const vec_t * p_text,
+                          const script_failure_t * p_failure) {
+    /* each body runs up to a line that is just its delimiter, or to the end
+       of the input, as heredoc_read has it; the lines the text already has
+       go first */
+    const char * p_c = p_text->data + p_failure->here_offset;
+    const char * const p_end = p_text->data + p_text->npos;
+    for (size_t i = 0; i < p_failure->heredocs.npos; i += 1) {
+        const char * delim = ((char **)p_failure->heredocs.data)[i];
+        const size_t delim_len = strlen(delim);
+        bool found = false;
+        while (!found) {
+            const char * line;
+            size_t len;
+            char * buffer = NULL;
+            if (p_c < p_end) {
+                line = p_c;
+                const char * p_newline = memchr(p_c, '\n', p_end - p_c);
+                len = (p_newline ? p_newline : p_end) - p_c;
+                p_c = p_newline ? p_newline + 1 : p_end;
+            } else if (!script_read_line(p_ctx, &line, &len, &buffer)) {
+                return;
             }
+            found = len == delim_len && memcmp(line, delim, delim_len) == 0;
+            free(buffer);
+        }
+    }
+}
+
+script_t * script_compile(const char * text, const size_t len, script_failure_t * p_failure) {
+    /* lexes the whole text with its expansions put off, then compiles the
+       tokens in one pass; NULL on a syntax error, which has been reported
+       unless the text merely ended too early */
+    shell_ctx_t * p_lex = &global_script_ctx;
+    if (!p_lex->scanner) {
+        if (!shell_ctx_init(p_lex)) {
+            puts(CTX_INIT_ERROR_MSG);
+            return NULL;
         }
+        p_lex->defer = true;
+    }
+    shell_ctx_reset(p_lex);
+    p_lex->unterminated = false;
+    char * buffer = arena_alloc(&p_lex->arena, len + 2);
+    memcpy(buffer, text, len);
+    buffer[len] = buffer[len + 1] = '\0';
+    lexer_scan_script(p_lex, buffer, len + 2);
+    global_metrics.tokens_lexed += p_lex->tokens.npos;
+    p_failure->incomplete = p_lex->unterminated;
+    vec_init_arena(&p_failure->heredocs, &p_lex->arena, sizeof(char *));
+    p_failure->here_offset = len;
+    if (p_lex->unterminated) return NULL;
+    global_scripts.compiles += 1;
+    script_t * p_script = calloc(1, sizeof(script_t));
+    if (!p_script) {
+        puts("ERROR: malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    vec_init_arena(&p_script->code, &p_script->arena, sizeof(unsigned));
+    vec_init_arena(&p_script->pipelines, &p_script->arena, sizeof(script_pipeline_t));
+    vec_init_arena(&p_script->loops, &p_script->arena, sizeof(script_loop_t));
+    vec_init_arena(&p_script->funcs, &p_script->arena, sizeof(script_func_t));
+    script_compiler_t comp;
+    memset(&comp, 0, sizeof(script_compiler_t));
+    comp.p_script = p_script;
+    comp.tokens = (const token_t *)p_lex->tokens.data;
+    comp.num_tokens = p_lex->tokens.npos;
+    comp.text = buffer;
+    comp.p_failure = p_failure;
+    vec_init_arena(&comp.pending, &p_lex->arena, sizeof(unsigned));
+    vec_init_arena(&comp.breaks, &p_lex->arena, sizeof(unsigned));
+    if (!script_list(&comp, 0)) {
+        arena_free(&p_script->arena);
+        free(p_script);
+        return NULL;
+    }
+    script_emit(&comp, OP_END, 0);
+    p_script->hash = hash_bytes(text, len);
+    p_script->text = arena_strndup(&p_script->arena, text, len);
+    p_script->text_len = len;
+    return p_script;
+}
 
-    /* Try to read more data. */
+void script_release(script_t * p_script) {
+    if (--p_script->refs > 0) return;
+    arena_free(&p_script->arena);
+    free(p_script);
+}
 
-    /* First move last chars to start of buffer. */
-    number_to_move = (int) ((yy_c_buf_p) - (yytext_ptr)) - 1;
+script_t * script_cache_find(script_cache_t * p_cache, const char * text, const size_t len) {
+    const size_t hash = hash_bytes(text, len);
+    for (int i = 0; i < SCRIPT_CACHE_CAPACITY; i += 1) {
+        script_t * p_script = p_cache->scripts[i];
+        if (p_script && p_script->hash == hash && p_script->text_len == len &&
+            memcmp(p_script->text, text, len) == 0) {
+            p_script->last_use = ++p_cache->clock;
+            p_cache->hits += 1;
+            return p_script;
+        }
+    }
+    return NULL;
+}
 
-    for ( i = 0; i < number_to_move; ++i )
-        *(dest++) = *(source++);
+void script_cache_store(script_cache_t * p_cache, script_t * p_script) {
+    /* a free slot, or else the least recently used script, which lives on
+       while a function still needs it */
+    int victim = 0;
+    for (int i = 0; i < SCRIPT_CACHE_CAPACITY; i += 1) {
+        if (!p_cache->scripts[i]) {
+            victim = i;
+            break;
+        }
+        if (p_cache->scripts[i]->last_use < p_cache->scripts[victim]->last_use) victim = i;
+    }
+    if (p_cache->scripts[victim]) script_release(p_cache->scripts[victim]);
+    p_script->refs += 1;
+    p_script->last_use = ++p_cache->clock;
+    p_cache->scripts[victim] = p_script;
+}
 
-    if ( YY_CURRENT_BUFFER_LVALUE->yy_buffer_status == YY_BUFFER_EOF_PENDING )
-        /* don't do the read, it's not guaranteed to return an EOF,
-         * just force an EOF
-         */
-        YY_CURRENT_BUFFER_LVALUE->yy_n_chars = (yy_n_chars) = 0;
+unsigned script_emit(script_compiler_t * p_comp, const int op, const unsigned arg) {
+    /* returns where the instruction went, for script_patch */
+    const unsigned word = (unsigned)op | arg << SCRIPT_OP_BITS;
+    if (!vec_push(&p_comp->p_script->code, &word)) {
+        puts(VEC_PUSH_ERROR_MSG);
+        exit(EXIT_FAILURE);
+    }
+    return p_comp->p_script->code.npos - 1;
+}
 
-    else
-        {
-            yy_size_t num_to_read =
-            YY_CURRENT_BUFFER_LVALUE->yy_buf_size - number_to_move - 1;
+void script_patch(script_compiler_t * p_comp, const unsigned at, const unsigned target) {
+    unsigned * code = (unsigned *)p_comp->p_script->code.data;
+    code[at] = (code[at] & ((1u << SCRIPT_OP_BITS) - 1)) | target << SCRIPT_OP_BITS;
+}
 
-        while ( num_to_read <= 0 )
-            { /* Not enough room in the buffer - grow it. */
+void script_push(vec_t * p_vec, const unsigned value) {
+    if (!vec_push(p_vec, &value)) {
+        puts(VEC_PUSH_ERROR_MSG);
+        exit(EXIT_FAILURE);
+    }
+}
 
-            /* just a shorter name for the current buffer */
-            YY_BUFFER_STATE b = YY_CURRENT_BUFFER;
+int script_peek(script_compiler_t * p_comp) {
+    if (p_comp->pos == p_comp->num_tokens) return KW_NONE;
+    return script_keyword(&p_comp->tokens[p_comp->pos]);
+}
 
-            int yy_c_buf_p_offset =
-                (int) ((yy_c_buf_p) - b->yy_ch_buf);
+bool script_error(script_compiler_t * p_comp) {
+    /* running out of tokens is not reported, more lines may follow */
+    if (p_comp->pos == p_comp->num_tokens) {
+        p_comp->p_failure->incomplete = true;
+        return false;
+    }
+    const token_t * p_tok = &p_comp->tokens[p_comp->pos];
+    printf("ERROR: syntax error near %s\n", p_tok->tag == TOK_NEWLINE ? "newline" : p_tok->text);
+    return false;
+}
 
-            if ( b->yy_is_our_buffer )
-                {
-                yy_size_t new_size = b->yy_buf_size * 2;
+bool script_expect(script_compiler_t * p_comp, const int kw) {
+    if (script_peek(p_comp) != kw) return script_error(p_comp);
+    p_comp->pos += 1;
+    return true;
+}
 
-                if ( new_size <= 0 )
-                    b->yy_buf_size += b->yy_buf_size / 8;
-                else
-                    b->yy_buf_size *= 2;
+void script_skip_newlines(script_compiler_t * p_comp) {
+    while (p_comp->pos < p_comp->num_tokens && p_comp->tokens[p_comp->pos].tag == TOK_NEWLINE) {
+        p_comp->pos += 1;
+    }
+}
 
-                b->yy_ch_buf = (char *)
-                    /* Include room in for 2 EOB chars. */
-                    yyrealloc((void *) b->yy_ch_buf,b->yy_buf_size + 2  );
-                }
-            else
-                /* Can't grow it, we don't own it. */
-                b->yy_ch_buf = 0;
+bool script_list(script_compiler_t * p_comp, const unsigned terminators) {
+    /* and-or lists separated by ;, & or newlines, up to one of the keywords
+       in terminators (a mask of them), which is left for the caller; the
+       top level (no terminators) goes on to the end of the tokens */
+    bool empty = true;
+    while (true) {
+        script_skip_newlines(p_comp);
+        if (p_comp->pos == p_comp->num_tokens) {
+            if (terminators) return script_error(p_comp);
+            return true;
+        }
+        if (terminators & 1u << script_peek(p_comp)) {
+            return empty ? script_error(p_comp) : true;
+        }
+        if (!script_and_or(p_comp)) return false;
+        empty = false;
+        if (p_comp->pos == p_comp->num_tokens) continue;
+        const int tag = p_comp->tokens[p_comp->pos].tag;
+        if (tag == TOK_SEMI || tag == TOK_NEWLINE) {
+            p_comp->pos += 1;
+        } else if (p_comp->tokens[p_comp->pos - 1].tag != TOK_BKG &&
+                   !(terminators & 1u << script_peek(p_comp))) {
+            /* a compound command can only be followed by a keyword that
+               closes the list it is in */
+            return script_error(p_comp);
+        }
+    }
+}
 
-            if ( ! b->yy_ch_buf )
-                YY_FATAL_ERROR(
-                "fatal error - scanner input buffer overflow" );
+bool script_and_or(script_compiler_t * p_comp) {
+    /* commands joined by && and ||: each operator jumps when $? already
+       decides it, onto the next operator of the other kind or past the
+       end, so a && b || c runs c when either a or b fails */
+    const size_t base = p_comp->pending.npos;
+    int num_ops = 0;
+    while (true) {
+        const bool negate = script_peek(p_comp) == KW_BANG;
+        if (negate) p_comp->pos += 1;
+        if (!script_command(p_comp)) return false;
+        if (negate) script_emit(p_comp, OP_NOT, 0);
+        if (p_comp->pos == p_comp->num_tokens) break;
+        const int tag = p_comp->tokens[p_comp->pos].tag;
+        if ((tag != TOK_AND && tag != TOK_OR) || p_comp->tokens[p_comp->pos - 1].tag == TOK_BKG) break;
+        p_comp->pos += 1;
+        script_skip_newlines(p_comp);
+        num_ops += 1;
+        const int op = tag == TOK_AND ? OP_JUMP_FALSE : OP_JUMP_TRUE;
+        const unsigned here = script_emit(p_comp, op, 0);
+        const unsigned * code = (const unsigned *)p_comp->p_script->code.data;
+        unsigned * pending = (unsigned *)p_comp->pending.data;
+        size_t kept = base;
+        for (size_t i = base; i < p_comp->pending.npos; i += 1) {
+            if ((int)(code[pending[i]] & ((1u << SCRIPT_OP_BITS) - 1)) == op) {
+                pending[kept++] = pending[i];
+            } else {
+                script_patch(p_comp, pending[i], here);
+            }
+        }
+        p_comp->pending.npos = kept;
+        script_push(&p_comp->pending, here);
+    }
+    if (num_ops && p_comp->tokens[p_comp->pos - 1].tag == TOK_BKG) {
+        puts("ERROR: & after && or || is not supported");
+        return false;
+    }
+    const unsigned * pending = (const unsigned *)p_comp->pending.data;
+    for (size_t i = base; i < p_comp->pending.npos; i += 1) {
+        script_patch(p_comp, pending[i], p_comp->p_script->code.npos);
+    }
+    p_comp->pending.npos = base;
+    return true;
+}
 
-            (yy_c_buf_p) = &b->yy_ch_buf[yy_c_buf_p_offset];
+bool script_command(script_compiler_t * p_comp) {
+    const int kw = script_peek(p_comp);
+    switch (kw) {
+    case KW_IF:
+        return script_if(p_comp);
 
-            num_to_read = YY_CURRENT_BUFFER_LVALUE->yy_buf_size -
-                        number_to_move - 1;
+    case KW_WHILE:
+    case KW_UNTIL:
+        return script_while(p_comp);
 
-            }
+    case KW_FOR:
+        return script_for(p_comp);
 
-        if ( num_to_read > YY_READ_BUF_SIZE )
-            num_to_read = YY_READ_BUF_SIZE;
+    case KW_LBRACE:
+        p_comp->pos += 1;
+        return script_list(p_comp, 1u << KW_RBRACE) && script_expect(p_comp, KW_RBRACE);
 
-        /* Read in more data. */
-        YY_INPUT( (&YY_CURRENT_BUFFER_LVALUE->yy_ch_buf[number_to_move]),
-            (yy_n_chars), num_to_read );
+    case KW_BREAK:
+    case KW_CONTINUE:
+    case KW_RETURN:
+        return script_jump(p_comp, kw);
 
-        YY_CURRENT_BUFFER_LVALUE->yy_n_chars = (yy_n_chars);
+    case KW_NONE:
+        if (p_comp->pos + 1 < p_comp->num_tokens && p_comp->tokens[p_comp->pos].tag == TOK_WORD &&
+            p_comp->tokens[p_comp->pos + 1].tag == TOK_PARENS) {
+            return script_function(p_comp);
         }
+        return script_simple(p_comp);
 
-    if ( (yy_n_chars) == 0 )
-        {
-        if ( number_to_move == YY_MORE_ADJ )
-            {
-            ret_val = EOB_ACT_END_OF_FILE;
-            yyrestart(yyin  );
-            }
+    default:
+        return script_error(p_comp);
+    }
+}
+
+bool script_is_compound(const int kw) {
+    return kw == KW_IF || kw == KW_WHILE || kw == KW_UNTIL || kw == KW_FOR || kw == KW_LBRACE;
+}
 
-        else
-            {
-            ret_val = EOB_ACT_LAST_MATCH;
-            YY_CURRENT_BUFFER_LVALUE->yy_buffer_status =
-                YY_BUFFER_EOF_PENDING;
+bool script_simple(script_compiler_t * p_comp) {
+    /* a pipeline, up to the first operator that is not one of its own; a
+       trailing | carries it on to the next line */
+    const size_t start = p_comp->pos;
+    while (p_comp->pos < p_comp->num_tokens) {
+        const int tag = p_comp->tokens[p_comp->pos].tag;
+        if (tag >= TOK_SEMI && tag <= TOK_NEWLINE) break;
+        if (tag == TOK_HEREDOC) {
+            puts("ERROR: heredocs are not supported in scripts");
+            script_heredocs(p_comp);
+            return false;
+        }
+        p_comp->pos += 1;
+        if (tag == TOK_BKG) break;
+        if (tag == TOK_PIPE) {
+            script_skip_newlines(p_comp);
+            if (script_is_compound(script_peek(p_comp))) {
+                puts("ERROR: compound commands in a pipeline are not supported");
+                return false;
             }
         }
-
-    else
-        ret_val = EOB_ACT_CONTINUE_SCAN;
-
-    if ((yy_size_t) ((yy_n_chars) + number_to_move) > YY_CURRENT_BUFFER_LVALUE->yy_buf_size) {
-        /* Extend the array by 50%, plus the number we really need. */
-        yy_size_t new_size = (yy_n_chars) + number_to_move + ((yy_n_chars) >> 1);
-        YY_CURRENT_BUFFER_LVALUE->yy_ch_buf = (char *) yyrealloc((void *) YY_CURRENT_BUFFER_LVALUE->yy_ch_buf,new_size  );
-        if ( ! YY_CURRENT_BUFFER_LVALUE->yy_ch_buf )
-            YY_FATAL_ERROR( "out of dynamic memory in yy_get_next_buffer()" );
     }
+    if (p_comp->pos == start || p_comp->tokens[p_comp->pos - 1].tag == TOK_PIPE) {
+        return script_error(p_comp);
+    }
+    script_emit(p_comp, OP_RUN, script_pipeline_add(p_comp, start, p_comp->pos));
+    return true;
+}
 
-    (yy_n_chars) += number_to_move;
-    YY_CURRENT_BUFFER_LVALUE->yy_ch_buf[(yy_n_chars)] = YY_END_OF_BUFFER_CHAR;
-    YY_CURRENT_BUFFER_LVALUE->yy_ch_buf[(yy_n_chars) + 1] = YY_END_OF_BUFFER_CHAR;
-
-    (yytext_ptr) = &YY_CURRENT_BUFFER_LVALUE->yy_ch_buf[0];
-
-    return ret_val;
+void script_heredocs(script_compiler_t * p_comp) {
+    /* notes the delimiters of the heredocs on this line, and where the
+       line after it starts, so that script_eval can skip their bodies */
+    script_failure_t * p_failure = p_comp->p_failure;
+    for (size_t i = p_comp->pos; i < p_comp->num_tokens; i += 1) {
+        const token_t * p_tok = &p_comp->tokens[i];
+        if (p_tok->tag == TOK_NEWLINE) {
+            p_failure->here_offset = p_tok->text - p_comp->text;
+            break;
+        }
+        if (p_tok->tag == TOK_HEREDOC && i + 1 < p_comp->num_tokens &&
+            p_comp->tokens[i + 1].tag <= TOK_GLOB && !vec_push(&p_failure->heredocs, &p_comp->tokens[i + 1].text)) {
+            puts(VEC_PUSH_ERROR_MSG);
+            exit(EXIT_FAILURE);
+        }
+    }
 }
 
-/* yy_get_previous_state - get the state just before the EOB char was reached */
+bool script_if(script_compiler_t * p_comp) {
+    /* a branch that was taken jumps to the end, and when none is, falling
+       off the last condition sets $? to 0, as in sh */
+    const size_t base = p_comp->pending.npos;
+    p_comp->pos += 1;
+    while (true) {
+        if (!script_list(p_comp, 1u << KW_THEN) || !script_expect(p_comp, KW_THEN)) return false;
+        const unsigned skip = script_emit(p_comp, OP_JUMP_FALSE, 0);
+        if (!script_list(p_comp, 1u << KW_ELIF | 1u << KW_ELSE | 1u << KW_FI)) return false;
+        script_push(&p_comp->pending, script_emit(p_comp, OP_JUMP, 0));
+        script_patch(p_comp, skip, p_comp->p_script->code.npos);
+        const int kw = script_peek(p_comp);
+        p_comp->pos += 1;
+        if (kw == KW_ELIF) continue;
+        if (kw == KW_ELSE) {
+            if (!script_list(p_comp, 1u << KW_FI) || !script_expect(p_comp, KW_FI)) return false;
+        } else {
+            script_emit(p_comp, OP_STATUS, 0);
+        }
+        break;
+    }
+    const unsigned * pending = (const unsigned *)p_comp->pending.data;
+    for (size_t i = base; i < p_comp->pending.npos; i += 1) {
+        script_patch(p_comp, pending[i], p_comp->p_script->code.npos);
+    }
+    p_comp->pending.npos = base;
+    return true;
+}
 
-    static yy_state_type yy_get_previous_state (void)
-{
-    register yy_state_type yy_current_state;
-    register char *yy_cp;
-    
-    yy_current_state = (yy_start);
+bool script_while(script_compiler_t * p_comp) {
+    /* while and until leave $? at 0, whatever ended them */
+    const bool until = script_peek(p_comp) == KW_UNTIL;
+    p_comp->pos += 1;
+    const unsigned top = p_comp->p_script->code.npos;
+    if (!script_list(p_comp, 1u << KW_DO) || !script_expect(p_comp, KW_DO)) return false;
+    const unsigned leave = script_emit(p_comp, until ? OP_JUMP_TRUE : OP_JUMP_FALSE, 0);
+    if (!script_loop_body(p_comp, top)) return false;
+    script_patch(p_comp, leave, p_comp->p_script->code.npos);
+    script_emit(p_comp, OP_STATUS, 0);
+    return true;
+}
 
-    for ( yy_cp = (yytext_ptr) + YY_MORE_ADJ; yy_cp < (yy_c_buf_p); ++yy_cp )
-        {
-        register YY_CHAR yy_c = (*yy_cp ? yy_ec[YY_SC_TO_UI(*yy_cp)] : 1);
-        if ( yy_accept[yy_current_state] )
-            {
-            (yy_last_accepting_state) = yy_current_state;
-            (yy_last_accepting_cpos) = yy_cp;
-            }
-        while ( yy_chk[yy_base[yy_current_state] + yy_c] != yy_current_state )
-            {
-            yy_current_state = (int) yy_def[yy_current_state];
-            if ( yy_current_state >= 25 )
-                yy_c = yy_meta[(unsigned int) yy_c];
-            }
-        yy_current_state = yy_nxt[yy_base[yy_current_state] + (unsigned int) yy_c];
+bool script_for(script_compiler_t * p_comp) {
+    /* for NAME [in WORDS]; do ... done, over "$@" without the in; the
+       words are expanded once, when the loop starts */
+    script_t * p_script = p_comp->p_script;
+    p_comp->pos += 1;
+    if (p_comp->pos == p_comp->num_tokens) return script_error(p_comp);
+    const token_t * p_name = &p_comp->tokens[p_comp->pos];
+    if (p_name->tag != TOK_WORD || var_name_len(p_name->text) != p_name->len) {
+        return script_error(p_comp);
+    }
+    script_loop_t loop = {arena_strndup(&p_script->arena, p_name->text, p_name->len),
+                          p_name->len, -1, p_comp->for_depth, 0};
+    p_comp->pos += 1;
+    script_skip_newlines(p_comp);
+    if (p_comp->pos < p_comp->num_tokens && p_comp->tokens[p_comp->pos].tag == TOK_WORD &&
+        strcmp(p_comp->tokens[p_comp->pos].text, "in") == 0) {
+        const size_t start = ++p_comp->pos;
+        while (p_comp->pos < p_comp->num_tokens) {
+            const int tag = p_comp->tokens[p_comp->pos].tag;
+            if (tag > TOK_GLOB && (tag < TOK_TEMPLATE || tag > TOK_TEMPLATE_LITERAL)) break;
+            p_comp->pos += 1;
         }
-
-    return yy_current_state;
+        loop.words = script_pipeline_add(p_comp, start, p_comp->pos);
+        if (p_comp->pos == p_comp->num_tokens) return script_error(p_comp);
+        const int tag = p_comp->tokens[p_comp->pos].tag;
+        if (tag != TOK_SEMI && tag != TOK_NEWLINE) return script_error(p_comp);
+        p_comp->pos += 1;
+    } else if (p_comp->pos < p_comp->num_tokens && p_comp->tokens[p_comp->pos].tag == TOK_SEMI) {
+        p_comp->pos += 1;
+    }
+    script_skip_newlines(p_comp);
+    if (!script_expect(p_comp, KW_DO)) return false;
+    const unsigned index = p_script->loops.npos;
+    if (!vec_push(&p_script->loops, &loop)) {
+        puts(VEC_PUSH_ERROR_MSG);
+        exit(EXIT_FAILURE);
+    }
+    script_emit(p_comp, OP_FOR_INIT, index);
+    const unsigned top = script_emit(p_comp, OP_FOR_NEXT, index);
+    p_comp->for_depth += 1;
+    if (!script_loop_body(p_comp, top)) return false;
+    p_comp->for_depth -= 1;
+    ((script_loop_t *)p_script->loops.data)[index].exit = p_script->code.npos;
+    return true;
 }
 
-/* yy_try_NUL_trans - try to make a transition on the NUL character
- *
- * synopsis
- *  next_state = yy_try_NUL_trans( current_state );
- */
-    static yy_state_type yy_try_NUL_trans  (yy_state_type yy_current_state )
-{
-    register int yy_is_jam;
-        register char *yy_cp = (yy_c_buf_p);
+bool script_loop_body(script_compiler_t * p_comp, const unsigned top) {
+    /* everything up to done; continue goes to top, break to what follows */
+    if (p_comp->num_loops == SCRIPT_MAX_DEPTH) {
+        puts("ERROR: loops nested too deeply");
+        return false;
+    }
+    const int level = p_comp->num_loops;
+    p_comp->loop_tops[p_comp->num_loops++] = top;
+    if (!script_list(p_comp, 1u << KW_DONE) || !script_expect(p_comp, KW_DONE)) return false;
+    p_comp->num_loops -= 1;
+    script_emit(p_comp, OP_JUMP, top);
+    unsigned * breaks = (unsigned *)p_comp->breaks.data;
+    size_t kept = 0;
+    for (size_t i = 0; i < p_comp->breaks.npos; i += 1) {
+        if ((int)(breaks[i] % SCRIPT_MAX_DEPTH) == level) {
+            script_patch(p_comp, breaks[i] / SCRIPT_MAX_DEPTH, p_comp->p_script->code.npos);
+        } else {
+            breaks[kept++] = breaks[i];
+        }
+    }
+    p_comp->breaks.npos = kept;
+    return true;
+}
 
-    register YY_CHAR yy_c = 1;
-    if ( yy_accept[yy_current_state] )
-        {
-        (yy_last_accepting_state) = yy_current_state;
-        (yy_last_accepting_cpos) = yy_cp;
+bool script_jump(script_compiler_t * p_comp, const int kw) {
+    /* break [n], continue [n] and return [n], n a number as it is written */
+    const char * name = p_comp->tokens[p_comp->pos].text;
+    p_comp->pos += 1;
+    unsigned arg = kw == KW_RETURN ? SCRIPT_ARG_NONE : 1;
+    if (p_comp->pos < p_comp->num_tokens && p_comp->tokens[p_comp->pos].tag == TOK_WORD) {
+        const char * word = p_comp->tokens[p_comp->pos].text;
+        char * p_end;
+        const long value = strtol(word, &p_end, 10);
+        if (p_end == word || *p_end || value < (kw == KW_RETURN ? 0 : 1)) {
+            printf("ERROR: %s: %s: numeric argument required\n", name, word);
+            return false;
         }
-    while ( yy_chk[yy_base[yy_current_state] + yy_c] != yy_current_state )
-        {
-        yy_current_state = (int) yy_def[yy_current_state];
-        if ( yy_current_state >= 25 )
-            yy_c = yy_meta[(unsigned int) yy_c];
+        arg = kw == KW_RETURN ? (unsigned)(value & 255) : (unsigned)(value < SCRIPT_MAX_DEPTH ? value : SCRIPT_MAX_DEPTH);
+        p_comp->pos += 1;
+    }
+    if (kw == KW_RETURN) {
+        if (!p_comp->in_func) {
+            puts("ERROR: return: not in a function");
+            return false;
         }
-    yy_current_state = yy_nxt[yy_base[yy_current_state] + (unsigned int) yy_c];
-    yy_is_jam = (yy_current_state == 24);
+        script_emit(p_comp, OP_RETURN, arg);
+        return true;
+    }
+    /* only the loops of the function being compiled count */
+    const unsigned num_loops = p_comp->num_loops - p_comp->loop_base;
+    if (num_loops == 0) {
+        printf("ERROR: %s: not in a loop\n", name);
+        return false;
+    }
+    const int level = p_comp->num_loops - (arg < num_loops ? arg : num_loops);
+    if (kw == KW_CONTINUE) {
+        script_emit(p_comp, OP_JUMP, p_comp->loop_tops[level]);
+    } else {
+        script_push(&p_comp->breaks, script_emit(p_comp, OP_JUMP, 0) * SCRIPT_MAX_DEPTH + level);
+    }
+    return true;
+}
 
-    return yy_is_jam ? 0 : yy_current_state;
+bool script_function(script_compiler_t * p_comp) {
+    /* NAME () compound: the body is compiled where it stands and jumped
+       over, OP_DEFINE points the name at it */
+    script_t * p_script = p_comp->p_script;
+    const token_t * p_name = &p_comp->tokens[p_comp->pos];
+    p_comp->pos += 2;
+    script_skip_newlines(p_comp);
+    if (!script_is_compound(script_peek(p_comp))) return script_error(p_comp);
+    const unsigned index = p_script->funcs.npos;
+    const script_func_t func = {arena_strndup(&p_script->arena, p_name->text, p_name->len), 0};
+    if (!vec_push(&p_script->funcs, &func)) {
+        puts(VEC_PUSH_ERROR_MSG);
+        exit(EXIT_FAILURE);
+    }
+    script_emit(p_comp, OP_DEFINE, index);
+    const unsigned over = script_emit(p_comp, OP_JUMP, 0);
+    const unsigned entry = p_script->code.npos;
+    /* break and continue never reach the loops around the definition */
+    const int loop_base = p_comp->loop_base;
+    const unsigned for_depth = p_comp->for_depth;
+    const bool in_func = p_comp->in_func;
+    p_comp->loop_base = p_comp->num_loops;
+    p_comp->for_depth = 0;
+    p_comp->in_func = true;
+    if (!script_command(p_comp)) return false;
+    script_emit(p_comp, OP_RETURN, SCRIPT_ARG_NONE);
+    p_comp->loop_base = loop_base;
+    p_comp->for_depth = for_depth;
+    p_comp->in_func = in_func;
+    ((script_func_t *)p_script->funcs.data)[index].entry = entry;
+    script_patch(p_comp, over, p_script->code.npos);
+    return true;
 }
 
-#ifndef YY_NO_INPUT
-#ifdef __cplusplus
-    static int yyinput (void)
-#else
-    static int input  (void)
-#endif
+int script_pipeline_add(script_compiler_t * p_comp, const size_t start, const size_t end) {
+    /* copies the tokens into the script, returns the pipeline's index */
+    script_t * p_script = p_comp->p_script;
+    script_pipeline_t pipeline = {NULL, 0, 1, 0, false};
+    pipeline.tokens = arena_alloc(&p_script->arena, (end - start) * sizeof(token_t));
+    for (size_t i = start; i < end; i += 1) {
+        const token_t * p_tok = &p_comp->tokens[i];
+        if (p_tok->tag == TOK_NEWLINE) continue;
+        token_t * p_copy = &pipeline.tokens[pipeline.num_tokens++];
+        p_copy->text = arena_strndup(&p_script->arena, p_tok->text, p_tok->len);
+        p_copy->len = p_tok->len;
+        p_copy->tag = p_tok->tag;
+        if (p_tok->tag == TOK_PIPE) pipeline.num_commands += 1;
+        if (p_tok->tag == TOK_GLOB) pipeline.num_globs += 1;
+        if (p_tok->tag >= TOK_TEMPLATE && p_tok->tag <= TOK_TEMPLATE_LITERAL) pipeline.expand = true;
+    }
+    if (!vec_push(&p_script->pipelines, &pipeline)) {
+        puts(VEC_PUSH_ERROR_MSG);
+        exit(EXIT_FAILURE);
+    }
+    return (int)p_script->pipelines.npos - 1;
+}
 
-{
-    int c;
-    
-    *(yy_c_buf_p) = (yy_hold_char);
-
-    if ( *(yy_c_buf_p) == YY_END_OF_BUFFER_CHAR )
-        {
-        /* yy_c_buf_p now points to the character we want to return.
-         * If this occurs *before* the EOB characters, then it's a
-         * valid NUL; if not, then we've hit the end of the buffer.
-         */
-        if ( (yy_c_buf_p) < &YY_CURRENT_BUFFER_LVALUE->yy_ch_buf[(yy_n_chars)] )
-            /* This was really a NUL. */
-            *(yy_c_buf_p) = '\0';
-
-        else
-            { /* need more input */
-            yy_size_t offset = (yy_c_buf_p) - (yytext_ptr);
-            ++(yy_c_buf_p);
-
-            switch ( yy_get_next_buffer(  ) )
-                {
-                case EOB_ACT_LAST_MATCH:
-                    /* This happens because yy_g_n_b()
-                     * sees that we've accumulated a
-                     * token and flags that we need to
-                     * try matching the token before
-                     * proceeding.  But for input(),
-                     * there's no matching to consider.
-                     * So convert the EOB_ACT_LAST_MATCH
-                     * to EOB_ACT_END_OF_FILE.
-                     */
-
-                    /* Reset buffer status. */
-                    yyrestart(yyin );
-
-                    /*FALLTHROUGH*/
-
-                case EOB_ACT_END_OF_FILE:
-                    {
-                    if ( yywrap( ) )
-                        return 0;
-
-                    if ( ! (yy_did_buffer_switch_on_eof) )
-                        YY_NEW_FILE;
-#ifdef __cplusplus
-                    return yyinput();
-#else
-                    return input();
-#endif
-                    }
+int script_run(shell_ctx_t * p_ctx, script_t * p_script, unsigned pc) {
+    /* the dispatch loop, from pc to OP_END or OP_RETURN; returns $? */
+    const unsigned * code = (const unsigned *)p_script->code.data;
+    const script_pipeline_t * pipelines = (const script_pipeline_t *)p_script->pipelines.data;
+    const script_loop_t * loops = (const script_loop_t *)p_script->loops.data;
+    const script_func_t * funcs = (const script_func_t *)p_script->funcs.data;
+    script_frame_t frames[SCRIPT_MAX_DEPTH];
+    unsigned num_frames = 0;
+    p_ctx->script_depth += 1;
+    bool running = true;
+    while (running) {
+        const unsigned word = code[pc++];
+        const unsigned arg = word >> SCRIPT_OP_BITS;
+        switch (word & ((1u << SCRIPT_OP_BITS) - 1)) {
+        case OP_RUN:
+            script_run_pipeline(p_ctx, &pipelines[arg]);
+            if (p_ctx->exited || script_interrupted(p_ctx)) running = false;
+            break;
 
-                case EOB_ACT_CONTINUE_SCAN:
-                    (yy_c_buf_p) = (yytext_ptr) + offset;
-                    break;
-                }
-            }
-        }
+        case OP_JUMP:
+            pc = arg;
+            break;
 
-    c = *(unsigned char *) (yy_c_buf_p);    /* cast for 8-bit char's */
-    *(yy_c_buf_p) = '\0';   /* preserve yytext */
-    (yy_hold_char) = *++(yy_c_buf_p);
-
-    return c;
-}
-#endif  /* ifndef YY_NO_INPUT */
-
-/** Immediately switch to a different input stream.
- * @param input_file A readable stream.
- * 
- * @note This function does not reset the start condition to @c INITIAL .
- */
-    void yyrestart  (FILE * input_file )
-{
-    
-    if ( ! YY_CURRENT_BUFFER ){
-        yyensure_buffer_stack ();
-        YY_CURRENT_BUFFER_LVALUE =
-            yy_create_buffer(yyin,YY_BUF_SIZE );
-    }
-
-    yy_init_buffer(YY_CURRENT_BUFFER,input_file );
-    yy_load_buffer_state( );
-}
-
-/** Switch to a different input buffer.
- * @param new_buffer The new input buffer.
- * 
- */
-    void yy_switch_to_buffer  (YY_BUFFER_STATE  new_buffer )
-{
-    
-    /* TODO. We should be able to replace this entire function body
-     * with
-     *      yypop_buffer_state();
-     *      yypush_buffer_state(new_buffer);
-     */
-    yyensure_buffer_stack ();
-    if ( YY_CURRENT_BUFFER == new_buffer )
-        return;
+        case OP_JUMP_FALSE:
+            if (p_ctx->last_status != 0) pc = arg;
+            break;
 
-    if ( YY_CURRENT_BUFFER )
-        {
-        /* Flush out information for old buffer. */
-        *(yy_c_buf_p) = (yy_hold_char);
-        YY_CURRENT_BUFFER_LVALUE->yy_buf_pos = (yy_c_buf_p);
-        YY_CURRENT_BUFFER_LVALUE->yy_n_chars = (yy_n_chars);
-        }
-
-    YY_CURRENT_BUFFER_LVALUE = new_buffer;
-    yy_load_buffer_state( );
-
-    /* We don't actually know whether we did this switch during
-     * EOF (yywrap()) processing, but the only time this flag
-     * is looked at is after yywrap() is called, so it's safe
-     * to go ahead and always set it.
-     */
-    (yy_did_buffer_switch_on_eof) = 1;
-}
-
-static void yy_load_buffer_state  (void)
-{
-        (yy_n_chars) = YY_CURRENT_BUFFER_LVALUE->yy_n_chars;
-    (yytext_ptr) = (yy_c_buf_p) = YY_CURRENT_BUFFER_LVALUE->yy_buf_pos;
-    yyin = YY_CURRENT_BUFFER_LVALUE->yy_input_file;
-    (yy_hold_char) = *(yy_c_buf_p);
-}
-
-/** Allocate and initialize an input buffer state.
- * @param file A readable stream.
- * @param size The character buffer size in bytes. When in doubt, use @c YY_BUF_SIZE.
- * 
- * @return the allocated buffer state.
- */
-    YY_BUFFER_STATE yy_create_buffer  (FILE * file, int  size )
-{
-    YY_BUFFER_STATE b;
-    
-    b = (YY_BUFFER_STATE) yyalloc(sizeof( struct yy_buffer_state )  );
-    if ( ! b )
-        YY_FATAL_ERROR( "out of dynamic memory in yy_create_buffer()" );
-
-    b->yy_buf_size = size;
-
-    /* yy_ch_buf has to be 2 characters longer than the size given because
-     * we need to put in 2 end-of-buffer characters.
-     */
-    b->yy_ch_buf = (char *) yyalloc(b->yy_buf_size + 2  );
-    if ( ! b->yy_ch_buf )
-        YY_FATAL_ERROR( "out of dynamic memory in yy_create_buffer()" );
-
-    b->yy_is_our_buffer = 1;
-
-    yy_init_buffer(b,file );
-
-    return b;
-}
-
-/** Destroy the buffer.
- * @param b a buffer created with yy_create_buffer()
- * 
- */
-    void yy_delete_buffer (YY_BUFFER_STATE  b )
-{
-    
-    if ( ! b )
-        return;
+        case OP_JUMP_TRUE:
+            if (p_ctx->last_status == 0) pc = arg;
+            break;
 
-    if ( b == YY_CURRENT_BUFFER ) /* Not sure if we should pop here. */
-        YY_CURRENT_BUFFER_LVALUE = (YY_BUFFER_STATE) 0;
+        case OP_NOT:
+            p_ctx->last_status = !p_ctx->last_status;
+            break;
 
-    if ( b->yy_is_our_buffer )
-        yyfree((void *) b->yy_ch_buf  );
+        case OP_STATUS:
+            p_ctx->last_status = arg;
+            break;
 
-    yyfree((void *) b  );
-}
+        case OP_FOR_INIT: {
+            const unsigned depth = loops[arg].depth;
+            while (num_frames <= depth) {
+                frames[num_frames++] = (script_frame_t){NULL, 0, 0};
+            }
+            script_for_init(p_ctx, p_script, &loops[arg], &frames[depth]);
+            break;
+        }
 
-#ifndef __cplusplus
-extern int isatty (int );
-#endif /* __cplusplus */
-    
-/* Initializes or reinitializes a buffer.
- * This function is sometimes called more than once on the same buffer,
- * such as during a yyrestart() or at EOF.
- */
-    static void yy_init_buffer  (YY_BUFFER_STATE  b, FILE * file )
+        case OP_FOR_NEXT: {
+            script_frame_t * p_frame = &frames[loops[arg].depth];
+            if (p_frame->next == p_frame->num_items) {
+                pc = loops[arg].exit;
+            } else if (!var_set(&global_vars, loops[arg].name, loops[arg].name_len,
+                                p_frame->items[p_frame->next++], false)) {
+                puts("ERROR: out of memory");
+                p_ctx->last_status = 1;
+                running = false;
+            }
+            break;
+        }
 
-{
-    int oerrno = errno;
-    
-    yy_flush_buffer(b );
+        case OP_DEFINE:
+            function_define(&global_functions, funcs[arg].name, p_script, funcs[arg].entry);
+            p_ctx->last_status = 0;
+            break;
 
-    b->yy_input_file = file;
-    b->yy_fill_buffer = 1;
+        case OP_RETURN:
+            if (arg != SCRIPT_ARG_NONE) p_ctx->last_status = arg;
+            running = false;
+            break;
 
-    /* If b is the current buffer, then yy_init_buffer was _probably_
-     * called from yyrestart() or through yy_get_next_buffer.
-     * In that case, we don't want to reset the lineno or column.
-     */
-    if (b != YY_CURRENT_BUFFER){
-        b->yy_bs_lineno = 1;
-        b->yy_bs_column = 0;
+        case OP_END:
+            running = false;
+            break;
+        }
     }
+    for (unsigned i = 0; i < num_frames; i += 1) free(frames[i].items);
+    p_ctx->script_depth -= 1;
+    return p_ctx->last_status;
+}
 
-        b->yy_is_interactive = file ? (isatty( fileno(file) ) > 0) : 0;
-    
-    errno = oerrno;
+void script_run_pipeline(shell_ctx_t * p_ctx, const script_pipeline_t * p_pipeline) {
+    /* goes through shell_eval like a line would, minus the lexer */
+    char * p_input = p_ctx->p_input;
+    shell_ctx_reset(p_ctx);
+    p_ctx->p_input = p_input;
+    script_push_tokens(p_ctx, p_pipeline);
+    p_ctx->num_commands = p_pipeline->num_commands;
+    shell_eval(p_ctx);
+    /* finished jobs are recycled as they would be after every line, except
+       in a server, where serve_collect still has to report other jobs */
+    if (!p_ctx->serving) job_notify(&global_jobs, global_tty_input && global_print_shell_context);
 }
 
-/** Discard all buffered characters. On the next scan, YY_INPUT will be called.
- * @param b the buffer state to be flushed, usually @c YY_CURRENT_BUFFER.
- * 
- */
-    void yy_flush_buffer (YY_BUFFER_STATE  b )
-{
-        if ( ! b )
+void script_push_tokens(shell_ctx_t * p_ctx, const script_pipeline_t * p_pipeline) {
+    vec_t * p_tokens = &p_ctx->tokens;
+    if (!vec_reserve(p_tokens, p_tokens->npos + p_pipeline->num_tokens)) {
+        puts(VEC_PUSH_ERROR_MSG);
+        exit(EXIT_FAILURE);
+    }
+    p_ctx->num_globs += p_pipeline->num_globs;
+    if (!p_pipeline->expand) {
+        /* nothing to expand, the script's own copies are used as they are */
+        memcpy(p_tokens->data + p_tokens->npos * sizeof(token_t), p_pipeline->tokens,
+               p_pipeline->num_tokens * sizeof(token_t));
+        p_tokens->npos += p_pipeline->num_tokens;
         return;
+    }
+    for (size_t i = 0; i < p_pipeline->num_tokens; i += 1) {
+        const token_t * p_tok = &p_pipeline->tokens[i];
+        if (p_tok->tag >= TOK_TEMPLATE && p_tok->tag <= TOK_TEMPLATE_LITERAL) {
+            script_expand_word(p_ctx, p_tok);
+        } else if (!vec_push(p_tokens, p_tok)) {
+            puts(VEC_PUSH_ERROR_MSG);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
 
-    b->yy_n_chars = 0;
+void script_expand_word(shell_ctx_t * p_ctx, const token_t * p_tok) {
+    /* puts the word together the way the lexer would have, with the values
+       the names have now */
+    p_ctx->word_glob = p_tok->tag == TOK_TEMPLATE_GLOB;
+    p_ctx->word_literal = p_tok->tag == TOK_TEMPLATE_LITERAL;
+    const char * p_c = p_tok->text;
+    const char * const p_end = p_tok->text + p_tok->len;
+    while (p_c < p_end) {
+        const size_t plain = strcspn(p_c, SCRIPT_MARKS);
+        if (plain) lexer_word_append(p_ctx, p_c, plain);
+        p_c += plain;
+        if (p_c == p_end) break;
+        const char * name = p_c + 1;
+        const char * name_end = strchr(name, SCRIPT_END);
+        lexer_expand(p_ctx, name, name_end - name, *p_c == SCRIPT_EXPAND);
+        p_c = name_end + 1;
+    }
+    lexer_word_end(p_ctx);
+}
 
-    /* We always need two end-of-buffer characters.  The first causes
-     * a transition to the end-of-buffer state.  The second causes
-     * a jam in that state.
-     */
-    b->yy_ch_buf[0] = YY_END_OF_BUFFER_CHAR;
-    b->yy_ch_buf[1] = YY_END_OF_BUFFER_CHAR;
+void script_for_init(shell_ctx_t * p_ctx, const script_t * p_script,
+                     const script_loop_t * p_loop, script_frame_t * p_frame) {
+    /* the words are expanded and globbed into one block of their own, the
+       arena goes with the first command of the body */
+    free(p_frame->items);
+    *p_frame = (script_frame_t){NULL, 0, 0};
+    const token_t * tokens = NULL;
+    size_t num_words = p_ctx->num_params;
+    if (p_loop->words != -1) {
+        char * p_input = p_ctx->p_input;
+        shell_ctx_reset(p_ctx);
+        p_ctx->p_input = p_input;
+        script_push_tokens(p_ctx, &((const script_pipeline_t *)p_script->pipelines.data)[p_loop->words]);
+        if (p_ctx->num_globs) glob_expand(p_ctx);
+        tokens = (const token_t *)p_ctx->tokens.data;
+        num_words = p_ctx->tokens.npos;
+    }
+    p_ctx->last_status = 0;
+    if (num_words == 0) return;
+    size_t size = num_words * sizeof(char *);
+    for (size_t i = 0; i < num_words; i += 1) {
+        size += (tokens ? tokens[i].len : strlen(p_ctx->params[i])) + 1;
+    }
+    p_frame->items = malloc(size);
+    if (!p_frame->items) {
+        puts("ERROR: malloc failed");
+        return;
+    }
+    char * p_strings = (char *)(p_frame->items + num_words);
+    for (size_t i = 0; i < num_words; i += 1) {
+        const char * word = tokens ? tokens[i].text : p_ctx->params[i];
+        const size_t len = tokens ? tokens[i].len : strlen(word);
+        p_frame->items[i] = p_strings;
+        memcpy(p_strings, word, len);
+        p_strings[len] = '\0';
+        p_strings += len + 1;
+    }
+    p_frame->num_items = num_words;
+}
 
-    b->yy_buf_pos = &b->yy_ch_buf[0];
+bool script_interrupted(shell_ctx_t * p_ctx) {
+    /* at a terminal a script stops at ^C, whether a job died of it or the
+       shell itself got it while running builtins */
+    if (!global_tty_input) return false;
+#ifdef __linux__
+    /* blocked for the signalfd, so nothing has read it yet */
+    sigset_t pending;
+    sigpending(&pending);
+    if (sigismember(&pending, SIGINT)) events_wait(&global_events, 0);
+#else
+    events_wait(&global_events, 0);
+#endif
+    if (global_events.interrupted) {
+        global_events.interrupted = false;
+        putchar('\n');
+        p_ctx->last_status = 128 + SIGINT;
+    }
+    return p_ctx->last_status == 128 + SIGINT;
+}
 
-    b->yy_at_bol = 1;
-    b->yy_buffer_status = YY_BUFFER_NEW;
+function_t * function_find(function_table_t * p_table, const char * name) {
+    /* asked for every command, so no functions costs nothing */
+    if (p_table->count == 0) return NULL;
+    const size_t hash = hash_string(name);
+    const size_t mask = p_table->capacity - 1;
+    for (size_t idx = hash & mask; p_table->funcs[idx].name; idx = (idx + 1) & mask) {
+        function_t * p_func = &p_table->funcs[idx];
+        if (p_func->hash == hash && strcmp(p_func->name, name) == 0) return p_func;
+    }
+    return NULL;
+}
 
-    if ( b == YY_CURRENT_BUFFER )
-        yy_load_buffer_state( );
+bool function_define(function_table_t * p_table, const char * name,
+                     script_t * p_script, const unsigned entry) {
+    /* a new definition replaces the old one, whose script may then go */
+    p_script->refs += 1;
+    function_t * p_func = function_find(p_table, name);
+    if (p_func) {
+        script_release(p_func->p_script);
+        p_func->p_script = p_script;
+        p_func->entry = entry;
+        return true;
+    }
+    if ((p_table->count + 1) * 2 > p_table->capacity) {
+        const size_t capacity = p_table->capacity ? p_table->capacity * 2 : HASH_INIT_CAPACITY;
+        function_t * funcs = calloc(capacity, sizeof(function_t));
+        if (!funcs) {
+            script_release(p_script);
+            return false;
+        }
+        for (size_t i = 0; i < p_table->capacity; i += 1) {
+            if (!p_table->funcs[i].name) continue;
+            size_t idx = p_table->funcs[i].hash & (capacity - 1);
+            while (funcs[idx].name) idx = (idx + 1) & (capacity - 1);
+            funcs[idx] = p_table->funcs[i];
+        }
+        free(p_table->funcs);
+        p_table->funcs = funcs;
+        p_table->capacity = capacity;
+    }
+    const size_t hash = hash_string(name);
+    size_t idx = hash & (p_table->capacity - 1);
+    while (p_table->funcs[idx].name) idx = (idx + 1) & (p_table->capacity - 1);
+    p_table->funcs[idx] = (function_t){strdup(name), hash, p_script, entry};
+    p_table->count += 1;
+    return true;
 }
 
-/** Pushes the new state onto the stack. The new state becomes
- *  the current state. This function will allocate the stack
- *  if necessary.
- *  @param new_buffer The new state.
- *  
- */
-void yypush_buffer_state (YY_BUFFER_STATE new_buffer )
-{
-        if (new_buffer == NULL)
-        return;
+size_t pid_hash(const pid_t pid) {
+    return (size_t)pid * 2654435761u;
+}
 
-    yyensure_buffer_stack();
+pid_slot_t * pid_map_find(job_table_t * p_table, const pid_t pid) {
+    if (!p_table->pid_capacity) return NULL;
+    const size_t mask = p_table->pid_capacity - 1;
+    size_t idx = pid_hash(pid) & mask;
+    while (p_table->pids[idx].pid) {
+        if (p_table->pids[idx].pid == pid) return &p_table->pids[idx];
+        idx = (idx + 1) & mask;
+    }
+    return NULL;
+}
 
-    /* This block is copied from yy_switch_to_buffer. */
-    if ( YY_CURRENT_BUFFER )
-        {
-        /* Flush out information for old buffer. */
-        *(yy_c_buf_p) = (yy_hold_char);
-        YY_CURRENT_BUFFER_LVALUE->yy_buf_pos = (yy_c_buf_p);
-        YY_CURRENT_BUFFER_LVALUE->yy_n_chars = (yy_n_chars);
+bool pid_map_rebuild(job_table_t * p_table) {
+    /* drops the slots of terminated processes, and grows if still needed */
+    size_t capacity = p_table->pid_capacity ? p_table->pid_capacity : HASH_INIT_CAPACITY;
+    while ((p_table->pid_live + 1) * 2 > capacity) capacity *= 2;
+    pid_slot_t * pids = calloc(capacity, sizeof(pid_slot_t));
+    if (!pids) return false;
+    global_loop_allocs += 1;
+    for (size_t i = 0; i < p_table->pid_capacity; i += 1) {
+        if (p_table->pids[i].pid > 0) {
+            size_t idx = pid_hash(p_table->pids[i].pid) & (capacity - 1);
+            while (pids[idx].pid) idx = (idx + 1) & (capacity - 1);
+            pids[idx] = p_table->pids[i];
         }
+    }
+    free(p_table->pids);
+    p_table->pids = pids;
+    p_table->pid_capacity = capacity;
+    p_table->pid_used = p_table->pid_live;
+    return true;
+}
 
-    /* Only push if top exists. Otherwise, replace top. */
-    if (YY_CURRENT_BUFFER)
-        (yy_buffer_stack_top)++;
-    YY_CURRENT_BUFFER_LVALUE = new_buffer;
-
-    /* copied from yy_switch_to_buffer. */
-    yy_load_buffer_state( );
-    (yy_did_buffer_switch_on_eof) = 1;
+bool job_table_init(job_table_t * p_table) {
+    memset(p_table, 0, sizeof(job_table_t));
+    return true;
 }
 
-/** Removes and deletes the top of the stack, if present.
- *  The next element becomes the new top.
- *  
- */
-void yypop_buffer_state (void)
-{
-        if (!YY_CURRENT_BUFFER)
-        return;
+job_t * job_create(job_table_t * p_table, shell_ctx_t * p_ctx,
+                   const int num_procs, const bool is_bkg) {
+    if (p_table->num_slots == p_table->capacity) {
+        const int capacity = p_table->capacity ? p_table->capacity * 2 : JOB_INIT_CAPACITY;
+        job_t ** jobs = realloc(p_table->jobs, capacity * sizeof(job_t *));
+        if (!jobs) return NULL;
+        global_loop_allocs += 1;
+        p_table->jobs = jobs;
+        p_table->capacity = capacity;
+    }
+    /* removed jobs are recycled along with their buffers */
+    job_t * p_job = p_table->p_free;
+    if (p_job) {
+        p_table->p_free = p_job->p_next;
+    } else {
+        p_job = calloc(1, sizeof(job_t));
+        if (!p_job) return NULL;
+        global_loop_allocs += 1;
+    }
+    if (p_job->procs_capacity < num_procs) {
+        process_t * procs = realloc(p_job->procs, num_procs * sizeof(process_t));
+        if (!procs) {
+            p_job->p_next = p_table->p_free;
+            p_table->p_free = p_job;
+            return NULL;
+        }
+        global_loop_allocs += 1;
+        p_job->procs = procs;
+        p_job->procs_capacity = num_procs;
+    }
+    /* the command line is kept for jobs and fg, the tokens are gone by then */
+    token_t * tokens = (token_t *)p_ctx->tokens.data;
+    size_t len = 1;
+    for (size_t i = 0; i < p_ctx->tokens.npos; i += 1) len += tokens[i].len + 1;
+    if (p_job->cmdline_capacity < len) {
+        char * cmdline = realloc(p_job->cmdline, len);
+        if (!cmdline) {
+            p_job->p_next = p_table->p_free;
+            p_table->p_free = p_job;
+            return NULL;
+        }
+        global_loop_allocs += 1;
+        p_job->cmdline = cmdline;
+        p_job->cmdline_capacity = len;
+    }
+    char * p_end = p_job->cmdline;
+    for (size_t i = 0; i < p_ctx->tokens.npos; i += 1) {
+        if (i) *p_end++ = ' ';
+        memcpy(p_end, tokens[i].text, tokens[i].len);
+        p_end += tokens[i].len;
+    }
+    *p_end = '\0';
+    p_job->id = p_table->num_slots + 1;
+    p_job->pgid = 0;
+    p_job->num_procs = 0;
+    p_job->num_live = 0;
+    p_job->num_stopped = 0;
+    p_job->is_bkg = is_bkg;
+    p_job->timed = p_ctx->timed;
+    p_job->p_report = NULL;
+    clock_gettime(CLOCK_MONOTONIC, &p_job->started);
+    p_job->p_next = NULL;
+    p_table->jobs[p_table->num_slots++] = p_job;
+    /* a job in a group of its own can be signalled, continued and handed
+       the terminal as a whole, with one call whatever its length */
+    const bool own_group = is_bkg || global_job_control;
+    p_job->pgid = own_group ? 0 : getpgrp();
+    p_ctx->job_pgid = own_group ? 0 : -1;
+    p_ctx->job_foreground = global_tty_input && !is_bkg;
+    return p_job;
+}
 
-    yy_delete_buffer(YY_CURRENT_BUFFER );
-    YY_CURRENT_BUFFER_LVALUE = NULL;
-    if ((yy_buffer_stack_top) > 0)
-        --(yy_buffer_stack_top);
-
-    if (YY_CURRENT_BUFFER) {
-        yy_load_buffer_state( );
-        (yy_did_buffer_switch_on_eof) = 1;
-    }
-}
-
-/* Allocates the stack if it does not exist.
- *  Guarantees space for at least one push.
- */
-static void yyensure_buffer_stack (void)
-{
-    yy_size_t num_to_alloc;
-    
-    if (!(yy_buffer_stack)) {
-
-        /* First allocation is just for 2 elements, since we don't know if this
-         * scanner will even need a stack. We use 2 instead of 1 to avoid an
-         * immediate realloc on the next call.
-         */
-        num_to_alloc = 1;
-        (yy_buffer_stack) = (struct yy_buffer_state**)yyalloc
-                                (num_to_alloc * sizeof(struct yy_buffer_state*)
-                                );
-        if ( ! (yy_buffer_stack) )
-            YY_FATAL_ERROR( "out of dynamic memory in yyensure_buffer_stack()" );
-                                  
-        memset((yy_buffer_stack), 0, num_to_alloc * sizeof(struct yy_buffer_state*));
-                
-        (yy_buffer_stack_max) = num_to_alloc;
-        (yy_buffer_stack_top) = 0;
-        return;
+bool job_add_process(job_table_t * p_table, job_t * p_job, const pid_t pid) {
+    if ((p_table->pid_used + 1) * 2 > p_table->pid_capacity && !pid_map_rebuild(p_table)) {
+        return false;
     }
+    const size_t mask = p_table->pid_capacity - 1;
+    size_t idx = pid_hash(pid) & mask;
+    while (p_table->pids[idx].pid) idx = (idx + 1) & mask;
+    p_table->pids[idx].pid = pid;
+    p_table->pids[idx].job_id = p_job->id;
+    p_table->pids[idx].proc_idx = p_job->num_procs;
+    p_table->pid_used += 1;
+    p_table->pid_live += 1;
+    if (p_job->pgid == 0) p_job->pgid = pid;
+    process_t * p_proc = &p_job->procs[p_job->num_procs++];
+    p_proc->pid = pid;
+    p_proc->state = PROC_RUNNING;
+    p_proc->status = 0;
+    events_watch_pid(&global_events, p_proc);
+    p_job->num_live += 1;
+    return true;
+}
 
-    if ((yy_buffer_stack_top) >= ((yy_buffer_stack_max)) - 1){
+void job_remove(job_table_t * p_table, job_t * p_job) {
+    p_table->jobs[p_job->id - 1] = NULL;
+    while (p_table->num_slots > 0 && !p_table->jobs[p_table->num_slots - 1]) {
+        p_table->num_slots -= 1;
+    }
+    p_job->p_next = p_table->p_free;
+    p_table->p_free = p_job;
+}
 
-        /* Increase the buffer to prepare for a possible push. */
-        int grow_size = 8 /* arbitrary grow size */;
+job_t * job_find(job_table_t * p_table, const char * spec) {
+    if (spec[0] == '%') spec += 1;
+    if (strcmp(spec, "%") == 0 || strcmp(spec, "+") == 0 || spec[0] == '\0') {
+        return job_current(p_table);
+    }
+    char * p_end;
+    const long id = strtol(spec, &p_end, 10);
+    if (*p_end != '\0' || id < 1 || id > p_table->num_slots) return NULL;
+    return p_table->jobs[id - 1];
+}
 
-        num_to_alloc = (yy_buffer_stack_max) + grow_size;
-        (yy_buffer_stack) = (struct yy_buffer_state**)yyrealloc
-                                ((yy_buffer_stack),
-                                num_to_alloc * sizeof(struct yy_buffer_state*)
-                                );
-        if ( ! (yy_buffer_stack) )
-            YY_FATAL_ERROR( "out of dynamic memory in yyensure_buffer_stack()" );
+job_t * job_find_pid(job_table_t * p_table, const pid_t pid) {
+    pid_slot_t * p_slot = pid > 0 ? pid_map_find(p_table, pid) : NULL;
+    return p_slot ? p_table->jobs[p_slot->job_id - 1] : NULL;
+}
 
-        /* zero only the new slots.*/
-        memset((yy_buffer_stack) + (yy_buffer_stack_max), 0, grow_size * sizeof(struct yy_buffer_state*));
-        (yy_buffer_stack_max) = num_to_alloc;
+job_t * job_current(job_table_t * p_table) {
+    /* the most recently started job that has not finished */
+    for (int i = p_table->num_slots - 1; i >= 0; i -= 1) {
+        if (p_table->jobs[i] && p_table->jobs[i]->num_live > 0) return p_table->jobs[i];
     }
+    return NULL;
 }
 
-/** Setup the input buffer state to scan directly from a user-specified character buffer.
- * @param base the character buffer
- * @param size the size in bytes of the character buffer
- * 
- * @return the newly allocated buffer state object. 
- */
-YY_BUFFER_STATE yy_scan_buffer  (char * base, yy_size_t  size )
-{
-    YY_BUFFER_STATE b;
-    
-    if ( size < 2 ||
-         base[size-2] != YY_END_OF_BUFFER_CHAR ||
-         base[size-1] != YY_END_OF_BUFFER_CHAR )
-        /* They forgot to leave room for the EOB's. */
-        return 0;
-
-    b = (YY_BUFFER_STATE) yyalloc(sizeof( struct yy_buffer_state )  );
-    if ( ! b )
-        YY_FATAL_ERROR( "out of dynamic memory in yy_scan_buffer()" );
-
-    b->yy_buf_size = size - 2;  /* "- 2" to take care of EOB's */
-    b->yy_buf_pos = b->yy_ch_buf = base;
-    b->yy_is_our_buffer = 0;
-    b->yy_input_file = 0;
-    b->yy_n_chars = b->yy_buf_size;
-    b->yy_is_interactive = 0;
-    b->yy_at_bol = 1;
-    b->yy_fill_buffer = 0;
-    b->yy_buffer_status = YY_BUFFER_NEW;
-
-    yy_switch_to_buffer(b  );
-
-    return b;
-}
-
-/** Setup the input buffer state to scan a string. The next call to yylex() will
- * scan from a @e copy of @a str.
- * @param yystr a NUL-terminated string to scan
- * 
- * @return the newly allocated buffer state object.
- * @note If you want to scan bytes that may contain NUL values, then use
- *       yy_scan_bytes() instead.
- */
-YY_BUFFER_STATE yy_scan_string (yyconst char * yystr )
-{
-    
-    return yy_scan_bytes(yystr,strlen(yystr) );
-}
-
-/** Setup the input buffer state to scan the given bytes. The next call to yylex() will
- * scan from a @e copy of @a bytes.
- * @param bytes the byte buffer to scan
- * @param len the number of bytes in the buffer pointed to by @a bytes.
- * 
- * @return the newly allocated buffer state object.
- */
-YY_BUFFER_STATE yy_scan_bytes  (yyconst char * yybytes, yy_size_t  _yybytes_len )
-{
-    YY_BUFFER_STATE b;
-    char *buf;
-    yy_size_t n, i;
-    
-    /* Get memory for full buffer, including space for trailing EOB's. */
-    n = _yybytes_len + 2;
-    buf = (char *) yyalloc(n  );
-    if ( ! buf )
-        YY_FATAL_ERROR( "out of dynamic memory in yy_scan_bytes()" );
-
-    for ( i = 0; i < _yybytes_len; ++i )
-        buf[i] = yybytes[i];
-
-    buf[_yybytes_len] = buf[_yybytes_len+1] = YY_END_OF_BUFFER_CHAR;
-
-    b = yy_scan_buffer(buf,n );
-    if ( ! b )
-        YY_FATAL_ERROR( "bad buffer in yy_scan_bytes()" );
-
-    /* It's okay to grow etc. this buffer, and we should throw it
-     * away when we're done.
-     */
-    b->yy_is_our_buffer = 1;
-
-    return b;
-}
-
-#ifndef YY_EXIT_FAILURE
-#define YY_EXIT_FAILURE 2
-#endif
+void job_record(job_table_t * p_table, const pid_t pid, const int status,
+                const struct rusage * p_usage) {
+    pid_slot_t * p_slot = pid_map_find(p_table, pid);
+    if (!p_slot) return;
+    job_t * p_job = p_table->jobs[p_slot->job_id - 1];
+    process_t * p_proc = &p_job->procs[p_slot->proc_idx];
+    if (WIFSTOPPED(status)) {
+        if (p_proc->state == PROC_RUNNING) p_job->num_stopped += 1;
+        p_proc->state = PROC_STOPPED;
+        p_proc->status = status;
+        return;
+    }
+    if (WIFCONTINUED(status)) {
+        if (p_proc->state == PROC_STOPPED) p_job->num_stopped -= 1;
+        p_proc->state = PROC_RUNNING;
+        return;
+    }
+    if (p_proc->state == PROC_STOPPED) p_job->num_stopped -= 1;
+    p_proc->state = PROC_DONE;
+    p_proc->status = status;
+    p_proc->usage = *p_usage;
+    clock_gettime(CLOCK_MONOTONIC, &p_proc->finished);
+    if (p_proc->pidfd != -1) {
+        /* closing it also takes it out of the event set */
+        close(p_proc->pidfd);
+        p_proc->pidfd = -1;
+    }
+    p_slot->pid = -1;
+    p_table->pid_live -= 1;
+    p_job->num_live -= 1;
+    global_metrics.children_reaped += 1;
+    if (p_job->num_live == 0) {
+        global_metrics.job_wall_ns += (p_proc->finished.tv_sec - p_job->started.tv_sec) * 1000000000LL +
+                                      p_proc->finished.tv_nsec - p_job->started.tv_nsec;
+        /* reported and removed by the next job_notify */
+        p_job->p_next = p_table->p_done;
+        p_table->p_done = p_job;
+    }
+}
 
-static void yy_fatal_error (yyconst char* msg )
-{
-        (void) fprintf( stderr, "%s\n", msg );
-    exit( YY_EXIT_FAILURE );
-}
-
-/* Redefine yyless() so it works in section 3 code. */
-
-#undef yyless
-#define yyless(n) \
-    do \
-        { \
-        /* Undo effects of setting up yytext. */ \
-        int yyless_macro_arg = (n); \
-        YY_LESS_LINENO(yyless_macro_arg);\
-        yytext[yyleng] = (yy_hold_char); \
-        (yy_c_buf_p) = yytext + yyless_macro_arg; \
-        (yy_hold_char) = *(yy_c_buf_p); \
-        *(yy_c_buf_p) = '\0'; \
-        yyleng = yyless_macro_arg; \
-        } \
-    while ( 0 )
-
-/* Accessor  methods (get/set functions) to struct members. */
-
-/** Get the current line number.
- * 
- */
-int yyget_lineno  (void)
-{
-        
-    return yylineno;
+void job_reap(job_table_t * p_table) {
+    /* collects every child that changed state, stops included */
+    int status;
+    pid_t pid;
+    struct rusage usage;
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage)) > 0) {
+        job_record(p_table, pid, status, &usage);
+    }
 }
 
-/** Get the input stream.
- * 
- */
-FILE *yyget_in  (void)
-{
-        return yyin;
+void job_reap_pid(job_table_t * p_table, const pid_t pid) {
+    /* one child whose pidfd said it exited, no need to ask about the rest */
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, WNOHANG, &usage) == pid) job_record(p_table, pid, status, &usage);
 }
 
-/** Get the output stream.
- * 
- */
-FILE *yyget_out  (void)
-{
-        return yyout;
+int wait_status_code(const int status) {
+    if (WIFEXITED(status)) return WEXITSTATUS(status);
+    if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+    if (WIFSTOPPED(status)) return 128 + WSTOPSIG(status);
+    return 0;
 }
 
-/** Get the length of the current token.
- * 
- */
-yy_size_t yyget_leng  (void)
-{
-        return yyleng;
+int job_wait(job_table_t * p_table, job_t * p_job) {
+    const long long start = trace_begin();
+    job_reap(p_table);
+    while (p_job->num_live > p_job->num_stopped) {
+        /* events_wait does the reaping, input that comes in meanwhile is
+           left for whoever reads next */
+        events_wait(&global_events, -1);
+        if (global_events.interrupted) {
+            /* a job in a group of its own did not see the terminal's ^C */
+            global_events.interrupted = false;
+            if (p_job->pgid != getpgrp()) kill(-p_job->pgid, SIGINT);
+        }
+    }
+    if (p_job->num_live > 0) {
+        /* stopped, it stays in the table until fg or bg */
+        p_job->is_bkg = true;
+        if (global_tty_input) putchar('\n');
+        job_print(stdout, p_job, false);
+    }
+    /* a pipeline's status is the status of its last process */
+    const int status = wait_status_code(p_job->procs[p_job->num_procs - 1].status);
+    trace_end(TRACE_WAIT, start, NULL, status);
+    return status;
 }
 
-/** Get the current token.
- * 
- */
+void job_continue(job_t * p_job) {
+    if (p_job->num_stopped == 0) return;
+    if (p_job->pgid != getpgrp()) {
+        kill(-p_job->pgid, SIGCONT);
+        return;
+    }
+    for (int i = 0; i < p_job->num_procs; i += 1) {
+        if (p_job->procs[i].state == PROC_STOPPED) kill(p_job->procs[i].pid, SIGCONT);
+    }
+}
 
-char *yyget_text  (void)
-{
-        return yytext;
+const char * proc_state_str(const int state, const int status, char * buffer, const size_t size) {
+    switch (state) {
+    case PROC_RUNNING: return "Running";
+    case PROC_STOPPED: return "Stopped";
+    }
+    if (WIFSIGNALED(status)) return strsignal(WTERMSIG(status));
+    if (WEXITSTATUS(status) == 0) return "Done";
+    snprintf(buffer, size, "Exit %d", WEXITSTATUS(status));
+    return buffer;
 }
 
-/** Set the current line number.
- * @param line_number
- * 
- */
-void yyset_lineno (int  line_number )
-{
-    
-    yylineno = line_number;
+void job_print(FILE * p_out, job_t * p_job, const bool show_pids) {
+    char buffer[16];
+    const process_t * p_last = &p_job->procs[p_job->num_procs - 1];
+    const int state = p_job->num_live == 0 ? PROC_DONE
+                    : p_job->num_live == p_job->num_stopped ? PROC_STOPPED
+                    : PROC_RUNNING;
+    const char * state_str = proc_state_str(state, p_last->status, buffer, sizeof(buffer));
+    if (!show_pids) {
+        fprintf(p_out, "[%d] %s\t%s\n", p_job->id, state_str, p_job->cmdline);
+        return;
+    }
+    fprintf(p_out, "[%d] %d %s\t%s\n", p_job->id, (int)p_job->pgid, state_str, p_job->cmdline);
+    for (int i = 0; i < p_job->num_procs; i += 1) {
+        const process_t * p_proc = &p_job->procs[i];
+        fprintf(p_out, "    %d %s\n", (int)p_proc->pid,
+               proc_state_str(p_proc->state, p_proc->status, buffer, sizeof(buffer)));
+    }
 }
 
-/** Set the input stream. This does not discard the current
- * input buffer.
- * @param in_str A readable stream.
- * 
- * @see yy_switch_to_buffer
- */
-void yyset_in (FILE *  in_str )
-{
-        yyin = in_str ;
+double timeval_secs(const struct timeval * p_tv) {
+    return p_tv->tv_sec + p_tv->tv_usec / 1e6;
 }
 
-void yyset_out (FILE *  out_str )
-{
-        yyout = out_str ;
+double elapsed_secs(const struct timespec * p_from, const struct timespec * p_to) {
+    return (p_to->tv_sec - p_from->tv_sec) + (p_to->tv_nsec - p_from->tv_nsec) / 1e9;
 }
 
-int yyget_debug  (void)
-{
-        return yy_flex_debug;
+void job_print_usage(job_t * p_job, FILE * p_out) {
+    /* the totals, then one line per stage so that the slow one stands out */
+    double real = 0, user = 0, sys = 0;
+    long maxrss = 0;
+    for (int i = 0; i < p_job->num_procs; i += 1) {
+        const process_t * p_proc = &p_job->procs[i];
+        const double proc_real = elapsed_secs(&p_job->started, &p_proc->finished);
+        if (proc_real > real) real = proc_real;
+        user += timeval_secs(&p_proc->usage.ru_utime);
+        sys += timeval_secs(&p_proc->usage.ru_stime);
+        if (p_proc->usage.ru_maxrss > maxrss) maxrss = p_proc->usage.ru_maxrss;
+    }
+    fprintf(p_out, "real %.3fs user %.3fs sys %.3fs maxrss %ldkB\n", real, user, sys, maxrss);
+    if (p_job->num_procs == 1) return;
+    for (int i = 0; i < p_job->num_procs; i += 1) {
+        const process_t * p_proc = &p_job->procs[i];
+        fprintf(p_out, "  %d: pid %d real %.3fs user %.3fs sys %.3fs maxrss %ldkB\n",
+                i, (int)p_proc->pid, elapsed_secs(&p_job->started, &p_proc->finished),
+                timeval_secs(&p_proc->usage.ru_utime), timeval_secs(&p_proc->usage.ru_stime),
+                p_proc->usage.ru_maxrss);
+    }
 }
 
-void yyset_debug (int  bdebug )
-{
-        yy_flex_debug = bdebug ;
+void job_log_usage(job_t * p_job, FILE * p_out) {
+    fprintf(p_out, "{\"job\":%d,\"cmd\":", p_job->id);
+    json_write_string(p_out, p_job->cmdline);
+    fprintf(p_out, ",\"status\":%d,\"stages\":[",
+            wait_status_code(p_job->procs[p_job->num_procs - 1].status));
+    for (int i = 0; i < p_job->num_procs; i += 1) {
+        const process_t * p_proc = &p_job->procs[i];
+        fprintf(p_out, "%s{\"pid\":%d,\"status\":%d,\"real\":%.6f,\"user\":%.6f,"
+                "\"sys\":%.6f,\"maxrss_kb\":%ld}", i ? "," : "", (int)p_proc->pid,
+                wait_status_code(p_proc->status), elapsed_secs(&p_job->started, &p_proc->finished),
+                timeval_secs(&p_proc->usage.ru_utime), timeval_secs(&p_proc->usage.ru_stime),
+                p_proc->usage.ru_maxrss);
+    }
+    fputs("]}\n", p_out);
 }
 
-static int yy_init_globals (void)
-{
-        /* Initialization is the same as for the non-reentrant scanner.
-     * This function is called from yylex_destroy(), so don't allocate here.
-     */
+void job_notify(job_table_t * p_table, const bool print) {
+    job_reap(p_table);
+    job_flush(p_table, print);
+}
 
-    (yy_buffer_stack) = 0;
-    (yy_buffer_stack_top) = 0;
-    (yy_buffer_stack_max) = 0;
-    (yy_c_buf_p) = (char *) 0;
-    (yy_init) = 0;
-    (yy_start) = 0;
+void job_flush(job_table_t * p_table, const bool print) {
+    /* reports and recycles the jobs that job_reap has seen finish */
+    job_t * p_job = p_table->p_done;
+    p_table->p_done = NULL;
+    while (p_job) {
+        job_t * p_next = p_job->p_next;
+        if (p_job->is_bkg && p_job->p_report) {
+            job_print(p_job->p_report, p_job, false);
+            fflush(p_job->p_report);
+        } else if (print && p_job->is_bkg) {
+            job_print(stdout, p_job, false);
+        }
+        if (p_job->timed) job_print_usage(p_job, stderr);
+        if (global_stats_log) job_log_usage(p_job, global_stats_log);
+        job_remove(p_table, p_job);
+        p_job = p_next;
+    }
+}
 
-/* Defined in main.c */
-#ifdef YY_STDINIT
-    yyin = stdin;
-    yyout = fopen(".flex_errors", "w");
+bool events_init(events_t * p_events, const bool interrupts) {
+    /* SIGCHLD (and SIGINT at a terminal) stop being delivered as signals
+       and become events, there is nothing left for a handler to race */
+    memset(p_events, 0, sizeof(events_t));
+    if (!vec_init(&p_events->ready, sizeof(int))) return false;
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    if (interrupts) {
+        /* and the shell must not be stopped by the terminal either, its
+           jobs get those signals now that they own the terminal */
+        sigaddset(&mask, SIGINT);
+        sigaddset(&mask, SIGTSTP);
+        sigaddset(&mask, SIGTTIN);
+        sigaddset(&mask, SIGTTOU);
+    }
+#ifdef __linux__
+    p_events->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (p_events->epoll_fd == -1) return false;
+    if (sigprocmask(SIG_BLOCK, &mask, &p_events->saved_mask) == -1) return false;
+    p_events->signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (p_events->signal_fd == -1) return false;
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = (uint64_t)EVENT_SIGNAL << 32;
+    return epoll_ctl(p_events->epoll_fd, EPOLL_CTL_ADD, p_events->signal_fd, &ev) == 0;
 #else
-    yyin = (FILE *) 0;
-    yyout = (FILE *) 0;
+    sigprocmask(SIG_BLOCK, NULL, &p_events->saved_mask);
+    if (pipe(p_events->signal_pipe) == -1) return false;
+    for (int i = 0; i < 2; i += 1) {
+        /* jobs must not inherit the pipe, and neither end may ever block */
+        fcntl(p_events->signal_pipe[i], F_SETFD, FD_CLOEXEC);
+        fcntl(p_events->signal_pipe[i], F_SETFL, O_NONBLOCK);
+    }
+    p_events->fds_capacity = 4;
+    p_events->fds = malloc(p_events->fds_capacity * sizeof(struct pollfd));
+    if (!p_events->fds) return false;
+    p_events->fds[0].fd = p_events->signal_pipe[0];
+    p_events->fds[0].events = POLLIN;
+    p_events->num_fds = 1;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(struct sigaction));
+    sa.sa_handler = sigchld_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    return sigaction(SIGCHLD, &sa, NULL) == 0;
 #endif
+}
 
-    /* For future reference: Set errno on error, since we are called by
-     * yylex_init()
-     */
-    return 0;
+void events_free(events_t * p_events) {
+#ifdef __linux__
+    close(p_events->epoll_fd);
+    close(p_events->signal_fd);
+#else
+    close(p_events->signal_pipe[0]);
+    close(p_events->signal_pipe[1]);
+    free(p_events->fds);
+#endif
+    vec_free(&p_events->ready, NULL);
 }
 
-/* yylex_destroy is for both reentrant and non-reentrant scanners. */
-int yylex_destroy  (void)
-{
-    
-    /* Pop the buffer stack, destroying each element. */
-    while(YY_CURRENT_BUFFER){
-        yy_delete_buffer(YY_CURRENT_BUFFER  );
-        YY_CURRENT_BUFFER_LVALUE = NULL;
-        yypop_buffer_state();
+void events_child(events_t * p_events) {
+    /* a forked builtin must not share the shell's event set, it gets one
+       of its own that only knows about its own children */
+    const sigset_t saved_mask = p_events->saved_mask;
+    events_free(p_events);
+    sigprocmask(SIG_SETMASK, &saved_mask, NULL);
+    if (!events_init(p_events, false)) {
+        perror("ERROR: events");
+        _exit(EXIT_FAILURE);
     }
+    p_events->saved_mask = saved_mask;
+}
 
-    /* Destroy the stack itself. */
-    yyfree((yy_buffer_stack) );
-    (yy_buffer_stack) = NULL;
-
-    /* Reset the globals. This is important in a non-reentrant scanner so the next time
-     * yylex() is called, initialization will occur. */
-    yy_init_globals( );
+bool events_watch(events_t * p_events, const int fd) {
+    /* reports fd once it is readable, and then not again until the next
+       events_watch, so input that nobody is reading does not spin */
+#ifdef __linux__
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.u64 = ((uint64_t)EVENT_INPUT << 32) | (uint32_t)fd;
+    if (epoll_ctl(p_events->epoll_fd, EPOLL_CTL_MOD, fd, &ev) == 0) return true;
+    return errno == ENOENT && epoll_ctl(p_events->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0;
+#else
+    /* a disarmed descriptor is kept as ~fd, which poll skips */
+    for (int i = 1; i < p_events->num_fds; i += 1) {
+        if (p_events->fds[i].fd == fd || p_events->fds[i].fd == ~fd) {
+            p_events->fds[i].fd = fd;
+            return true;
+        }
+    }
+    if (p_events->num_fds == p_events->fds_capacity) {
+        struct pollfd * fds = realloc(p_events->fds, 2 * p_events->fds_capacity * sizeof(struct pollfd));
+        if (!fds) return false;
+        p_events->fds = fds;
+        p_events->fds_capacity *= 2;
+    }
+    p_events->fds[p_events->num_fds].fd = fd;
+    p_events->fds[p_events->num_fds].events = POLLIN;
+    p_events->num_fds += 1;
+    return true;
+#endif
+}
 
-    return 0;
+void events_unwatch(events_t * p_events, const int fd) {
+#ifdef __linux__
+    epoll_ctl(p_events->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+#else
+    for (int i = 1; i < p_events->num_fds; i += 1) {
+        if (p_events->fds[i].fd == fd || p_events->fds[i].fd == ~fd) {
+            p_events->num_fds -= 1;
+            p_events->fds[i] = p_events->fds[p_events->num_fds];
+            break;
+        }
+    }
+#endif
+    int * ready = (int *)p_events->ready.data;
+    size_t kept = 0;
+    for (size_t i = 0; i < p_events->ready.npos; i += 1) {
+        if (ready[i] != fd) ready[kept++] = ready[i];
+    }
+    p_events->ready.npos = kept;
 }
 
-/*
- * Internal utility routines.
- */
+void events_watch_pid(events_t * p_events, process_t * p_proc) {
+    /* the exit then wakes the loop with the pid in hand, SIGCHLD is still
+       what reports stops and any process this fails for */
+    p_proc->pidfd = -1;
+#if defined(__linux__) && defined(SYS_pidfd_open)
+    const int pidfd = (int)syscall(SYS_pidfd_open, p_proc->pid, 0);
+    if (pidfd == -1) return;
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = ((uint64_t)EVENT_PID << 32) | (uint32_t)p_proc->pid;
+    if (epoll_ctl(p_events->epoll_fd, EPOLL_CTL_ADD, pidfd, &ev) == -1) {
+        close(pidfd);
+        return;
+    }
+    p_proc->pidfd = pidfd;
+#endif
+}
 
-#ifndef yytext_ptr
-static void yy_flex_strncpy (char* s1, yyconst char * s2, int n )
-{
-    register int i;
-    for ( i = 0; i < n; ++i )
-        s1[i] = s2[i];
+void events_ready(events_t * p_events, const int fd) {
+    if (!vec_push(&p_events->ready, &fd)) {
+        puts(VEC_PUSH_ERROR_MSG);
+        exit(EXIT_FAILURE);
+    }
 }
-#endif
 
-#ifdef YY_NEED_STRLEN
-static int yy_flex_strlen (yyconst char * s )
-{
-    register int n;
-    for ( n = 0; s[n]; ++n )
-        ;
+void events_wait(events_t * p_events, const int timeout) {
+    /* sleeps until something happens, or for timeout ms (-1 for ever), and
+       dispatches all of it from here */
+    bool reap = false;
+#ifdef __linux__
+    struct epoll_event evs[EVENTS_BATCH];
+    const int num_events = epoll_wait(p_events->epoll_fd, evs, EVENTS_BATCH, timeout);
+    for (int i = 0; i < num_events; i += 1) {
+        const uint32_t value = (uint32_t)evs[i].data.u64;
+        switch (evs[i].data.u64 >> 32) {
+        case EVENT_SIGNAL: {
+            struct signalfd_siginfo info;
+            while (read(p_events->signal_fd, &info, sizeof(info)) == sizeof(info)) {
+                if (info.ssi_signo == SIGCHLD) reap = true;
+                if (info.ssi_signo == SIGINT) p_events->interrupted = true;
+            }
+            break;
+        }
 
-    return n;
-}
-#endif
+        case EVENT_INPUT:
+            events_ready(p_events, (int)value);
+            break;
 
-void *yyalloc (yy_size_t  size )
-{
-    return (void *) malloc( size );
+        case EVENT_PID:
+            job_reap_pid(&global_jobs, (pid_t)value);
+            break;
+        }
+    }
+#else
+    /* EINTR only means that the SIGCHLD came in */
+    if (poll(p_events->fds, p_events->num_fds, timeout) > 0) {
+        if (p_events->fds[0].revents) {
+            char drain[64];
+            while (read(p_events->signal_pipe[0], drain, sizeof(drain)) > 0);
+        }
+        for (int i = 1; i < p_events->num_fds; i += 1) {
+            if (p_events->fds[i].fd >= 0 && p_events->fds[i].revents) {
+                events_ready(p_events, p_events->fds[i].fd);
+                p_events->fds[i].fd = ~p_events->fds[i].fd;
+            }
+        }
+    }
+    /* the handler may have run without waking poll, it is cheap to ask */
+    reap = true;
+#endif
+    if (reap) job_reap(&global_jobs);
 }
 
-void *yyrealloc  (void * ptr, yy_size_t  size )
-{
-    /* The cast to (char *) in the following accommodates both
-     * implementations that use char* generic pointers, and those
-     * that use void* generic pointers.  It works with the latter
-     * because both ANSI C and C++ allow castless assignment from
-     * any pointer type to void*, and deal with argument conversions
-     * as though doing an assignment.
-     */
-    return (void *) realloc( (char *) ptr, size );
+int events_next(events_t * p_events) {
+    /* a ready input descriptor, or -1 when there is none */
+    if (p_events->ready.npos == 0) return -1;
+    p_events->ready.npos -= 1;
+    return ((int *)p_events->ready.data)[p_events->ready.npos];
 }
 
-void yyfree (void * ptr )
-{
-    free( (char *) ptr );   /* see yyrealloc() for (char *) cast */
+void json_write_string(FILE * p_out, const char * str) {
+    fputc('"', p_out);
+    for (const char * p_c = str; *p_c; p_c += 1) {
+        if (*p_c == '"' || *p_c == '\\') fputc('\\', p_out);
+        if ((unsigned char)*p_c < 0x20) {
+            fprintf(p_out, "\\u%04x", *p_c);
+        } else {
+            fputc(*p_c, p_out);
+        }
+    }
+    fputc('"', p_out);
 }
 
-#define YYTABLES_NAME "yytables"
-
-#line 45 "lexer.l"
+bool trace_open(trace_t * p_trace, const char * path) {
+    p_trace->p_out = fopen(path, "w");
+    if (!p_trace->p_out) return false;
+    p_trace->pid = getpid();
+    p_trace->num_events = 0;
+    /* the array format, which trace viewers accept without the closing ] */
+    fputs("[\n", p_trace->p_out);
+    atexit(trace_flush);
+    return true;
+}
 
+long long trace_begin() {
+    /* 0 when tracing is off, so that the disabled cost is one branch */
+    if (!global_trace.p_out) return 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
 
+void trace_end(const int phase, const long long start, const char * label, const int arg) {
+    if (!global_trace.p_out) return;
+    trace_event_t * p_event = &global_trace.events[global_trace.num_events++];
+    p_event->start_ns = start;
+    p_event->dur_ns = trace_begin() - start;
+    p_event->phase = phase;
+    p_event->arg = arg;
+    p_event->label[0] = '\0';
+    if (label) {
+        strncpy(p_event->label, label, TRACE_LABEL_SIZE - 1);
+        p_event->label[TRACE_LABEL_SIZE - 1] = '\0';
+    }
+    if (global_trace.num_events == TRACE_BUFFER_SIZE) trace_flush();
+}
 
-YY_BUFFER_STATE global_buffer_state;
+void metrics_print(FILE * p_out, const bool prometheus) {
+    /* name value lines, or the text format Prometheus scrapes, where every
+       counter is myshell_<name>_total */
+    for (size_t i = 0; i < sizeof(METRICS) / sizeof(metric_t); i += 1) {
+        const metric_t * p_metric = &METRICS[i];
+        if (!prometheus) {
+            fprintf(p_out, "%s %zu\n", p_metric->name, *p_metric->p_value);
+            continue;
+        }
+        int len = strlen(p_metric->name);
+        const bool ns = len > 3 && strcmp(p_metric->name + len - 3, "_ns") == 0;
+        const char * unit = ns ? "_seconds" : "";
+        if (ns) len -= 3;
+        fprintf(p_out, "# HELP myshell_%.*s%s_total %s\n", len, p_metric->name, unit, p_metric->help);
+        fprintf(p_out, "# TYPE myshell_%.*s%s_total counter\n", len, p_metric->name, unit);
+        if (ns) {
+            fprintf(p_out, "myshell_%.*s%s_total %.9f\n", len, p_metric->name, unit,
+                    *p_metric->p_value / 1e9);
+        } else {
+            fprintf(p_out, "myshell_%.*s_total %zu\n", len, p_metric->name, *p_metric->p_value);
+        }
+    }
+}
 
-void lexer_set_target(vec_t * p_target) {
-    p_global_lexer_target = p_target;
+long long metrics_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
 }
 
-void lexer_parse_buffer(char * buffer) {
-    yy_scan_buffer(buffer,READ_BUFFER_SIZE);
-    yylex();
-    yy_delete_buffer(YY_CURRENT_BUFFER);
+void trace_flush() {
+    /* children that exit() through a failed exec inherit the buffer too,
+       only the shell that opened the trace writes it */
+    if (!global_trace.p_out || global_trace.pid != getpid()) return;
+    FILE * p_out = global_trace.p_out;
+    for (size_t i = 0; i < global_trace.num_events; i += 1) {
+        const trace_event_t * p_event = &global_trace.events[i];
+        fprintf(p_out, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":1,"
+                "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"%s\":%d",
+                TRACE_PHASE_NAMES[p_event->phase], (int)global_trace.pid,
+                p_event->start_ns / 1e3, p_event->dur_ns / 1e3,
+                TRACE_ARG_NAMES[p_event->phase], p_event->arg);
+        if (p_event->label[0]) {
+            fputs(",\"command\":", p_out);
+            json_write_string(p_out, p_event->label);
+        }
+        fputs("}},\n", p_out);
+    }
+    global_trace.num_events = 0;
+    fflush(p_out);
 }
 
+/* THE SCANNER, GENERATED FROM lexer.l (make lex.yy.c, see the makefile) */
+#include "lex.yy.c"